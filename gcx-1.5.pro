@@ -58,6 +58,7 @@ HEADERS = \
    $$PWD/src/plots.h \
    $$PWD/src/psf.h \
    $$PWD/src/query.h \
+   $$PWD/src/querycache.h \
    $$PWD/src/recipe.h \
    $$PWD/src/reduce.h \
    $$PWD/src/sidereal_time.h \
@@ -120,6 +121,7 @@ SOURCES = \
    $$PWD/src/plots.c \
    $$PWD/src/psf.c \
    $$PWD/src/query.c \
+   $$PWD/src/querycache.c \
    $$PWD/src/recipe.c \
    $$PWD/src/recipegui.c \
    $$PWD/src/reduce.c \
@@ -145,12 +147,15 @@ SOURCES = \
    $$PWD/src/ccd/aphot.c \
    $$PWD/src/ccd/badpix.c \
    $$PWD/src/ccd/ccd_frame.c \
+   $$PWD/src/ccd/combine.c \
    $$PWD/src/ccd/dslr.c \
    $$PWD/src/ccd/edb.c \
    $$PWD/src/ccd/errlog.c \
+   $$PWD/src/ccd/grid.c \
    $$PWD/src/ccd/median.c \
 #   $$PWD/src/ccd/rcp.c \
    $$PWD/src/ccd/sources.c \
+   $$PWD/src/ccd/threads.c \
    $$PWD/src/ccd/use_dcraw.c \
    $$PWD/src/ccd/warp.c \
    $$PWD/src/ccd/worldpos.c \
@@ -0,0 +1,113 @@
+/* bench_tycho2.c: time Tycho-2 box searches on a synthetic tyc2.dat of
+ * uniformly spread stars, and the first search, which makes the tiles.
+ * Built by "make bench"; run as
+ *	bench_tycho2 [stars [dir]]
+ * stars defaults to 2500000 (about the real catalogue, 520MB), dir to the
+ * current directory. The catalogue and its tiles are removed at the end. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+#include "tycho2.h"
+
+#define REPS 20
+#define MAX_STARS 100000
+
+/* write field at offs of a record, followed by a separator */
+static void put_field(char *rec, int offs, char *fmt, double v)
+{
+	char buf[32];
+	int n = snprintf(buf, 32, fmt, v);
+
+	memcpy(rec + offs, buf, n);
+	rec[offs + n] = '|';
+}
+
+static int write_catalog(char *fn, int n)
+{
+	char rec[TYCRECSZ];
+	FILE *fp;
+	int i;
+
+	fp = fopen(fn, "w");
+	if (fp == NULL)
+		return -1;
+
+	srand(3);
+	for (i = 0; i < n; i++) {
+		double ra = 360.0 * rand() / (RAND_MAX + 1.0);
+		double dec = asin(2.0 * rand() / (RAND_MAX + 1.0) - 1) * 180 / M_PI;
+		double vt = 7 + 5 * rand() / (RAND_MAX + 1.0);
+
+		memset(rec, ' ', TYCRECSZ);
+		snprintf(rec, 14, "%04d %05d %1d", 1 + i % 9537, 1 + i / 9537 % 99999, 1);
+		rec[12] = ' ';
+		put_field(rec, 15, "%12.8f", ra);
+		put_field(rec, 28, "%+12.8f", dec);
+		put_field(rec, 57, "%3.0f", 20 + i % 50);
+		put_field(rec, 61, "%3.0f", 20 + i % 40);
+		put_field(rec, 110, "%6.3f", vt + 0.8);
+		put_field(rec, 117, "%5.3f", 0.05);
+		put_field(rec, 123, "%6.3f", vt);
+		put_field(rec, 130, "%5.3f", 0.04);
+		rec[TYCRECSZ - 1] = '\n';
+
+		if (fwrite(rec, TYCRECSZ, 1, fp) != 1) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	return fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+	double fields[][4] = { /* ra, dec, w, h */
+		{ 120, 20, 0.5, 0.5 }, { 200, -40, 2, 2 }, { 300, 60, 10, 5 },
+		{ 45, 85, 40, 4 }, { 180, 0, 20, 20 },
+	};
+	int nstars = (argc > 1) ? atoi(argv[1]) : 2500000;
+	char *dir = (argc > 2) ? argv[2] : ".";
+	struct tycho2_star *st = malloc(MAX_STARS * sizeof(struct tycho2_star));
+	char *fn = g_build_filename(dir, "tyc2.dat", NULL);
+	char *tiles = g_build_filename(dir, TYCHO2_TILES_NAME, NULL);
+	gint64 t0, t1;
+	int f, k, n = 0;
+
+	remove(tiles);
+	if (write_catalog(fn, nstars)) {
+		fprintf(stderr, "cannot write %s\n", fn);
+		return 1;
+	}
+
+	t0 = g_get_monotonic_time();
+	n = tycho2_box(fn, 10, 10, 1, 1, st, MAX_STARS);
+	t1 = g_get_monotonic_time();
+	printf("first search, making the tiles of %d stars: %.2f s\n", nstars, (t1 - t0) / 1e6);
+	if (n < 0) {
+		fprintf(stderr, "search failed\n");
+		return 1;
+	}
+
+	for (f = 0; f < sizeof(fields) / sizeof(fields[0]); f++) {
+		double *fl = fields[f];
+
+		t0 = g_get_monotonic_time();
+		for (k = 0; k < REPS; k++)
+			n = tycho2_box(fn, fl[0], fl[1], fl[2], fl[3], st, MAX_STARS);
+		t1 = g_get_monotonic_time();
+
+		printf("box %5.1f %+5.1f %4.1f x %4.1f: %6d stars %8.3f ms\n",
+		       fl[0], fl[1], fl[2], fl[3], n, (t1 - t0) / 1e3 / REPS);
+	}
+
+	remove(fn);
+	remove(tiles);
+	g_free(fn);
+	g_free(tiles);
+	free(st);
+	return 0;
+}
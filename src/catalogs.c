@@ -32,6 +32,8 @@
 #include <errno.h>
 #include <math.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 //#include <glib.h>
 #include <glob.h>
 
@@ -211,64 +213,37 @@ static int cats_mag_comp_fn (const void *a, const void *b)
 static int tycho2_cat_search(struct cat_star *cst[], struct catalog *cat, 
 	       double ra, double dec, double radius, int n)
 {
-    int sz = (TYCRECSZ + 1) * CAT_GET_SIZE;
-    char *buf = calloc(sz, 1);
+	struct tycho2_star *ts = malloc(CAT_GET_SIZE * sizeof(struct tycho2_star));
+	if (ts == NULL) return -1;
 
 	radius = fabs(radius);
     double f = cos(degrad(dec));
     if (f < 0.1) f = 0.1;
 
     d3_printf("running tycho2 search w:%.3f h:%.3f [%d] f=%.3f\n", radius*2/60 / f, radius*2/60, n, f);
-    int ret = tycho2_search(ra, dec, radius*2/60 / f, radius*2/60, buf, sz, P_STR(FILE_TYCHO2_PATH));
+    int ret = tycho2_box(P_STR(FILE_TYCHO2_PATH), ra, dec, radius*2/60 / f, radius*2/60, ts, CAT_GET_SIZE);
 
     d3_printf("tycho2 returns %d\n", ret);
-	if (ret <= 0) {
-		free(buf);
-		return ret;
-	}
-
-    double rm = ra - radius/60/f;
-	if (rm < 0) {
-		ret += tycho2_search(360 + rm/2, dec, -rm/2, radius*2/60, 
-				     buf + ret * (TYCRECSZ+1), sz - ret * (TYCRECSZ+1), 
-				     P_STR(FILE_TYCHO2_PATH));
-    }
     if (ret <= 0) {
-        free(buf);
+        free(ts);
         return ret;
     }
 
-//    struct cat_star **st = calloc(CAT_GET_SIZE, sizeof(struct cat_star *));
     struct cat_star **st = calloc(ret, sizeof(struct cat_star *));
 
-    char *p = buf;
     int i;
 	for (i = 0; i < ret; i++) {
-		int r, s;
-        float ra, raerr, dec, decerr;
-        float vt = MAG_UNSET, vterr = BIG_ERR, bt = MAG_UNSET, bterr = BIG_ERR;
-//		d3_printf("tycho star is: \n %s\n", p);
-
-        if ((sscanf(p, "%d %d", &r, &s)) != 2) break;
-        if ((sscanf(p+15, "%f", &ra) != 1)) break;
-        if ((sscanf(p+28, "%f", &dec) != 1)) break;
-
-		sscanf(p+110, "%f", &bt);
-		sscanf(p+117, "%f", &bterr);
-		sscanf(p+123, "%f", &vt);
-		sscanf(p+130, "%f", &vterr);
-		sscanf(p+57, "%f", &raerr);
-		sscanf(p+61, "%f", &decerr);
+        float vt = ts[i].vt, vterr = ts[i].vterr, bt = ts[i].bt, bterr = ts[i].bterr;
 
         struct cat_star *cats = cat_star_new();
-		cats->ra = ra;
-		cats->dec = dec;
-		cats->perr = 0.001 * sqrt(sqr(raerr) + sqr(decerr));
+		cats->ra = ts[i].ra;
+		cats->dec = ts[i].dec;
+		cats->perr = 0.001 * sqrt(sqr(ts[i].raerr) + sqr(ts[i].decerr));
 		cats->equinox = 2000.0;
-        asprintf(&cats->name, "%04d-%04d", r, s);
+        asprintf(&cats->name, "%04d-%04d", ts[i].tyc1, ts[i].tyc2);
         cats->type = CATS_TYPE_SREF;
         cats->flags |= CATS_FLAG_ASTROMET;
-        if (vt < 30.0 && bt < 30.0) {
+        if (vt != MAG_UNSET && bt != MAG_UNSET) {
 			cats->mag = vt - 0.090 * (bt - vt);
             double verr = vterr;
             double berr = bterr;
@@ -280,7 +255,7 @@ static int tycho2_cat_search(struct cat_star *cst[], struct catalog *cat,
                    vt - 0.090 * (bt - vt), verr, 0.850 * (bt - vt) + vt - 0.090 * (bt - vt),
                                berr, vt, vterr, bt, bterr);
 
-		} else if (vt < 30.0) {
+		} else if (vt != MAG_UNSET) {
 			cats->mag = vt;
             asprintf(&cats->smags, "vt=%.3f/%.3f", vt, vterr);
 
@@ -289,9 +264,8 @@ static int tycho2_cat_search(struct cat_star *cst[], struct catalog *cat,
             asprintf(&cats->smags, "bt=%.3f/%.3f", bt, bterr);
 		}
 		st[i] = cats;
-		p+= TYCRECSZ + 1;
 	}
-	free(buf);
+	free(ts);
 	qsort(st, ret, sizeof(struct cat_star *), cats_mag_comp_fn);
     for (i=0 ; i < ret; i++) {
         cst[i] = st[i]; // copy cat_star pointers
@@ -328,6 +302,150 @@ static struct catalog *cat_open_tycho2(struct catalog *cat)
 /* local catalog code */
 
 /* local catalog methods */
+
+/* The local catalog keeps its stars in cat_stars, with two indices over them:
+ * cat->hash maps the lowercased names to the stars, and cat->index sorts the
+ * stars in declination zones LOCAL_ZONE_H high, by ra within a zone. The hash
+ * is updated as stars are added; the spatial index is marked stale and rebuilt
+ * by the next search or sync */
+
+#define LOCAL_ZONE_H 0.25 // degrees
+
+struct local_entry {
+	double ra, dec;		// ra in [0, 360)
+	struct cat_star *cats;
+};
+
+struct local_index {
+	int stale;
+	int nzones;
+	int *zone_first;	// nzones + 1 offsets into entries
+	struct local_entry *entries;
+};
+
+static int local_zone(struct local_index *ix, double dec)
+{
+	int z = floor((dec + 90.0) / LOCAL_ZONE_H);
+
+	if (z < 0) return 0;
+	if (z >= ix->nzones) return ix->nzones - 1;
+	return z;
+}
+
+static int local_entry_comp(const void *a, const void *b)
+{
+	double ra = ((struct local_entry *)a)->ra;
+	double rb = ((struct local_entry *)b)->ra;
+
+	return (ra > rb) - (ra < rb);
+}
+
+static GHashTable *local_hash(struct catalog *cat)
+{
+	if (cat->hash == NULL)
+		cat->hash = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	return cat->hash;
+}
+
+static struct local_index *local_index(struct catalog *cat)
+{
+	if (cat->index == NULL) {
+		struct local_index *ix = calloc(1, sizeof(struct local_index));
+		if (ix == NULL) return NULL;
+
+		ix->nzones = ceil(180.0 / LOCAL_ZONE_H);
+		ix->stale = 1;
+		cat->index = ix;
+	}
+	return cat->index;
+}
+
+/* rebuild the spatial index of cat if it is stale; return -1 on alloc failure */
+static int local_index_update(struct catalog *cat)
+{
+	struct local_index *ix = local_index(cat);
+	GList *lcat;
+	int *fill, n, z;
+
+	if (ix == NULL) return -1;
+	if (! ix->stale) return 0;
+
+	free(ix->entries);
+	free(ix->zone_first);
+
+	n = g_list_length(cat->cat_stars);
+	ix->entries = malloc((n + 1) * sizeof(struct local_entry));
+	ix->zone_first = calloc(ix->nzones + 1, sizeof(int));
+	fill = malloc((ix->nzones + 1) * sizeof(int));
+
+	if (ix->entries == NULL || ix->zone_first == NULL || fill == NULL) {
+		err_printf("local_index_update: cannot alloc index\n");
+		free(ix->entries);
+		free(ix->zone_first);
+		free(fill);
+		ix->entries = NULL;
+		ix->zone_first = NULL;
+		return -1;
+	}
+
+	// counting sort of the stars by zone, then by ra within each zone
+	for (lcat = cat->cat_stars; lcat != NULL; lcat = g_list_next(lcat))
+		ix->zone_first[local_zone(ix, CAT_STAR(lcat->data)->dec) + 1]++;
+	for (z = 0; z < ix->nzones; z++)
+		ix->zone_first[z + 1] += ix->zone_first[z];
+
+	memcpy(fill, ix->zone_first, (ix->nzones + 1) * sizeof(int));
+	for (lcat = cat->cat_stars; lcat != NULL; lcat = g_list_next(lcat)) {
+		struct cat_star *cats = CAT_STAR(lcat->data);
+		struct local_entry *e = ix->entries + fill[local_zone(ix, cats->dec)]++;
+
+		e->ra = fmod(cats->ra, 360.0);
+		if (e->ra < 0) e->ra += 360.0;
+		e->dec = cats->dec;
+		e->cats = cats;
+	}
+	free(fill);
+
+	for (z = 0; z < ix->nzones; z++)
+		qsort(ix->entries + ix->zone_first[z], ix->zone_first[z + 1] - ix->zone_first[z],
+		      sizeof(struct local_entry), local_entry_comp);
+
+	ix->stale = 0;
+	return 0;
+}
+
+/* add to cst the stars of zone z with ralo <= ra <= rahi and decmin <= dec <= decmax,
+ * up to a total of n; return the new total */
+static int local_zone_search(struct local_index *ix, int z, double ralo, double rahi,
+			     double decmin, double decmax, struct cat_star *cst[], int i, int n)
+{
+	int lo = ix->zone_first[z], hi = ix->zone_first[z + 1];
+
+	// first entry with ra >= ralo
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (ix->entries[mid].ra < ralo)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < ix->zone_first[z + 1] && i < n; lo++) {
+		struct local_entry *e = ix->entries + lo;
+
+		if (e->ra > rahi)
+			break;
+		if (e->dec > decmax || e->dec < decmin)
+			continue;
+
+		cst[i] = e->cats;
+		cat_star_ref(e->cats, "local_search");
+		i++;
+	}
+	return i;
+}
+
 /* search for objects within a certain area 
  * the 'radius' is actually the max of the ra and dec 
  * distances, with the ra distance adjusted for declination
@@ -335,31 +453,39 @@ static struct catalog *cat_open_tycho2(struct catalog *cat)
 int local_search(struct cat_star *cst[], struct catalog *cat, 
 	       double ra, double dec, double radius, int n)
 {
-    GList *lcat = cat->cat_stars;
-	struct cat_star *cats;
-	int i = 0;
+	struct local_index *ix;
+	int i = 0, z;
 	double ramin, ramax, decmin, decmax;
 	double c;
 
 	if (strcasecmp(cat->name, catalogs[LOCAL_NAME]))
 		return -1;
 
+	if (local_index_update(cat))
+		return -1;
+	ix = cat->index;
+
 	decmin = dec - radius / 60.0;
 	decmax = dec + radius / 60.0;
 	c = cos(degrad(dec)) + 0.01;
 	ramin = ra - radius / 60.0 / c;
 	ramax = ra + radius / 60.0 / c;
 
-	while (lcat != NULL && i < n) {
-		cats = CAT_STAR(lcat->data);
-		lcat = g_list_next(lcat);
-		if (cats->ra > ramax || cats->ra < ramin)
-			continue;
- 		if (cats->dec > decmax || cats->dec < decmin)
-			continue;
-		cst[i] = cats;
-        cat_star_ref(cats, "local_search");
-		i++;
+	// bring the ra range to [0, 360), split in two if it wraps
+	if (ramax - ramin >= 360.0) {
+		ramin = 0;
+		ramax = 360.0;
+	} else {
+		double w = ramax - ramin;
+		ramin = fmod(ramin, 360.0);
+		if (ramin < 0) ramin += 360.0;
+		ramax = ramin + w;
+	}
+
+	for (z = local_zone(ix, decmin); z <= local_zone(ix, decmax) && i < n; z++) {
+		i = local_zone_search(ix, z, ramin, fmin(ramax, 360.0), decmin, decmax, cst, i, n);
+		if (ramax > 360.0 && i < n)
+			i = local_zone_search(ix, z, 0, ramax - 360.0, decmin, decmax, cst, i, n);
 	}
 	return i;
 }
@@ -368,34 +494,21 @@ int local_search(struct cat_star *cst[], struct catalog *cat,
 static int cached_local_get(struct cat_star *cst[], struct catalog *cat, 
 	      char *name, int n)
 {
-    GList *lcat = cat->cat_stars;
-	int i = 0, ret;
 	struct cat_star *cats;
 
 	g_return_val_if_fail(n != 0, 0);
 	g_return_val_if_fail(name != NULL, 0);
-	
-	if (cat->hash == NULL) {
-		while (lcat != NULL && i < n) {
-			if (!strcasecmp(name, CAT_STAR(lcat->data)->name)) {
-				cst[i] = lcat->data;
-                cat_star_ref(CAT_STAR(lcat->data), "cached_local_get 1");
-				i++;
-			}
-			lcat = g_list_next(lcat);
-		}
-		ret = i;
-	} else {
-		cats = g_hash_table_lookup(cat->hash, name);
-		if (cats != NULL) {
-			cst[0] = cats;
-            cat_star_ref(cats, "cached_local_get 2");
-			ret = 1;
-		} else {
-			ret = 0;
-		}
-	} 
-	return ret;
+
+	char *key = g_ascii_strdown(name, -1);
+	cats = g_hash_table_lookup(local_hash(cat), key);
+	g_free(key);
+
+	if (cats == NULL)
+		return 0;
+
+	cst[0] = cats;
+	cat_star_ref(cats, "cached_local_get");
+	return 1;
 }
 
 int local_get(struct cat_star **cst, struct catalog *cat,
@@ -428,6 +541,7 @@ static void update_cat_star(struct cat_star *ocats, struct cat_star *cats)
     ocats->type = cats->type;
 	ocats->flags = cats->flags;
     ocats->mag = cats->mag;
+    free(ocats->name);
     ocats->name = strdup(cats->name);
     str_join_str(&ocats->comments, ", %s", cats->comments); // equiv strdup(cats->comments) when ocats->comments == NULL
     str_join_str(&ocats->cmags, ", %s", cats->cmags);
@@ -442,29 +556,37 @@ static void update_cat_star(struct cat_star *ocats, struct cat_star *cats)
  */ 
 int local_add(struct cat_star *cats, struct catalog *cat)
 {
-	int ret;
 	struct cat_star *cst;
+	struct local_index *ix;
 
-	ret = cached_local_get(&cst, cat, cats->name, 1);
-	if (ret < 0)
-		return ret;
+	g_return_val_if_fail(cats->name != NULL, -1);
 
-	if (ret == 0) {
-		if (cat->hash == NULL) {
-			cat->hash = g_hash_table_new(g_str_hash, g_str_equal);
-		}
+	char *key = g_ascii_strdown(cats->name, -1);
+	cst = g_hash_table_lookup(local_hash(cat), key);
+
+	if (cst == NULL) {
         cat->cat_stars = g_list_prepend((GList *)cat->cat_stars, cats);
         cat_star_ref(cats, "local_add");
-		g_hash_table_insert(cat->hash, cats->name, cats);
+		g_hash_table_insert(cat->hash, key, cats);
 	} else {
-		update_cat_star(cst, cats);
+		g_free(key);
+		if (cst != cats)
+			update_cat_star(cst, cats);
 	}
+
+	// the star is new or may have moved
+	ix = local_index(cat);
+	if (ix == NULL)
+		return -1;
+	ix->stale = 1;
+
 	return 1;
 }
 
+/* bring the indices of the local catalog up to date */
 int local_sync(struct catalog *cat)
 {
-	return 0;
+	return local_index_update(cat);
 }
 
 /*
@@ -476,6 +598,7 @@ static struct catalog *cat_open_local(struct catalog *cat)
 		cat->name = catalogs[LOCAL_NAME];
 		cat->ref_count = 0;
         cat->cat_stars = NULL;
+		local_hash(cat);
 		if (P_INT(FILE_PRELOAD_LOCAL))
 			local_load_catalogs(P_STR(FILE_CATALOG_PATH));
 	}
@@ -1156,71 +1279,337 @@ void local_load_catalogs(char *path)
 }
 
 
-static struct cat_star *local_search_file(char *fn, char *name)
+/* Name index of the catalog files: for each file, a table from the lowercased
+ * star names to the offset just past the '(' opening the star's record. The
+ * tables are kept in memory and saved in the user cache dir, and are remade
+ * when the file size or mtime changes */
+
+#define NAME_INDEX_MAGIC "GCXNAMI1"
+#define NAME_INDEX_MAX_DEPTH 64
+
+struct name_index {
+	gint64 mtime, size;	// of the catalog file the index was made from
+	GHashTable *names;	// lowercased name -> gint64 offset
+};
+
+static GHashTable *name_indices;	// catalog file name -> struct name_index
+
+static void name_index_free(struct name_index *nx)
 {
-	char *lbuf = NULL;
-	size_t len = 0;
-	FILE *inf;
-	int ret, i;
-	char *nm = NULL;
-	int paren = 1;
-	GScanner *scan;
+	if (nx == NULL) return;
+	if (nx->names) g_hash_table_destroy(nx->names);
+	g_free(nx);
+}
 
-	inf = fopen(fn, "r");
-	if (inf == NULL) {
-		err_printf("cannot open catalog file: %s (%s)\n", fn, strerror(errno));
-		return NULL;
+static struct name_index *name_index_new(gint64 mtime, gint64 size)
+{
+	struct name_index *nx = g_new0(struct name_index, 1);
+
+	nx->mtime = mtime;
+	nx->size = size;
+	nx->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	return nx;
+}
+
+/* add name to the index unless it is there already (the first record wins,
+ * like in a sequential search) */
+static void name_index_add(struct name_index *nx, char *name, int len, gint64 offset)
+{
+	char *key = g_ascii_strdown(name, len);
+
+	if (g_hash_table_lookup(nx->names, key) != NULL) {
+		g_free(key);
+		return;
 	}
-	
-	do {
-		ret = getline(&lbuf, &len, inf);
-		if (ret < 0)
-			break;
-		nm = strstr(lbuf, name);
-		if (nm != NULL && nm > lbuf) {
-			if (nm[-1] == '"' && nm[strlen(name)] == '"')
-				break;
+
+	gint64 *v = g_new(gint64, 1);
+	*v = offset;
+	g_hash_table_insert(nx->names, key, v);
+}
+
+static char *name_index_file(char *fn)
+{
+	char *sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, fn, -1);
+	char *ifn = g_build_filename(g_get_user_cache_dir(), "gcx", sum, NULL);
+
+	g_free(sum);
+	return ifn;
+}
+
+static int is_ident_char(int c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '-';
+}
+
+/* scan the text of a catalog file for (... name "xxx" ...) records, the way
+ * the star file scanner tokenizes it: ; comments up to the end of line,
+ * "" strings with \ escapes and '' strings without */
+static void name_index_scan(struct name_index *nx, char *text, gsize len)
+{
+	gint64 open[NAME_INDEX_MAX_DEPTH];
+	int depth = 0;
+	GString *name = g_string_new(NULL);
+	gsize i = 0;
+
+	while (i < len) {
+		char c = text[i];
+
+		if (c == ';') {
+			while (i < len && text[i] != '\n') i++;
+
+		} else if (c == '"') {
+			for (i++; i < len && text[i] != '"'; i++)
+				if (text[i] == '\\') i++;
+			i++;
+
+		} else if (c == '\'') {
+			for (i++; i < len && text[i] != '\''; i++)
+				;
+			i++;
+
+		} else if (c == '(') {
+			if (depth < NAME_INDEX_MAX_DEPTH) open[depth] = i + 1;
+			depth++;
+			i++;
+
+		} else if (c == ')') {
+			if (depth > 0) depth--;
+			i++;
+
+		} else if (is_ident_char(c)) {
+			gsize s = i;
+			while (i < len && is_ident_char(text[i])) i++;
+
+			if (i - s != 4 || strncmp(text + s, "name", 4) || depth < 1 || depth > NAME_INDEX_MAX_DEPTH)
+				continue;
+
+			while (i < len && isspace((unsigned char)text[i])) i++;
+			if (i >= len || text[i] != '"')
+				continue;
+
+			g_string_truncate(name, 0);
+			for (i++; i < len && text[i] != '"'; i++) {
+				if (text[i] == '\\' && i + 1 < len) i++;
+				g_string_append_c(name, text[i]);
+			}
+			i++;
+
+			name_index_add(nx, name->str, name->len, open[depth - 1]);
+
 		} else {
-			nm = NULL;
+			i++;
+		}
+	}
+	g_string_free(name, TRUE);
+}
+
+/* save the index as: magic, mtime, size, number of names, then
+ * (offset, name length, name) for each name */
+static void name_index_save(struct name_index *nx, char *ifn)
+{
+	GString *buf = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer key, value;
+	gint32 n = g_hash_table_size(nx->names);
+
+	g_string_append_len(buf, NAME_INDEX_MAGIC, 8);
+	g_string_append_len(buf, (char *)&nx->mtime, sizeof(gint64));
+	g_string_append_len(buf, (char *)&nx->size, sizeof(gint64));
+	g_string_append_len(buf, (char *)&n, sizeof(gint32));
+
+	g_hash_table_iter_init(&iter, nx->names);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		guint16 len = MIN(strlen(key), G_MAXUINT16);
+
+		g_string_append_len(buf, value, sizeof(gint64));
+		g_string_append_len(buf, (char *)&len, sizeof(guint16));
+		g_string_append_len(buf, key, len);
+	}
+
+	char *dir = g_path_get_dirname(ifn);
+	if (g_mkdir_with_parents(dir, 0755) == 0) {
+		GError *err = NULL;
+		if (! g_file_set_contents(ifn, buf->str, buf->len, &err)) {
+			d1_printf("cannot save name index %s (%s)\n", ifn, err->message);
+			g_error_free(err);
 		}
-	} while (ret > 0);
-	if (nm == NULL || ret == 0) { 
-        if (lbuf) free(lbuf);
-		fclose(inf);
+	}
+	g_free(dir);
+	g_string_free(buf, TRUE);
+}
+
+/* load a saved index; return NULL if it is missing, damaged or was made from
+ * another version of the catalog file */
+static struct name_index *name_index_load(char *ifn, gint64 mtime, gint64 size)
+{
+	char *data, *p, *end;
+	gsize len;
+	gint64 imtime, isize;
+	gint32 n, i;
+
+	if (! g_file_get_contents(ifn, &data, &len, NULL))
+		return NULL;
+
+	p = data;
+	end = data + len;
+
+	if (len < 8 + 2 * sizeof(gint64) + sizeof(gint32) || memcmp(p, NAME_INDEX_MAGIC, 8)) {
+		g_free(data);
 		return NULL;
 	}
-	d3_printf("found: \n%s\n", lbuf);
+	p += 8;
+	memcpy(&imtime, p, sizeof(gint64)); p += sizeof(gint64);
+	memcpy(&isize, p, sizeof(gint64)); p += sizeof(gint64);
+	memcpy(&n, p, sizeof(gint32)); p += sizeof(gint32);
 
-	fseek(inf, nm - lbuf - ret + 1, SEEK_CUR);
-	
-    for (i = 0; (i < 100000) && (ftell(inf) > 0); i++) {
-		char c;
-		fseek(inf, -2, SEEK_CUR);
-		c = fgetc(inf);
-		if (c == '(') {
-            paren --;
-			if (paren == 0) {
-//				fseek(inf, -1, SEEK_CUR);
-                break; // found start of record
-			}
+	if (imtime != mtime || isize != size) {
+		g_free(data);
+		return NULL;
+	}
+
+	struct name_index *nx = name_index_new(mtime, size);
+
+	for (i = 0; i < n; i++) {
+		gint64 offset;
+		guint16 nlen;
+
+		if (end - p < sizeof(gint64) + sizeof(guint16))
+			break;
+		memcpy(&offset, p, sizeof(gint64)); p += sizeof(gint64);
+		memcpy(&nlen, p, sizeof(guint16)); p += sizeof(guint16);
+		if (end - p < nlen)
+			break;
+
+		name_index_add(nx, p, nlen, offset);
+		p += nlen;
+	}
+	g_free(data);
+
+	if (i < n) {
+		name_index_free(nx);
+		return NULL;
+	}
+	return nx;
+}
+
+/* return the name index of catalog file fn, loading or making it as needed */
+static struct name_index *name_index_get(char *fn)
+{
+	struct stat st;
+	struct name_index *nx;
+
+	if (stat(fn, &st)) {
+		err_printf("cannot open catalog file: %s (%s)\n", fn, strerror(errno));
+		return NULL;
+	}
+
+	if (name_indices == NULL)
+		name_indices = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+						     (GDestroyNotify) name_index_free);
+
+	nx = g_hash_table_lookup(name_indices, fn);
+	if (nx != NULL && nx->mtime == st.st_mtime && nx->size == st.st_size)
+		return nx;
+
+	char *ifn = name_index_file(fn);
+
+	nx = name_index_load(ifn, st.st_mtime, st.st_size);
+	if (nx == NULL) {
+		char *text;
+		gsize len;
+
+		if (! g_file_get_contents(fn, &text, &len, NULL)) {
+			err_printf("cannot read catalog file: %s\n", fn);
+			g_free(ifn);
+			return NULL;
 		}
-		if (c == ')') 
-			paren ++;
+		d1_printf("Indexing catalog file: %s\n", fn);
+
+		nx = name_index_new(st.st_mtime, st.st_size);
+		name_index_scan(nx, text, len);
+		g_free(text);
+
+		name_index_save(nx, ifn);
 	}
-	lseek(fileno(inf), ftell(inf), SEEK_SET);
+	g_free(ifn);
 
-    scan = init_scanner();
-	g_scanner_input_file(scan, fileno(inf));
+	g_hash_table_replace(name_indices, g_strdup(fn), nx);
+	return nx;
+}
 
-    struct cat_star *cats = cat_star_new();
-	if (!parse_star(scan, cats)) {
-		g_scanner_destroy(scan);
-	} else {
-        cats = cat_star_release(cats, "local_search_files");
+/* read the star record at offset (just past its opening paren) in file fn */
+static struct cat_star *local_read_star(char *fn, gint64 offset)
+{
+	int fd;
+	GScanner *scan;
+	struct cat_star *cats;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0) {
+		err_printf("cannot open catalog file: %s (%s)\n", fn, strerror(errno));
+		return NULL;
 	}
-    if (lbuf) free(lbuf);
-	fclose(inf);
-    return cats;
+	if (lseek(fd, offset, SEEK_SET) != offset) {
+		close(fd);
+		return NULL;
+	}
+
+	scan = init_scanner();
+	g_scanner_input_file(scan, fd);
+
+	cats = cat_star_new();
+	if (parse_star(scan, cats))
+		cats = cat_star_release(cats, "local_read_star");
+
+	g_scanner_destroy(scan);
+	close(fd);
+	return cats;
+}
+
+/* drop the index of fn, in memory and on disk */
+static void name_index_forget(char *fn)
+{
+	char *ifn = name_index_file(fn);
+
+	if (name_indices != NULL)
+		g_hash_table_remove(name_indices, fn);
+	unlink(ifn);
+	g_free(ifn);
+}
+
+static struct cat_star *local_search_file(char *fn, char *name)
+{
+	struct name_index *nx;
+	struct cat_star *cats = NULL;
+	gint64 *offset;
+	int retry;
+
+	char *key = g_ascii_strdown(name, -1);
+
+	for (retry = 0; retry < 2 && cats == NULL; retry++) {
+		nx = name_index_get(fn);
+		if (nx == NULL)
+			break;
+
+		offset = g_hash_table_lookup(nx->names, key);
+		if (offset == NULL)
+			break;
+
+		cats = local_read_star(fn, *offset);
+		if (cats != NULL && cats->name != NULL && ! strcasecmp(cats->name, name))
+			break;
+
+		/* the file changed without changing its size or mtime */
+		if (cats != NULL)
+			cats = cat_star_release(cats, "local_search_file");
+		name_index_forget(fn);
+	}
+	g_free(key);
+
+	if (cats != NULL)
+		d3_printf("found %s in %s\n", name, fn);
+
+	return cats;
 }
 
 static struct cat_star *local_search_files(char *name)
@@ -1245,7 +1634,7 @@ static struct cat_star *local_search_files(char *name)
             ret = glob(buf, GLOB_TILDE, NULL, &gl);
             if (ret == 0) {
                 unsigned i;
-                for (i = 0; i < gl.gl_pathc; i++) {
+                for (i = 0; i < gl.gl_pathc && cats == NULL; i++) {
                     d1_printf("Searching catalog file: %s\n", gl.gl_pathv[i]);
                     cats = local_search_file(gl.gl_pathv[i], name);
                 }
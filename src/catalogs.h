@@ -149,6 +149,7 @@ struct catalog {
 	int (* cat_sync)(struct catalog *cat);
     void *cat_stars; 		/* usually hold a list of cat_stars - or nothing */
 	GHashTable *hash; 	/* hash table used to speed searches up */
+	void *index;		/* spatial index over cat_stars, if the catalog keeps one */
 };
 
 
@@ -46,16 +46,15 @@ double hist_clip_avg(struct rstats *rs, double *median, double sigmas,
 	int iy = 0;
 	int all = 0, n;
 	double m=0, so, s2, sum;
-	int s=0, e=H_SIZE;
+	int s=0, e=H_SIZE; // clip range, as histogram bin indices
 
-
-	for (ix = 0; ix < H_SIZE; ix++) {
-		all += rs->h[ix];
+	for (ix = 0; ix < rs->nbins; ix++) {
+		all += rs->hn[ix];
 	}
-	for (ix = 0; ix < H_SIZE; ix++) { /* get the median */
-		iy += rs->h[ix];
+	for (ix = 0; ix < rs->nbins; ix++) { /* get the median */
+		iy += rs->hn[ix];
 		if (iy >= all / 2) {
-			m = ix + H_START;
+			m = rs->hv[ix];
 			break;
 		}
 	}
@@ -64,10 +63,14 @@ double hist_clip_avg(struct rstats *rs, double *median, double sigmas,
 		so = s2;
 		sum = s2 = 0;
 		n = 0;
-		for (ix = s; ix < e; ix++) {
-			sum += (ix + H_START) * rs->h[ix];
-			s2 += sqr(ix + H_START - m) * rs->h[ix] ;
-			n += rs->h[ix];
+		for (ix = 0; ix < rs->nbins; ix++) {
+			int b = rs->hv[ix] - H_START;
+			if (b < s) continue;
+			if (b >= e) break;
+
+			sum += rs->hv[ix] * rs->hn[ix];
+			s2 += sqr(rs->hv[ix] - m) * rs->hn[ix] ;
+			n += rs->hn[ix];
 		}
 		if (n == 0)
 			goto nullhist;
@@ -86,16 +89,18 @@ double hist_clip_avg(struct rstats *rs, double *median, double sigmas,
 	
 	} while (it < 10 && (it == 1 || fabs(so - s2) > 0.00001) && (s != e));
 
-//	if (s == e)
-//		m = s + H_START;
 	if (median) {
-		if (s == e) 
+		if (s == e || n / 2 == 0)
 			*median = s + H_START;
 		iy = 0;
-		for (ix = s; ix < e; ix++) { /* get the median */
-			iy += rs->h[ix];
+		for (ix = 0; ix < rs->nbins && n / 2 > 0; ix++) { /* get the median */
+			int b = rs->hv[ix] - H_START;
+			if (b < s) continue;
+			if (b >= e) break;
+
+			iy += rs->hn[ix];
 			if (iy >= n / 2) {
-				*median = ix + H_START;
+				*median = rs->hv[ix];
 				break;
 			}
 		}
@@ -117,7 +122,100 @@ nullhist:
 	return m;
 }
 
+/* per-thread storage for the ring pixel values and the sparse histogram */
+struct sky_bins {
+	int *v;		// floored pixel values of the ring
+	int vsize;
+	int *hv;	// sparse histogram handed out in struct rstats
+	int hvsize;
+	int *hn;
+	int hnsize;
+	int *h;		// dense histogram over the value range
+	int hsize;
+};
+
+static __thread struct sky_bins sky_bins;
+
+#define SKY_SORT_MAX 64	// rings up to this size are always sorted
+#define SKY_HIST_SPAN 4	// count in a dense histogram when the value range is within this many times the pixels
+
+static int *grow_buf(int **buf, int *size, int n)
+{
+	if (n > *size) {
+		int *b = realloc(*buf, n * sizeof(int));
+		if (b == NULL)
+			return NULL;
+		*buf = b;
+		*size = n;
+	}
+	return *buf;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	return (*(int *)a > *(int *)b) - (*(int *)a < *(int *)b);
+}
+
+/* bin the nv values in sky_bins.v (all within vmin..vmax) into the sparse histogram of rs:
+ * small or widely spread rings are sorted, dense ones counted over their min-max range.
+ * Return -1 if out of memory */
+static int sky_bins_build(struct rstats *rs, int nv, int vmin, int vmax)
+{
+	struct sky_bins *sb = &sky_bins;
+	int i, n = 0;
+
+	rs->nbins = 0;
+	if (nv <= 0)
+		return 0;
+
+	if (grow_buf(&sb->hv, &sb->hvsize, nv) == NULL || grow_buf(&sb->hn, &sb->hnsize, nv) == NULL)
+		return -1;
 
+	long range = (long) vmax - vmin + 1;
+
+	if (nv > SKY_SORT_MAX && range <= (long) SKY_HIST_SPAN * nv) {
+		if (grow_buf(&sb->h, &sb->hsize, range) == NULL)
+			return -1;
+
+		memset(sb->h, 0, range * sizeof(int));
+		for (i = 0; i < nv; i++)
+			sb->h[sb->v[i] - vmin] ++;
+
+		for (i = 0; i < range; i++) {
+			if (sb->h[i] == 0)
+				continue;
+			sb->hv[n] = vmin + i;
+			sb->hn[n] = sb->h[i];
+			n++;
+		}
+	} else {
+		if (nv <= SKY_SORT_MAX) { // insertion sort
+			for (i = 1; i < nv; i++) {
+				int t = sb->v[i], j = i;
+				for (; j > 0 && sb->v[j - 1] > t; j--)
+					sb->v[j] = sb->v[j - 1];
+				sb->v[j] = t;
+			}
+		} else {
+			qsort(sb->v, nv, sizeof(int), cmp_int);
+		}
+
+		for (i = 0; i < nv; i++) {
+			if (n > 0 && sb->hv[n - 1] == sb->v[i]) {
+				sb->hn[n - 1] ++;
+			} else {
+				sb->hv[n] = sb->v[i];
+				sb->hn[n] = 1;
+				n++;
+			}
+		}
+	}
+
+	rs->nbins = n;
+	rs->hv = sb->hv;
+	rs->hn = sb->hn;
+	return 0;
+}
 
 // compute ring statistics between r1 and r2; ring has the origin at x, y;
 // values lower than min or larger than max are skipped
@@ -151,11 +249,15 @@ int ring_stats(struct ccd_frame *fr, double x, double y,
 
 //	d3_printf("enter ringstats\n");
 
-//    unsigned hix;
-//    for (hix = 0; hix < H_SIZE; hix++) rs->h[hix] = 0;
-
     *rs = (struct rstats) {0};
 
+    int npix = (xe > xs && ye > ys) ? (xe - xs) * (ye - ys) : 0;
+    if (grow_buf(&sky_bins.v, &sky_bins.vsize, npix) == NULL && npix > 0) {
+        err_printf("ring_stats: cannot alloc ring buffer\n");
+        return -1;
+    }
+    int nv = 0;
+
 //	d3_printf("init histogram\n");
 
 // walk the ring and collect statistics
@@ -217,7 +319,7 @@ int ring_stats(struct ccd_frame *fr, double x, double y,
             if (hp < pmin) pmin = hp;
             if (hp > pmax) pmax = hp;
 
-            rs->h[hp] ++;
+            sky_bins.v[nv++] = hp + H_START;
 		}
 	}
 
@@ -238,14 +340,19 @@ int ring_stats(struct ccd_frame *fr, double x, double y,
         rs->sigma = SIGMA(sumsq, sum, rs->used);
     }
 
+    if (sky_bins_build(rs, nv, pmin + H_START, pmax + H_START)) {
+        err_printf("ring_stats: cannot alloc histogram\n");
+        return -1;
+    }
+
 // walk the histogram and compute median
     int med = 0;
-    unsigned int hix;
-    for (hix = pmin; hix <= pmax; hix++) {
-        med += rs->h[hix];
+    int hix;
+    for (hix = 0; hix < rs->nbins - 1; hix++) {
+        med += rs->hn[hix];
         if (med >= 0.5 * rs->used) break;
 	}
-    rs->median = H_START + hix;
+    rs->median = rs->hv[hix];
 
 	return 0;
 }
@@ -525,6 +632,7 @@ int aperture_photometry(struct ccd_frame *fr, struct star *s,
 		return ret;
 
 	if (p->center) {
+		frame_stats(fr);
 		for (i=0; i< 10; i++) {
 			rm = aperture_centroid(fr, p->r1, s->x, s->y, 
                            s->aph.sky + 2 * fr->stats.csigma, &cx, &cy,
@@ -41,22 +41,6 @@
 
 #define BAD_INCREMENT 1024
 
-static double median_pixel(float *dp, int w)
-{
-    double p[8];
-
-	p[0] = dp[-w - 1];
-	p[1] = dp[-w];
-	p[2] = dp[-w + 1];
-	p[3] = dp[-1];
-    p[4] = dp[1];
-    p[5] = dp[w - 1];
-    p[6] = dp[w];
-    p[7] = dp[w + 1];
-
-    return dmedian(p, 8);
-}
-
 /* add_bad_pixel adds a bad pixel to the bad pixel map */
 static int add_bad_pixel(int x, int y, struct bad_pix_map *map, int type, float v)
 {
@@ -84,47 +68,192 @@ static int add_bad_pixel(int x, int y, struct bad_pix_map *map, int type, float
 	return 0;
 }
 
-/* find_bad_pixels writes a bad pixel file, that contains a listing
-   of hot/bright and dark pixels; For each pixel (except a 1-pix border)
-   it compares the pixel to the median of it's neighbours; If the difference
-   is greater than 'sig' frame csigmas, it is added to the pixel map
-   the bad pixel map's size is increased if necessary */
-int find_bad_pixels(struct bad_pix_map *map, struct ccd_frame *fr, double sig)
-{
-    int x, y;
+#define BADPIX_BAND_H 64 // rows per band of the detector
+
+// compare-exchange, leaves the smaller value in a
+#define PIX_SORT(a, b) { float t_ = (a < b) ? a : b; b = (a < b) ? b : a; a = t_; }
 
-	float v;
+/* median of the 8 neighbours of each pixel of row r (x = 1 .. w - 2), as dmedian
+   would return it (the 5th smallest); the rows above and below must exist.
+   A fixed sorting network on the 8 values, without branches, so the loop
+   can be vectorized */
+static void neighbour_median_row(float *r, int w, float *med)
+{
+	float *a = r - w;
+	float *c = r + w;
+	int x;
+
+	for (x = 1; x < w - 1; x++) {
+		float p0 = a[x - 1], p1 = a[x], p2 = a[x + 1], p3 = r[x - 1];
+		float p4 = r[x + 1], p5 = c[x - 1], p6 = c[x], p7 = c[x + 1];
+
+		PIX_SORT(p0, p2); PIX_SORT(p1, p3); PIX_SORT(p4, p6); PIX_SORT(p5, p7);
+		PIX_SORT(p0, p4); PIX_SORT(p1, p5); PIX_SORT(p2, p6); PIX_SORT(p3, p7);
+		PIX_SORT(p0, p1); PIX_SORT(p2, p3); PIX_SORT(p4, p5); PIX_SORT(p6, p7);
+		PIX_SORT(p2, p4); PIX_SORT(p3, p5);
+		PIX_SORT(p1, p4); PIX_SORT(p3, p6);
+		PIX_SORT(p1, p2); PIX_SORT(p3, p4); PIX_SORT(p5, p6);
+
+		med[x] = p4;
+	}
+}
 
-    int ret = 0;
-    if (!fr->stats.statsok)
-		frame_stats(fr);
+struct badpix_job {
+	struct ccd_frame **frs;
+	int n;			// number of frames in the stack
+	double *lo;		// per frame thresholds
+	double *hi;
+	int band_h;
+	struct bad_pix_map *band;	// pixels found, one map per band
+};
+
+/* rows [y0, y1) of the frame interior (frame rows y0 + 1 .. y1) */
+static int badpix_rows(void *data, int plane, int y0, int y1)
+{
+	struct badpix_job *job = data;
+	struct bad_pix_map *map = &job->band[y0 / job->band_h];
+	int w = job->frs[0]->w;
+	int n = job->n;
+	int x, y, i;
+
+	float *med = malloc(w * sizeof(float));
+	float *dev = malloc(n * w * sizeof(float)); // deviation from the median, per frame
+	double *v = malloc(n * sizeof(double));
+	int ret = 0;
+
+	if (med == NULL || dev == NULL || v == NULL) {
+		ret = ERR_ALLOC;
+		goto end;
+	}
 
-    double lo = - sig * fr->stats.csigma;
-    double hi =   sig * fr->stats.csigma;
+	for (y = y0 + 1; y < y1 + 1; y++) {
+		for (i = 0; i < n; i++) {
+			float *r = (float *)job->frs[i]->dat + y * w;
+			float *d = dev + i * w;
 
-    float *dp = (float *)(fr->dat);
+			neighbour_median_row(r, w, med);
+			for (x = 1; x < w - 1; x++)
+				d[x] = r[x] - med[x];
+		}
 
-	for (x = 1; x < fr->w - 1; x++) {
-        float *dpt = dp + x + fr->w;
-		for (y = 1; y < fr->h - 1; y++) {
-            float median_pix = median_pixel(dpt, fr->w); // should we exclude center pixel?
+		for (x = 1; x < w - 1; x++) {
+			int hot = 0, dark = 0;
 
-            v = *dpt - median_pix;
+			// a pixel has to be off in most frames, so transients are left out
+			for (i = 0; i < n; i++) {
+				v[i] = dev[i * w + x];
+				if (v[i] > job->hi[i])
+					hot++;
+				else if (v[i] < job->lo[i])
+					dark++;
+			}
 
-            if (v > hi)
-                ret = add_bad_pixel(x, y, map, BAD_HOT, fabs(v));
-            else if (v < lo)
-                ret = add_bad_pixel(x, y, map, BAD_DARK, fabs(v));
+			if (2 * hot > n)
+				ret = add_bad_pixel(x, y, map, BAD_HOT, fabs(dmedian(v, n)));
+			else if (2 * dark > n)
+				ret = add_bad_pixel(x, y, map, BAD_DARK, fabs(dmedian(v, n)));
 
 			if (ret)
-				goto error;
+				goto end;
+		}
+	}
+
+end:
+	free(med);
+	free(dev);
+	free(v);
+	return ret;
+}
 
-			dpt += fr->w;
+static int cmp_bad_pixel(const void *a, const void *b)
+{
+	const struct bad_pixel *pa = a;
+	const struct bad_pixel *pb = b;
+
+	if (pa->x != pb->x)
+		return (pa->x > pb->x) - (pa->x < pb->x);
+	return (pa->y > pb->y) - (pa->y < pb->y);
+}
+
+/* find_bad_pixels_stack adds to map the hot/bright and dark pixels of a stack
+   of n frames of the same size (darks, usually). For each pixel (except a 1-pix
+   border) it compares the pixel to the median of it's 8 neighbours; if the
+   difference is greater than 'sig' frame csigmas in more than half of the frames,
+   the pixel is added to the map, with the median difference. A single frame
+   gives the pixels that are off in that frame. The frame interior is scanned in
+   parallel row bands; the pixels are added by column, then row */
+int find_bad_pixels_stack(struct bad_pix_map *map, struct ccd_frame **frs, int n, double sig)
+{
+	struct badpix_job job;
+	int i, ret = 0;
+
+	if (n < 1)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (frs[i]->pix_format != PIX_FLOAT) {
+			err_printf("find_bad_pixels: %s is not a float frame\n", frs[i]->name);
+			return -1;
+		}
+		if (frs[i]->w != frs[0]->w || frs[i]->h != frs[0]->h) {
+			err_printf("find_bad_pixels: %s has a different size\n", frs[i]->name);
+			return -1;
 		}
+		frame_stats(frs[i]);
 	}
+
+	struct ccd_frame *fr = frs[0];
+	int h = fr->h - 2; // interior rows
+
+	memset(&job, 0, sizeof(struct badpix_job));
+	job.frs = frs;
+	job.n = n;
+	job.band_h = BADPIX_BAND_H;
+
+	int nbands = (h > 0) ? (h + job.band_h - 1) / job.band_h : 0;
+
+	job.lo = malloc(n * sizeof(double));
+	job.hi = malloc(n * sizeof(double));
+	job.band = calloc(nbands + 1, sizeof(struct bad_pix_map));
+	if (job.lo == NULL || job.hi == NULL || job.band == NULL) {
+		ret = ERR_ALLOC;
+		goto end;
+	}
+
+	for (i = 0; i < n; i++) {
+		job.lo[i] = - sig * frs[i]->stats.csigma;
+		job.hi[i] =   sig * frs[i]->stats.csigma;
+	}
+
+	if (fr->w > 2 && h > 0 && parallel_rows(h, 1, job.band_h, badpix_rows, &job, NULL, NULL)) {
+		ret = ERR_ALLOC;
+		goto end;
+	}
+
+	// collect the bands
+	unsigned first = map->pixels;
+	for (i = 0; i < nbands; i++) {
+		unsigned k;
+		for (k = 0; k < job.band[i].pixels; k++) {
+			struct bad_pixel *p = &job.band[i].pix[k];
+			ret = add_bad_pixel(p->x, p->y, map, p->type, p->v);
+			if (ret)
+				goto end;
+		}
+	}
+	if (map->pixels - first > 1)
+		qsort(map->pix + first, map->pixels - first, sizeof(struct bad_pixel), cmp_bad_pixel);
+
 // todo: find bad regions
 
-error:
+end:
+	if (job.band)
+		for (i = 0; i < nbands; i++)
+			free(job.band[i].pix);
+	free(job.band);
+	free(job.lo);
+	free(job.hi);
+
 	map->x_skip = fr->x_skip;
 	map->y_skip = fr->y_skip;
 	map->bin_x = fr->exp.bin_x;
@@ -132,7 +261,14 @@ error:
 
 	info_printf("found %d bad pixels\n", map->pixels);
 	return ret;
+}
 
+/* find_bad_pixels writes a bad pixel file, that contains a listing
+   of hot/bright and dark pixels of one frame; see find_bad_pixels_stack.
+   the bad pixel map's size is increased if necessary */
+int find_bad_pixels(struct bad_pix_map *map, struct ccd_frame *fr, double sig)
+{
+	return find_bad_pixels_stack(map, &fr, 1, sig);
 }
 
 /* save_bad_pix saves a bad pixel map to a file. The file
@@ -544,6 +680,42 @@ static void fix_pixel_green(struct ccd_frame *fr, int x, int y, int bn)
 	}
 }
 
+/* get the frame position of bad pixel i of the map into (*frx, *fry).
+ * return 1 if fix_bad_pixels interpolates it, 0 if it is left alone */
+static int bad_pixel_pos(struct ccd_frame *fr, struct bad_pix_map *map, int i, int *frx, int *fry)
+{
+	if (fr->magic & FRAME_HAS_CFA) {
+		/* CFA pattern */
+		*frx = map->pix[i].x;
+		*fry = map->pix[i].y;
+
+		switch (CFA_COLOR(fr->rmeta.color_matrix, *frx, *fry)) {
+		case CFA_RED:
+		case CFA_BLUE:
+			return ! ((*frx < 2) || (*frx > fr->w - 3) || (*fry < 2) || (*fry > fr->h - 3));
+
+		case CFA_GREEN1:
+		case CFA_GREEN2:
+			return ! ((*frx < 1) || (*frx > fr->w - 2) || (*fry < 1) || (*fry > fr->h - 2));
+		}
+		return 0;
+	}
+
+	if (fr->magic & FRAME_VALID_RGB)
+		return 0;
+
+	/* regular BW image */
+	if (fr->exp.bin_y != 0 && fr->exp.bin_x != 0) {
+		*frx = map->pix[i].x - fr->x_skip / fr->exp.bin_x;
+		*fry = map->pix[i].y - fr->y_skip / fr->exp.bin_y;
+	} else {
+		*frx = map->pix[i].x;
+		*fry = map->pix[i].y;
+	}
+
+	return (*frx > 1 && *frx < fr->w - 2 && *fry > 1 && *fry < fr->h - 2);
+}
+
 /* fix_bad_pixels will interpolate the bad pixels of a frame from their good first-order
    neighbours. */
 int fix_bad_pixels (struct ccd_frame *fr, struct bad_pix_map *map)
@@ -555,24 +727,18 @@ int fix_bad_pixels (struct ccd_frame *fr, struct bad_pix_map *map)
 //printf("here\n");
 		/* CFA pattern */
 		for (i = 0; i < map->pixels; i++) {
-			frx = map->pix[i].x;
-			fry = map->pix[i].y;
+			if (! bad_pixel_pos(fr, map, i, &frx, &fry))
+				continue;
 
 			switch (CFA_COLOR(fr->rmeta.color_matrix, frx, fry)) {
 			case CFA_RED:
 			case CFA_BLUE:
-				if ((frx < 2) || (frx > fr->w - 3) || (fry < 2) || (fry > fr->h - 3))
-					continue;
-
 				bn = bad_neighbours_redblue(map, i);
 				fix_pixel_redblue(fr, frx, fry, bn);
 				break;
 
 			case CFA_GREEN1:
 			case CFA_GREEN2:
-				if ((frx < 1) || (frx > fr->w - 2) || (fry < 1) || (fry > fr->h - 2))
-					continue;
-
 				bn = bad_neighbours_green(map, i);
 				fix_pixel_green(fr, frx, fry, bn);
 				break;
@@ -586,26 +752,38 @@ int fix_bad_pixels (struct ccd_frame *fr, struct bad_pix_map *map)
 	} else {
 		/* regular BW image */
 		for (i = 0; i < map->pixels; i++) {
-            if (fr->exp.bin_y != 0 && fr->exp.bin_x != 0) {
-                frx = map->pix[i].x - fr->x_skip / fr->exp.bin_x;
-                fry = map->pix[i].y - fr->y_skip / fr->exp.bin_y;
-            } else {
-                frx = map->pix[i].x;
-                fry = map->pix[i].y;
-            }
+			if (! bad_pixel_pos(fr, map, i, &frx, &fry))
+				continue;
+
+			if (map->pix[i].type == BAD_REGION) {
+				fix_region(fr, frx, fry, map->pix[i].bad_neighbors);
+			} else {
+				bn = bad_neighbours(map, i,  fr->exp.bin_x, fr->exp.bin_y);
+				fix_pixel(fr, frx, fry, bn);
+			}
+		}
+	}
+	return 0;
+}
 
-            if (frx > 1 && frx < fr->w - 2 && fry > 1 && fry < fr->h - 2) {
-                if (map->pix[i].type == BAD_REGION) {
-                    fix_region(fr, frx, fry, map->pix[i].bad_neighbors);
-                } else {
-                    bn = bad_neighbours(map, i,  fr->exp.bin_x, fr->exp.bin_y);
-                    fix_pixel(fr, frx, fry, bn);
-                }
-            }
+/* the offsets (x + y * w) of the frame pixels fix_bad_pixels changes, in a
+ * malloced array (*offs) the caller frees. Return their number, -1 on error */
+int bad_pixel_offsets(struct ccd_frame *fr, struct bad_pix_map *map, int **offs)
+{
+	int i, n = 0;
+	int frx, fry;
 
-        }
+	*offs = malloc((map->pixels + 1) * sizeof(int));
+	if (*offs == NULL) {
+		err_printf("bad_pixel_offsets: cannot alloc offsets\n");
+		return -1;
 	}
-	return 0;
+
+	for (i = 0; i < map->pixels; i++)
+		if (bad_pixel_pos(fr, map, i, &frx, &fry))
+			(*offs)[n++] = frx + fry * fr->w;
+
+	return n;
 }
 
 
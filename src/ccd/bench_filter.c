@@ -0,0 +1,75 @@
+// bench_filter.c: time filter_frame with the 7x7 kernel of new_blur_kern
+// (applied in 2-D) and with a separable 7x7 gaussian, and gauss_blur_frame,
+// on a 3000x2000 frame. Built by "make bench"; run as
+//   bench_filter [threads]
+// threads defaults to 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <glib.h>
+
+#include "ccd.h"
+#include "../params.h"
+
+#define W 3000
+#define H 2000
+#define REPS 3
+
+static struct ccd_frame *noise_frame(void)
+{
+    struct ccd_frame *fr = new_frame(W, H);
+    float *dp = fr->dat;
+    int i;
+
+    srand(3);
+    for (i = 0; i < W * H; i++)
+        dp[i] = 100 + 400 * (rand() / (float)RAND_MAX);
+    return fr;
+}
+
+static void time_filter(char *what, float *kern, int size)
+{
+    struct ccd_frame *fr = noise_frame();
+    struct ccd_frame *fro = new_frame(W, H);
+    gint64 t0;
+    int k;
+
+    t0 = g_get_monotonic_time();
+    for (k = 0; k < REPS; k++)
+        filter_frame(fr, fro, kern, size);
+    printf("%-24s %7.1f ms\n", what, (g_get_monotonic_time() - t0) / 1e3 / REPS);
+
+    free_frame(fr);
+    free_frame(fro);
+}
+
+int main(int argc, char **argv)
+{
+    struct blur_kern *bk = new_blur_kern(NULL, 7, 1.5);
+    float sep[49];
+    gint64 t0, total = 0;
+    int i, k;
+
+    P_INT(CCDRED_THREADS) = (argc > 1) ? atoi(argv[1]) : 1;
+
+    time_filter("filter_frame 7x7 blur", bk->kern, bk->size);
+
+    for (i = 0; i < 49; i++) {
+        int x = i % 7 - 3, y = i / 7 - 3;
+        sep[i] = exp(-(x * x + y * y) / 4.0) / 12.5;
+    }
+    time_filter("filter_frame 7x7 gauss", sep, 7);
+
+    for (k = 0; k < REPS; k++) { // blurs in place, so a new frame each time
+        struct ccd_frame *fr = noise_frame();
+        t0 = g_get_monotonic_time();
+        gauss_blur_frame(fr, 3.0);
+        total += g_get_monotonic_time() - t0;
+        free_frame(fr);
+    }
+    printf("%-24s %7.1f ms\n", "gauss_blur_frame 3.0", total / 1e3 / REPS);
+
+    free_blur_kern(bk);
+    return 0;
+}
@@ -0,0 +1,71 @@
+// bench_fits.c: time write_fits_frame on a 4096x4096 frame, as 16-bit data
+// and unscaled floats (the float_fits option), and check that both read
+// back exactly. Built by "make bench"; run as
+//   bench_fits [threads [file]]
+// threads defaults to 1, file to bench.fits in the current directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <glib.h>
+
+#include "ccd.h"
+#include "../params.h"
+
+#define SIZE 4096
+#define REPS 5
+
+static int run(struct ccd_frame *fr, char *fn, int float_fits)
+{
+    gint64 t0, t1;
+    int i, k, bad = 0;
+
+    P_INT(FILE_FLOAT_FITS) = float_fits;
+
+    t0 = g_get_monotonic_time();
+    for (k = 0; k < REPS; k++) {
+        fr->stats.statsok = 0; // the 16-bit writer needs them each time
+        if (write_fits_frame(fr, fn)) {
+            fprintf(stderr, "cannot write %s\n", fn);
+            return -1;
+        }
+    }
+    t1 = g_get_monotonic_time();
+
+    struct ccd_frame *rf = read_fits_file(fn, 0, NULL);
+    if (rf == NULL) {
+        fprintf(stderr, "cannot read back %s\n", fn);
+        return -1;
+    }
+    for (i = 0; i < fr->w * fr->h; i++) {
+        float v = ((float *)fr->dat)[i];
+        float e = float_fits ? v : floorf(v + 0.5);
+        if (((float *)rf->dat)[i] != e)
+            bad++;
+    }
+    free_frame(rf);
+
+    printf("%-8s %7.1f ms per frame, %d pixels differ on reading back\n",
+           float_fits ? "float" : "16-bit", (t1 - t0) / 1e3 / REPS, bad);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    char *fn = (argc > 2) ? argv[2] : "bench.fits";
+    struct ccd_frame *fr = new_frame(SIZE, SIZE);
+    float *dp = fr->dat;
+    int i, bad;
+
+    P_INT(CCDRED_THREADS) = (argc > 1) ? atoi(argv[1]) : 1;
+
+    for (i = 0; i < SIZE * SIZE; i++) // in 16-bit range, with fractions
+        dp[i] = (i * 2654435761u % 60000) + 0.2f * (i % 4);
+
+    bad = run(fr, fn, 0);
+    bad |= run(fr, fn, 1);
+
+    free_frame(fr);
+    remove(fn);
+    return bad != 0;
+}
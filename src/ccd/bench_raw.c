@@ -0,0 +1,284 @@
+// bench_raw.c: time read_raw_file on a synthetic Canon CR2: a 5184x3888
+// frame of 14-bit noisy sky, stored as 2-component lossless JPEG in three
+// slices, and check the decoded frame against the source. Built by
+// "make bench"; run as
+//   bench_raw [threads [file]]
+// threads defaults to 1, file to bench.cr2 in the current directory.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+#include <glib.h>
+
+#include "ccd.h"
+#include "../params.h"
+
+#define W 5184 // frame width, two components of 2592
+#define H 3888
+#define NCOMP 2
+#define BITS 14
+#define SLICES 2 // of SLICE_W columns, and the rest
+#define SLICE_W 1728
+#define REPS 3
+
+/* the huffman table: three codes of length 2, then one of each length 3 .. 15 */
+static const int code_counts[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0 };
+static const int code_vals[16] = { 6, 7, 8, 5, 9, 4, 10, 3, 11, 2, 12, 1, 13, 0, 14, 15 };
+
+struct out {
+    uint8_t *buf;
+    size_t len;
+    uint32_t acc;	// bits not written yet
+    int nacc;
+};
+
+static void put8(struct out *o, int v)
+{
+    o->buf[o->len++] = v;
+}
+
+static void put16(struct out *o, int v) // big endian, for the jpeg markers
+{
+    put8(o, v >> 8);
+    put8(o, v & 0xff);
+}
+
+static void put16le(struct out *o, int v)
+{
+    put8(o, v & 0xff);
+    put8(o, v >> 8);
+}
+
+static void put32le(struct out *o, uint32_t v)
+{
+    put16le(o, v & 0xffff);
+    put16le(o, v >> 16);
+}
+
+/* entropy coded bits, with a 0 stuffed after each 0xff byte */
+static void put_bits(struct out *o, int v, int n)
+{
+    while (n--) {
+        o->acc = (o->acc << 1) | ((v >> n) & 1);
+        if (++o->nacc == 8) {
+            put8(o, o->acc);
+            if (o->acc == 0xff)
+                put8(o, 0);
+            o->acc = 0;
+            o->nacc = 0;
+        }
+    }
+}
+
+static void tiff_tag(struct out *o, int tag, int type, int count, uint32_t data)
+{
+    put16le(o, tag);
+    put16le(o, type);
+    put32le(o, count);
+    put32le(o, data);
+}
+
+/* the lossless jpeg stream of raster, W / NCOMP samples of NCOMP components per row */
+static void put_ljpeg(struct out *o, uint16_t *raster)
+{
+    int clen[17], cval[17];
+    int pred[NCOMP];
+    int code = 0, i, k = 0, l, x, y;
+
+    for (l = 0; l < 16; l++) {
+        for (i = 0; i < code_counts[l]; i++) {
+            clen[code_vals[k]] = l + 1;
+            cval[code_vals[k]] = code++;
+            k++;
+        }
+        code <<= 1;
+    }
+
+    put16(o, 0xffd8);
+
+    put16(o, 0xffc4);
+    put16(o, 2 + 1 + 16 + 16);
+    put8(o, 0);
+    for (i = 0; i < 16; i++)
+        put8(o, code_counts[i]);
+    for (i = 0; i < 16; i++)
+        put8(o, code_vals[i]);
+
+    put16(o, 0xffc3);
+    put16(o, 8 + NCOMP * 3);
+    put8(o, BITS);
+    put16(o, H);
+    put16(o, W / NCOMP);
+    put8(o, NCOMP);
+    for (i = 0; i < NCOMP; i++) {
+        put8(o, i + 1);
+        put8(o, 0x11);
+        put8(o, 0);
+    }
+
+    put16(o, 0xffda);
+    put16(o, 6 + 2 * NCOMP);
+    put8(o, NCOMP);
+    for (i = 0; i < NCOMP; i++) {
+        put8(o, i + 1);
+        put8(o, 0x00);
+    }
+    put8(o, 1); // predictor: left
+    put8(o, 0);
+    put8(o, 0);
+
+    for (i = 0; i < NCOMP; i++)
+        pred[i] = (1 << BITS) - 1;
+
+    for (y = 0; y < H; y++) {
+        uint16_t *r = raster + (size_t) y * W;
+        for (x = 0; x < W; x++) {
+            int c = x % NCOMP;
+            int p = (x < NCOMP) ? pred[c] : r[x - NCOMP];
+            int d = (int16_t) (r[x] - p);
+            int s = 0;
+
+            if (x < NCOMP)
+                pred[c] = r[x];
+            while (abs(d) >> s)
+                s++;
+            put_bits(o, cval[s], clen[s]);
+            if (s)
+                put_bits(o, (d >= 0) ? d : d + (1 << s) - 1, s);
+        }
+    }
+    while (o->nacc)
+        put_bits(o, 1, 1);
+    put16(o, 0xffd9);
+}
+
+/* write a little-endian CR2 holding the tags read_cr2_file needs, and the
+ * frame img in slices; return the size of the jpeg stream */
+static size_t write_cr2(char *fn, uint16_t *img)
+{
+    struct out o = { 0 };
+    uint16_t *raster = malloc((size_t) W * H * sizeof(uint16_t));
+    size_t n = 0, jpeg_len;
+    int k, x, y;
+
+    // the stream holds the slices one after the other, each top to bottom
+    for (k = 0; k <= SLICES; k++) {
+        int x0 = k * SLICE_W;
+        int sw = (k < SLICES) ? SLICE_W : W - SLICES * SLICE_W;
+        for (y = 0; y < H; y++)
+            for (x = 0; x < sw; x++)
+                raster[n++] = img[(size_t) y * W + x0 + x];
+    }
+
+    o.buf = malloc((size_t) W * H * 4 + 4096);
+
+    const int ifd0 = 16, ifd1 = ifd0 + 18, ifd2 = ifd1 + 6, ifd3 = ifd2 + 6;
+    const int exif = ifd3 + 42, makernote = exif + 18, sensor = makernote + 30;
+    const int color = sensor + 17 * 2, slices = color + 582 * 2, jpeg = slices + 6;
+
+    put16le(&o, 0x4949);
+    put16le(&o, 42);
+    put32le(&o, ifd0);
+    put8(&o, 'C');
+    put8(&o, 'R');
+    put8(&o, 2);
+    put8(&o, 0);
+    put32le(&o, ifd3);
+
+    put16le(&o, 1);
+    tiff_tag(&o, 0x8769, 4, 1, exif);
+    put32le(&o, ifd1);
+    put16le(&o, 0);
+    put32le(&o, ifd2);
+    put16le(&o, 0);
+    put32le(&o, ifd3);
+
+    put16le(&o, 3);
+    tiff_tag(&o, 0x0111, 4, 1, jpeg);
+    tiff_tag(&o, 0x0117, 4, 1, 0); // the size is patched in below
+    tiff_tag(&o, 0xc640, 3, 3, slices);
+    put32le(&o, 0);
+
+    put16le(&o, 1);
+    tiff_tag(&o, 0x927c, 7, 1, makernote);
+    put32le(&o, 0);
+
+    put16le(&o, 2);
+    tiff_tag(&o, 0x00e0, 3, 17, sensor);
+    tiff_tag(&o, 0x4001, 3, 582, color);
+    put32le(&o, 0);
+
+    for (k = 0; k < 17; k++) // sensor info: width, height and borders
+        put16le(&o, (k == 1) ? W : (k == 2) ? H : (k == 7) ? W - 1 : (k == 8) ? H - 1 : 0);
+    for (k = 0; k < 582; k++) // color data as the 20D's: white balance gains at 25
+        put16le(&o, (k >= 25 && k < 29) ? 1024 : 0);
+
+    put16le(&o, SLICES);
+    put16le(&o, SLICE_W);
+    put16le(&o, W - SLICES * SLICE_W);
+
+    put_ljpeg(&o, raster);
+    jpeg_len = o.len - jpeg;
+
+    size_t len = o.len;
+    o.len = ifd3 + 2 + 12 + 8; // the bytecount value
+    put32le(&o, jpeg_len);
+    o.len = len;
+
+    FILE *fp = fopen(fn, "wb");
+    if (fp == NULL || fwrite(o.buf, 1, o.len, fp) != o.len) {
+        fprintf(stderr, "cannot write %s\n", fn);
+        exit(1);
+    }
+    fclose(fp);
+
+    free(o.buf);
+    free(raster);
+    return jpeg_len;
+}
+
+int main(int argc, char **argv)
+{
+    char *fn = (argc > 2) ? argv[2] : "bench.cr2";
+    uint16_t *img = malloc((size_t) W * H * sizeof(uint16_t));
+    size_t i, jpeg_len;
+    gint64 t0, t1;
+    int k, bad = 0;
+
+    P_INT(CCDRED_THREADS) = (argc > 1) ? atoi(argv[1]) : 1;
+
+    srand(3);
+    for (i = 0; i < (size_t) W * H; i++) { // sky, a pattern, noise and some stars
+        double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = rand() / (RAND_MAX + 1.0);
+        int val = 2048 + 500 * sin(i % W / 50.0) + 100 * sqrt(-2 * log(u)) * cos(2 * M_PI * v)
+            + ((rand() % 5000 == 0) ? 12000 : 0);
+        img[i] = (val < 0) ? 0 : (val > 16383) ? 16383 : val;
+    }
+    jpeg_len = write_cr2(fn, img);
+
+    struct ccd_frame *fr = NULL;
+    t0 = g_get_monotonic_time();
+    for (k = 0; k < REPS; k++) {
+        if (fr)
+            free_frame(fr);
+        fr = read_raw_file(fn);
+        if (fr == NULL) {
+            fprintf(stderr, "cannot read %s\n", fn);
+            return 1;
+        }
+    }
+    t1 = g_get_monotonic_time();
+
+    for (i = 0; i < (size_t) W * H; i++)
+        if (((float *)fr->dat)[i] != img[i])
+            bad++;
+
+    printf("read_raw_file: %.1f MB stream, %.1f ms per frame, %.0f MB/s, %d pixels differ\n",
+           jpeg_len / 1e6, (t1 - t0) / 1e3 / REPS, jpeg_len * REPS / ((t1 - t0) / 1e6) / 1e6, bad);
+
+    free_frame(fr);
+    free(img);
+    remove(fn);
+    return bad != 0;
+}
@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <math.h>
 #include <sys/time.h>
+#include <glib.h>
 
 #ifdef HAVE_LIBDMALLOC
 #include <dmalloc.h>
@@ -110,6 +111,7 @@ struct exp_data {
 
 // center of the population lies between 1/POP_CENTER and 1-1/POP_CENTER
 #define POP_CENTER 4
+#define STATS_SAMPLE_STEP 3 // pixel step of display-only stats (odd, so all cfa positions are sampled)
 #define H_SIZE (2*65535 + 1)
 #define H_START (-65535)
 // frame_stats fills the statistics buffer for the frame
@@ -122,12 +124,12 @@ struct exp_data {
 // an image histogram
 struct im_histogram {
 	unsigned hsize;	// number of bins in histogram
-	double st; 	// the value of the leftmost bin
-	double end; 	// rightmost bin
+	double st; 	// the value of the leftmost bin; bins are one unit wide and
+	double end; 	// span the data range, within H_START .. H_START + H_SIZE
     unsigned cst;   // beginning of the population center (only set - region_stats())
     unsigned cend;  // end of the population center (not used)
     unsigned binmax; // highest value of a bin (only set - region_stats())
-	unsigned *hdat; // pointer to the actual histogram data (hsize unsigneds)
+	unsigned *hdat; // pointer to the actual histogram data (room for H_SIZE + 1 unsigneds)
 };
 
 // structure holding satistics on the frame
@@ -145,6 +147,23 @@ struct im_stats {
     int free_stats; // if 1 free the stats struct returned by alloc_stats(NULL)
 	double avgs[4];
 	struct im_histogram hist; // the histogram for the current image
+	int step;	// stats are of every step-th row and column (1: all pixels)
+	int plane;	// active_plane the stats are of
+	unsigned generation; // frame generation the stats are of
+};
+
+// running sums for frame statistics, so a frame can be scanned in pieces
+// (see stats_acc_init, stats_acc_add, stats_acc_merge and stats_acc_finish)
+struct stats_acc {
+	unsigned *hdat;	// histogram being filled (hsize unit bins and a zero sentinel)
+	unsigned hsize;
+	double hmin;	// value of the first bin
+	double sum;
+	double sumsq;
+	double min;
+	double max;
+	double avgs[4];	// sums of the four 2x2 cfa positions
+	unsigned n;	// pixels added
 };
 
 /* wcs states */
@@ -218,6 +237,32 @@ struct bad_pixel {
     unsigned short bad_neighbors;
 };
 
+// single-pass calibration (calib_add_*, calib_frame): the operations are
+// applied to every pixel in the order they were added
+#define CALIB_MAX_OPS 8
+
+enum {
+	CALIB_SUB,	// subtract a bias or dark frame
+	CALIB_FLAT,	// divide by a flat
+	CALIB_SCALE,	// p * m + s
+};
+
+struct calib_op {
+	int type;
+	struct ccd_frame *fr1;	// bias/dark/flat frame
+	double m, s;		// scale and shift
+	double mu, ll;		// flat average and lowest usable flat value
+	int xst, yst;		// overlap with fr1, from the frame skips
+	int x1st, y1st;
+	int xovlap, yovlap;
+};
+
+struct calib {
+	int nops;
+	struct calib_op op[CALIB_MAX_OPS];
+	struct bad_pix_map *map;	// pixels interpolated after the ops, or NULL
+};
+
 // bad pixel map
 struct bad_pix_map {
 	int ref_count;
@@ -306,6 +351,8 @@ struct ccd_frame {
 	unsigned magic; // an unique number identifying the frame (science, dark, flatfield etc)
 	struct exp_data exp;
     struct im_stats stats;
+    struct im_stats dstats; // sampled stats for display only (frame_stats_sampled)
+    unsigned generation; // bumped when the pixel data changes (frame_data_changed)
     struct wcs fim;
 	struct raw_metadata rmeta;
 	int data_valid;	/* non-zero shows the data in the array is valid
@@ -328,6 +375,7 @@ struct ccd_frame {
     void *ofr; // pointer to o_frame if mband active
     struct image_file *imf; // point back to imf
     void *window; // used only as argument to user_about() for control-c polling
+    GRWLock pix_lock; // see frame_pixels_write_lock
 };
 
 // magic numbers for ccd frame
@@ -533,7 +581,12 @@ struct rstats {
 	double sumsq;
 	int max_x;
 	int max_y;
-	int h[H_SIZE];
+// sparse histogram of the floored pixel values used (H_START .. H_START + H_SIZE - 1):
+// nbins occupied bins in increasing order. Set by ring_stats; the arrays belong to the
+// calling thread and stay valid until its next ring_stats call
+	int nbins;
+	int *hv;	// bin values
+	int *hn;	// pixel counts
 };
 
 struct moments {
@@ -573,6 +626,13 @@ struct ctrans {
 	double b[MAX_ORDER+1][MAX_ORDER+1];
 };
 
+// interpolation kernels for resample_frame
+enum {
+	RESAMPLE_BILINEAR,
+	RESAMPLE_BICUBIC,
+	RESAMPLE_LANCZOS3,
+};
+
 //define inline functions for performance-critical stuff
 enum {
 	PLANE_NULL  = 0,
@@ -603,6 +663,55 @@ static inline float get_pixel_luminence(struct ccd_frame *fr, int x, int y) {
 	return *((float *)fr->dat + offset);
 }
 
+// add pixel v at (x, y) to the running statistics
+static inline void stats_acc_add(struct stats_acc *acc, float v, int x, int y) {
+	unsigned bix;
+	double d = (double) v - acc->hmin;
+	if (! (d >= 0))
+		bix = 0;
+	else if (d >= acc->hsize)
+		bix = acc->hsize - 1;
+	else
+		bix = d;
+
+	acc->hdat[bix] ++;
+
+	if (v > acc->max) acc->max = v;
+	if (v < acc->min) acc->min = v;
+
+	acc->sum += v;
+	acc->sumsq += v * v;
+
+	acc->avgs[y % 2 * 2 + x % 2] += v;
+	acc->n ++;
+}
+
+/* the planes of a frame may be read by other threads (the image window renders
+ * tiles in the background). In-place operations hold the write lock while they
+ * change, replace or free the planes; frame_stats must not be called meanwhile */
+static inline void frame_pixels_write_lock(struct ccd_frame *fr) {
+	g_rw_lock_writer_lock(&fr->pix_lock);
+}
+
+static inline void frame_pixels_write_unlock(struct ccd_frame *fr) {
+	g_rw_lock_writer_unlock(&fr->pix_lock);
+}
+
+static inline void frame_pixels_read_lock(struct ccd_frame *fr) {
+	g_rw_lock_reader_lock(&fr->pix_lock);
+}
+
+static inline void frame_pixels_read_unlock(struct ccd_frame *fr) {
+	g_rw_lock_reader_unlock(&fr->pix_lock);
+}
+
+// mark the pixel data of fr as changed, so frame_stats recomputes the statistics
+static inline void frame_data_changed(struct ccd_frame *fr) {
+	fr->generation ++;
+	fr->stats.statsok = 0;
+	fr->dstats.statsok = 0;
+}
+
 //////////// Function declarations
 
 
@@ -620,6 +729,10 @@ extern void set_color_plane(struct ccd_frame *fr, int plane_iter, float *fptr);
 extern void scale_shift_frame_CFA(struct ccd_frame *fr, double *mp, double *sp);
 extern void free_stats(struct im_stats *st);
 extern int region_stats(struct ccd_frame *fr, int rx, int ry, int rw, int rh, struct im_stats *st);
+extern int region_stats_sampled(struct ccd_frame *fr, int rx, int ry, int rw, int rh, int step, struct im_stats *st);
+extern void stats_acc_init(struct stats_acc *acc, unsigned *hdat, unsigned hsize, double hmin);
+extern void stats_acc_merge(struct stats_acc *acc, struct stats_acc *acc1);
+extern void stats_acc_finish(struct stats_acc *acc, struct im_stats *st);
 extern struct im_stats *alloc_stats(struct im_stats *st);
 extern void get_frame(struct ccd_frame *fr, char *msg);
 extern struct ccd_frame *release_frame(struct ccd_frame *fr, char *msg);
@@ -632,15 +745,42 @@ extern void free_frame_data(struct ccd_frame *fr);
 extern int frame_to_float(struct ccd_frame *fr);
 extern struct ccd_frame *clone_frame(struct ccd_frame *fr);
 extern void frame_stats(struct ccd_frame *fr);
+extern struct im_stats *frame_stats_sampled(struct ccd_frame *fr, int step);
 
 struct ccd_frame *read_fits_file(char *filename, int force_unsigned, char *default_cfa);
 struct ccd_frame *read_gz_fits_file(char *filename, char *ungz, int force_unsigned, char *default_cfa);
 extern int write_fits_frame(struct ccd_frame *fr, char *filename);
 extern int write_gz_fits_frame(struct ccd_frame *fr, char *fn);
+
+/* strip access to uncompressed fits files: whole rows of one plane are read or
+ * written in place, so a frame never needs to be resident */
+struct fits_strip {
+	char *filename;		// file read or written
+	char *zip_name;		// written file is compressed to this name on close
+	FILE *fp;		// open while writing
+	int w;
+	int h;
+	int nplanes;		// 1, or 3 for NAXIS = 3 files
+	int bitpix;
+	double bscale;
+	double bzero;
+	int force_unsigned;
+	off_t data_offset;	// first data byte, after the header blocks
+};
+
+extern struct fits_strip *fits_strip_open(char *filename, int force_unsigned, struct ccd_frame **hdp);
+extern int fits_strip_read(struct fits_strip *fs, int plane, int y0, int rows, float *buf);
+extern struct fits_strip *fits_strip_create(char *filename, struct ccd_frame *hd, int w, int h, int nplanes);
+extern int fits_strip_write(struct fits_strip *fs, int plane, int y0, int rows, float *buf);
+extern int fits_strip_close(struct fits_strip *fs);
 extern int scale_shift_frame(struct ccd_frame *fr, double m, double s);
 extern int madd_frames (struct ccd_frame *fr, struct ccd_frame *fr1, double m);
 extern int sub_frames (struct ccd_frame *fr, struct ccd_frame *fr1);
 extern int flat_frame(struct ccd_frame *fr, struct ccd_frame *fr1);
+extern int calib_add_sub(struct calib *cb, struct ccd_frame *fr, struct ccd_frame *fr1);
+extern int calib_add_flat(struct calib *cb, struct ccd_frame *fr, struct ccd_frame *fr1);
+extern int calib_add_scale(struct calib *cb, struct ccd_frame *fr, double m, double s);
+extern int calib_frame(struct ccd_frame *fr, struct calib *cb);
 extern int crop_frame(struct ccd_frame *fr, int x, int y, int w, int h);
 
 //extern int libip_head(struct ccd_frame *fr);
@@ -707,7 +847,9 @@ extern int load_bad_pix(struct bad_pix_map *map);
 extern int free_bad_pix(struct bad_pix_map *map);
 
 extern int find_bad_pixels(struct bad_pix_map *map, struct ccd_frame *fr, double sig);
+extern int find_bad_pixels_stack(struct bad_pix_map *map, struct ccd_frame **frs, int n, double sig);
 extern int fix_bad_pixels (struct ccd_frame *fr, struct bad_pix_map *map);
+extern int bad_pixel_offsets(struct ccd_frame *fr, struct bad_pix_map *map, int **offs);
 
 // from ccd/aphot.c
 
@@ -799,6 +941,8 @@ extern struct blur_kern *new_blur_kern(struct blur_kern *kern, int size, double
 extern void free_blur_kern(struct blur_kern *kern);
 extern int make_shift_ctrans(struct ctrans *ct, double dx, double dy);
 extern int make_roto_translate(struct ctrans *ct, double dx, double dy, double xs, double ys, double rot);
+extern int make_align_ctrans(struct ctrans *ct, double dx, double dy, double theta, double xc, double yc);
+extern int resample_frame(struct ccd_frame *fr, struct ctrans *ct, int method);
 extern int shift_frame(struct ccd_frame *fr, double dx, double dy);
 extern int linear_x_shear(struct ccd_frame *in, struct ccd_frame *out, double a, double c);
 extern int linear_y_shear(struct ccd_frame *in, struct ccd_frame *out, double b, double c, double u0, double v0);
@@ -812,6 +956,41 @@ extern void rotate_frame_pi(struct ccd_frame *fr);
 extern void rotate_trame_pi_2(struct ccd_frame *fr, int direction);
 extern int gauss_blur_frame(struct ccd_frame *fr, double r);
 
+// from ccd/combine.c
+#define COMBINE_TILE_W 64 // pixels per row in a combine tile
+#define COMBINE_SCRATCH(n) (8 * ((n) + 1)) // floats of scratch space the tile kernels need for n frames
+
+enum {
+	COMBINE_SCALAR,
+	COMBINE_SSE2,
+	COMBINE_AVX2,
+};
+
+typedef void (*tile_func)(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix);
+extern int combine_simd(void);
+extern void combine_set_simd(int level);
+extern void tile_average(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix);
+extern void tile_median(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix);
+extern void tile_mmedian(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix);
+extern void tile_ks(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix);
+
+// from ccd/threads.c
+// band worker: process rows [y0, y1) of plane; return non-zero to abort
+typedef int (*rows_func)(void *data, int plane, int y0, int y1);
+// called on the calling thread while bands run; return non-zero to abort
+typedef int (*poll_func)(void *data, int done, int total);
+
+extern int ccd_threads(void);
+extern int parallel_rows(int h, int nplanes, int band_h, rows_func f, void *data,
+			 poll_func poll, void *poll_data);
+
+// from ccd/grid.c
+struct point_grid;
+extern struct point_grid *point_grid_new(double *x, double *y, int n, double cell);
+extern void point_grid_free(struct point_grid *g);
+extern int point_grid_box(struct point_grid *g, double xmin, double ymin, double xmax, double ymax, int **ix, int *size);
+extern int point_grid_first(struct point_grid *g, double xmin, double ymin, double xmax, double ymax);
+
 /* from ccd/edb.c */
 int locate_edb(char name[], double *ra, double *dec, double *mag, char *edbdir);
 
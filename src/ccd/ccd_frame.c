@@ -46,6 +46,11 @@
 #include <errno.h>
 #include <glib.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #include "ccd/ccd.h"
 //#include "cpxcon_regs.h"
 
@@ -112,7 +117,7 @@ struct im_stats *alloc_stats(struct im_stats *st)
     if (st) {
         st->hist.hsize = H_SIZE;
         if (st->hist.hdat == NULL) {
-            st->hist.hdat = (unsigned *)calloc(H_SIZE, sizeof(unsigned));
+            st->hist.hdat = (unsigned *)calloc(H_SIZE + 1, sizeof(unsigned));
             if (st->hist.hdat == NULL) {
                 if (new_st) free(new_st);
                 st = NULL;
@@ -215,11 +220,13 @@ struct ccd_frame *new_frame_head_fr(struct ccd_frame* fr, unsigned size_x, unsig
     }
 
     hd->stats = (struct im_stats) { 0 };
+    hd->dstats = (struct im_stats) { 0 };
     if (alloc_stats(&hd->stats) == NULL) {
         if (var) free(var);
         free(hd);
         return NULL;
     }
+    g_rw_lock_init(&hd->pix_lock);
 
 	hd->magic = UNDEF_FRAME;
     if (fr == NULL) {
@@ -280,6 +287,8 @@ void free_frame(struct ccd_frame *fr)
 //        free_stats(&fr->stats);
         // just free hist.hdat or clang analyser complains
         if (fr->stats.hist.hdat) free(fr->stats.hist.hdat);
+        if (fr->dstats.hist.hdat) free(fr->dstats.hist.hdat);
+        g_rw_lock_clear(&fr->pix_lock);
 
 //        if (fr->alignment_mask) free_alignment_mask(fr);
         free(fr);
@@ -375,96 +384,82 @@ int alloc_frame_rgb_data(struct ccd_frame *fr)
 
 
 
-int region_stats(struct ccd_frame *fr, int rx, int ry, int rw, int rh, struct im_stats *st)
+/* start running statistics that fill the histogram hdat of hsize unit bins,
+ * the first for values in [hmin, hmin + 1); hdat has room for hsize + 1 */
+void stats_acc_init(struct stats_acc *acc, unsigned *hdat, unsigned hsize, double hmin)
 {
-    if (st == NULL) return -1;
-    st->statsok = 0;
-
-    if (! (rw * rh > 1)) return -1;
+    acc->hdat = hdat;
+    acc->hsize = hsize;
+    acc->hmin = hmin;
 
-    if (fr->pix_format != PIX_FLOAT) {
-		d3_printf("frame_stats: converting frame to float format!\n");
-        if (frame_to_float(fr) < 0) {
-            err_printf("error converting frame to float\n");
-            return -1;
-		}
-	}
+    unsigned hix; // clear histogram and the sentinel past it
+    for (hix = 0; hix <= hsize; hix++) acc->hdat[hix] = 0;
 
-    if (st->hist.hdat == NULL) return -1;
+    acc->sum = 0.0;
+    acc->sumsq = 0.0;
+    acc->min = HUGE_VAL;
+    acc->max = -HUGE_VAL;
 
-    unsigned hsize = st->hist.hsize;
+    int aix;
+    for (aix = 0; aix < 4; aix++)
+        acc->avgs[aix] = 0;
 
-    unsigned int hix; // clear histogram
-    for (hix = 0; hix < hsize; hix++) st->hist.hdat[hix] = 0;
+    acc->n = 0;
+}
 
-    double hmin = H_MIN;
-    double hstep = (H_MAX - H_MIN) / hsize;
-    unsigned binmax = 0;
+/* add the statistics of acc1 (same histogram size) to acc */
+void stats_acc_merge(struct stats_acc *acc, struct stats_acc *acc1)
+{
+    unsigned hix;
+    for (hix = 0; hix < acc->hsize; hix++) acc->hdat[hix] += acc1->hdat[hix];
 
-    double sum = 0.0;
-    double sumsq = 0.0;
+    acc->sum += acc1->sum;
+    acc->sumsq += acc1->sumsq;
+    if (acc1->min < acc->min) acc->min = acc1->min;
+    if (acc1->max > acc->max) acc->max = acc1->max;
 
     int aix;
     for (aix = 0; aix < 4; aix++)
-        st->avgs[aix] = 0;
-
-// do the reading and calculate stats
+        acc->avgs[aix] += acc1->avgs[aix];
 
-    double min, max;
-	min = max = get_pixel_luminence(fr, rx, ry);
-//min = 0; max = 9;
-    int y;
-	for (y = ry; y < ry + rh; y++) {
-        int x;
-		for (x = rx; x < rx + rw; x++) {
-            float v = get_pixel_luminence(fr, x, y);
-//int k = (x % 2);
-//v = (k) ? 0 : 9;
-            unsigned bix;
-            if (HIST_OFFSET < floor((v - hmin) / hstep))
-                bix = 0;
-            else
-                bix = HIST_OFFSET + floor((v - hmin) / hstep);
-
-            if (bix >= hsize) bix = hsize - 1;
-
-            st->hist.hdat[bix] ++;
-            if (st->hist.hdat[bix] > binmax) binmax = st->hist.hdat[bix];
+    acc->n += acc1->n;
+}
 
-            if (v > max)
-				max = v;
-            else if (v < min)
-				min = v;
+/* set st from the running statistics; acc must be filling st's histogram */
+void stats_acc_finish(struct stats_acc *acc, struct im_stats *st)
+{
+    unsigned hsize = acc->hsize;
+    double hstep = 1;
 
-			sum += v;
-			sumsq += v * v;
+    unsigned all = acc->n;
 
-			st->avgs[y % 2 * 2 + x % 2] += v;
-		}
-	}
+    st->min = acc->min;
+    st->max = acc->max;
 
-	st->min = min;
-	st->max = max;
+    st->avg = acc->sum / all;
 
-    unsigned all = rw * rh;
+    st->sigma = SIGMA(acc->sumsq, acc->sum, all);
 
-    st->avg = sum / all;
+    st->avgs[0] = 4.0 * acc->avgs[0] / all;
+    st->avgs[1] = 4.0 * acc->avgs[1] / all;
+    st->avgs[2] = 4.0 * acc->avgs[2] / all;
+    st->avgs[3] = 4.0 * acc->avgs[3] / all;
 
-    st->sigma = SIGMA(sumsq, sum, all);
+    unsigned binmax = 0;
+    unsigned i, is = 0;
+	for (i = 0; i < hsize; i++) {
+		if (acc->hdat[i] > binmax) binmax = acc->hdat[i];
+	}
 
-    st->avgs[0] = 4.0 * st->avgs[0] / all;
-    st->avgs[1] = 4.0 * st->avgs[1] / all;
-    st->avgs[2] = 4.0 * st->avgs[2] / all;
-    st->avgs[3] = 4.0 * st->avgs[3] / all;
-	
 	st->hist.binmax = binmax;
-	st->hist.st = H_MIN - HIST_OFFSET;
-	st->hist.end = H_MAX - HIST_OFFSET;
+	st->hist.hsize = hsize;
+	st->hist.st = acc->hmin;
+	st->hist.end = acc->hmin + hsize;
 
 // scan the histogram to get the median, cavg and csigma
 
-	sum = 0.0;
-	sumsq = 0.0;
+    double sum = 0.0;
+    double sumsq = 0.0;
 
     unsigned n = 0;
 
@@ -472,15 +467,13 @@ int region_stats(struct ccd_frame *fr, int rx, int ry, int rw, int rh, struct im
     unsigned e = all - all / POP_CENTER; // top 1/4
 
     unsigned b = 0;
-    double bv0 = hmin - HIST_OFFSET;
+    double bv0 = acc->hmin;
     double c = all / 2;
 
     double median = 0.0;
     gboolean median_set = FALSE;
 
-    unsigned i, is;
-
-    unsigned *hdp = st->hist.hdat;
+    unsigned *hdp = acc->hdat;
     int nzero = 0;
     for (i = 0; i < hsize; i++, hdp++) {
         b += *hdp;
@@ -528,22 +521,314 @@ int region_stats(struct ccd_frame *fr, int rx, int ry, int rw, int rh, struct im
 		st->csigma = st->sigma;
 	}
 	st->median = median;
+	st->step = 1;
 	st->statsok = 1;
+}
 
-	return 0;
+struct stats_job {
+    struct ccd_frame *fr;
+    int rx, ry;		// region origin
+    int nx, ny;		// samples per row and rows sampled
+    int step;
+    int band_h;		// sampled rows per band
+    struct stats_acc *acc; // one per band
+};
+
+/* the values of sampled row j of the region; they are put in buf unless they
+ * can be read in place */
+static float *stats_row(struct stats_job *job, int j, float *buf)
+{
+    struct ccd_frame *fr = job->fr;
+    int y = job->ry + j * job->step;
+    float *dp = NULL;
+    int k, x;
+
+    if (! (fr->magic & FRAME_VALID_RGB))
+        dp = (float *)fr->dat;
+    else if (fr->active_plane >= PLANE_RED && fr->active_plane <= PLANE_BLUE)
+        dp = get_color_plane(fr, fr->active_plane);
+
+    if (dp == NULL) { // luminence of the rgb planes
+        for (k = 0, x = job->rx; k < job->nx; k++, x += job->step)
+            buf[k] = get_pixel_luminence(fr, x, y);
+        return buf;
+    }
+
+    dp += y * fr->w + job->rx;
+    if (job->step == 1)
+        return dp;
+
+    for (k = 0; k < job->nx; k++)
+        buf[k] = dp[k * job->step];
+    return buf;
+}
+
+/* min, max and sums of n values; sums[0] and sums[1] get the sums of the values
+ * at even and odd k, sumsq the sum of squares */
+static int stats_sums(float *v, int n, float *min, float *max, double *sums, double *sumsq, int k)
+{
+    for (; k < n; k++) {
+        if (v[k] < *min) *min = v[k];
+        if (v[k] > *max) *max = v[k];
+        sums[k % 2] += v[k];
+        *sumsq += v[k] * v[k];
+    }
+    return k;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* AVX2: 8 values at a time, in 4 double lanes; lanes 0, 2 hold even and 1, 3 odd k */
+__attribute__((target("avx2")))
+static int stats_sums_avx2(float *v, int n, float *min, float *max, double *sums, double *sumsq)
+{
+    __m256 vmin = _mm256_set1_ps(*min);
+    __m256 vmax = _mm256_set1_ps(*max);
+    __m256d s = _mm256_setzero_pd();
+    __m256d sq = _mm256_setzero_pd();
+    double ls[4], lsq[4];
+    float lmin[8], lmax[8];
+    int k, i;
+
+    for (k = 0; k + 8 <= n; k += 8) {
+        __m256 d = _mm256_loadu_ps(v + k);
+        vmin = _mm256_min_ps(d, vmin); // a nan in d keeps vmin
+        vmax = _mm256_max_ps(d, vmax);
+        __m256 d2 = _mm256_mul_ps(d, d);
+        s = _mm256_add_pd(s, _mm256_cvtps_pd(_mm256_castps256_ps128(d)));
+        s = _mm256_add_pd(s, _mm256_cvtps_pd(_mm256_extractf128_ps(d, 1)));
+        sq = _mm256_add_pd(sq, _mm256_cvtps_pd(_mm256_castps256_ps128(d2)));
+        sq = _mm256_add_pd(sq, _mm256_cvtps_pd(_mm256_extractf128_ps(d2, 1)));
+    }
+    _mm256_storeu_ps(lmin, vmin);
+    _mm256_storeu_ps(lmax, vmax);
+    _mm256_storeu_pd(ls, s);
+    _mm256_storeu_pd(lsq, sq);
+
+    for (i = 0; i < 8; i++) {
+        if (lmin[i] < *min) *min = lmin[i];
+        if (lmax[i] > *max) *max = lmax[i];
+    }
+    sums[0] += ls[0] + ls[2];
+    sums[1] += ls[1] + ls[3];
+    *sumsq += lsq[0] + lsq[1] + lsq[2] + lsq[3];
+    return k;
+}
+
+#endif
+
+/* first pass: min, max and sums of a band of sampled rows */
+static int stats_sums_rows(void *data, int plane, int j0, int j1)
+{
+    struct stats_job *job = data;
+    struct stats_acc *acc = &job->acc[j0 / job->band_h];
+    float *buf = malloc(job->nx * sizeof(float));
+    int j;
+
+    if (buf == NULL) return -1;
+
+#ifdef HAVE_X86_SIMD
+    int avx2 = (combine_simd() == COMBINE_AVX2);
+#endif
+    float min = HUGE_VAL, max = -HUGE_VAL;
+
+    for (j = j0; j < j1; j++) {
+        double sums[2] = { 0, 0 };
+        int y = job->ry + j * job->step;
+        int k = 0;
+
+        float *v = stats_row(job, j, buf);
+#ifdef HAVE_X86_SIMD
+        if (avx2) k = stats_sums_avx2(v, job->nx, &min, &max, sums, &acc->sumsq);
+#endif
+        stats_sums(v, job->nx, &min, &max, sums, &acc->sumsq, k);
+
+        // sample k is at x = rx + k * step, step is odd
+        acc->avgs[y % 2 * 2 + job->rx % 2] += sums[0];
+        acc->avgs[y % 2 * 2 + (job->rx + 1) % 2] += sums[1];
+        acc->sum += sums[0] + sums[1];
+        acc->n += job->nx;
+    }
+    acc->min = min;
+    acc->max = max;
+
+    free(buf);
+    return 0;
+}
+
+/* second pass: the histogram of a band of sampled rows */
+static int stats_hist_rows(void *data, int plane, int j0, int j1)
+{
+    struct stats_job *job = data;
+    struct stats_acc *acc = &job->acc[j0 / job->band_h];
+    float *buf = malloc(job->nx * sizeof(float));
+    unsigned *hdat = acc->hdat;
+    unsigned last = acc->hsize - 1;
+    double hmin = acc->hmin;
+    int j, k;
+
+    if (buf == NULL) return -1;
+
+    for (j = j0; j < j1; j++) {
+        float *v = stats_row(job, j, buf);
+        for (k = 0; k < job->nx; k++) {
+            double d = v[k] - hmin;
+            unsigned bix;
+            if (! (d >= 0))
+                bix = 0;
+            else if (d >= last)
+                bix = last;
+            else
+                bix = d;
+            hdat[bix] ++;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* statistics of every step-th row and column of the region (rx, ry, rw, rh) of fr
+ * into st; step 1 uses all pixels, an even step is rounded up. The histogram
+ * covers just the range of the data. Bands of rows are summed in parallel, one
+ * band per worker. Return 0 for ok, -1 for error */
+int region_stats_sampled(struct ccd_frame *fr, int rx, int ry, int rw, int rh, int step, struct im_stats *st)
+{
+    struct stats_job job;
+    int i, ret = -1;
+
+    if (st == NULL) return -1;
+    st->statsok = 0;
+
+    if (! (rw * rh > 1)) return -1;
+
+    if (fr->pix_format != PIX_FLOAT) {
+		d3_printf("frame_stats: converting frame to float format!\n");
+        if (frame_to_float(fr) < 0) {
+            err_printf("error converting frame to float\n");
+            return -1;
+		}
+	}
+
+    if (st->hist.hdat == NULL) return -1;
+
+    if (step < 1) step = 1;
+    if (step > 1 && step % 2 == 0) step++;
+
+    memset(&job, 0, sizeof(struct stats_job));
+    job.fr = fr;
+    job.rx = rx;
+    job.ry = ry;
+    job.step = step;
+    job.nx = (rw + step - 1) / step;
+    job.ny = (rh + step - 1) / step;
+
+    // one band (and histogram) per worker
+    int nbands = ccd_threads();
+    if (nbands > job.ny) nbands = job.ny;
+    if (nbands < 1) nbands = 1;
+    job.band_h = (job.ny + nbands - 1) / nbands;
+    nbands = (job.ny + job.band_h - 1) / job.band_h;
+
+    job.acc = calloc(nbands, sizeof(struct stats_acc));
+    if (job.acc == NULL) return -1;
+    for (i = 0; i < nbands; i++)
+        stats_acc_init(&job.acc[i], st->hist.hdat, 0, 0);
+
+    if (parallel_rows(job.ny, 1, job.band_h, stats_sums_rows, &job, NULL, NULL))
+        goto out;
+
+    double min = HUGE_VAL, max = -HUGE_VAL;
+    for (i = 0; i < nbands; i++) {
+        if (job.acc[i].min < min) min = job.acc[i].min;
+        if (job.acc[i].max > max) max = job.acc[i].max;
+    }
+
+    // unit bins over the data range, clipped like the full histogram
+    double hmin = floor(min), hmax = floor(max);
+    if (! (hmin >= H_START)) hmin = H_START;
+    if (! (hmin <= H_START + H_SIZE - 1)) hmin = H_START + H_SIZE - 1;
+    if (! (hmax <= H_START + H_SIZE - 1)) hmax = H_START + H_SIZE - 1;
+    if (! (hmax >= hmin)) hmax = hmin;
+    unsigned hsize = hmax - hmin + 1;
+
+    for (i = 0; i < nbands; i++) {
+        struct stats_acc a = job.acc[i];
+        unsigned *hdat = (i == 0) ? st->hist.hdat : malloc((hsize + 1) * sizeof(unsigned));
+        if (hdat == NULL) break;
+        stats_acc_init(&job.acc[i], hdat, hsize, hmin);
+        job.acc[i].sum = a.sum; // keep the sums of the first pass
+        job.acc[i].sumsq = a.sumsq;
+        job.acc[i].min = a.min;
+        job.acc[i].max = a.max;
+        memcpy(job.acc[i].avgs, a.avgs, sizeof(a.avgs));
+        job.acc[i].n = a.n;
+    }
+    if (i < nbands) {
+        nbands = i;
+        goto out;
+    }
+
+    if (parallel_rows(job.ny, 1, job.band_h, stats_hist_rows, &job, NULL, NULL))
+        goto out;
+
+    for (i = 1; i < nbands; i++)
+        stats_acc_merge(&job.acc[0], &job.acc[i]);
+
+    stats_acc_finish(&job.acc[0], st);
+    st->step = step;
+    ret = 0;
+
+out:
+    for (i = 1; i < nbands; i++)
+        if (job.acc[i].hdat != st->hist.hdat) free(job.acc[i].hdat);
+    free(job.acc);
+    return ret;
 }
 
+int region_stats(struct ccd_frame *fr, int rx, int ry, int rw, int rh, struct im_stats *st)
+{
+    return region_stats_sampled(fr, rx, ry, rw, rh, 1, st);
+}
 
+/* statistics of the whole frame; they are kept until the data changes
+ * (frame_data_changed or clearing statsok) */
 void frame_stats(struct ccd_frame *hd)
 {
+    if (hd->stats.statsok && hd->stats.step == 1 && hd->stats.generation == hd->generation
+        && hd->stats.plane == hd->active_plane)
+        return;
+
     hd->data_valid = hd->w * hd->h;
-/*
-int rw = 50;
-int rh = 50;
-int rx = (hd->w + rw) / 2;
-int ry = (hd->h + rh) / 2;
-*/
-    region_stats(hd, 0, 0, hd->w, hd->h, &hd->stats);
+
+    if (region_stats(hd, 0, 0, hd->w, hd->h, &hd->stats) == 0) {
+        hd->stats.generation = hd->generation;
+        hd->stats.plane = hd->active_plane;
+    }
+}
+
+/* statistics of every step-th row and column, for display. They go to
+ * dstats, so fr->stats only ever holds full statistics; returns the full
+ * stats if they are current, else the sampled ones (NULL on error) */
+struct im_stats *frame_stats_sampled(struct ccd_frame *hd, int step)
+{
+    if (hd->stats.statsok && hd->stats.generation == hd->generation
+        && hd->stats.plane == hd->active_plane)
+        return &hd->stats;
+
+    if (hd->dstats.statsok && hd->dstats.generation == hd->generation
+        && hd->dstats.plane == hd->active_plane)
+        return &hd->dstats;
+
+    if (alloc_stats(&hd->dstats) == NULL)
+        return NULL;
+
+    if (region_stats_sampled(hd, 0, 0, hd->w, hd->h, step, &hd->dstats) < 0)
+        return NULL;
+
+    hd->dstats.generation = hd->generation;
+    hd->dstats.plane = hd->active_plane;
+    return &hd->dstats;
 }
 
 
@@ -934,12 +1219,23 @@ void fits_set_binned_parms(struct ccd_frame *fr, double parm_unbinned, char *com
 //    }
 }
 
-// read_fits_file reads a fits file from disk/memory and creates a new frame
-// holding the data from the file.
-static struct ccd_frame *read_fits_file_generic(void *fp, char *fn, int force_unsigned, char *default_cfa, struct read_fn *rd)
-{
-    struct ccd_frame *hd = NULL;
+struct fits_head {
+    FITS_str *var;  // cards not parsed below
+    int nvar;
+    unsigned naxis;
+    unsigned naxis3;
+    int width;
+    int height;
+    float bscale;
+    float bzero;
+    int bitpix;
+    int blocks;     // number of 2880-byte header blocks, data starts after these
+};
 
+// read and check the header cards of a fits file; the unparsed cards are returned in fh->var
+// return 0 for ok, -1 for a bad header (fh->var is freed)
+static int read_fits_header(void *fp, struct read_fn *rd, struct fits_head *fh)
+{
     FITS_str *var = NULL;
     int nvar = 0;
 
@@ -957,16 +1253,17 @@ static struct ccd_frame *read_fits_file_generic(void *fp, char *fn, int force_un
     int hb;
     for (hb = 0; hb < 50; hb++)	{// at most 50 header blocks
 
+        char block[FITS_HROWS * FITS_HCOLS]; // read a whole block, then split it into cards
+        if (rd->fnread(block, 1, sizeof(block), fp) != sizeof(block))
+            break;
+
         int cd;
         for (cd = 0; cd < FITS_HROWS; cd++) {	// 36 cards per block
 
             char lb[FITS_STRS];
 
-            int k;
-            for (k = 0; k < FITS_HCOLS; k++)	// chars per card
-				lb[k] = rd->fngetc(fp);
-
-            lb[k] = 0;
+            memcpy(lb, block + cd * FITS_HCOLS, FITS_HCOLS);
+            lb[FITS_HCOLS] = 0;
 
             if (ef) continue; // END found - keep reeding to end of block
 
@@ -1039,48 +1336,122 @@ static struct ccd_frame *read_fits_file_generic(void *fp, char *fn, int force_un
 		goto err_exit;
 	}
 
-    // check for any required scaling/shifting
-    double bz, bs;
+    fh->var = var;
+    fh->nvar = nvar;
+    fh->naxis = naxis;
+    fh->naxis3 = naxis3;
+    fh->width = width;
+    fh->height = height;
+    fh->bscale = bscale;
+    fh->bzero = bzero;
+    fh->bitpix = bitpix;
+    fh->blocks = hb + 1;
 
-    bz = (isnan(bzero)) ? 0 : bzero;
-    bs = (isnan(bscale)) ? 1 : bscale;
+    return 0;
+
+err_exit:
+    if (var) free(var);
+    return -1;
+}
+
+// allocate a frame (with data planes) for the image described by fh; the header cards in fh->var
+// are moved to the frame. return NULL for error (fh->var is freed)
+static struct ccd_frame *new_fits_frame(struct fits_head *fh, char *default_cfa)
+{
+    struct ccd_frame *hd;
 
     //now allocate the header for the new frame
     hd = new_frame_head_fr(NULL, 0, 0);
     if (hd == NULL) {
-        err_printf("read_fits_file_generic: error creating header\n");
-        free(var);
-        goto err_exit;
+        err_printf("new_fits_frame: error creating header\n");
+        free(fh->var);
+        return NULL;
     }
 
     // initialize hd
-    hd->var_str = var;
-    hd->nvar = nvar;
+    hd->var_str = fh->var;
+    hd->nvar = fh->nvar;
 
-    hd->w = width;
-    hd->h = height;
+    hd->w = fh->width;
+    hd->h = fh->height;
 
-    hd->stats.zero = bz;
-    hd->stats.scale = bs;
+    hd->stats.zero = (isnan(fh->bzero)) ? 0 : fh->bzero;
+    hd->stats.scale = (isnan(fh->bscale)) ? 1 : fh->bscale;
 
 	if (alloc_frame_data(hd)) {
-		err_printf("read_fits_file_generic: cannot allocate data for frame\n");
+		err_printf("new_fits_frame: cannot allocate data for frame\n");
         free_frame(hd);
-		goto err_exit;
+		return NULL;
 	}
 
 	hd->magic = UNDEF_FRAME;
 //    hd->rmeta.color_matrix = 0;
 	parse_color_field(hd, default_cfa);
 
-	if (naxis == 3 || hd->rmeta.color_matrix) {
+	if (fh->naxis == 3 || hd->rmeta.color_matrix) {
 		if (alloc_frame_rgb_data(hd)) {
-			err_printf("read_fits_file_generic: cannot allocate RGB data for frame\n");
+			err_printf("new_fits_frame: cannot allocate RGB data for frame\n");
             free_frame(hd);
-			goto err_exit;
+			return NULL;
 		}
 	}
 
+    return hd;
+}
+
+// set up a frame once its data has been read: rgb planes, skips, stats, time, wcs and noise values
+static void finish_fits_frame(struct ccd_frame *hd, unsigned naxis, char *fn)
+{
+//	d3_printf("B");
+	if (naxis == 3) {
+		hd->magic |= FRAME_VALID_RGB;
+		hd->rmeta.color_matrix = 0;
+        free(hd->dat);
+		hd->dat = NULL;
+	}
+
+	hd->pix_size = sizeof (float);
+	hd->data_valid = 1;
+
+    double ccdskip1; fits_get_double(hd, "CCDSKIP1", &ccdskip1);
+    hd->x_skip = (isnan(ccdskip1)) ? 0 : ccdskip1;
+
+    double ccdskip2; fits_get_double(hd, "CCDSKIP2", &ccdskip2);
+    hd->y_skip = (isnan(ccdskip2)) ? 0 : ccdskip2;
+
+	frame_stats(hd);
+
+    hd->name = strdup(fn);
+
+    hd->fim.jd = frame_jdate(hd);
+
+    wcs_transform_from_frame (hd, &hd->fim);
+
+    // read noise values with defaults
+    rescan_fits_exp(hd, &hd->exp);
+}
+
+// read_fits_file reads a fits file from disk/memory and creates a new frame
+// holding the data from the file.
+static struct ccd_frame *read_fits_file_generic(void *fp, char *fn, int force_unsigned, char *default_cfa, struct read_fn *rd)
+{
+    struct ccd_frame *hd = NULL;
+
+    struct fits_head fh;
+    if (read_fits_header(fp, rd, &fh)) goto err_exit;
+
+    unsigned naxis = fh.naxis;
+    int bitpix = fh.bitpix;
+
+    // check for any required scaling/shifting
+    double bz, bs;
+
+    bz = (isnan(fh.bzero)) ? 0 : fh.bzero;
+    bs = (isnan(fh.bscale)) ? 1 : fh.bscale;
+
+    hd = new_fits_frame(&fh, default_cfa);
+    if (hd == NULL) goto err_exit;
+
 // do the reading and calculate stats
     unsigned frame = hd->w * hd->h;
     unsigned all = frame * (naxis == 3 ? 3 : 1);
@@ -1238,33 +1609,7 @@ static struct ccd_frame *read_fits_file_generic(void *fp, char *fn, int force_un
         }
     }
 
-//	d3_printf("B");
-	if (naxis == 3) {
-		hd->magic |= FRAME_VALID_RGB;
-		hd->rmeta.color_matrix = 0;
-        free(hd->dat);
-		hd->dat = NULL;
-	}
-
-	hd->pix_size = sizeof (float);
-	hd->data_valid = 1;
-
-    double ccdskip1; fits_get_double(hd, "CCDSKIP1", &ccdskip1);
-    hd->x_skip = (isnan(ccdskip1)) ? 0 : ccdskip1;
-
-    double ccdskip2; fits_get_double(hd, "CCDSKIP2", &ccdskip2);
-    hd->y_skip = (isnan(ccdskip2)) ? 0 : ccdskip2;
-
-	frame_stats(hd);
-
-    hd->name = strdup(fn);
-
-    hd->fim.jd = frame_jdate(hd);
-
-    wcs_transform_from_frame (hd, &hd->fim);
-
-    // read noise values with defaults
-    rescan_fits_exp(hd, &hd->exp);
+    finish_fits_frame(hd, naxis, fn);
 
 err_exit:
 	rd->fnclose(fp);
@@ -1273,35 +1618,303 @@ err_exit:
 	return hd;
 }
 
-/* entry points for read_fits. read_fits_file is provided for compatibility */
-struct ccd_frame *read_fits_file(char *filename, int force_unsigned, char *default_cfa) // not used
+// convert n pixels of raw fits data to floats, the same way read_fits_file_generic does
+static void fits_to_float(void *raw, float *out, size_t n, int bitpix, double bs, double bz, int force_unsigned)
 {
-	FILE *fp;
-	int zipped;
+    unsigned char *cv = raw;
+    uint16_t *v = raw;
+    uint32_t *fv = raw;
+    uint64_t *dv = raw;
+    size_t i;
+
+    switch(bitpix) {
+    case 8:
+        for (i = 0; i < n; i++)
+            out[i] = (bz == 0) ? cv[i] * bs : ((char *)cv)[i] * bs + bz;
+        break;
+    case 16:
+        if (force_unsigned && bz == 0) {
+            for (i = 0; i < n; i++)
+                out[i] = (unsigned short)be16toh(v[i]) * bs;
+        } else {
+            for (i = 0; i < n; i++)
+                out[i] = (short)be16toh(v[i]) * bs + bz;
+        }
+        break;
+    case 32:
+    case -32:
+        for (i = 0; i < n; i++) {
+            union {float f32; uint32_t u32; } cnvt;
+
+            cnvt.u32 = be32toh(fv[i]);
+            float fds = (bitpix == -32) ? cnvt.f32 : cnvt.u32 * 1.0;
+            out[i] = bs * fds + bz;
+        }
+        break;
+    case 64:
+    case -64:
+        for (i = 0; i < n; i++) {
+            union {double d64; uint64_t u64; } cnvt;
+
+            cnvt.u64 = be64toh(dv[i]);
+            double dds = (bitpix == -64) ? cnvt.d64 : cnvt.u64 * 1.0;
+            out[i] = bs * dds + bz;
+        }
+        break;
+    }
+}
 
-    zipped = (fits_filename(filename) < 0) ;
-	if (zipped) {
-		err_printf("read_fits_file: cannot open non-fits file\n");
-		return NULL;
-	}
-    fp = fopen(filename, "r");
-    if (fp == NULL) {
-        err_printf("\nread_fits_file: Cannot open file %s\n", filename);
-        return NULL;
-	}
+#ifdef HAVE_X86_SIMD
 
-    struct ccd_frame *fr = read_fits_file_generic(fp, filename, force_unsigned, default_cfa, &read_FILE);
+/* byte-swap kernels for the common cases: 16-bit integers with an integer bzero and
+ * unit bscale (exact in int32), and unscaled 32-bit floats. They return the number
+ * of pixels converted; the rest are done by fits_to_float */
 
-    return fr;
+__attribute__((target("sse2")))
+static size_t be16_to_float_sse2(unsigned char *raw, float *out, size_t n, int unsign, int bz)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i vbz = _mm_set1_epi32(bz);
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i *)(raw + 2 * i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+
+        __m128i lo, hi;
+        if (unsign) {
+            lo = _mm_unpacklo_epi16(v, zero);
+            hi = _mm_unpackhi_epi16(v, zero);
+        } else {
+            lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+            hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        }
+        _mm_storeu_ps(out + i, _mm_cvtepi32_ps(_mm_add_epi32(lo, vbz)));
+        _mm_storeu_ps(out + i + 4, _mm_cvtepi32_ps(_mm_add_epi32(hi, vbz)));
+    }
+    return i;
 }
 
-/* read from file, but using 'popen ungzcmd' if the file appears to be compressed */
-/* a typical value for ungz would be 'zcat ' */
-struct ccd_frame *read_gz_fits_file(char *filename, char *ungz, int force_unsigned, char *default_cfa)
+__attribute__((target("avx2")))
+static size_t be16_to_float_avx2(unsigned char *raw, float *out, size_t n, int unsign, int bz)
 {
-	FILE *fp = NULL;
+    __m256i swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                    1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m256i vbz = _mm256_set1_epi32(bz);
+    size_t i;
+
+    for (i = 0; i + 16 <= n; i += 16) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(raw + 2 * i)), swap);
+        __m128i vl = _mm256_castsi256_si128(v);
+        __m128i vh = _mm256_extracti128_si256(v, 1);
+
+        __m256i lo, hi;
+        if (unsign) {
+            lo = _mm256_cvtepu16_epi32(vl);
+            hi = _mm256_cvtepu16_epi32(vh);
+        } else {
+            lo = _mm256_cvtepi16_epi32(vl);
+            hi = _mm256_cvtepi16_epi32(vh);
+        }
+        _mm256_storeu_ps(out + i, _mm256_cvtepi32_ps(_mm256_add_epi32(lo, vbz)));
+        _mm256_storeu_ps(out + i + 8, _mm256_cvtepi32_ps(_mm256_add_epi32(hi, vbz)));
+    }
+    return i;
+}
 
-    int zipped = (fits_filename(filename) < 0) ;
+// adding 0 turns -0 into +0, as bs * f + bz does in the generic conversion
+__attribute__((target("sse2")))
+static size_t be32f_to_float_sse2(unsigned char *raw, float *out, size_t n)
+{
+    __m128i m1 = _mm_set1_epi32(0x00ff0000);
+    __m128i m2 = _mm_set1_epi32(0x0000ff00);
+    __m128 zero = _mm_setzero_ps();
+    size_t i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *)(raw + 4 * i));
+        v = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(v, 24), _mm_srli_epi32(v, 24)),
+                         _mm_or_si128(_mm_and_si128(_mm_slli_epi32(v, 8), m1),
+                                      _mm_and_si128(_mm_srli_epi32(v, 8), m2)));
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_castsi128_ps(v), zero));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t be32f_to_float_avx2(unsigned char *raw, float *out, size_t n)
+{
+    __m256i swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                    3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256 zero = _mm256_setzero_ps();
+    size_t i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i *)(raw + 4 * i)), swap);
+        _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_castsi256_ps(v), zero));
+    }
+    return i;
+}
+
+#endif
+
+// fits_to_float with vector kernels where the conversion is exact in them
+static void fits_to_float_fast(unsigned char *raw, float *out, size_t n, int bitpix, double bs, double bz, int force_unsigned)
+{
+    size_t done = 0;
+
+#ifdef HAVE_X86_SIMD
+    int simd = combine_simd();
+
+    if (bitpix == 16 && bs == 1.0 && bz == floor(bz) && fabs(bz) <= 65536) {
+        int unsign = (force_unsigned && bz == 0);
+        if (simd == COMBINE_AVX2)
+            done = be16_to_float_avx2(raw, out, n, unsign, bz);
+        else if (simd == COMBINE_SSE2)
+            done = be16_to_float_sse2(raw, out, n, unsign, bz);
+
+    } else if (bitpix == -32 && bs == 1.0 && bz == 0.0) {
+        if (simd == COMBINE_AVX2)
+            done = be32f_to_float_avx2(raw, out, n);
+        else if (simd == COMBINE_SSE2)
+            done = be32f_to_float_sse2(raw, out, n);
+    }
+#endif
+    if (done < n)
+        fits_to_float(raw + done * (abs(bitpix) / 8), out + done, n - done, bitpix, bs, bz, force_unsigned);
+}
+
+struct fits_convert_job {
+    unsigned char *data;    // first data byte of the file
+    float *planes[3];
+    int w;
+    int h;
+    int bitpix;
+    double bs;
+    double bz;
+    int force_unsigned;
+};
+
+static int fits_convert_rows(void *data, int plane, int y0, int y1)
+{
+    struct fits_convert_job *job = data;
+    int bpp = abs(job->bitpix) / 8;
+    size_t first = ((size_t) plane * job->h + y0) * job->w;
+
+    fits_to_float_fast(job->data + first * bpp, job->planes[plane] + (size_t) y0 * job->w,
+                       (size_t) (y1 - y0) * job->w, job->bitpix, job->bs, job->bz, job->force_unsigned);
+    return 0;
+}
+
+/* fast path for uncompressed files: map the file, parse the header blocks in place and
+ * convert whole planes in bands on the worker pool. Return 1 (and leave *frp alone) if the file
+ * cannot be mapped or is shorter than its header says, so the stream reader can handle it;
+ * otherwise set *frp to the frame, or NULL for a bad file, and return 0 */
+static int read_fits_file_mmap(char *filename, int force_unsigned, char *default_cfa, struct ccd_frame **frp)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) || ! S_ISREG(st.st_mode) || st.st_size < FITS_HCOLS * FITS_HROWS) {
+        close(fd);
+        return 1;
+    }
+
+    unsigned char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return 1;
+
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    struct fits_head fh;
+    void *mem = mem_open(map, (st.st_size > G_MAXUINT) ? G_MAXUINT : st.st_size);
+    int ret = read_fits_header(mem, &read_mem, &fh);
+    mem_close(mem);
+
+    if (ret) {
+        munmap(map, st.st_size);
+        *frp = NULL;
+        return 0;
+    }
+
+    int nplanes = (fh.naxis == 3) ? 3 : 1;
+    size_t offset = (size_t) fh.blocks * FITS_HCOLS * FITS_HROWS;
+    size_t size = (size_t) fh.width * fh.height * nplanes * (abs(fh.bitpix) / 8);
+
+    if (offset + size > (size_t) st.st_size) { // short file, padded by the stream reader
+        free(fh.var);
+        munmap(map, st.st_size);
+        return 1;
+    }
+
+    struct ccd_frame *hd = new_fits_frame(&fh, default_cfa);
+    if (hd == NULL) {
+        munmap(map, st.st_size);
+        *frp = NULL;
+        return 0;
+    }
+
+    struct fits_convert_job job;
+
+    job.data = map + offset;
+    if (nplanes == 3) {
+        job.planes[0] = hd->rdat;
+        job.planes[1] = hd->gdat;
+        job.planes[2] = hd->bdat;
+    } else {
+        job.planes[0] = hd->dat;
+    }
+    job.w = fh.width;
+    job.h = fh.height;
+    job.bitpix = fh.bitpix;
+    job.bs = hd->stats.scale;
+    job.bz = hd->stats.zero;
+    job.force_unsigned = force_unsigned;
+
+    parallel_rows(job.h, nplanes, 0, fits_convert_rows, &job, NULL, NULL);
+
+    munmap(map, st.st_size);
+
+    finish_fits_frame(hd, fh.naxis, filename);
+
+    *frp = hd;
+    return 0;
+}
+
+/* entry points for read_fits. read_fits_file is provided for compatibility */
+struct ccd_frame *read_fits_file(char *filename, int force_unsigned, char *default_cfa) // not used
+{
+	FILE *fp;
+	int zipped;
+
+    zipped = (fits_filename(filename) < 0) ;
+	if (zipped) {
+		err_printf("read_fits_file: cannot open non-fits file\n");
+		return NULL;
+	}
+    struct ccd_frame *fr;
+    if (read_fits_file_mmap(filename, force_unsigned, default_cfa, &fr) == 0)
+        return fr;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        err_printf("\nread_fits_file: Cannot open file %s\n", filename);
+        return NULL;
+	}
+
+    fr = read_fits_file_generic(fp, filename, force_unsigned, default_cfa, &read_FILE);
+
+    return fr;
+}
+
+/* read from file, but using 'popen ungzcmd' if the file appears to be compressed */
+/* a typical value for ungz would be 'zcat ' */
+struct ccd_frame *read_gz_fits_file(char *filename, char *ungz, int force_unsigned, char *default_cfa)
+{
+	FILE *fp = NULL;
+
+    int zipped = (fits_filename(filename) < 0) ;
 	if (zipped && ungz == NULL) {
         err_printf("read_gz_fits_file: no unzip command set\n");
 		return NULL;
@@ -1323,6 +1936,10 @@ struct ccd_frame *read_gz_fits_file(char *filename, char *ungz, int force_unsign
 			return NULL;
 		}
     } else {
+        struct ccd_frame *fr;
+        if (read_fits_file_mmap(filename, force_unsigned, default_cfa, &fr) == 0)
+            return fr;
+
         fp = fopen(filename, "r");
         if (fp == NULL) {
             err_printf("read_gz_fits_file: Cannot open file %s\n", filename);
@@ -1369,98 +1986,28 @@ struct ccd_frame *read_file_from_mem(mem_file type, const unsigned char *data, u
 }
 
 
-// write a frame to disk as a fits file
-
-int write_fits_frame_unzipped(struct ccd_frame *fr, char *filename)
+// write the fits header cards for a w x h image (naxis 2 or 3) followed by the cards in fr->var_str,
+// padded to a whole number of header blocks; return the number of header blocks written
+static int write_fits_header(FILE *fp, struct ccd_frame *fr, int naxis, int w, int h, int bitpix, double bscale, double bzero)
 {
-//	char *lb = NULL;
-	FILE *fp;
-	int i, j, k, v;
-	unsigned all;
-//	struct tm *t;
-	float *dat_ptr[4], **datp = dat_ptr;
-	float *dp;
-//	int jdi;
-//	double jd;
-	double bscale, bzero;
-	int naxis;
-
-//	fits_filename(lb, MAX_FILENAME);
-
-    fp = fopen(filename, "w");
-	if (fp == NULL) {
-        err_printf("\nwrite_fits_frame: Cannot open file: %s for writing\n", filename);
-
-		return (ERR_FILE);
-	}
-/*
-	t = gmtime(&(fr->exp.exp_start.tv_sec));
-	sprintf(lb, "'%d-%02d-%02dT%02d:%02d:%02d.%02d'", 1900 + t->tm_year, t->tm_mon + 1,
-		t->tm_mday, t->tm_hour, t->tm_min, t->tm_sec,
-		(int)(fr->exp.exp_start.tv_usec / 10000));
-// do the julian date (per hsaa p107)
-	i = 1900 + t->tm_year;
-	j = t->tm_mon + 1;
-	k = t->tm_mday;
-
-	jdi = k - 32075 + 1461 * (i + 4800 + (j - 14) / 12) / 4
-		+ 367 * (j - 2 - (j - 14) / 12 * 12) / 12
-		- 3 * (( i + 4900 + (j - 14) / 12) / 100) / 4;
-
-	jd = jdi - 0.5 + t->tm_hour / 24.0 + t->tm_min / (24.0 * 60.0)
-		+ t->tm_sec / (24.0 * 3600.0) + fr->exp.exp_start.tv_usec /
-		(1000000.0 * 24.0 * 3600.0);
-*/
-
-    if (fr->stats.statsok == 0)
-		frame_stats(fr);
+	int i, j, k;
 
-	if (fr->magic & FRAME_VALID_RGB) {
-		naxis = 3;
-	} else {
-		naxis = 2;
-	}
 	i = 0;
     i++; fprintf(fp, "%-8s= %20s / %-40s       ", "SIMPLE", "T", "Standard FITS format");
-    i++; fprintf(fp, "%-8s= %20d / %-40s       ", "BITPIX", 16,	"Bits per pixel");
+    i++; fprintf(fp, "%-8s= %20d / %-40s       ", "BITPIX", bitpix, "Bits per pixel");
 	i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS", naxis, "");
-	i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS1", fr->w, "");
-	i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS2", fr->h, "");
+	i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS1", w, "");
+	i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS2", h, "");
 
 	if (naxis == 3) {
 		i++; fprintf(fp, "%-8s= %20d   %-40s       ", "NAXIS3", 3, "");
 	}
 
-//	if (fr->exp.datavalid) {
-//		i++; fprintf(fp, "%-8s= %-20s   %-40s       ", "TIMESYS", "'TT'", "");
-//		i++; fprintf(fp, "%-8s= %-25s   %-35s       ", "DATE-OBS", lb,
-//			     "UTC OF INTEGRATION START");
-//	}
-
-//    bscale = (fr->stats.max - fr->stats.min) / 32768.0;
-//    bzero = (fr->stats.max + fr->stats.min) / 2.0;
-
-	if ( ((fr->stats.max - fr->stats.min) < 32767.0)
-	     && (fr->stats.max < 32767)) {// we use positive, scaled by 1 format
-        bscale = 1.0;
-		bzero = 0.0;
-	} else {
-        bscale = 1.0;
-		bzero = 32768.0;
-	}
-
     i++; fprintf(fp, "%-8s= %20.7f   %-40s       ", "BSCALE", bscale, "");
     i++; fprintf(fp, "%-8s= %20.7f   %-40s       ", "BZERO", bzero, "");
 
-// fill in /replace the noise pars
-
 // finally, print the rest of the header lines
 
-//	for (j=0; j < fr->nvar; j++) {
-//		for (k=0; k<FITS_HCOLS; k++)
-//			fputc(fr->var[j][k], fp);
-//		i++;
-//	}
     for (j = 0; j < fr->nvar; j++) {
         for (k = 0; k < FITS_HCOLS; k++)
             fputc(fr->var_str[j][k], fp);
@@ -1477,55 +2024,180 @@ int write_fits_frame_unzipped(struct ccd_frame *fr, char *filename)
 		fprintf(fp, "%80s", "");
 //	d3_printf("i=%d j=%d", i, j);
 
+	return (i + k) / FITS_HROWS;
+}
+
+#define FITS_WRITE_BLOCKS 1024 // data blocks converted per pwrite, about 3MB
+
+struct fits_write_job {
+    float *planes[3];
+    size_t all;         // pixels per plane
+    size_t first;       // pixel index (across planes) at the start of buf
+    size_t n;           // pixels in buf
+    unsigned char *buf;
+    int bitpix;         // 16 or -32
+    double bscale;
+    double bzero;
+};
+
+// convert data blocks [y0, y1) of the write buffer; the tail of the last block is zeroed
+static int fits_write_rows(void *data, int plane, int y0, int y1)
+{
+    struct fits_write_job *job = data;
+    int block_size = FITS_HCOLS * FITS_HROWS;
+    int bpp = abs(job->bitpix) / 8;
+    size_t i = (size_t) y0 * block_size / bpp;
+    size_t end = (size_t) y1 * block_size / bpp;
+
+    if (end > job->n) {
+        memset(job->buf + job->n * bpp, 0, (end - job->n) * bpp);
+        end = job->n;
+    }
+
+    while (i < end) { // runs of pixels within one plane
+        size_t k = job->first + i;
+        size_t o = k % job->all;
+        size_t run = job->all - o;
+        if (run > end - i) run = end - i;
+
+        float *dp = job->planes[k / job->all] + o;
+        unsigned char *out = job->buf + i * bpp;
+        size_t j;
+
+        if (job->bitpix == -32) {
+            for (j = 0; j < run; j++) {
+                union {float f32; uint32_t u32; } cnvt;
+
+                cnvt.f32 = dp[j];
+                cnvt.u32 = htobe32(cnvt.u32);
+                memcpy(out + 4 * j, &cnvt.u32, 4);
+            }
+        } else {
+            //real value = bzero + bscale * <array_value>
+            for (j = 0; j < run; j++) {
+                int v = floor( (dp[j] - job->bzero) / job->bscale + 0.5 );
+                if (v < -32768)
+                    v = -32768;
+                if (v > 32767)
+                    v = 32767;
+                out[2 * j] = (v >> 8) & 0xff;
+                out[2 * j + 1] = v & 0xff;
+            }
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/* write a frame to disk as a fits file. Data is 16-bit integers, or native floats (BITPIX -32)
+ * when the float_fits option is set. Pixels are converted a chunk of blocks at a time
+ * on the worker pool and written with pwrite after the header */
+int write_fits_frame_unzipped(struct ccd_frame *fr, char *filename)
+{
+	FILE *fp;
+	double bscale, bzero;
+	int naxis, bitpix;
+
 	if (fr->pix_size != 4 || fr->pix_format != PIX_FLOAT) {
 		err_printf("\nwrite_fits_frame: I can only write float frames\n");
 
 		return ERR_FATAL;
 	}
 
-	all = fr->w * fr->h;
-int pad;
-	if (naxis == 3) {
-		dat_ptr[0] = (float *)fr->rdat;
-		dat_ptr[1] = (float *)fr->gdat;
-		dat_ptr[2] = (float *)fr->bdat;
-		dat_ptr[3] = NULL;
-        pad = 2880 - (all * 2 * naxis) % 2880;
+    fp = fopen(filename, "w");
+	if (fp == NULL) {
+        err_printf("\nwrite_fits_frame: Cannot open file: %s for writing\n", filename);
+
+		return (ERR_FILE);
+	}
+
+	if (fr->magic & FRAME_VALID_RGB) {
+		naxis = 3;
 	} else {
-		dat_ptr[0] = (float *)fr->dat;
-		dat_ptr[1] = NULL;
-        pad = 2880 - (all * 2 * 1) % 2880;
+		naxis = 2;
 	}
-	while (*datp) {
-		dp = (float *)(*datp);
-		datp++;
-
-		//real value = bzero + bscale * <array_value>
-        uint i;
-		for (i = 0; i < all; i ++) {
-			v = floor( (dp[i] - bzero) / bscale + 0.5 );
-			if (v < -32768)
-				v = -32768;
-			if (v > 32767)
-				v = 32767;
-			putc((v >> 8) & 0xff, fp);
-			putc((v) & 0xff, fp);
-		}
+
+    if (P_INT(FILE_FLOAT_FITS)) {
+        bitpix = -32;
+        bscale = 1.0;
+        bzero = 0.0;
+
+    } else {
+        bitpix = 16;
+
+        frame_stats(fr);
+
+        if ( ((fr->stats.max - fr->stats.min) < 32767.0)
+             && (fr->stats.max < 32767)) {// we use positive, scaled by 1 format
+            bscale = 1.0;
+            bzero = 0.0;
+        } else {
+            bscale = 1.0;
+            bzero = 32768.0;
+        }
+    }
+
+    int blocks = write_fits_header(fp, fr, naxis, fr->w, fr->h, bitpix, bscale, bzero);
+
+    int ret = 0;
+    if (fflush(fp)) ret = ERR_FILE;
+
+    struct fits_write_job job;
+
+	if (naxis == 3) {
+        job.planes[0] = (float *)fr->rdat;
+        job.planes[1] = (float *)fr->gdat;
+        job.planes[2] = (float *)fr->bdat;
+	} else {
+        job.planes[0] = (float *)fr->dat;
 	}
+    job.all = (size_t) fr->w * fr->h;
+    job.bitpix = bitpix;
+    job.bscale = bscale;
+    job.bzero = bzero;
 
-        /* pad the end of record */
-d3_printf("ccd_frame.write_fits_frame %d %d %d\n", all, naxis, pad); 
-//	for (i = 0;  i < pad; i++)
-//		putc(' ', fp);
+    int block_size = FITS_HCOLS * FITS_HROWS;
+    int bpp = abs(bitpix) / 8;
+    size_t total = job.all * (naxis == 3 ? 3 : 1);
+    size_t chunk = (size_t) FITS_WRITE_BLOCKS * block_size / bpp;
+    off_t pos = (off_t) blocks * block_size;
+
+    job.buf = malloc((size_t) FITS_WRITE_BLOCKS * block_size);
+    if (job.buf == NULL) {
+        err_printf("\nwrite_fits_frame: cannot alloc write buffer\n");
+        ret = ERR_ALLOC;
+    }
 
-    while(pad++ < 2880)
-        putc(' ', fp);
+    int fd = fileno(fp);
 
-    fflush(fp);
-	fsync(fileno(fp));
-	fclose(fp);
+    for (job.first = 0; ret == 0 && job.first < total; job.first += chunk) {
+        job.n = (total - job.first < chunk) ? total - job.first : chunk;
 
-	return 0;
+        int nblocks = (job.n * bpp + block_size - 1) / block_size;
+        parallel_rows(nblocks, 1, 0, fits_write_rows, &job, NULL, NULL);
+
+        size_t len = (size_t) nblocks * block_size;
+        unsigned char *bp = job.buf;
+        while (len > 0) {
+            ssize_t put = pwrite(fd, bp, len, pos);
+            if (put < 0 && errno == EINTR) continue;
+            if (put <= 0) {
+                err_printf("\nwrite_fits_frame: error writing %s: %s\n", filename, strerror(errno));
+                ret = ERR_FILE;
+                break;
+            }
+            bp += put;
+            pos += put;
+            len -= put;
+        }
+    }
+
+    if (job.buf) free(job.buf);
+
+	fsync(fd);
+	if (fclose(fp)) ret = ERR_FILE;
+
+	return ret;
 }
 
 int write_gz_fits_frame(struct ccd_frame *fr, char *fn)
@@ -1571,6 +2243,242 @@ int write_fits_frame(struct ccd_frame *fr, char *filename)
 }
 
 
+/* open an uncompressed fits file for strip reading. Only the header is read;
+ * if hdp is not NULL, *hdp is set to a frame holding the header (no data) which
+ * the caller releases. Return NULL if the file cannot be read in strips */
+struct fits_strip *fits_strip_open(char *filename, int force_unsigned, struct ccd_frame **hdp)
+{
+    if (hdp) *hdp = NULL;
+
+    if (fits_filename(filename) < 0) {
+        err_printf("fits_strip_open: %s is compressed, cannot read it in strips\n", filename);
+        return NULL;
+    }
+
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        err_printf("fits_strip_open: Cannot open file %s\n", filename);
+        return NULL;
+    }
+
+    struct fits_head fh;
+    int ret = read_fits_header(fp, &read_FILE, &fh);
+    fclose(fp);
+
+    if (ret) {
+        err_printf("fits_strip_open: bad header in %s\n", filename);
+        return NULL;
+    }
+
+    struct fits_strip *fs = calloc(1, sizeof(struct fits_strip));
+    if (fs == NULL) {
+        free(fh.var);
+        return NULL;
+    }
+
+    fs->filename = strdup(filename);
+    fs->w = fh.width;
+    fs->h = fh.height;
+    fs->nplanes = (fh.naxis == 3) ? 3 : 1;
+    fs->bitpix = fh.bitpix;
+    fs->bzero = (isnan(fh.bzero)) ? 0 : fh.bzero;
+    fs->bscale = (isnan(fh.bscale)) ? 1 : fh.bscale;
+    fs->force_unsigned = force_unsigned;
+    fs->data_offset = (off_t) fh.blocks * FITS_HCOLS * FITS_HROWS;
+
+    if (hdp == NULL) {
+        free(fh.var);
+        return fs;
+    }
+
+    struct ccd_frame *hd = new_frame_head_fr(NULL, fh.width, fh.height);
+    if (hd == NULL) {
+        err_printf("fits_strip_open: error creating header\n");
+        free(fh.var);
+        fits_strip_close(fs);
+        return NULL;
+    }
+
+    hd->var_str = fh.var;
+    hd->nvar = fh.nvar;
+
+    hd->stats.zero = fs->bzero;
+    hd->stats.scale = fs->bscale;
+    hd->pix_size = sizeof (float);
+
+    double ccdskip1; fits_get_double(hd, "CCDSKIP1", &ccdskip1);
+    hd->x_skip = (isnan(ccdskip1)) ? 0 : ccdskip1;
+
+    double ccdskip2; fits_get_double(hd, "CCDSKIP2", &ccdskip2);
+    hd->y_skip = (isnan(ccdskip2)) ? 0 : ccdskip2;
+
+    hd->name = strdup(filename);
+    hd->fim.jd = frame_jdate(hd);
+    wcs_transform_from_frame (hd, &hd->fim);
+    rescan_fits_exp(hd, &hd->exp);
+
+    *hdp = hd;
+    return fs;
+}
+
+/* read rows [y0, y0 + rows) of plane into buf (rows * w floats)
+ * return 0 for ok, -1 for error */
+int fits_strip_read(struct fits_strip *fs, int plane, int y0, int rows, float *buf)
+{
+    if (plane < 0 || plane >= fs->nplanes || y0 < 0 || rows <= 0 || y0 + rows > fs->h) {
+        err_printf("fits_strip_read: bad strip %d,%d+%d\n", plane, y0, rows);
+        return -1;
+    }
+
+    int bpp = abs(fs->bitpix) / 8;
+    size_t n = (size_t) rows * fs->w;
+
+    void *raw = malloc(n * bpp);
+    if (raw == NULL) {
+        err_printf("fits_strip_read: cannot alloc strip buffer\n");
+        return -1;
+    }
+
+    // the file is reopened for each strip so a long stack does not run out of descriptors
+    FILE *fp = fopen(fs->filename, "r");
+    if (fp == NULL) {
+        err_printf("fits_strip_read: Cannot open file %s\n", fs->filename);
+        free(raw);
+        return -1;
+    }
+
+    size_t got = 0;
+    off_t pos = fs->data_offset + ((off_t) plane * fs->h + y0) * fs->w * bpp;
+    if (fseeko(fp, pos, SEEK_SET) == 0)
+        got = fread(raw, bpp, n, fp);
+    fclose(fp);
+
+    if (got != n) {
+        err_printf("fits_strip_read: data is short in %s, got %zu, expected %zu\n", fs->filename, got, n);
+        free(raw);
+        return -1;
+    }
+
+    fits_to_float(raw, buf, n, fs->bitpix, fs->bscale, fs->bzero, fs->force_unsigned);
+    free(raw);
+
+    return 0;
+}
+
+/* create a fits file for strip writing, with the header cards of hd. The data is written as
+ * BITPIX -32, so strips need no scaling decided in advance. A compressed name is written
+ * unzipped first and compressed by fits_strip_close, as write_fits_frame does */
+struct fits_strip *fits_strip_create(char *filename, struct ccd_frame *hd, int w, int h, int nplanes)
+{
+    struct fits_strip *fs = calloc(1, sizeof(struct fits_strip));
+    if (fs == NULL) return NULL;
+
+    fs->filename = strdup(filename);
+    if (is_zip_name(filename)) {
+        fs->zip_name = strdup(filename);
+        fs->filename[has_extension(fs->filename)] = 0;
+    }
+
+    fs->fp = fopen(fs->filename, "w");
+    if (fs->fp == NULL) {
+        err_printf("\nfits_strip_create: Cannot open file: %s for writing\n", fs->filename);
+        fits_strip_close(fs);
+        return NULL;
+    }
+
+    fs->w = w;
+    fs->h = h;
+    fs->nplanes = (nplanes == 3) ? 3 : 1;
+    fs->bitpix = -32;
+    fs->bscale = 1.0;
+    fs->bzero = 0.0;
+
+    int blocks = write_fits_header(fs->fp, hd, (fs->nplanes == 3) ? 3 : 2, w, h, fs->bitpix, fs->bscale, fs->bzero);
+    fs->data_offset = (off_t) blocks * FITS_HCOLS * FITS_HROWS;
+
+    return fs;
+}
+
+/* write rows [y0, y0 + rows) of plane from buf; return 0 for ok, -1 for error */
+int fits_strip_write(struct fits_strip *fs, int plane, int y0, int rows, float *buf)
+{
+    if (fs->fp == NULL || plane < 0 || plane >= fs->nplanes || y0 < 0 || rows <= 0 || y0 + rows > fs->h) {
+        err_printf("fits_strip_write: bad strip %d,%d+%d\n", plane, y0, rows);
+        return -1;
+    }
+
+    size_t n = (size_t) rows * fs->w;
+
+    uint32_t *raw = malloc(n * sizeof(uint32_t));
+    if (raw == NULL) {
+        err_printf("fits_strip_write: cannot alloc strip buffer\n");
+        return -1;
+    }
+
+    size_t i;
+    for (i = 0; i < n; i++) {
+        union {float f32; uint32_t u32; } cnvt;
+
+        cnvt.f32 = buf[i];
+        raw[i] = htobe32(cnvt.u32);
+    }
+
+    size_t put = 0;
+    off_t pos = fs->data_offset + ((off_t) plane * fs->h + y0) * fs->w * sizeof(uint32_t);
+    if (fseeko(fs->fp, pos, SEEK_SET) == 0)
+        put = fwrite(raw, sizeof(uint32_t), n, fs->fp);
+    free(raw);
+
+    if (put != n) {
+        err_printf("fits_strip_write: error writing %s\n", fs->filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* finish a strip file: a written file is padded to a whole block, closed and
+ * compressed if needed. fs is freed; return 0 for ok */
+int fits_strip_close(struct fits_strip *fs)
+{
+    int ret = 0;
+
+    if (fs == NULL) return -1;
+
+    if (fs->fp) {
+        int block_size = FITS_HCOLS * FITS_HROWS;
+        off_t end = fs->data_offset + (off_t) fs->w * fs->h * fs->nplanes * sizeof(uint32_t);
+        int pad = (block_size - end % block_size) % block_size;
+
+        if (fseeko(fs->fp, end, SEEK_SET) == 0) {
+            while (pad-- > 0)
+                putc(0, fs->fp);
+        } else
+            ret = -1;
+
+        fflush(fs->fp);
+        fsync(fileno(fs->fp));
+        if (fclose(fs->fp)) ret = -1;
+
+        char *gzcmd = P_STR(FILE_COMPRESS);
+
+        if (ret == 0 && fs->zip_name && gzcmd != NULL) {
+            char *cmd = NULL;
+            asprintf(&cmd, "%s '%s'", gzcmd, fs->filename);
+            if (cmd) {
+                ret = system(cmd);
+                free(cmd);
+            }
+        }
+    }
+
+    if (fs->filename) free(fs->filename);
+    if (fs->zip_name) free(fs->zip_name);
+    free(fs);
+
+    return ret;
+}
+
+
 // flat_frame divides ff by (fr1 / cavg(fr1) ; the two frames are aligned according to their skips
 // the size of fr is not changed
 
@@ -1589,7 +2497,7 @@ int flat_frame(struct ccd_frame *fr, struct ccd_frame *fr1)
 		return -1;
 	}
 
-    if (! fr1->stats.statsok) frame_stats(fr1);
+    frame_stats(fr1);
 
     mu = fr1->stats.cavg;
 	if (mu <= 0.0) {
@@ -1629,6 +2537,7 @@ int flat_frame(struct ccd_frame *fr, struct ccd_frame *fr1)
 //	d3_printf("xst %d x1st %d yst %d x1st %d xovlap %d yovlap %d",
 //		  xst, x1st, yst, y1st, xovlap, yovlap);
 
+	frame_pixels_write_lock(fr);
 	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
 		dp = get_color_plane(fr, plane_iter);
 		dp1 = get_color_plane(fr1, plane_iter);
@@ -1669,7 +2578,8 @@ int flat_frame(struct ccd_frame *fr, struct ccd_frame *fr1)
 
 		}
 	}
-    fr->stats.statsok = 0;
+	frame_pixels_write_unlock(fr);
+    frame_data_changed(fr);
 
     fr->exp.flat_noise = sqrt( sqr(fr1->exp.rdnoise) + mu / sqrt(fr1->exp.scale) ) / mu;
 
@@ -1715,6 +2625,7 @@ int add_frames (struct ccd_frame *fr, struct ccd_frame *fr1)
 //	d3_printf("xst %d x1st %d yst %d x1st %d xovlap %d yovlap %d",
 //		  xst, x1st, yst, y1st, xovlap, yovlap);
 
+	frame_pixels_write_lock(fr);
 	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
 		dp = get_color_plane(fr, plane_iter);
 		dp1 = get_color_plane(fr1, plane_iter);
@@ -1731,10 +2642,11 @@ int add_frames (struct ccd_frame *fr, struct ccd_frame *fr1)
 			dp1 += fr1->w - xovlap;
 		}
 	}
+	frame_pixels_write_unlock(fr);
 // fit noise data
 	fr->exp.bias = fr->exp.bias + fr1->exp.bias;
 	fr->exp.rdnoise = sqrt(sqr(fr->exp.rdnoise) + sqr(fr1->exp.rdnoise));
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 	return 0;
 }
 
@@ -1782,6 +2694,7 @@ int sub_frames (struct ccd_frame *fr, struct ccd_frame *fr1)
 //	d3_printf("xst %d x1st %d yst %d x1st %d xovlap %d yovlap %d",
 //		  xst, x1st, yst, y1st, xovlap, yovlap);
 
+	frame_pixels_write_lock(fr);
 	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
 		dp = get_color_plane(fr, plane_iter);
 		dp1 = get_color_plane(fr1, plane_iter);
@@ -1798,13 +2711,14 @@ int sub_frames (struct ccd_frame *fr, struct ccd_frame *fr1)
 			dp1 += fr1->w - xovlap;
 		}
 	}
+	frame_pixels_write_unlock(fr);
 
 // compute noise data
 	fr->exp.bias = fr->exp.bias - fr1->exp.bias;
 // try this
     fr->exp.rdnoise = sqrt(sqr(fr->exp.rdnoise) + sqr(fr1->exp.rdnoise));
 //    fr->exp.rdnoise = fr->exp.rdnoise + fr1->exp.rdnoise;
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 //	d3_printf("read noise is: %.1f %.1f\n", fr1->exp.rdnoise, fr->exp.rdnoise);
 	return 0;
 }
@@ -1818,6 +2732,7 @@ int scale_shift_frame(struct ccd_frame *fr, double m, double s)
 	int plane_iter = 0;
 
 	all = fr->w * fr->h;
+	frame_pixels_write_lock(fr);
 	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         dp = get_color_plane(fr, plane_iter);
 
@@ -1826,11 +2741,326 @@ int scale_shift_frame(struct ccd_frame *fr, double m, double s)
 			dp ++;
 		}
 	}
+	frame_pixels_write_unlock(fr);
 	fr->exp.bias = fr->exp.bias * m + s;
 	fr->exp.scale /= fabs(m);
 	fr->exp.rdnoise *= fabs(m);
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
+
+	return 0;
+}
+
+/* overlap of fr1 on fr, aligned according to their skips, as the frame
+ * arithmetic functions above use it */
+static void calib_overlap(struct calib_op *op, struct ccd_frame *fr, struct ccd_frame *fr1)
+{
+	op->xst = fr1->x_skip - fr->x_skip;
+	if (fr1->x_skip + fr1->w >= fr->w + fr->x_skip)
+		op->xovlap = fr->x_skip + fr->w - fr1->x_skip;
+	else
+		op->xovlap = fr1->x_skip + fr1->w - fr->x_skip;
+	if (op->xst < 0) {
+		op->x1st = -op->xst;
+		op->xst = 0;
+	} else
+		op->x1st = 0;
+
+	op->yst = fr1->y_skip - fr->y_skip;
+	if (fr1->y_skip + fr1->h >= fr->h + fr->y_skip)
+		op->yovlap = fr->y_skip + fr->h - fr1->y_skip;
+	else
+		op->yovlap = fr1->y_skip + fr1->h - fr->y_skip;
+	if (op->yst < 0) {
+		op->y1st = -op->yst;
+		op->yst = 0;
+	} else
+		op->y1st = 0;
+}
+
+static struct calib_op *calib_new_op(struct calib *cb, int type)
+{
+	if (cb->nops >= CALIB_MAX_OPS) {
+		err_printf("calib: too many operations\n");
+		return NULL;
+	}
+	struct calib_op *op = &cb->op[cb->nops];
+	memset(op, 0, sizeof(struct calib_op));
+	op->type = type;
+	return op;
+}
+
+/* add the subtraction of fr1 (a bias or dark frame) to the calibration of fr.
+ * the checks and the frame noise data are done here, as in sub_frames; the
+ * pixels change in calib_frame. Return 0 for ok */
+int calib_add_sub(struct calib *cb, struct ccd_frame *fr, struct ccd_frame *fr1)
+{
+	if ((color_plane_iter(fr, 0) != color_plane_iter(fr1, 0))) {
+		err_printf("cannot subtract frames with different number of planes\n");
+		return -1;
+	}
+
+	struct calib_op *op = calib_new_op(cb, CALIB_SUB);
+	if (op == NULL) return -1;
+
+	op->fr1 = fr1;
+	calib_overlap(op, fr, fr1);
+	cb->nops++;
+
+	fr->exp.bias = fr->exp.bias - fr1->exp.bias;
+	fr->exp.rdnoise = sqrt(sqr(fr->exp.rdnoise) + sqr(fr1->exp.rdnoise));
+	frame_data_changed(fr);
+	return 0;
+}
+
+/* add flatfielding by fr1 to the calibration of fr, with the checks of flat_frame */
+int calib_add_flat(struct calib *cb, struct ccd_frame *fr, struct ccd_frame *fr1)
+{
+	if (color_plane_iter(fr, 0) != color_plane_iter(fr1, 0)) {
+		err_printf("cannot subtract frames with different number of planes\n");
+		return -1;
+	}
+
+	frame_stats(fr1);
+
+	double mu = fr1->stats.cavg;
+	if (mu <= 0.0) {
+		err_printf("flat frame has negative avg: %.2f aborting\n", mu);
+		return -1;
+	}
+
+	if (fabs(fr->exp.bias) > 2.0) {
+		err_printf("flat failed: large frame bias (%.f)\n", fr->exp.bias);
+		return -1;
+	}
+
+	struct calib_op *op = calib_new_op(cb, CALIB_FLAT);
+	if (op == NULL) return -1;
+
+	op->fr1 = fr1;
+	op->mu = mu;
+	op->ll = mu / MAX_FLAT_GAIN;
+	calib_overlap(op, fr, fr1);
+	cb->nops++;
+
+	frame_data_changed(fr);
+	fr->exp.flat_noise = sqrt( sqr(fr1->exp.rdnoise) + mu / sqrt(fr1->exp.scale) ) / mu;
+	return 0;
+}
+
+/* add fr <= fr * m + s to the calibration of fr */
+int calib_add_scale(struct calib *cb, struct ccd_frame *fr, double m, double s)
+{
+	struct calib_op *op = calib_new_op(cb, CALIB_SCALE);
+	if (op == NULL) return -1;
+
+	op->m = m;
+	op->s = s;
+	cb->nops++;
+
+	fr->exp.bias = fr->exp.bias * m + s;
+	fr->exp.scale /= fabs(m);
+	fr->exp.rdnoise *= fabs(m);
+	frame_data_changed(fr);
+	return 0;
+}
+
+struct calib_job {
+	struct ccd_frame *fr;
+	struct calib *cb;
+	int band_h;
+	struct stats_acc *acc;	// one per band, NULL when stats are not kept
+	int rgb_stats;		// stats are of the rgb luminence
+	int *bad;		// sorted offsets of the pixels the map changes
+	int nbad;
+};
+
+/* apply op to row y of one plane; dp and dp1 are the plane data of fr and op->fr1 */
+static void calib_op_row(struct ccd_frame *fr, struct calib_op *op, float *dp, float *dp1, int y)
+{
+	int x;
+
+	if (op->type == CALIB_SCALE) {
+		dp += y * fr->w;
+		for (x = 0; x < fr->w; x++)
+			dp[x] = dp[x] * op->m + op->s;
+		return;
+	}
+
+	if (y < op->yst || y >= op->yst + op->yovlap)
+		return;
+
+	struct ccd_frame *fr1 = op->fr1;
+	int yo = y - op->yst; // row within the overlap
+
+	dp += op->xst + y * fr->w;
+	dp1 += op->x1st + (op->y1st + yo) * fr1->w;
+
+	if (op->type == CALIB_SUB) {
+		for (x = 0; x < op->xovlap; x++)
+			dp[x] = dp[x] - dp1[x];
+
+	} else if (fr->magic) {
+		for (x = 0; x < op->xovlap; x++) {
+			int k = yo % 2 * 2 + x % 2;
+
+			double ll = fr1->stats.avgs[k] / MAX_FLAT_GAIN;
+			if (dp1[x] > ll)
+				dp[x] = dp[x] / dp1[x] * fr->stats.avgs[k];
+			else
+				dp[x] = dp[x] * MAX_FLAT_GAIN;
+		}
+	} else {
+		for (x = 0; x < op->xovlap; x++) {
+			if (dp1[x] > op->ll)
+				dp[x] = dp[x] / dp1[x] * op->mu;
+			else
+				dp[x] = dp[x] * MAX_FLAT_GAIN;
+		}
+	}
+}
+
+static int calib_rows(void *data, int plane_ix, int y0, int y1)
+{
+	struct calib_job *job = data;
+	struct ccd_frame *fr = job->fr;
+	struct calib *cb = job->cb;
+	struct stats_acc *acc = (job->acc) ? &job->acc[y0 / job->band_h] : NULL;
+	int y, i;
+
+	// first bad pixel at or after the band
+	int *bad = job->bad;
+	int *bad_end = job->bad + job->nbad;
+	int off0 = y0 * fr->w;
+	while (bad < bad_end && *bad < off0) bad++;
+
+	for (y = y0; y < y1; y++) {
+		// all operations on the row while it is in cache
+		int plane_iter = 0;
+		while ((plane_iter = color_plane_iter(fr, plane_iter))) {
+			float *dp = get_color_plane(fr, plane_iter);
+
+			for (i = 0; i < cb->nops; i++) {
+				struct calib_op *op = &cb->op[i];
+				float *dp1 = (op->fr1) ? get_color_plane(op->fr1, plane_iter) : NULL;
+				calib_op_row(fr, op, dp, dp1, y);
+			}
+		}
+
+		if (acc == NULL)
+			continue;
+
+		int x;
+		if (job->rgb_stats) {
+			for (x = 0; x < fr->w; x++)
+				stats_acc_add(acc, get_pixel_luminence(fr, x, y), x, y);
+		} else {
+			float *dp = (float *)fr->dat + y * fr->w;
+			int off = y * fr->w;
+			for (x = 0; x < fr->w; x++, off++) {
+				if (bad < bad_end && *bad == off) { // added once it is fixed
+					while (bad < bad_end && *bad == off) bad++;
+					continue;
+				}
+				stats_acc_add(acc, dp[x], x, y);
+			}
+		}
+	}
+	return 0;
+}
+
+static int cmp_offset(const void *a, const void *b)
+{
+	int ia = *(const int *)a;
+	int ib = *(const int *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* apply the calibration in cb to fr: the operations run in one pass over the
+ * frame, a row at a time on the worker pool, and the frame statistics are
+ * gathered as the rows are finished, so fr->stats is valid on return.
+ * Pixels of the bad pixel map are interpolated last; interpolation commutes
+ * with the linear operations, so this matches fixing them before a scale.
+ * Return 0 for ok */
+int calib_frame(struct ccd_frame *fr, struct calib *cb)
+{
+	struct calib_job job;
+	int i;
+
+	if (fr->pix_format != PIX_FLOAT) {
+		if (frame_to_float(fr) < 0) {
+			err_printf("error converting frame to float\n");
+			return -1;
+		}
+	}
+
+	memset(&job, 0, sizeof(struct calib_job));
+	job.fr = fr;
+	job.cb = cb;
+
+	// the map makes cfa frames lose their rgb planes, stats are then of the raw data
+	job.rgb_stats = (fr->magic & FRAME_VALID_RGB) && ! (cb->map && (fr->magic & FRAME_HAS_CFA));
+
+	if (cb->map && ! job.rgb_stats) {
+		job.nbad = bad_pixel_offsets(fr, cb->map, &job.bad);
+		if (job.nbad < 0) {
+			job.bad = NULL;
+			job.nbad = 0;
+		}
+		if (job.nbad > 1)
+			qsort(job.bad, job.nbad, sizeof(int), cmp_offset);
+	}
+
+	// one band (and histogram) per worker
+	int nbands = ccd_threads();
+	if (nbands > fr->h) nbands = fr->h;
+	if (nbands < 1) nbands = 1;
+	job.band_h = (fr->h + nbands - 1) / nbands;
+	nbands = (fr->h + job.band_h - 1) / job.band_h;
+
+	if (fr->stats.hist.hdat && fr->w * fr->h > 1) {
+		job.acc = calloc(nbands, sizeof(struct stats_acc));
+		for (i = 0; job.acc && i < nbands; i++) {
+			unsigned *hdat = (i == 0) ? fr->stats.hist.hdat : malloc((H_SIZE + 1) * sizeof(unsigned));
+			if (hdat == NULL) break;
+			stats_acc_init(&job.acc[i], hdat, H_SIZE, H_START);
+		}
+		if (job.acc && i < nbands) { // no room for the histograms, stats are done later
+			while (--i > 0) free(job.acc[i].hdat);
+			free(job.acc);
+			job.acc = NULL;
+		}
+	}
+
+	frame_pixels_write_lock(fr);
+	parallel_rows(fr->h, 1, job.band_h, calib_rows, &job, NULL, NULL);
+
+	if (cb->map) fix_bad_pixels(fr, cb->map);
+	frame_pixels_write_unlock(fr);
+	frame_data_changed(fr); // also drops the display stats
+
+	if (job.acc) {
+		for (i = 1; i < nbands; i++) {
+			stats_acc_merge(&job.acc[0], &job.acc[i]);
+			free(job.acc[i].hdat);
+		}
+
+		int j;
+		for (j = 0; j < job.nbad; j++) { // the interpolated pixels
+			if (j > 0 && job.bad[j] == job.bad[j - 1]) continue;
+			int x = job.bad[j] % fr->w;
+			int y = job.bad[j] / fr->w;
+			stats_acc_add(&job.acc[0], ((float *)fr->dat)[job.bad[j]], x, y);
+		}
+
+		fr->data_valid = fr->w * fr->h;
+		stats_acc_finish(&job.acc[0], &fr->stats);
+		fr->stats.generation = fr->generation;
+		fr->stats.plane = fr->active_plane;
+		free(job.acc);
+	}
 
+	free(job.bad);
 	return 0;
 }
 
@@ -1839,6 +3069,7 @@ void scale_shift_frame_CFA(struct ccd_frame *fr, double *mp, double *sp)
 	float *dp = get_color_plane(fr, PLANE_RAW);
 	int x, y;
 
+	frame_pixels_write_lock(fr);
 	for (y = 0; y < fr->h; y++) {
 		for (x = 0; x < fr->w; x++) {
 			int c = CFA_COLOR(fr->rmeta.color_matrix, x, y);
@@ -1849,6 +3080,7 @@ void scale_shift_frame_CFA(struct ccd_frame *fr, double *mp, double *sp)
 			dp++;
 		}
 	}
+	frame_pixels_write_unlock(fr);
 }
 
 static int scale_shift_frame_RGB(struct ccd_frame *fr, double *mp, double *sp)
@@ -1869,10 +3101,12 @@ static int scale_shift_frame_RGB(struct ccd_frame *fr, double *mp, double *sp)
 			m = mp [c];
 			s = sp [c];
 
+			frame_pixels_write_lock(fr);
 			for (i=0; i<all; i++) {
 				*dp = *dp * m + s;
 				dp ++;
 			}
+			frame_pixels_write_unlock(fr);
 		}
 	}
 m = 1;
@@ -1880,7 +3114,7 @@ s = 0;
 	fr->exp.bias = fr->exp.bias * m + s;
 	fr->exp.scale /= fabs(m);
 	fr->exp.rdnoise *= fabs(m);
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 
 	return 0;
 }
@@ -1904,6 +3138,7 @@ int crop_frame(struct ccd_frame *fr, int x, int y, int w, int h)
 		err_printf("crop_frame: bad subframe\n");
 		return ERR_FATAL;
 	}
+	frame_pixels_write_lock(fr);
  	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
  		dpp = get_color_planeptr(fr, plane_iter);
  		sp = dp = *dpp;
@@ -1918,6 +3153,7 @@ int crop_frame(struct ccd_frame *fr, int x, int y, int w, int h)
 		}
         ret = realloc(*dpp, sizeof(float)*w*h);
 		if (ret == NULL) {
+			frame_pixels_write_unlock(fr);
 			err_printf("crop_frame: alloc error \n");
 			return ERR_ALLOC;
 		}
@@ -1928,7 +3164,8 @@ int crop_frame(struct ccd_frame *fr, int x, int y, int w, int h)
 	fr->y_skip += y;
 	fr->w = w;
 	fr->h = h;
-    fr->stats.statsok = 0;
+	frame_pixels_write_unlock(fr);
+    frame_data_changed(fr);
 	return 0;
 }
 
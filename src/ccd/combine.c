@@ -0,0 +1,519 @@
+/*******************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+*******************************************************************************/
+
+// combine.c: pixel combination kernels for stacking, working on tiles of pixels
+
+/* A tile holds the same run of w pixels from each of n frames: pixel x of
+ * frame i is tile[i * tw + x]. The kernels walk down the frames for several
+ * pixels at a time, using AVX2 or SSE2 when the processor has them. The
+ * per-pixel arithmetic is done in the same order and precision as the scalar
+ * code, so every path gives the same result. Medians sort 4 or 8 pixels at
+ * once with a sorting network in SSE2 or AVX2 lanes, and pick the same element
+ * the scalar fmedian does. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+#include "ccd.h"
+
+static int simd_level = -1;
+
+/* highest instruction set the kernels may use on this processor */
+int combine_simd(void)
+{
+	if (simd_level < 0) {
+		int level = COMBINE_SCALAR;
+#ifdef HAVE_X86_SIMD
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+			level = COMBINE_AVX2;
+		else if (__builtin_cpu_supports("sse2"))
+			level = COMBINE_SSE2;
+#endif
+		simd_level = level;
+	}
+	return simd_level;
+}
+
+/* force the kernels down to a lower instruction set (for checking them against each other) */
+void combine_set_simd(int level)
+{
+	int max;
+
+	simd_level = -1;
+	max = combine_simd();
+	simd_level = (level < max) ? level : max;
+}
+
+/* copy the column of pixel x into pix and return its median */
+static float column_median(float *tile, int n, int tw, int x, float *pix)
+{
+	int i;
+	for (i = 0; i < n; i++)
+		pix[i] = tile[i * tw + x];
+	return fmedian(pix, n);
+}
+
+/* scalar kernels, one pixel (column) at a time; also used for the
+ * pixels left over at the end of a row by the vector kernels */
+
+static void average_scalar(float *tile, int n, int tw, int x0, int x1, float *out)
+{
+	int i, x;
+
+	for (x = x0; x < x1; x++) {
+		float m = 0.0;
+		for (i = 0; i < n; i++)
+			m += tile[i * tw + x];
+		out[x] = m / n;
+	}
+}
+
+static void mmedian_scalar(float *tile, int n, int tw, int x0, int x1, float sigmas,
+			   float *out, float *pix)
+{
+	int i, x;
+
+	sigmas = sqr(sigmas);
+	for (x = x0; x < x1; x++) {
+		float sum = 0.0, sumsq = 0.0;
+		float m, s;
+		int k = 0;
+
+		for (i = 0; i < n; i++) {
+			float v = tile[i * tw + x];
+			sum += v;
+			sumsq += sqr(v);
+		}
+		m = sum / (1.0 * n);
+		s = sigmas * (sumsq / (1.0 * n) - sqr(m));
+		m = column_median(tile, n, tw, x, pix);
+
+		sum = 0;
+		for (i = 0; i < n; i++) {
+			float v = tile[i * tw + x];
+			if (sqr(v - m) < s) {
+				sum += v;
+				k++;
+			}
+		}
+		out[x] = (k != 0) ? sum / (1.0 * k) : tile[x];
+	}
+}
+
+/* state of the kappa-sigma iteration for one pixel */
+struct ks_pix {
+	float m;
+	float s;
+	int k;
+	int iter;
+	int active;
+};
+
+static void ks_start(struct ks_pix *p, float sum, float sumsq, int n, float sigmas, int iter, float median)
+{
+	p->s = sigmas * (sumsq / (1.0 * n) - sqr(sum / (1.0 * n)));
+	p->m = median;
+	p->k = 0;
+	p->iter = iter;
+	p->active = 1;
+}
+
+/* one step of the iteration, given the sums of the pixels within the clip */
+static void ks_step(struct ks_pix *p, float sum, float sumsq, int k, float sigmas)
+{
+	int r = p->k;
+
+	p->iter --;
+	p->k = k;
+	if (k == 0) {
+		p->active = 0;
+		return;
+	}
+	p->m = sum / (1.0 * (k));
+	p->s = sigmas * (sumsq / (1.0 * (k)) - sqr(p->m));
+
+	if (! ((p->iter > 0) && (k != r)))
+		p->active = 0;
+}
+
+static void ks_scalar(float *tile, int n, int tw, int x0, int x1, float sigmas, int iter,
+		      float *out, float *pix)
+{
+	int i, x;
+
+	sigmas = sqr(sigmas);
+	for (x = x0; x < x1; x++) {
+		float sum = 0.0, sumsq = 0.0;
+		struct ks_pix p;
+
+		for (i = 0; i < n; i++) {
+			float v = tile[i * tw + x];
+			sum += v;
+			sumsq += sqr(v);
+		}
+		ks_start(&p, sum, sumsq, n, sigmas, iter, column_median(tile, n, tw, x, pix));
+
+		while (p.active) {
+			int k = 0;
+			sum = 0.0;
+			sumsq = 0.0;
+			for (i = 0; i < n; i++) {
+				float v = tile[i * tw + x];
+				if (sqr(v - p.m) < p.s) {
+					sum += v;
+					sumsq += sqr(v);
+					k++;
+				}
+			}
+			ks_step(&p, sum, sumsq, k, sigmas);
+		}
+		out[x] = p.m;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* SSE2: 4 pixels at a time */
+
+__attribute__((target("sse2")))
+static int average_sse2(float *tile, int n, int tw, int w, float *out)
+{
+	int i, x;
+	__m128 vn = _mm_set1_ps(n);
+
+	for (x = 0; x + 4 <= w; x += 4) {
+		__m128 m = _mm_setzero_ps();
+		for (i = 0; i < n; i++)
+			m = _mm_add_ps(m, _mm_loadu_ps(tile + i * tw + x));
+		_mm_storeu_ps(out + x, _mm_div_ps(m, vn));
+	}
+	return x;
+}
+
+__attribute__((target("sse2")))
+static void sums_sse2(float *tile, int n, int tw, int x, float *sum, float *sumsq)
+{
+	int i;
+	__m128 s = _mm_setzero_ps();
+	__m128 sq = _mm_setzero_ps();
+
+	for (i = 0; i < n; i++) {
+		__m128 v = _mm_loadu_ps(tile + i * tw + x);
+		s = _mm_add_ps(s, v);
+		sq = _mm_add_ps(sq, _mm_mul_ps(v, v));
+	}
+	_mm_storeu_ps(sum, s);
+	_mm_storeu_ps(sumsq, sq);
+}
+
+/* sums of the pixels v with (v - m)^2 < s, for 4 pixels */
+__attribute__((target("sse2")))
+static void clip_sums_sse2(float *tile, int n, int tw, int x, float *m, float *s,
+			   float *sum, float *sumsq, int *k)
+{
+	int i;
+	__m128 vm = _mm_loadu_ps(m);
+	__m128 vs = _mm_loadu_ps(s);
+	__m128 su = _mm_setzero_ps();
+	__m128 sq = _mm_setzero_ps();
+	__m128i kk = _mm_setzero_si128();
+
+	for (i = 0; i < n; i++) {
+		__m128 v = _mm_loadu_ps(tile + i * tw + x);
+		__m128 d = _mm_sub_ps(v, vm);
+		__m128 in = _mm_cmplt_ps(_mm_mul_ps(d, d), vs);
+		__m128 vi = _mm_and_ps(in, v);
+		su = _mm_add_ps(su, vi);
+		sq = _mm_add_ps(sq, _mm_and_ps(in, _mm_mul_ps(v, v)));
+		kk = _mm_sub_epi32(kk, _mm_castps_si128(in));
+	}
+	_mm_storeu_ps(sum, su);
+	if (sumsq) _mm_storeu_ps(sumsq, sq);
+	_mm_storeu_si128((__m128i *)k, kk);
+}
+
+/* AVX2: 8 pixels at a time */
+
+__attribute__((target("avx2")))
+static int average_avx2(float *tile, int n, int tw, int w, float *out)
+{
+	int i, x;
+	__m256 vn = _mm256_set1_ps(n);
+
+	for (x = 0; x + 8 <= w; x += 8) {
+		__m256 m = _mm256_setzero_ps();
+		for (i = 0; i < n; i++)
+			m = _mm256_add_ps(m, _mm256_loadu_ps(tile + i * tw + x));
+		_mm256_storeu_ps(out + x, _mm256_div_ps(m, vn));
+	}
+	return x;
+}
+
+__attribute__((target("avx2")))
+static void sums_avx2(float *tile, int n, int tw, int x, float *sum, float *sumsq)
+{
+	int i;
+	__m256 s = _mm256_setzero_ps();
+	__m256 sq = _mm256_setzero_ps();
+
+	for (i = 0; i < n; i++) {
+		__m256 v = _mm256_loadu_ps(tile + i * tw + x);
+		s = _mm256_add_ps(s, v);
+		sq = _mm256_add_ps(sq, _mm256_mul_ps(v, v));
+	}
+	_mm256_storeu_ps(sum, s);
+	_mm256_storeu_ps(sumsq, sq);
+}
+
+__attribute__((target("avx2")))
+static void clip_sums_avx2(float *tile, int n, int tw, int x, float *m, float *s,
+			   float *sum, float *sumsq, int *k)
+{
+	int i;
+	__m256 vm = _mm256_loadu_ps(m);
+	__m256 vs = _mm256_loadu_ps(s);
+	__m256 su = _mm256_setzero_ps();
+	__m256 sq = _mm256_setzero_ps();
+	__m256i kk = _mm256_setzero_si256();
+
+	for (i = 0; i < n; i++) {
+		__m256 v = _mm256_loadu_ps(tile + i * tw + x);
+		__m256 d = _mm256_sub_ps(v, vm);
+		__m256 in = _mm256_cmp_ps(_mm256_mul_ps(d, d), vs, _CMP_LT_OQ);
+		su = _mm256_add_ps(su, _mm256_and_ps(in, v));
+		sq = _mm256_add_ps(sq, _mm256_and_ps(in, _mm256_mul_ps(v, v)));
+		kk = _mm256_sub_epi32(kk, _mm256_castps_si256(in));
+	}
+	_mm256_storeu_ps(sum, su);
+	if (sumsq) _mm256_storeu_ps(sumsq, sq);
+	_mm256_storeu_si256((__m256i *)k, kk);
+}
+
+
+/* medians of 4 or 8 pixels at once with Batcher's odd-even merge sort network,
+ * which works for any n; the columns are sorted in scratch and the element of
+ * rank n/2 is taken, the same one fmedian picks */
+
+#define NETWORK_LOOP(compare_exchange) {					\
+	int p, k, j, i;								\
+	for (p = 1; p < n; p <<= 1)						\
+		for (k = p; k >= 1; k >>= 1)					\
+			for (j = k % p; j + k < n; j += 2 * k)			\
+				for (i = 0; i < k && i + j + k < n; i++)	\
+					if ((i + j) / (2 * p) == (i + j + k) / (2 * p)) \
+						compare_exchange(i + j, i + j + k); \
+}
+
+__attribute__((target("sse2")))
+static void median_sse2(float *tile, int n, int tw, int x, float *scratch, float *med)
+{
+	int i;
+	__m128 *v = (__m128 *)scratch;
+
+	for (i = 0; i < n; i++)
+		v[i] = _mm_loadu_ps(tile + i * tw + x);
+
+#define CE_SSE2(a, b) { __m128 t = v[a]; v[a] = _mm_min_ps(t, v[b]); v[b] = _mm_max_ps(t, v[b]); }
+	NETWORK_LOOP(CE_SSE2)
+#undef CE_SSE2
+
+	_mm_storeu_ps(med, v[n / 2]);
+}
+
+__attribute__((target("avx2")))
+static void median_avx2(float *tile, int n, int tw, int x, float *scratch, float *med)
+{
+	int i;
+	__m256 *v = (__m256 *)scratch;
+
+	for (i = 0; i < n; i++)
+		v[i] = _mm256_loadu_ps(tile + i * tw + x);
+
+#define CE_AVX2(a, b) { __m256 t = v[a]; v[a] = _mm256_min_ps(t, v[b]); v[b] = _mm256_max_ps(t, v[b]); }
+	NETWORK_LOOP(CE_AVX2)
+#undef CE_AVX2
+
+	_mm256_storeu_ps(med, v[n / 2]);
+}
+
+#endif
+
+#define MAX_LANES 8
+#define NETWORK_FRAMES_PER_LANE 20 // above lanes * this many frames, a selection per pixel is faster than the network
+
+typedef void (*sums_func)(float *tile, int n, int tw, int x, float *sum, float *sumsq);
+typedef void (*clip_sums_func)(float *tile, int n, int tw, int x, float *m, float *s,
+			       float *sum, float *sumsq, int *k);
+typedef void (*median_func)(float *tile, int n, int tw, int x, float *scratch, float *med);
+
+struct kernels {
+	int lanes;	// 0 when there is no vector path
+	sums_func sums;
+	clip_sums_func clip_sums;
+	median_func median;
+};
+
+/* pick the vector width and kernels for this processor */
+static void vector_kernels(struct kernels *kn)
+{
+	kn->lanes = 0;
+#ifdef HAVE_X86_SIMD
+	switch (combine_simd()) {
+	case COMBINE_AVX2:
+		kn->lanes = 8;
+		kn->sums = sums_avx2;
+		kn->clip_sums = clip_sums_avx2;
+		kn->median = median_avx2;
+		break;
+	case COMBINE_SSE2:
+		kn->lanes = 4;
+		kn->sums = sums_sse2;
+		kn->clip_sums = clip_sums_sse2;
+		kn->median = median_sse2;
+		break;
+	}
+#endif
+}
+
+/* medians of the pixels [x, x + lanes) into med */
+static void lane_medians(struct kernels *kn, float *tile, int n, int tw, int x, float *pix, float *med)
+{
+	int l;
+
+	if (n <= NETWORK_FRAMES_PER_LANE * kn->lanes) {
+		float *scratch = (float *)(((uintptr_t) pix + 31) & ~(uintptr_t) 31);
+		(* kn->median)(tile, n, tw, x, scratch, med);
+	} else {
+		for (l = 0; l < kn->lanes; l++)
+			med[l] = column_median(tile, n, tw, x + l, pix);
+	}
+}
+
+/* the tile kernels: combine the n frames of a tile into out[0..w) (w <= tw).
+ * pix is scratch space for COMBINE_SCRATCH(n) floats */
+
+void tile_average(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix)
+{
+	int x = 0;
+
+#ifdef HAVE_X86_SIMD
+	switch (combine_simd()) {
+	case COMBINE_AVX2:
+		x = average_avx2(tile, n, tw, w, out);
+		break;
+	case COMBINE_SSE2:
+		x = average_sse2(tile, n, tw, w, out);
+		break;
+	}
+#endif
+	average_scalar(tile, n, tw, x, w, out);
+}
+
+void tile_median(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix)
+{
+	struct kernels kn;
+	int x = 0;
+
+	vector_kernels(&kn);
+	if (kn.lanes) {
+		for (x = 0; x + kn.lanes <= w; x += kn.lanes)
+			lane_medians(&kn, tile, n, tw, x, pix, out + x);
+	}
+	for (; x < w; x++)
+		out[x] = column_median(tile, n, tw, x, pix);
+}
+
+void tile_mmedian(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix)
+{
+	struct kernels kn;
+	int x = 0, l;
+
+	vector_kernels(&kn);
+	if (kn.lanes) {
+		float sg = sqr(sigmas);
+
+		for (x = 0; x + kn.lanes <= w; x += kn.lanes) {
+			float sum[MAX_LANES], sumsq[MAX_LANES], m[MAX_LANES], s[MAX_LANES];
+			int k[MAX_LANES];
+
+			(* kn.sums)(tile, n, tw, x, sum, sumsq);
+			for (l = 0; l < kn.lanes; l++) {
+				m[l] = sum[l] / (1.0 * n);
+				s[l] = sg * (sumsq[l] / (1.0 * n) - sqr(m[l]));
+			}
+			lane_medians(&kn, tile, n, tw, x, pix, m);
+
+			(* kn.clip_sums)(tile, n, tw, x, m, s, sum, NULL, k);
+			for (l = 0; l < kn.lanes; l++)
+				out[x + l] = (k[l] != 0) ? sum[l] / (1.0 * k[l]) : tile[x + l];
+		}
+	}
+	mmedian_scalar(tile, n, tw, x, w, sigmas, out, pix);
+}
+
+void tile_ks(float *tile, int n, int tw, int w, float sigmas, int iter, float *out, float *pix)
+{
+	struct kernels kn;
+	int x = 0, l;
+
+	vector_kernels(&kn);
+	if (kn.lanes) {
+		float sg = sqr(sigmas);
+
+		for (x = 0; x + kn.lanes <= w; x += kn.lanes) {
+			float sum[MAX_LANES], sumsq[MAX_LANES], m[MAX_LANES], s[MAX_LANES];
+			int k[MAX_LANES];
+			struct ks_pix p[MAX_LANES];
+			int active = 0;
+
+			(* kn.sums)(tile, n, tw, x, sum, sumsq);
+			lane_medians(&kn, tile, n, tw, x, pix, m);
+			for (l = 0; l < kn.lanes; l++) {
+				ks_start(p + l, sum[l], sumsq[l], n, sg, iter, m[l]);
+				active++;
+			}
+
+			// all lanes step together; a converged lane keeps its result
+			while (active) {
+				for (l = 0; l < kn.lanes; l++) {
+					m[l] = p[l].m;
+					s[l] = p[l].s;
+				}
+				(* kn.clip_sums)(tile, n, tw, x, m, s, sum, sumsq, k);
+				active = 0;
+				for (l = 0; l < kn.lanes; l++) {
+					if (! p[l].active) continue;
+					ks_step(p + l, sum[l], sumsq[l], k[l], sg);
+					active += p[l].active;
+				}
+			}
+			for (l = 0; l < kn.lanes; l++)
+				out[x + l] = p[l].m;
+		}
+	}
+	ks_scalar(tile, n, tw, x, w, sigmas, iter, out, pix);
+}
@@ -166,7 +166,7 @@ static int ljpeg_prepare_huff_tables(struct ljpeg_decompress *jpeg, uint8_t *dat
 	uint8_t *ptr = data;
 	struct ljpeg_huff_table *table;
 	int table_id, i, j, k;
-	int code, val_idx, num_codes, elem, free_bits, prefix;
+	int code, val_idx, num_codes, free_bits, prefix;
 
 	/* there can be multiple tables in a DHT block */
 	while (len) {
@@ -181,6 +181,11 @@ static int ljpeg_prepare_huff_tables(struct ljpeg_decompress *jpeg, uint8_t *dat
 
 		table = &jpeg->dc_huff_tables[table_id];
 
+		/* a table can be redefined */
+		free(table->vals);
+		free(table->lookup);
+		memset(table, 0, sizeof(struct ljpeg_huff_table));
+
 		code    = 0;
 		val_idx = 0;
 
@@ -198,6 +203,10 @@ static int ljpeg_prepare_huff_tables(struct ljpeg_decompress *jpeg, uint8_t *dat
 				table->codes[i].min_code = code;
 				code += num_codes;
 				table->codes[i].max_code = code;
+
+				/* more codes than fit in i + 1 bits */
+				if (code > (1 << (i + 1)))
+					return 1;
 			}
 
 			code <<= 1;
@@ -218,16 +227,23 @@ static int ljpeg_prepare_huff_tables(struct ljpeg_decompress *jpeg, uint8_t *dat
 			return 1;
 
 		for (i = 0; i < table->num_vals; i++) {
+			/* difference magnitudes are 0..16 bits */
+			if (*ptr > 16)
+				return 1;
+
 			table->vals[i] = *ptr++;
 			len--;
 		}
 
-		/* prepare the 8-bit shortcut table */
-		memset(table->table8, 0, sizeof(table->table8));
-		for (i = 0; i < 8; i++) {
+		/* prepare the 16-bit lookup table; every code of length l
+		   fills the 2^(16 - l) entries it prefixes */
+		if ((table->lookup = calloc(1 << 16, sizeof(uint16_t))) == NULL)
+			return 1;
+
+		for (i = 0; i < 16; i++) {
 			for (j = 0; j < table->codes[i].num_codes; j++) {
 
-				free_bits = 8 - (i + 1);
+				free_bits = 16 - (i + 1);
 				prefix    = (table->codes[i].min_code + j) << free_bits;
 
 				/*
@@ -235,40 +251,77 @@ static int ljpeg_prepare_huff_tables(struct ljpeg_decompress *jpeg, uint8_t *dat
 					  i + 1, j, table->codes[i].num_codes, free_bits, prefix);
 				*/
 
-				for (k = 0; k < (1 << free_bits); k++) {
-					elem = prefix | k;
-
-					table->table8[elem].length = i + 1;
-					table->table8[elem].value  = table->vals[table->codes[i].val_idx + j];
-
-					/* d4_printf("elem %04x, length %d, value %04x\n",
-						  elem, i + 1, table->table8[elem].value);
-					*/
-				}
+				for (k = 0; k < (1 << free_bits); k++)
+					table->lookup[prefix | k] = ((i + 1) << 8) |
+						table->vals[table->codes[i].val_idx + j];
 			}
 		}
 
-		/* align all codes to the left */
-		for (i = 0; i < 16; i++) {
-			table->codes[i].min_code <<= 15 - i;
-			table->codes[i].max_code <<= 15 - i;
+		table->present = 1;
+	}
+	return 0;
+}
 
-			/*
-			d4_printf("code length: %d, num_codes %d, min_code %08x, max_code %08x, val_idx %d\n",
-				  i + 1, table->codes[i].num_codes,
-				  table->codes[i].min_code, table->codes[i].max_code,
-				  table->codes[i].val_idx);
-			*/
+
+/* copy the entropy coded segment at data to the input buffer, dropping
+   the 0x00 that escapes every 0xFF and stopping at EOI */
+static int ljpeg_unstuff(struct ljpeg_input *input, uint8_t *data, size_t len)
+{
+	uint8_t *out;
+	size_t i, n;
+
+	if ((out = malloc(len + LJPEG_INPUT_PAD)) == NULL) {
+		err_printf("ljpeg_unstuff: malloc failed\n");
+		return 1;
+	}
+
+	for (i = 0, n = 0; i < len; i++) {
+		/* copy up to the next 0xFF in one go */
+		uint8_t *ff = memchr(data + i, 0xFF, len - i);
+		size_t run = (ff ? (size_t) (ff - data) : len) - i;
+
+		memcpy(out + n, data + i, run);
+		n += run;
+		i += run;
+		if (i >= len)
+			break;
+
+		out[n++] = data[i];
+
+		if (i + 1 < len && data[i + 1] == 0x00) {
+			i++;
+			continue;
 		}
 
-		//table->codes[i].min_code = code << (15 - i);
+		/* fill byte before a marker */
+		if (i + 1 < len && data[i + 1] == 0xFF) {
+			n--;
+			continue;
+		}
 
-		table->present = 1;
+		/* EOI or end of data */
+		if (i + 1 >= len || data[i + 1] == 0xD9) {
+			n--;
+			break;
+		}
+
+		err_printf("ljpeg_unstuff: unexpected marker [0xff %02x] in stream\n", data[i + 1]);
+		free(out);
+		return 1;
 	}
+
+	/* reading past the end returns ones */
+	memset(out + n, 0xFF, LJPEG_INPUT_PAD);
+
+	input->buffer      = out;
+	input->buffer_size = n;
+	input->pos         = 0;
+	input->bits        = 0;
+	input->nbits       = 0;
+
 	return 0;
 }
 
-
 static int ljpeg_decompress_start(struct ljpeg_decompress *jpeg, int fd, off_t file_offset, size_t file_size)
 {
 	uint32_t offset = file_offset;
@@ -338,28 +391,19 @@ static int ljpeg_decompress_start(struct ljpeg_decompress *jpeg, int fd, off_t f
 			free(data);
 
 			uint32_t data_offset = offset + len + 2;
-			jpeg->input.buffer_size   = file_size - (data_offset - file_offset);
+			size_t data_size = file_size - (data_offset - file_offset);
 
-			if (read_file_block(fd, data_offset, jpeg->input.buffer_size, (void **) &jpeg->input.buffer)) {
+			if (read_file_block(fd, data_offset, data_size, &data)) {
 				err_printf("ljpeg_decompress: cannot read compressed data\n");
 				return 1;
 			}
 
-			/* set up bit feed */
-			for (i = 4; i; i--) {
-				uint8_t c = jpeg->input.buffer[jpeg->input.pos++];
-				jpeg->input.bits <<= 8;
-				jpeg->input.bits |= c;
-
-				if (c == 0xFF) {
-					c = jpeg->input.buffer[jpeg->input.pos++];
-					if (c) {
-						err_printf("ljpeg_decompress: file is corrupted\n");
-						return 1;
-					}
-				}
+			if (ljpeg_unstuff(&jpeg->input, data, data_size)) {
+				err_printf("ljpeg_decompress: file is corrupted\n");
+				free(data);
+				return 1;
 			}
-			jpeg->input.residue = 8;
+			free(data);
 
 			return 0;
 
@@ -458,192 +502,165 @@ static int ljpeg_decompress_start(struct ljpeg_decompress *jpeg, int fd, off_t f
 }
 
 
-static int ljpeg_get_bits(struct ljpeg_decompress *jpeg, int n_bits)
+/* top up the bit reservoir to at least 56 bits, with one unaligned 8-byte
+   load; the input padding keeps the load inside the buffer */
+static inline void ljpeg_fill_bits(struct ljpeg_input *input, uint64_t *bits, int *nbits, uint32_t *pos)
 {
-	struct ljpeg_input *input = &jpeg->input;
-	uint32_t newbits;
-	uint8_t c;
-
-	//d4_printf("get_bits( %d )\n", n_bits);
-
-	input->bits <<= n_bits;
-	input->residue -= n_bits;
-
-	if (input->pos >= input->buffer_size) {
-		input->bits |= (1 << (8 - input->residue)) -1;
-		return (input->bits >> 16);
-	}
-
-	for (newbits = 0; input->residue <= 0; input->residue += 8) {
-		c = input->buffer[input->pos++];
-
-		newbits <<= 8;
-		newbits |= c;
-
-		if (c == 0xFF) {
-			c = input->buffer[input->pos++];
-
-			/* "post-escapes" the previous 0xFF */
-			if (c == 0x00)
-				continue;
-
-			/* EOI */
-			if (c == 0xD9) {
-				input->pos -= 2;
-				input->buffer_size = input->pos;
-				input->bits |= (1 << (8 - input->residue)) - 1;
-				return (input->bits >> 16);
-			}
-
-			err_printf("ljpeg_get_bits: unexpected marker [0xff %02x] in stream\n", c);
+	uint64_t next;
 
-			return 0;
-		}
-
-	}
+	memcpy(&next, input->buffer + *pos, sizeof(next));
+	*bits |= be64toh(next) >> *nbits;
+	*pos  += (63 - *nbits) >> 3;
+	*nbits |= 56;
 
-	// d4_printf("newbits %08x\n", newbits);
-
-	input->bits |= newbits << (8 - input->residue);
-	return (input->bits >> 16);
+	if (*pos > input->buffer_size)
+		*pos = input->buffer_size;
 }
 
-static inline int ljpeg_huffmann_decode(uint16_t bits, struct ljpeg_huff_table *table, int *width, int *val)
+/* decode nrows rows of samples into out. Every row starts from the first
+   sample of the row before (jpeg->pred), the other samples from their left
+   neighbour. Return 0 for ok */
+static int ljpeg_decompress_rows(struct ljpeg_decompress *jpeg, uint16_t *out, int nrows)
 {
-	int i, hbits;
-
-	if (table->table8[bits >> 8].length) {
-		*width = table->table8[bits >> 8].length;
-		*val   = table->table8[bits >> 8].value;
-
-		//d4_printf("%04x -> len %2d, val %2d\n", bits, *width, *val);
-		return 0;
-	}
-
-	for (i = 0; i < 16; i++) {
-		if (bits >= table->codes[i].min_code &&
-		    bits <  table->codes[i].max_code) {
-
-			*width = i + 1;
+	struct ljpeg_input *input = &jpeg->input;
+	uint64_t bits = input->bits;
+	int nbits = input->nbits;
+	uint32_t pos = input->pos;
+	int ncomp = jpeg->numcomp;
+	int width = jpeg->width * ncomp;
+	uint16_t *lookup[4];
+	int left[4];
+	int row, i, j, ret = 0;
+
+	for (j = 0; j < ncomp; j++)
+		lookup[j] = jpeg->dc_tables[j]->lookup;
+
+	for (row = 0; row < nrows; row++, out += width) {
+		for (i = 0; i < width; i += ncomp) {
+			for (j = 0; j < ncomp; j++) {
+				int code, len, ssss, diff;
+
+				/* a code and its difference take at most 32 bits; the
+				   refill is cheap enough to do every time */
+				ljpeg_fill_bits(input, &bits, &nbits, &pos);
+
+				code = lookup[j][bits >> 48];
+				len  = code >> 8;
+				if (len == 0) {
+					d4_printf("huffmann decode fail\n");
+					ret = 1;
+					goto done;
+				}
+				bits  <<= len;
+				nbits  -= len;
+
+				ssss = code & 0xFF;
+				if (ssss == 16) {
+					diff = -32768;
+				} else {
+					/* the next ssss bits, 0 for ssss = 0; kept free of
+					   branches, as the sign is as good as random */
+					diff = (bits >> 1) >> (63 - ssss);
+					bits  <<= ssss;
+					nbits  -= ssss;
+
+					/* negative differences have a leading 0 */
+					diff -= ((diff - (1 << ssss >> 1)) >> 31) & ((1 << ssss) - 1);
+				}
 
-			hbits = (bits >> (16 - *width)) << (16 - *width);
-			*val   = table->vals[table->codes[i].val_idx + hbits - table->codes[i].min_code];
+				if (i == 0)
+					left[j] = jpeg->pred[j] = jpeg->pred[j] + diff;
+				else
+					left[j] = (uint16_t) (left[j] + diff);
 
-			// d4_printf("%04x -> len %d, val %d\n", bits, *width, *val);
-			return 0;
+				out[i + j] = left[j];
+			}
 		}
 	}
 
-	d4_printf("huffmann decode fail\n");
+done:
+	input->bits  = bits;
+	input->nbits = nbits;
+	input->pos   = pos;
 
-	return 1;
+	return ret;
 }
 
-static int ljpeg_decompress_row(struct ljpeg_decompress *jpeg, uint16_t *row_ptr)
+/* copy decoded rows [y0, y1) of the image to the frame. The samples come
+   in slices: slice_cnt_0 slices slice_size_0 columns wide followed by one
+   slice_size_1 wide, each complete from top to bottom. Without slices
+   information the image is a single slice */
+static int ljpeg_put_rows(void *data, int plane, int y0, int y1)
 {
-	int i, j, ncomp, huff_len;
-	uint16_t bits;
-	int16_t diff;
-	uint32_t diff_code;
-
-	ncomp = jpeg->numcomp;
-
-	for (i = 0; i < ncomp * jpeg->width; i += ncomp) {
+	struct ljpeg_decompress *jpeg = data;
+	int nslices = jpeg->slice_cnt_0 + 1;
+	int y, k, i;
 
-		for (j = 0; j < ncomp; j++) {
+	for (y = y0; y < y1; y++) {
+		float *dst = (float *) jpeg->data + (size_t) y * jpeg->image_width;
+		uint16_t *src = jpeg->raster;
 
-			bits = ljpeg_get_bits(jpeg, jpeg->diff_bits);
-			if (ljpeg_huffmann_decode(bits, jpeg->dc_tables[j], &huff_len, &jpeg->diff_bits))
-				return 1;
+		for (k = 0; k < nslices; k++) {
+			int swidth;
 
-			diff_code = ljpeg_get_bits(jpeg, huff_len);
-			if (diff_code & 0x8000)
-				diff = diff_code >> (16 - jpeg->diff_bits);
+			if (jpeg->slice_cnt_0 == 0)
+				swidth = jpeg->width * jpeg->numcomp;
 			else
-				diff = -((int32_t) ((diff_code ^ 0xFFFF) >> (16 - jpeg->diff_bits)));
+				swidth = (k < jpeg->slice_cnt_0) ? jpeg->slice_size_0 : jpeg->slice_size_1;
 
-			if (i == 0) {
-				jpeg->pred[j] += diff;
+			uint16_t *s = src + (size_t) y * swidth;
 
-				row_ptr[j] = jpeg->pred[j];
-			} else {
-				row_ptr[j] = row_ptr[j - ncomp] + diff;
-			}
-		}
+			for (i = 0; i < swidth; i++)
+				dst[i] = s[i];
 
-		row_ptr += ncomp;
+			dst += swidth;
+			src += (size_t) swidth * jpeg->height;
+		}
 	}
-
 	return 0;
 }
 
-static void ljpeg_put_row(struct ljpeg_decompress *jpeg, uint16_t *row_ptr, int row)
+static int ljpeg_decompress_scan(struct ljpeg_decompress *jpeg)
 {
-	float *data = (float *) jpeg->data;
-	uint16_t val;
-	int i, pos, width, slice, swidth;
+	int i, width, slices_width;
 
 	width = jpeg->width * jpeg->numcomp;
-	for (i = 0; i < width; i++) {
-		val = *row_ptr++;
-
-		if (jpeg->slice_cnt_0) {
-			pos = row * width + i;
-			slice = pos / (jpeg->slice_size_0 * jpeg->height);
-
-			swidth = jpeg->slice_size_0;
-			if (slice >= jpeg->slice_cnt_0) {
-				slice  = jpeg->slice_cnt_0;
-				swidth = jpeg->slice_size_1;
-			}
 
-			pos = pos - slice * jpeg->slice_size_0 * jpeg->height;
-
-			jpeg->row = pos / swidth;
-			jpeg->col = pos % swidth + slice * jpeg->slice_size_0;
-		}
-
-#if 0
-
-		if (jpeg->row >= jpeg->image_y_min && jpeg->row <= jpeg->image_y_max &&
-		    jpeg->col >= jpeg->image_x_min && jpeg->col <= jpeg->image_x_max) {
-
-			data[jpeg->image_width * (jpeg->row - jpeg->image_y_min) +
-			     jpeg->col - jpeg->image_x_min] = (float) val;
-		}
-#else
-
-		data[jpeg->image_width * jpeg->row + jpeg->col] = (float) val;
-#endif
+	slices_width = width;
+	if (jpeg->slice_cnt_0)
+		slices_width = jpeg->slice_cnt_0 * jpeg->slice_size_0 + jpeg->slice_size_1;
 
+	if (width <= 0 || jpeg->height <= 0 || slices_width != width ||
+	    width > jpeg->image_width || jpeg->height > jpeg->image_height) {
+		err_printf("ljpeg_decompress: image size does not match the sensor\n");
+		return 1;
+	}
 
-		if (++jpeg->col >= width) {
-			jpeg->col = 0;
-			jpeg->row++;
+	for (i = 0; i < jpeg->numcomp; i++) {
+		if (jpeg->dc_tables[i] == NULL || jpeg->dc_tables[i]->lookup == NULL) {
+			err_printf("ljpeg_decompress: missing huffmann table\n");
+			return 1;
 		}
 	}
-}
-
-
-static int ljpeg_decompress_scan(struct ljpeg_decompress *jpeg)
-{
-	uint16_t *row_ptr;
-	int i, row;
 
 	for (i = 0; i < 4; i++)
 		jpeg->pred[i] = (1 << jpeg->bits) - 1;
 
-	row_ptr = calloc(jpeg->width * jpeg->numcomp, sizeof(uint16_t));
-	for (row = 0; row < jpeg->height; row++) {
-		if (ljpeg_decompress_row(jpeg, row_ptr)) {
-			d4_printf("ljpeg_decompress_row: failed at row %d\n", row);
-			free(row_ptr);
-			return 1;
-		}
+	jpeg->raster = malloc((size_t) width * jpeg->height * sizeof(uint16_t));
+	if (jpeg->raster == NULL) {
+		err_printf("ljpeg_decompress: malloc failed\n");
+		return 1;
+	}
 
-		ljpeg_put_row(jpeg, row_ptr, row);
+	/* the entropy coded stream has no restart markers, so it can only be
+	   decoded in order; placing the slices in the frame runs in parallel */
+	if (ljpeg_decompress_rows(jpeg, jpeg->raster, jpeg->height)) {
+		d4_printf("ljpeg_decompress_rows: failed\n");
+		return 1;
 	}
 
+	parallel_rows(jpeg->height, 1, 0, ljpeg_put_rows, jpeg, NULL, NULL);
+
 	return 0;
 }
 
@@ -1111,8 +1128,17 @@ err_release:
 
 static void free_cr2(struct cr2 *cr2)
 {
+	int i;
+
 	if (cr2->jpeg.input.buffer)
 		free(cr2->jpeg.input.buffer);
+
+	free(cr2->jpeg.raster);
+
+	for (i = 0; i < 4; i++) {
+		free(cr2->jpeg.dc_huff_tables[i].vals);
+		free(cr2->jpeg.dc_huff_tables[i].lookup);
+	}
 }
 
 static void canon_cr2_tag_callback(void *user, uint16_t tag, uint16_t type, uint32_t len, uint32_t data)
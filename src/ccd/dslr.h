@@ -192,11 +192,9 @@ struct ljpeg_huff_table {
 	int      num_vals;
 	uint8_t *vals;
 
-	/* shortcut lookup table for the first 8 bit */
-	struct {
-		uint8_t length;
-		uint8_t value;
-	} table8[256];
+	/* lookup table over the next 16 bits of the stream:
+	   code length << 8 | value, or 0 for no valid code */
+	uint16_t *lookup;
 
 	struct ljpeg_huff_codes codes[16];
 };
@@ -211,13 +209,17 @@ struct ljpeg_comp_info {
 	int ac_table;
 };
 
+/* the entropy coded data is unstuffed when read and padded with
+   LJPEG_INPUT_PAD bytes of 0xFF, so refills can always load 8 bytes */
+#define LJPEG_INPUT_PAD 16
+
 struct ljpeg_input {
 	uint8_t *buffer;
 	uint32_t buffer_size;
 
-	uint32_t bits;
+	uint64_t bits;	/* bit reservoir, next bit in the msb */
+	int      nbits;	/* valid bits in the reservoir */
 	uint32_t pos;
-	int      residue;
 };
 
 struct ljpeg_decompress {
@@ -236,7 +238,6 @@ struct ljpeg_decompress {
 	struct ljpeg_input input;
 
 	uint16_t pred[4];
-	int      diff_bits;
 
 	uint16_t slice_cnt_0;
 	uint16_t slice_size_0;
@@ -249,9 +250,8 @@ struct ljpeg_decompress {
 	int image_x_min, image_x_max;
 	int image_y_min, image_y_max;
 
-	/* position where we're unpacking */
-	int row;
-	int col;
+	/* the decoded samples, in stream order */
+	uint16_t *raster;
 
 	/* the uncompressed image data */
 	void *data;
@@ -26,17 +26,20 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <glib.h>
 
 /* add a little structure to error/log handling 
  * the latest error string (as printed by err_printf)
  * is retained in a static variable, so the calling 
  * function can find out what it was about.
  *
- * Of course, this is highly unthread-safe
+ * Of course, this is highly unthread-safe; err_printf at least takes a lock,
+ * as frame loaders and savers can report from worker threads
  */
 
 #define ERR_BUF_SIZE 1024
 static char *lasterr_string = NULL;
+G_LOCK_DEFINE_STATIC(lasterr);
 int debug_level = 0;
 
 int deb_printf(int level, const char *fmt, ...)
@@ -65,11 +68,13 @@ int err_printf(const char *fmt, ...)
 #endif
 	va_start(ap, fmt);
 	va_start(ap2, fmt);
+    G_LOCK(lasterr);
     if (lasterr_string) free(lasterr_string), lasterr_string = NULL;
     ret = vasprintf(&lasterr_string, fmt, ap2);
 	if (ret > 0 && lasterr_string[ret-1] == '\n')
 		lasterr_string[ret-1] = 0;
     ret = vfprintf(stderr, fmt, ap); fflush(NULL);
+    G_UNLOCK(lasterr);
 
 	va_end(ap);
 	return ret;
@@ -78,8 +83,10 @@ int err_printf(const char *fmt, ...)
 /* clear the last error string (to make sure we don't get stale errors) */
 void err_clear(void)
 {
+    G_LOCK(lasterr);
     if (lasterr_string) free(lasterr_string);
     lasterr_string = NULL;
+    G_UNLOCK(lasterr);
 }
 
 /* get the error string */
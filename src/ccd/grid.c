@@ -0,0 +1,239 @@
+/*******************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+*******************************************************************************/
+
+// grid.c: uniform grid index over 2-d point positions, for neighbour lookups
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+
+#include "ccd.h"
+
+#define GRID_MAX_CELLS_PER_POINT 4 // cells are grown until there are at most this many per point
+
+struct point_grid {
+	double x0, y0;	// lower corner of cell (0, 0)
+	double cell;	// cell size
+	int nx, ny;
+	int n;		// number of points
+	int *start;	// nx * ny + 1 offsets into ix, one run per cell
+	int *ix;	// point indices, by cell and ascending within a cell
+	double *x, *y;	// copies of the point positions
+};
+
+static int grid_cell_x(struct point_grid *g, double x)
+{
+	double i = floor((x - g->x0) / g->cell);
+
+	if (! (i >= 0)) return 0;
+	if (i >= g->nx) return g->nx - 1;
+	return i;
+}
+
+static int grid_cell_y(struct point_grid *g, double y)
+{
+	double j = floor((y - g->y0) / g->cell);
+
+	if (! (j >= 0)) return 0;
+	if (j >= g->ny) return g->ny - 1;
+	return j;
+}
+
+/* build an index over the n points (x[i], y[i]). cell is the grid step; it
+ * should be about the search radius the index will be used with. When it is
+ * <= 0, a step giving about one point per cell is used. Points with a non-finite
+ * position are left out. Return NULL on error */
+struct point_grid *point_grid_new(double *x, double *y, int n, double cell)
+{
+	struct point_grid *g;
+	double xmin = HUGE_VAL, xmax = -HUGE_VAL;
+	double ymin = HUGE_VAL, ymax = -HUGE_VAL;
+	int i, c;
+
+	if (n < 0) return NULL;
+
+	g = calloc(1, sizeof(struct point_grid));
+	if (g == NULL) {
+		err_printf("point_grid_new: cannot alloc grid\n");
+		return NULL;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (! isfinite(x[i]) || ! isfinite(y[i])) continue;
+		if (x[i] < xmin) xmin = x[i];
+		if (x[i] > xmax) xmax = x[i];
+		if (y[i] < ymin) ymin = y[i];
+		if (y[i] > ymax) ymax = y[i];
+	}
+	if (xmin > xmax) { // no usable points
+		xmin = xmax = 0;
+		ymin = ymax = 0;
+	}
+
+	double w = xmax - xmin;
+	double h = ymax - ymin;
+
+	if (cell <= 0 || ! isfinite(cell))
+		cell = (n > 0) ? sqrt((w + 1) * (h + 1) / n) : 1;
+
+	// keep the cell table from outgrowing the points
+	double max_cells = (n > 0) ? (double) GRID_MAX_CELLS_PER_POINT * n : 1;
+	while ((floor(w / cell) + 1) * (floor(h / cell) + 1) > max_cells)
+		cell *= 2;
+
+	g->x0 = xmin;
+	g->y0 = ymin;
+	g->cell = cell;
+	g->nx = floor(w / cell) + 1;
+	g->ny = floor(h / cell) + 1;
+	g->n = n;
+
+	g->start = calloc(g->nx * g->ny + 1, sizeof(int));
+	g->ix = malloc((n + 1) * sizeof(int));
+	g->x = malloc((n + 1) * sizeof(double));
+	g->y = malloc((n + 1) * sizeof(double));
+	int *cix = malloc((n + 1) * sizeof(int));
+
+	if (g->start == NULL || g->ix == NULL || g->x == NULL || g->y == NULL || cix == NULL) {
+		err_printf("point_grid_new: cannot alloc grid\n");
+		free(cix);
+		point_grid_free(g);
+		return NULL;
+	}
+
+	// counting sort of the points by cell; keeps ascending order within a cell
+	for (i = 0; i < n; i++) {
+		g->x[i] = x[i];
+		g->y[i] = y[i];
+		if (! isfinite(x[i]) || ! isfinite(y[i])) {
+			cix[i] = -1;
+			continue;
+		}
+		cix[i] = grid_cell_y(g, y[i]) * g->nx + grid_cell_x(g, x[i]);
+		g->start[cix[i] + 1]++;
+	}
+	for (c = 0; c < g->nx * g->ny; c++)
+		g->start[c + 1] += g->start[c];
+
+	int *fill = malloc((g->nx * g->ny + 1) * sizeof(int));
+	if (fill == NULL) {
+		err_printf("point_grid_new: cannot alloc grid\n");
+		free(cix);
+		point_grid_free(g);
+		return NULL;
+	}
+	memcpy(fill, g->start, g->nx * g->ny * sizeof(int));
+
+	for (i = 0; i < n; i++)
+		if (cix[i] >= 0) g->ix[fill[cix[i]]++] = i;
+
+	free(fill);
+	free(cix);
+	return g;
+}
+
+void point_grid_free(struct point_grid *g)
+{
+	if (g == NULL) return;
+
+	free(g->start);
+	free(g->ix);
+	free(g->x);
+	free(g->y);
+	free(g);
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+	int ia = *(const int *)a;
+	int ib = *(const int *)b;
+
+	return (ia > ib) - (ia < ib);
+}
+
+/* put in *ix the indices of the points inside the box xmin <= x <= xmax,
+ * ymin <= y <= ymax, in ascending order. *ix is a malloced buffer of *size
+ * entries (NULL and 0 to start), grown as needed; the caller frees it.
+ * Return the number of points found, -1 on alloc failure */
+int point_grid_box(struct point_grid *g, double xmin, double ymin, double xmax, double ymax, int **ix, int *size)
+{
+	int i0, i1, j0, j1, i, j, k;
+	int found = 0;
+
+	if (g == NULL || g->n == 0 || xmin > xmax || ymin > ymax) return 0;
+
+	i0 = grid_cell_x(g, xmin); i1 = grid_cell_x(g, xmax);
+	j0 = grid_cell_y(g, ymin); j1 = grid_cell_y(g, ymax);
+
+	for (j = j0; j <= j1; j++) {
+		for (i = i0; i <= i1; i++) {
+			int c = j * g->nx + i;
+			for (k = g->start[c]; k < g->start[c + 1]; k++) {
+				int p = g->ix[k];
+				if (g->x[p] < xmin || g->x[p] > xmax || g->y[p] < ymin || g->y[p] > ymax) continue;
+
+				if (found >= *size) {
+					int nsize = (*size < 16) ? 16 : *size * 2;
+					int *nix = realloc(*ix, nsize * sizeof(int));
+					if (nix == NULL) {
+						err_printf("point_grid_box: cannot alloc index buffer\n");
+						return -1;
+					}
+					*ix = nix;
+					*size = nsize;
+				}
+				(*ix)[found++] = p;
+			}
+		}
+	}
+
+	if (found > 1)
+		qsort(*ix, found, sizeof(int), cmp_int);
+
+	return found;
+}
+
+/* return the lowest index of the points inside the box, or -1 if there are none */
+int point_grid_first(struct point_grid *g, double xmin, double ymin, double xmax, double ymax)
+{
+	int i0, i1, j0, j1, i, j, k;
+	int first = -1;
+
+	if (g == NULL || g->n == 0 || xmin > xmax || ymin > ymax) return -1;
+
+	i0 = grid_cell_x(g, xmin); i1 = grid_cell_x(g, xmax);
+	j0 = grid_cell_y(g, ymin); j1 = grid_cell_y(g, ymax);
+
+	for (j = j0; j <= j1; j++) {
+		for (i = i0; i <= i1; i++) {
+			int c = j * g->nx + i;
+			for (k = g->start[c]; k < g->start[c + 1]; k++) {
+				int p = g->ix[k];
+				if (first >= 0 && p >= first) break; // ascending within a cell
+				if (g->x[p] < xmin || g->x[p] > xmax || g->y[p] < ymin || g->y[p] > ymax) continue;
+				first = p;
+				break;
+			}
+		}
+	}
+
+	return first;
+}
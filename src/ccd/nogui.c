@@ -0,0 +1,60 @@
+// nogui.c: what libccd takes from the rest of gcx, for the test and
+// benchmark programs that link the library alone. Parameters are all zero
+// (ccd_threads() then uses every cpu), nothing aborts, and frames carry no
+// wcs or observation data.
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+
+#include "ccd.h"
+#include "../params.h"
+
+struct param ptable[PAR_TABLE_SIZE];
+
+int check_user_abort(gpointer window)
+{
+	return 0;
+}
+
+void add_sky_patch_to_frame(struct ccd_frame *fr, double x, double y, int r, double sky_level, double sky_sigma)
+{
+}
+
+int is_zip_name(char *fn)
+{
+	return 0;
+}
+
+int has_extension(char *fn)
+{
+	char *p = strrchr(fn, '.');
+	return p ? p - fn : -1;
+}
+
+struct ccd_frame *read_jpeg_file(char *filename)
+{
+	return NULL;
+}
+
+struct ccd_frame *read_tiff_file(char *filename)
+{
+	return NULL;
+}
+
+double frame_jdate(struct ccd_frame *fr)
+{
+	return 0;
+}
+
+void rescan_fits_exp(struct ccd_frame *fr, struct exp_data *exp)
+{
+}
+
+void wcs_clone(struct wcs *dst, struct wcs *src)
+{
+}
+
+void wcs_transform_from_frame(struct ccd_frame *fr, struct wcs *wcs)
+{
+}
@@ -601,8 +601,9 @@ static int check_datavalid(const void *p1, const void *p2)
     return 0;
 }
 
-// src stars sorted, on entry, by y then x
-// sorted by flux on return
+// src stars in scan order on entry, sorted by flux on return.
+// a star is a duplicate of an earlier one when it is within the mean fwhm in
+// both x and y; the pair is kept as the one with the larger fwhm
 static void check_multiple(struct sources *src)
 {
 // get median fwhm:
@@ -624,25 +625,59 @@ static void check_multiple(struct sources *src)
 
     double av_fwhm = (count > 0) ? sum_fwhm / count : 3;
 
-    for (i = 0; i < src->ns; i++) { // look for any duplicate sj close to si
+    // centroids can move off the scan row, so the stars are not strictly
+    // sorted by y; look the neighbours up in a grid instead
+    double *x = malloc((src->ns + 1) * sizeof(double));
+    double *y = malloc((src->ns + 1) * sizeof(double));
+    struct point_grid *grid = NULL;
+
+    if (x && y) {
+        for (i = 0; i < src->ns; i++) {
+            x[i] = src->s[i].x;
+            y[i] = src->s[i].y;
+        }
+        grid = point_grid_new(x, y, src->ns, av_fwhm);
+    }
+    free(x);
+    free(y);
+
+    int *near = NULL, near_size = 0;
+
+    for (i = 0; grid && i < src->ns; i++) { // look for any duplicate sj close to si
         struct star *si = &(src->s[i]);
-        if (si->datavalid) {
-            int j;
-            for (j = i + 1; j < src->ns; j++) {
+        if (! si->datavalid) continue;
+
+        int last = i; // stars up to here are done with
+        int moved;
+        do { // search again from the new position when si is replaced
+            moved = 0;
+            int n = point_grid_box(grid, si->x - av_fwhm, si->y - av_fwhm, si->x + av_fwhm, si->y + av_fwhm, &near, &near_size);
+
+            int k;
+            for (k = 0; k < n && ! moved; k++) {
+                int j = near[k];
+                if (j <= last) continue;
+
                 struct star *sj = &(src->s[j]);
-                if (sj->datavalid) {
-                    if (fabs(si->y - sj->y) > av_fwhm) break; // next si
+                if (! sj->datavalid) continue;
 
-                    if (fabs(si->x - sj->x) < av_fwhm) { // si, sj are duplicates
-                        if (si->fwhm < sj->fwhm) // set si to star with largest fwhm
-                            *si = *sj; // copy sj to si
-                        sj->datavalid = 0; // drop sj
+                if (fabs(si->y - sj->y) > av_fwhm) continue;
+
+                if (fabs(si->x - sj->x) < av_fwhm) { // si, sj are duplicates
+                    if (si->fwhm < sj->fwhm) { // set si to star with largest fwhm
+                        *si = *sj; // copy sj to si
+                        moved = 1;
                     }
+                    sj->datavalid = 0; // drop sj
+                    last = j;
                 }
             }
-        }
+        } while (moved);
     }
 
+    free(near);
+    point_grid_free(grid);
+
     qsort(src->s, src->ns, sizeof(struct star), compare_flux);
 
     for (i = 0; i < src->ns; i++) {
@@ -668,11 +703,85 @@ static int insert_star(struct sources *src, struct star *s)
 	return 0;
 }
 
+#define EXTRACT_BAND_H 16	// rows scanned per worker band
+#define EXTRACT_WAVE_BANDS 8	// bands per worker between checks for a full table or user abort
+
+// stars found in one band, in scan order
+struct band_stars {
+    struct star *s;
+    int *y;	// row of the peak each star was found from
+    int n;
+    int size;
+};
+
+struct extract_job {
+    struct ccd_frame *fr;
+    float *plane;	// pixel plane, or NULL if luminance has to be combined from rgb
+    int xs, xe, ys, ye;	// search region
+    int y0;		// first row of the current wave
+    double minpk;
+    struct band_stars *bands;
+};
+
+static int extract_stars_rows(void *data, int plane_ix, int y0, int y1)
+{
+    struct extract_job *job = data;
+    struct ccd_frame *fr = job->fr;
+    struct band_stars *bs = job->bands + y0 / EXTRACT_BAND_H; // rows are relative to the wave
+
+    y0 += job->y0;
+    y1 += job->y0;
+    int xs = job->xs, xe = job->xe, ys = job->ys, ye = job->ye;
+    int w = fr->w;
+    double minpk = job->minpk;
+
+#define PIX(x, y) (job->plane ? job->plane[(y) * w + (x)] : get_pixel_luminence(fr, (x), (y)))
+
+    int y;
+    for (y = y0; y < y1; y++) {
+        int x;
+        for (x = xs; x < xe; x++) {
+            float p = PIX(x, y);
+
+            if (! (p > minpk)) continue;
+
+            if (x - 1 < xs || ! (p >= PIX(x - 1, y))) continue;
+            if (x + 1 >= xe || ! (p >= PIX(x + 1, y))) continue;
+            if (y - 1 < ys || ! (p >= PIX(x, y - 1))) continue;
+            if (y + 1 >= ye || ! (p >= PIX(x, y + 1))) continue;
+
+            struct star st = { 0 };
+            if (star_at(fr, x, y, 5, minpk, &st)) continue;
+
+            if (bs->n == bs->size) {
+                int size = bs->size ? 2 * bs->size : 64;
+                struct star *ns = realloc(bs->s, size * sizeof(struct star));
+                if (ns) bs->s = ns;
+                int *ny = realloc(bs->y, size * sizeof(int));
+                if (ny) bs->y = ny;
+                if (ns == NULL || ny == NULL) {
+                    err_printf("extract_stars: cannot alloc star list\n");
+                    return -1;
+                }
+                bs->size = size;
+            }
+            bs->s[bs->n] = st;
+            bs->y[bs->n] = y;
+            bs->n++;
+        }
+    }
+#undef PIX
+    return 0;
+}
+
 // find the src->maxn brightest 'stars' in the supplied region;
 // if region is NULL, search the whole frame 
 // returns the actual number of stars found, -1 if user aborted.
 // the star centroided positions, estimated fluxes and sizes are updated in
 // the result table
+// The region is scanned in row bands on the worker pool, a wave of bands at a time; the
+// stars of each wave are inserted in scan order, so the result (and where a full table
+// stops the scan) is the same as for a serial scan
 
 int extract_stars(struct ccd_frame *fr, struct region *reg, double sigmas, int *first_last_y, struct sources *src)
 {
@@ -689,56 +798,81 @@ int extract_stars(struct ccd_frame *fr, struct region *reg, double sigmas, int *
         ye = fr->h - EXCLUDE_EDGE;
     }
 
-    if (!fr->stats.statsok)	frame_stats(fr);
+    frame_stats(fr);
 
 //	d3_printf("extract_stars: frame size is %dx%d\n", fr->w, fr->h);
 //	d3_printf("extract_stars: frame pixel format is %d [%d]\n", fr->pix_format, fr->pix_size);
 
-    double minpk = fr->stats.cavg + 2 * sigmas * fr->stats.csigma;
+    struct extract_job job;
+
+    job.fr = fr;
+    job.plane = NULL;
+    if (! (fr->magic & FRAME_VALID_RGB))
+        job.plane = (float *) fr->dat;
+    else if (fr->active_plane == PLANE_RED)
+        job.plane = (float *) fr->rdat;
+    else if (fr->active_plane == PLANE_GREEN)
+        job.plane = (float *) fr->gdat;
+    else if (fr->active_plane == PLANE_BLUE)
+        job.plane = (float *) fr->bdat;
+
+    job.minpk = fr->stats.cavg + 2 * sigmas * fr->stats.csigma;
     int abort = 0;
 
-    int y;
     if (first_last_y && (*first_last_y > ys && *first_last_y < ye)) ys = *first_last_y;
-    for (y = ys; y < ye; y++) {
 
-        abort = check_user_abort(fr->window);
-        if (abort != 0) break; // check for user abort
+    job.xs = xs;
+    job.xe = xe;
+    job.ys = ys;
+    job.ye = ye;
 
-        int x;
-        for (x = xs; x < xe; x++) {
-
-//            if ( (abs(x - 642) < 10 && abs(y - 702) < 10)) {
-                float p = get_pixel_luminence(fr, x, y);
+    int nbands = ccd_threads() * EXTRACT_WAVE_BANDS;
+    job.bands = calloc(nbands, sizeof(struct band_stars));
+    if (job.bands == NULL) {
+        err_printf("extract_stars: cannot alloc bands\n");
+        return -1;
+    }
 
-                int at_peak = p > minpk;
-                if (at_peak) {
+    int full = 0;
+    int y = ys;
+    for (job.y0 = ys; job.y0 < ye && ! full; job.y0 += nbands * EXTRACT_BAND_H) {
 
-                    int x_test;
+        abort = check_user_abort(fr->window);
+        if (abort != 0) break; // check for user abort
 
-                    x_test = x - 1; at_peak &= (x_test >= xs && p >= get_pixel_luminence(fr, x_test, y));
-                    x_test = x + 1; at_peak &= (x_test < xe && p >= get_pixel_luminence(fr, x_test, y));
+        int y1 = job.y0 + nbands * EXTRACT_BAND_H;
+        if (y1 > ye) y1 = ye;
 
-                    if (at_peak) {
-                        int y_test;
-                        y_test = y - 1; at_peak &= (y_test >= ys && p >= get_pixel_luminence(fr, x, y_test));
-                        y_test = y + 1; at_peak &= (y_test < ye && p >= get_pixel_luminence(fr, x, y_test));
+        int i;
+        for (i = 0; i < nbands; i++)
+            job.bands[i].n = 0;
 
-                        if (at_peak) {
-                            struct star st = { 0 };
-//                            if ( (abs(x - 1271) < 5 && abs(y - 780) < 5))
+        if (parallel_rows(y1 - job.y0, 1, EXTRACT_BAND_H, extract_stars_rows, &job, NULL, NULL)) {
+            abort = 1; // out of memory
+            break;
+        }
 
-                            if (star_at(fr, x, y, 5, minpk, &st) == 0) {
-//                            if (locate_star(fr, x, y, SEARCH_R, min_flux, &st) == 0) {
-                                if (insert_star(src, &st) == 0) goto finished; // no more space in src
-                            }
-                        }
-                    }
-//                }
+        for (i = 0; i < nbands && ! full; i++) {
+            struct band_stars *bs = job.bands + i;
+            int k;
+            for (k = 0; k < bs->n; k++) {
+                if (insert_star(src, &bs->s[k]) == 0) { // no more space in src
+                    y = bs->y[k];
+                    full = 1;
+                    break;
+                }
             }
         }
+        if (! full) y = y1;
+    }
+
+    int i;
+    for (i = 0; i < nbands; i++) {
+        if (job.bands[i].s) free(job.bands[i].s);
+        if (job.bands[i].y) free(job.bands[i].y);
     }
+    free(job.bands);
 
-finished:
     if (abort) return -1;
 
     if (first_last_y) *first_last_y = (y == ye) ? fr->h : y;
@@ -768,16 +902,6 @@ typedef struct _patch {
 } Patch;
 
 
-gint sort_points(gconstpointer pa, gconstpointer pb)
-{
-    const Point *a = *(Point **)pa;
-    const Point *b = *(Point **)pb;
-
-    if (a->value < b->value) return -1;
-    if (a->value > b->value) return 1;
-    return 0;
-}
-
 /*
 float patch_median_exclude(Patch *patch, float *p0, int w, int h, int patch_size)
 {
@@ -824,203 +948,298 @@ float patch_median_exclude(Patch *patch, float *p0, int w, int h, int patch_size
 }
 */
 
-float array_median_exclude(GPtrArray *array, Point *points, int medw)
+/* star-excluding sliding median: the values of a line are quantized to
+   MS_LEVELS levels, and the window centered on each value is kept sorted as it
+   slides, so that the clip and the median of the values kept are read off it
+   with exact integer sums */
+
+#define MS_LEVELS 65536
+#define MS_MAX_WINDOW 4095 // keeps the integer sums of the clip test in range
+#define MS_SCAN_WINDOW 64 // windows clipped a point at a time, without steps
+
+/* the 1 sigma clip drops the brightest point while it is more than sigma above
+   the mean of the points left. Dropping a point of the same value leaves
+   n * (value - mean) unchanged and lowers n^2 * sigma^2, so a level is dropped
+   whole or not at all: test whether level t is above mean + sigma of the
+   points n, s, s2 */
+static inline int ms_drops(gint64 n, gint64 s, gint64 s2, int t)
 {
-    g_ptr_array_sort(array, sort_points);
-
-    if (medw % 2 == 0) medw++;
-
-    int n = medw;
-    Point *v;
-    double sum = 0, sum2 = 0;
-    for (v = points; v < points + medw; v++) {
-        sum += v->value;
-        sum2 += v->value * v->value;
-    }
+    gint64 d = t * n - s; // n * (t - mean), compared with n * sigma
+    return d > 0 && d * d > n * s2 - s * s;
+}
 
-    double mean = sum / n;
-    double stddev = sqrt(sum2 / n - mean * mean);
+/* the points of the window up to a level (the first n of the sorted window),
+   and their sums */
+struct median_step {
+    int level;
+    int n;
+    gint64 sum;
+    gint64 sum2;
+};
 
-    long int median_ix = medw / 2;
-    double k = 1.0;
+/* number of the n sorted levels a that are not above l */
+static inline int ms_count(unsigned short *a, int n, int l)
+{
+    unsigned short *b = a;
 
-    Point **vptr = (Point **)array->pdata;
-    v = vptr[n - 1];
-    while (v->value - mean > k * stddev) { // remove bright values (stars)
-        if (! v->exclude) {
-            v->exclude = TRUE; // drop it
-            n--;
-            sum -= v->value;
-            sum2 -= v->value * v->value;
+    while (n > 1) {
+        int half = n / 2;
+        b = (b[half - 1] <= l) ? b + half : b;
+        n -= half;
+    }
+    return b - a + (n == 1 && b[0] <= l);
+}
 
-            mean = sum / n;
-            stddev = sqrt(sum2 / n - mean * mean);
+/* take out from the m sorted levels of the window and put in; returns the
+   number of steps that changed. Steps are lower down the chain, so those under
+   both out and in are the ones past it */
+static int ms_slide(unsigned short *a, int m, struct median_step *st, int nst, int out, int in)
+{
+    struct median_step *p;
 
-            if (n % 2) median_ix--;
-        } else
-            n--;
+    if (in == out) return 0;
 
-        v = vptr[n - 1];
+    int po = ms_count(a, m, out) - 1; // the last point of level out
+    if (in > out) {
+        int pi = ms_count(a, m, in) - 1;
+        memmove(a + po, a + po + 1, (pi - po) * sizeof(*a));
+        a[pi] = in;
+    } else {
+        int pi = ms_count(a, m, in);
+        memmove(a + pi + 1, a + pi, (po - pi) * sizeof(*a));
+        a[pi] = in;
     }
 
-    v = vptr[median_ix]; // median Point
-    float median = v->value;
-    if (n % 2 == 0) {
-        v = vptr[median_ix - 1]; // median Point
-        median = (median + v->value) / 2;
+    gint64 out2 = (gint64)out * out, in2 = (gint64)in * in;
+    int low = (in < out) ? in : out;
+    for (p = st; p < st + nst && p->level >= low; p++) { // without branches, they would go either way
+        int o = (out <= p->level), k = (in <= p->level);
+        p->n += k - o;
+        p->sum += k * in - o * out;
+        p->sum2 += k * in2 - o * out2;
     }
-
-    return median;
+    return p - st;
 }
 
-
-// median filter row and column (whole frame) with star exclusion
-int median_with_star_exclusion(struct ccd_frame *fr, int medw)
+/* the clip of a window stops at its highest level that is not above mean +
+   sigma of the points up to it. Dropping points above mean + sigma lowers both
+   the mean and sigma, so every level above mean + sigma of the points up to
+   some level, and under that level, is dropped as well. The clip is done in
+   steps down from the whole window: each one is taken at mean + sigma of the
+   step above, until the top level left is kept. Windows slide by one point, so
+   the steps of the previous one, with their sums updated, mostly still hold:
+   a step is only retaken when the step above no longer drops all the levels
+   down to it, and the chain is left as it was from the first step that the
+   slide did not change (of the first changed ones). st has room for one step
+   more than the m points of the sorted window a. Returns the number of steps;
+   the points of the last one are kept */
+static int ms_clip(unsigned short *a, struct median_step *st, int nst, int changed)
 {
-    if (medw % 2 == 0) medw++;
+    int moved = 0;
+    int i;
 
-    Point *points = calloc(medw, sizeof(Point));
-    if (points == NULL) return 0;
+    for (i = 0; ; i++) {
+        struct median_step *p = st + i;
+        struct median_step *q = p + 1;
 
-    int plane_iter = 0;
-    while ((plane_iter = color_plane_iter(fr, plane_iter))) {
-        float *dpi = get_color_plane(fr, plane_iter);
-
-        float *row_median = calloc(fr->w * fr->h, sizeof(float));
-        float *column_median = calloc(fr->w * fr->h, sizeof(float));
+        if (i >= changed && ! moved)
+            return nst;
 
-        if (! (row_median && column_median)) {
-            if (row_median) free(row_median);
-            if (column_median) free(column_median);
-            free(points);
-            return 0;
+        if (i + 1 < nst && q->n < p->n && ms_drops(p->n, p->sum, p->sum2, a[q->n])) {
+            moved = 0;
+            continue;
         }
 
-        int edge_bit, do_edges, edge_lo, edge_hi;
-
-        edge_bit = fr->w % medw;
-        do_edges = (edge_bit != 0);
-
-        edge_lo = edge_bit / 2;
-        edge_hi = (do_edges) ? medw - edge_lo - 1 : 0;
+        if (! ms_drops(p->n, p->sum, p->sum2, a[p->n - 1]))
+            return i + 1;
 
-        int yi; float *row; // filter rows
-        for (yi = 0, row = dpi; yi < fr->h; yi++, row += fr->w) { // each frame row
-
-            float *in = row;
-            float *out_start = row_median + yi * fr->w;
-
-            GPtrArray *array = NULL;
-
-            Point *v = points;
-            int b;
-            for (b = -edge_lo; b < fr->w + edge_hi; b++) { // each point in row
-                v->value = *in;
-                v->exclude = FALSE;
-                v->id = b;
+        // move the next step to the highest level that p does not drop
+        if (i + 1 >= nst) {
+            nst = i + 2;
+            *q = *p;
+        } else if (q->n >= p->n) {
+            *q = *p;
+        }
+        while (ms_drops(p->n, p->sum, p->sum2, a[q->n - 1])) {
+            gint64 l = a[--q->n];
+            q->sum -= l;
+            q->sum2 -= l * l;
+        }
+        while (! ms_drops(p->n, p->sum, p->sum2, a[q->n])) {
+            gint64 l = a[q->n++];
+            q->sum += l;
+            q->sum2 += l * l;
+        }
+        q->level = a[q->n - 1];
+        moved = 1;
+    }
+}
 
-                if (array == NULL) array = g_ptr_array_sized_new(medw); // new accum for each medw sized sample
+/* clip the sorted window from its top a point at a time; returns the number
+   of points kept. Cheaper than the steps of ms_clip for small windows */
+static int ms_scan(unsigned short *a, struct median_step *p)
+{
+    gint64 n = p->n, s = p->sum, s2 = p->sum2;
 
-                if (array == NULL) break;
+    while (ms_drops(n, s, s2, a[n - 1])) {
+        gint64 l = a[--n];
+        s -= l;
+        s2 -= l * l;
+    }
+    return n;
+}
 
-                g_ptr_array_insert(array, v - points, v); // add point to accum
+static int comp_level(const void *a, const void *b)
+{
+    return *(unsigned short *)a - *(unsigned short *)b;
+}
 
-                if (b >= 0 && b < fr->w - 1) in++;
-                v++;
+/* filter the n values of a line in place: each value that the clip of the
+   medw-wide window centered on it drops is replaced with the median of the
+   values kept. The line is padded with its edge values. q has room for n
+   levels, a for medw, st for medw + 1 steps */
+static void line_median_exclude(float *line, int n, int medw, unsigned short *q,
+                                unsigned short *a, struct median_step *st)
+{
+    int i, x;
+    float lo = line[0], hi = line[0];
 
-                if (v == points + medw || b == fr->w + edge_hi - 1) { // calculate median for medw sample
-                    float median = array_median_exclude(array, points, medw); // sort, exclude, calculate median
+    for (i = 1; i < n; i++) {
+        float v = line[i];
+        if (v < lo) lo = v;
+        if (v > hi) hi = v;
+    }
+    if (! (hi > lo)) return; // flat, nothing is dropped
 
-                    for (v = points; v < points + medw; v++) { // output medw sized sample
-                        if (v->id >= 0) {
-                            if (v->id >= fr->w) break;
+    // integer data keeps whole levels
+    double scale = (MS_LEVELS - 1) / (hi - lo);
+    if (scale >= 1) scale = floor(scale);
 
-                            float *out = out_start + v->id;
-                            *out = (v->exclude) ? median : v->value; // median or existing value
-                        }
-                    }
+    for (i = 0; i < n; i++) {
+        int l = (line[i] - lo) * scale + 0.5;
+        q[i] = (l > MS_LEVELS - 1) ? MS_LEVELS - 1 : l;
+    }
 
-                    g_ptr_array_free(array, TRUE);
+    int r = medw / 2;
+    for (i = -r; i <= r; i++)
+        a[i + r] = q[(i < 0) ? 0 : (i > n - 1) ? n - 1 : i];
+    qsort(a, medw, sizeof(*a), comp_level);
+
+    st[0].level = MS_LEVELS - 1; // the first step is the whole window
+    st[0].n = medw;
+    st[0].sum = st[0].sum2 = 0;
+    for (i = 0; i < medw; i++) {
+        st[0].sum += a[i];
+        st[0].sum2 += (gint64)a[i] * a[i];
+    }
+    int nst = 1, changed = 1;
 
-                    array = NULL;
-                    v = points;
-                }
-            }
+    for (x = 0; x < n; x++) {
+        if (x > 0) {
+            int out = x - r - 1, in = x + r;
+            changed = ms_slide(a, medw, st, nst, q[(out < 0) ? 0 : out], q[(in > n - 1) ? n - 1 : in]);
         }
 
-        edge_bit = fr->h % medw;
-        do_edges = (edge_bit != 0);
-
-        edge_lo = edge_bit / 2;
-        edge_hi = (do_edges) ? medw - edge_lo - 1: 0;
-
-        int xi; float *column; // filter columns
-
-#define MEDIAN_OF_MEDIANS
-
-#ifdef MEDIAN_OF_MEDIANS
-        column = row_median; // column median of row medians
-#else
-        column = dpi;
-#endif
-
-        for (xi = 0; xi < fr->w; xi++, column++) {
-
-            float *in = column;
-            float *out_start = column_median + xi; // 0 to fr->w
+        int kept;
+        if (medw <= MS_SCAN_WINDOW) {
+            kept = ms_scan(a, st);
+        } else {
+            nst = ms_clip(a, st, nst, changed);
+            kept = st[nst - 1].n;
+        }
+        if (q[x] <= a[kept - 1]) continue;
 
-            GPtrArray *array = NULL;
-            Point *v = points;
+        double median = a[kept / 2];
+        if (kept % 2 == 0)
+            median = (median + a[kept / 2 - 1]) / 2;
 
-            int b;
-            for (b = -edge_lo; b < fr->h + edge_hi; b++) {
-                v->value = *in;
-                v->exclude = FALSE;
-                v->id = b;
+        line[x] = lo + median / scale;
+    }
+}
 
-                if (array == NULL) array = g_ptr_array_sized_new(medw);
+struct median_job {
+    float *dat;	// the plane being filtered
+    int w;
+    int h;
+    int medw;
+};
 
-                if (array == NULL) break;
+static int median_rows(void *data, int plane, int y0, int y1)
+{
+    struct median_job *job = data;
+    unsigned short *q = malloc((job->w + job->medw) * sizeof(unsigned short));
+    struct median_step *st = malloc((job->medw + 1) * sizeof(struct median_step));
+    int y;
 
-                g_ptr_array_insert(array, v - points, v);
+    if (q && st)
+        for (y = y0; y < y1; y++)
+            line_median_exclude(job->dat + y * job->w, job->w, job->medw, q, q + job->w, st);
 
-                if (b >= 0 && b < fr->h - 1) in += fr->w;
-                v++;
+    free(q);
+    free(st);
+    return (q && st) ? 0 : -1;
+}
 
-                if (v == points + medw || b == fr->h + edge_hi - 1) { // calculate median for sample
-                    float median = array_median_exclude(array, points, medw);
+#define MEDIAN_COLUMNS 16 // columns copied out together, a cache line of floats
 
-                    for (v = points; v < points + medw; v++) { // output sample
-                        if (v->id >= 0) {
-                            if (v->id >= fr->h) break;
+/* y0, y1 are columns here */
+static int median_columns(void *data, int plane, int x0, int x1)
+{
+    struct median_job *job = data;
+    unsigned short *q = malloc((job->h + job->medw) * sizeof(unsigned short));
+    struct median_step *st = malloc((job->medw + 1) * sizeof(struct median_step));
+    float *col = malloc(MEDIAN_COLUMNS * job->h * sizeof(float));
+    int x, y, k;
+
+    if (q && st && col) {
+        for (x = x0; x < x1; x += MEDIAN_COLUMNS) {
+            int nc = (x1 - x < MEDIAN_COLUMNS) ? x1 - x : MEDIAN_COLUMNS;
+
+            for (y = 0; y < job->h; y++)
+                for (k = 0; k < nc; k++)
+                    col[k * job->h + y] = job->dat[y * job->w + x + k];
+
+            for (k = 0; k < nc; k++)
+                line_median_exclude(col + k * job->h, job->h, job->medw, q, q + job->h, st);
+
+            for (y = 0; y < job->h; y++)
+                for (k = 0; k < nc; k++)
+                    job->dat[y * job->w + x + k] = col[k * job->h + y];
+        }
+    }
 
-                            float *out = out_start + v->id * fr->w;
-                            *out = (v->exclude) ? median : v->value;
-                        }
-                    }
+    free(q);
+    free(st);
+    free(col);
+    return (q && st && col) ? 0 : -1;
+}
 
-                    g_ptr_array_free(array, TRUE);
+// median filter row and column (whole frame) with star exclusion
+// the rows are filtered first, then the columns of the result (median of
+// medians); both passes work in place and run on the worker pool
+int median_with_star_exclusion(struct ccd_frame *fr, int medw)
+{
+    if (medw % 2 == 0) medw++;
+    if (medw > MS_MAX_WINDOW) medw = MS_MAX_WINDOW;
 
-                    array = NULL;
-                    v = points;
-                }
-            }
-        }
+    struct median_job job;
+    job.w = fr->w;
+    job.h = fr->h;
+    job.medw = medw;
 
-#ifdef MEDIAN_OF_MEDIANS
-        float *out, *p; // column median of row median
-        for (out = dpi, p = column_median; out < dpi + fr->w * fr->h; out++, p++) *out = *p;
-#else
-        float *out, *rp, *cp;
-        for (out = dpi, rp = row_median, cp = column_median; out < dpi + fr->w * fr->h; out++, rp++, cp++) *out = (*rp + *cp) / 2;
-#endif
+    int ok = 1;
+    int plane_iter = 0;
+    frame_pixels_write_lock(fr);
+    while (ok && (plane_iter = color_plane_iter(fr, plane_iter))) {
+        job.dat = get_color_plane(fr, plane_iter);
 
-        free(column_median);
-        free(row_median);
+        ok = ! parallel_rows(fr->h, 1, 0, median_rows, &job, NULL, NULL)
+            && ! parallel_rows(fr->w, 1, 0, median_columns, &job, NULL, NULL);
     }
-    free(points);
+    frame_pixels_write_unlock(fr);
+    if (! ok) return 0;
 
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 
     return 1;
 }
@@ -1041,10 +1260,12 @@ int erase_stars_from_extracted(struct ccd_frame *fr)
         int extracted = extract_stars(copy_fr, NULL, 3, &first_last_y, src);
         if (extracted > 0) {
             int i;
+            frame_pixels_write_lock(fr);
             for (i = 0; i < extracted; i++) {
                 struct star *s = &(src->s[i]);
                 add_sky_patch_to_frame(fr, s->x, s->y, s->starr * 2.5, s->sky, s->sky_sigma);
             }
+            frame_pixels_write_unlock(fr);
             ns += extracted;
         }
 
@@ -1057,7 +1278,7 @@ int erase_stars_from_extracted(struct ccd_frame *fr)
 
 //    release_frame(copy_fr, "erase_stars");
 
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 
     return (abort) ? -1 : ns; // number of stars extracted or -1 user abort
 }
@@ -0,0 +1,121 @@
+// test_median.c: check median_with_star_exclusion against a brute-force
+// clip of every window. Integer data over less than 65536 adu is quantized
+// without loss, so the two must agree to float rounding.
+// Run by "make check".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <glib.h>
+
+#include "ccd.h"
+
+static int comp_float(const void *a, const void *b)
+{
+    float x = *(float *)a, y = *(float *)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* the clip of median_with_star_exclusion, done over each sorted window */
+static void brute_line(float *in, float *out, int n, int medw, float *win)
+{
+    int r = medw / 2;
+    int x, i;
+
+    for (x = 0; x < n; x++) {
+        for (i = -r; i <= r; i++) {
+            int k = x + i;
+            win[i + r] = in[(k < 0) ? 0 : (k > n - 1) ? n - 1 : k];
+        }
+        qsort(win, medw, sizeof(float), comp_float);
+
+        gint64 m = medw, s = 0, s2 = 0;
+        for (i = 0; i < medw; i++) {
+            gint64 v = win[i];
+            s += v;
+            s2 += v * v;
+        }
+        while (m > 1) { // drop the top while it is more than sigma above the mean
+            gint64 t = win[m - 1], d = t * m - s;
+            if (! (d > 0 && d * d > m * s2 - s * s))
+                break;
+            m--;
+            s -= t;
+            s2 -= t * t;
+        }
+
+        if (in[x] <= win[m - 1])
+            out[x] = in[x];
+        else if (m % 2)
+            out[x] = win[m / 2];
+        else
+            out[x] = (win[m / 2 - 1] + win[m / 2]) / 2;
+    }
+}
+
+/* sky with a gradient and noise, and a few stars */
+static void fill_line(float *d, int n, unsigned seed)
+{
+    int i, k;
+
+    srand(seed);
+    for (i = 0; i < n; i++) {
+        double u = (rand() + 1.0) / (RAND_MAX + 2.0), v = rand() / (RAND_MAX + 1.0);
+        d[i] = floor(1000 + 0.05 * i + 30 * sqrt(-2 * log(u)) * cos(2 * M_PI * v));
+    }
+    for (k = 0; k < n / 100; k++) {
+        int x = rand() % n;
+        double a = 200 + rand() % 20000;
+        for (i = -4; i <= 4; i++)
+            if (x + i >= 0 && x + i < n)
+                d[x + i] += floor(a * exp(-i * i / 3.0));
+    }
+}
+
+/* filter a 1-row (or 1-column) frame, so that only one pass changes it */
+static int check(int n, int medw, int columns)
+{
+    struct ccd_frame *fr = columns ? new_frame(1, n) : new_frame(n, 1);
+    float *in = malloc(n * sizeof(float));
+    float *ref = malloc(n * sizeof(float));
+    float *win = malloc(medw * sizeof(float));
+    int i, bad = 0;
+
+    fill_line(in, n, medw * 2 + columns);
+    for (i = 0; i < n; i++)
+        ((float *)fr->dat)[i] = in[i];
+
+    brute_line(in, ref, n, medw, win);
+    median_with_star_exclusion(fr, medw);
+
+    for (i = 0; i < n; i++) {
+        float v = ((float *)fr->dat)[i];
+        if (fabs(v - ref[i]) > 0.01) {
+            if (bad++ < 5)
+                fprintf(stderr, "%s medw %d at %d: %.2f, brute force %.2f\n",
+                        columns ? "columns" : "rows", medw, i, v, ref[i]);
+        }
+    }
+
+    free_frame(fr);
+    free(in);
+    free(ref);
+    free(win);
+    return bad;
+}
+
+int main(int argc, char **argv)
+{
+    int sizes[] = { 3, 5, 15, 31, 63, 65, 101, 301, 1001 };
+    int i, bad = 0;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        bad += check(5000, sizes[i], 0);
+        bad += check(5000, sizes[i], 1);
+    }
+    if (bad) {
+        fprintf(stderr, "%d pixels differ\n", bad);
+        return 1;
+    }
+    return 0;
+}
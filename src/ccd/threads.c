@@ -0,0 +1,205 @@
+/*******************************************************************************
+  This program is free software; you can redistribute it and/or modify it
+  under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+*******************************************************************************/
+
+// threads.c: shared worker pool and row-band parallel loops for frame operations
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include "ccd.h"
+#include "params.h"
+
+#define MAX_THREADS 64
+#define POLL_INTERVAL_MS 50 // how often the caller's poll function runs while bands are busy
+#define BANDS_PER_WORKER 4  // over-split so uneven bands still load-balance
+
+static GThreadPool *pool = NULL;
+static GMutex pool_lock;
+
+static __thread int in_worker = 0; // set on pool threads, nested loops run serially
+
+struct band_job {
+	rows_func f;
+	void *data;
+	GMutex lock;
+	GCond done_cond;
+	int pending;	// bands not yet finished
+	int done;	// bands finished
+	gint abort;	// set by the poll function or a failing band
+};
+
+struct band {
+	struct band_job *job;
+	int plane;
+	int y0;
+	int y1;
+};
+
+/* number of workers used for frame operations; the CCDRED_THREADS parameter,
+ * or one per online processor when it is 0 */
+int ccd_threads(void)
+{
+	int n = P_INT(CCDRED_THREADS);
+
+	if (n <= 0) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		n = (ncpu > 0) ? ncpu : 1;
+	}
+	if (n > MAX_THREADS) n = MAX_THREADS;
+	return n;
+}
+
+static void band_worker(gpointer data, gpointer user_data)
+{
+	struct band *b = data;
+	struct band_job *job = b->job;
+
+	in_worker = 1;
+
+	if (! g_atomic_int_get(&job->abort)) {
+		if (job->f(job->data, b->plane, b->y0, b->y1))
+			g_atomic_int_set(&job->abort, 1);
+	}
+
+	g_mutex_lock(&job->lock);
+	job->pending--;
+	job->done++;
+	g_cond_signal(&job->done_cond);
+	g_mutex_unlock(&job->lock);
+
+	free(b);
+}
+
+/* get the shared pool, sized to n workers; NULL if it cannot be created */
+static GThreadPool *get_pool(int n)
+{
+	g_mutex_lock(&pool_lock);
+	if (pool == NULL) {
+		pool = g_thread_pool_new(band_worker, NULL, n, FALSE, NULL);
+	} else if (g_thread_pool_get_max_threads(pool) != n) {
+		g_thread_pool_set_max_threads(pool, n, NULL);
+	}
+	g_mutex_unlock(&pool_lock);
+	return pool;
+}
+
+/* run f over rows [0, h) of each of nplanes planes, split into bands of
+ * band_h rows (0 picks a size from the number of workers). Bands run on the
+ * shared worker pool; the calling thread waits and calls poll(poll_data, done, total)
+ * every POLL_INTERVAL_MS, so poll may safely touch the gui. A non-zero return
+ * from poll or from f stops the remaining bands from starting.
+ * Every band writes only its own rows, so the result does not depend on
+ * the number of workers. Return 0 for success, -1 if aborted */
+int parallel_rows(int h, int nplanes, int band_h, rows_func f, void *data,
+		  poll_func poll, void *poll_data)
+{
+	int n = ccd_threads();
+	int plane, y;
+
+	if (h <= 0 || nplanes <= 0)
+		return 0;
+
+	if (band_h <= 0) {
+		band_h = h / (n * BANDS_PER_WORKER);
+		if (band_h < 16) band_h = 16;
+	}
+	int bands = (h + band_h - 1) / band_h;
+	int total = bands * nplanes;
+
+	if (n <= 1 || total <= 1 || in_worker) { // serial path, same bands in order
+		int done = 0;
+		for (plane = 0; plane < nplanes; plane++) {
+			for (y = 0; y < h; y += band_h) {
+				if (poll && (* poll)(poll_data, done, total)) return -1;
+				if (f(data, plane, y, (y + band_h < h) ? y + band_h : h)) return -1;
+				done++;
+			}
+		}
+		if (poll) (* poll)(poll_data, done, total);
+		return 0;
+	}
+
+	GThreadPool *p = get_pool(n);
+	if (p == NULL)
+		err_printf("parallel_rows: cannot create worker pool, running serially\n");
+
+	struct band_job job;
+	job.f = f;
+	job.data = data;
+	job.pending = 0;
+	job.done = 0;
+	job.abort = 0;
+	g_mutex_init(&job.lock);
+	g_cond_init(&job.done_cond);
+
+	for (plane = 0; plane < nplanes; plane++) {
+		for (y = 0; y < h; y += band_h) {
+			struct band *b = malloc(sizeof(struct band));
+			if (b == NULL) {
+				g_atomic_int_set(&job.abort, 1);
+				break;
+			}
+			b->job = &job;
+			b->plane = plane;
+			b->y0 = y;
+			b->y1 = (y + band_h < h) ? y + band_h : h;
+
+			g_mutex_lock(&job.lock);
+			job.pending++;
+			g_mutex_unlock(&job.lock);
+
+			if (p == NULL || ! g_thread_pool_push(p, b, NULL)) {
+				g_mutex_lock(&job.lock);
+				job.pending--;
+				g_mutex_unlock(&job.lock);
+				// pool unavailable: do the band here
+				if (! g_atomic_int_get(&job.abort) && f(data, b->plane, b->y0, b->y1))
+					g_atomic_int_set(&job.abort, 1);
+				g_mutex_lock(&job.lock);
+				job.done++;
+				g_mutex_unlock(&job.lock);
+				free(b);
+			}
+		}
+	}
+
+	g_mutex_lock(&job.lock);
+	while (job.pending > 0) {
+		gint64 end = g_get_monotonic_time() + POLL_INTERVAL_MS * G_TIME_SPAN_MILLISECOND;
+		g_cond_wait_until(&job.done_cond, &job.lock, end);
+
+		if (poll && job.pending > 0) {
+			int done = job.done;
+			g_mutex_unlock(&job.lock);
+			if ((* poll)(poll_data, done, total))
+				g_atomic_int_set(&job.abort, 1);
+			g_mutex_lock(&job.lock);
+		}
+	}
+	g_mutex_unlock(&job.lock);
+
+	if (poll && ! job.abort) (* poll)(poll_data, total, total);
+
+	g_mutex_clear(&job.lock);
+	g_cond_clear(&job.done_cond);
+
+	return (job.abort) ? -1 : 0;
+}
@@ -35,141 +35,183 @@
 #include <sys/time.h>
 #include <time.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
 #include "ccd.h"
 //#include "x11ops.h"
 //#include "warpaffine.h"
 
 float smooth3[9] = {0.25, 0.5, 0.25, 0.5, 1.0, 0.5, 0.25, 0.5, 0.25};
 
-// fast 7x7 convolution; dp points to the upper-left of the convolution box
-// in the image, ker is a linear vector that contains the kerner
-// scanned l->r and t>b; w is the width of the image
-static inline float conv7(float *dp, float *ker, int w)
+#define CONV_MAX_SIZE 31 // largest filter_frame kernel
+
+/* correlate nr input rows with a kernel of nr rows of kw taps: for x in
+ * [x0, n), out[x] = sum over r, i of k[r * kw + i] * rows[r][x + i]. The
+ * products are summed in kernel order, the same in every version */
+static void conv_rows(float **rows, int nr, float *k, int kw, int n, float *out, int x0)
+{
+	int r, i, x;
+
+	for (x = x0; x < n; x++)
+		out[x] = rows[0][x] * k[0];
+	for (r = 0; r < nr; r++)
+		for (i = (r == 0); i < kw; i++) {
+			float *dp = rows[r] + i;
+			float kv = k[r * kw + i];
+			for (x = x0; x < n; x++)
+				out[x] += dp[x] * kv;
+		}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* SSE2: 4 pixels at a time; return the number of pixels done */
+__attribute__((target("sse2")))
+static int conv_rows_sse2(float **rows, int nr, float *k, int kw, int n, float *out)
+{
+	int r, i, x;
+
+	for (x = 0; x + 4 <= n; x += 4) {
+		__m128 d = _mm_mul_ps(_mm_loadu_ps(rows[0] + x), _mm_set1_ps(k[0]));
+		for (r = 0; r < nr; r++)
+			for (i = (r == 0); i < kw; i++)
+				d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(rows[r] + x + i), _mm_set1_ps(k[r * kw + i])));
+		_mm_storeu_ps(out + x, d);
+	}
+	return x;
+}
+
+/* AVX2: 8 pixels at a time */
+__attribute__((target("avx2")))
+static int conv_rows_avx2(float **rows, int nr, float *k, int kw, int n, float *out)
 {
-	register int nl;
-	register float d;
-
-	nl = w - 6;
-	d = *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	return d;
+	int r, i, x;
+
+	for (x = 0; x + 8 <= n; x += 8) {
+		__m256 d = _mm256_mul_ps(_mm256_loadu_ps(rows[0] + x), _mm256_set1_ps(k[0]));
+		for (r = 0; r < nr; r++)
+			for (i = (r == 0); i < kw; i++)
+				d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(rows[r] + x + i), _mm256_set1_ps(k[r * kw + i])));
+		_mm256_storeu_ps(out + x, d);
+	}
+	return x;
 }
 
-// fast 5x5 convolution; dp points to the upper-left of the convolution box
-// in the image, ker is a linear vector that contains the kerner
-// scanned l->r and t>b; w is the width of the image
-static inline float conv5(float *dp, float *ker, int w)
+#endif
+
+static void conv_rows_simd(float **rows, int nr, float *k, int kw, int n, float *out)
 {
-	int nl;
-	float d;
-
-	nl = w - 4;
-	d = *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp * (*ker++);
-	dp += nl;
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp * (*ker++);
-	dp += nl;
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp * (*ker++);
-	dp += nl;
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp++ * (*ker++);
-	d += *dp * (*ker++);
-	return d;
+	int x = 0;
+
+#ifdef HAVE_X86_SIMD
+	switch (combine_simd()) {
+	case COMBINE_AVX2:
+		x = conv_rows_avx2(rows, nr, k, kw, n, out);
+		break;
+	case COMBINE_SSE2:
+		x = conv_rows_sse2(rows, nr, k, kw, n, out);
+		break;
+	}
+#endif
+	conv_rows(rows, nr, k, kw, n, out, x);
 }
 
-// fast 3x3 convolution; dp points to the upper-left of the convolution box
-// in the image, ker is a linear vector that contains the kerner
-// scanned l->r and t>b; w is the width of the image
-static inline float conv3(float *dp, float *ker, int w)
+/* if the size x size kernel is the outer product of a column and a row
+ * vector, put them in ck and rk and return 1; return 0 otherwise */
+static int kern_separable(float *kern, int size, float *ck, float *rk)
 {
-	register int nl;
-	register float d;
-
-	nl = w - 2;
-	d = *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	dp += nl;
-	d += *dp++ * *ker++;
-	d += *dp++ * *ker++;
-	d += *dp * *ker++;
-	return d;
+	int i, j, i0 = 0, j0 = 0;
+
+	for (i = 0; i < size * size; i++)
+		if (fabs(kern[i]) > fabs(kern[i0 * size + j0])) {
+			i0 = i / size;
+			j0 = i % size;
+		}
+
+	float p = kern[i0 * size + j0];
+	if (p == 0) return 0;
+
+	for (i = 0; i < size; i++) {
+		ck[i] = kern[i * size + j0];
+		rk[i] = kern[i0 * size + i] / p;
+	}
+	for (i = 0; i < size; i++)
+		for (j = 0; j < size; j++)
+			if (fabs(kern[i * size + j] - ck[i] * rk[j]) > 1e-6 * fabs(p))
+				return 0;
+	return 1;
+}
+
+struct filter_job {
+	float *in[3];
+	float *out[3];
+	int w;
+	int h;
+	int size;
+	float *kern;	// size * size kernel
+	int separable;
+	float ck[CONV_MAX_SIZE]; // column and row vectors of a separable kernel
+	float rk[CONV_MAX_SIZE];
+	float filler;
+};
+
+static int filter_rows(void *data, int plane, int y0, int y1)
+{
+	struct filter_job *job = data;
+	int w = job->w, m = job->size / 2;
+	float *in = job->in[plane];
+	float *out = job->out[plane];
+	float *rows[CONV_MAX_SIZE];
+	int x, y, r;
+
+	// rows within size/2 of the top and bottom are filler
+	for (y = y0; y < y1 && y < m; y++)
+		for (x = 0; x < w; x++)
+			out[y * w + x] = job->filler;
+	for (y = (y1 > job->h - m) ? job->h - m : y1; y < y1; y++)
+		for (x = 0; x < w; x++)
+			out[y * w + x] = job->filler;
+
+	if (y0 < m) y0 = m;
+	if (y1 > job->h - m) y1 = job->h - m;
+	if (y0 >= y1) return 0;
+
+	float *tmp = NULL;
+	if (job->separable) { // rows of the horizontal pass, with size/2 rows of margin
+		tmp = malloc((y1 - y0 + 2 * m) * w * sizeof(float));
+		if (tmp == NULL) return -1;
+
+		for (y = y0 - m; y < y1 + m; y++) {
+			rows[0] = in + y * w;
+			conv_rows_simd(rows, 1, job->rk, job->size, w - 2 * m, tmp + (y - y0 + m) * w);
+		}
+	}
+
+	for (y = y0; y < y1; y++) {
+		float *o = out + y * w;
+
+		if (job->separable) {
+			for (r = 0; r < job->size; r++)
+				rows[r] = tmp + (y - y0 + r) * w;
+			conv_rows_simd(rows, job->size, job->ck, 1, w - 2 * m, o + m);
+		} else {
+			for (r = 0; r < job->size; r++)
+				rows[r] = in + (y - m + r) * w;
+			conv_rows_simd(rows, job->size, job->kern, job->size, w - 2 * m, o + m);
+		}
+
+		// columns within size/2 of the sides are filler
+		for (x = 0; x < m; x++) {
+			o[x] = job->filler;
+			o[w - 1 - x] = job->filler;
+		}
+	}
+
+	free(tmp);
+	return 0;
 }
 
 struct blur_kern *new_blur_kern(struct blur_kern *blur, int size, double fwhm)
@@ -199,120 +241,93 @@ void free_blur_kern(struct blur_kern *blur)
 // filter a frame using the supplied kernel
 // size must be an odd number >=3
 // results within size/2 pixels of edges are set to cavg
+// a separable kernel is applied as a row and a column pass; the rows
+// and the color planes are filtered in parallel
 // returns 0 for ok, -1 for error
 int filter_frame(struct ccd_frame *fr, struct ccd_frame *fro, float *kern, int size)
 {
-    if (size % 2 != 1 || size < 3 || size > 7) {
-		err_printf("filter_frame: bad size %d\n");
+	struct filter_job job;
+
+	if (size % 2 != 1 || size < 3 || size > CONV_MAX_SIZE || size > fr->w || size > fr->h) {
+		err_printf("filter_frame: bad size %d\n", size);
 		return -1;
 	}
 
-    int w = fr->w;
-
-//    int all = w * (fr->h - (size - 1)) - (size) ;
-    int all = fr->w * (fr->h - size + 1);
-
-    int plane_iter = 0;
-	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
-        float *dpi = get_color_plane(fr, plane_iter);
-        float *dpo = get_color_plane(fro, plane_iter);
-
-        float *dpo0 = dpo;
-
-        int i;
-        for (i = 0; i < (size / 2) * w; i++) { // cavg start size/2 rows
-            *dpo++ = fr->stats.cavg;
-		}
-        dpo += size / 2; // center dpo at first (output) pixel
-
-		switch(size) {
-		case 3:
-            for (i = 0; i < all; i++) {
-				*dpo = conv3(dpi, kern, w);
-				dpi ++;
-				dpo ++;
-			}
-			break;
-		case 5:
-            for (i = 0; i < all; i++) {
-				*dpo = conv5(dpi, kern, w);
-				dpi ++;
-  				dpo ++;
-			}
-			break;
-		case 7:
-            for (i = 0; i < all; i++) {
-                *dpo = conv7(dpi, kern, w);
-				dpi ++;
-				dpo ++;
-			}
-			break;
-		}
-
-        for (i = 0; i < (size / 2) * (w - 1); i++) { // cavg end size/2 rows
-            *dpo++ = fr->stats.cavg;
-		}
-
-        // cavg start and end columns
-        dpo = dpo0;
-
-        int x, y;
-        for (y = 0; y < fr->h; y++) {
-            for (x = 0; x < size / 2; x++) // cavg start columns
-                *dpo++ = fr->stats.cavg;
+	frame_stats(fr);
+
+	memset(&job, 0, sizeof(struct filter_job));
+	job.w = fr->w;
+	job.h = fr->h;
+	job.size = size;
+	job.kern = kern;
+	job.separable = kern_separable(kern, size, job.ck, job.rk);
+	job.filler = fr->stats.cavg;
+
+	int nplanes = 0;
+	int plane_iter = 0;
+	while ((plane_iter = color_plane_iter(fr, plane_iter)) && nplanes < 3) {
+		job.in[nplanes] = get_color_plane(fr, plane_iter);
+		job.out[nplanes] = get_color_plane(fro, plane_iter);
+		nplanes++;
+	}
 
-            dpo0 += w;
-            dpo = dpo0 - size / 2;
+	frame_pixels_write_lock(fro);
+	int ret = parallel_rows(fr->h, nplanes, 0, filter_rows, &job, NULL, NULL);
+	frame_pixels_write_unlock(fro);
 
-            for (x = 0; x < size / 2; x++) // cavg end columns
-                *dpo++ = fr->stats.cavg;
-        }
+	if (ret) {
+		err_printf("filter_frame: alloc error\n");
+		return -1;
 	}
 
-    fr->stats.statsok = 0;
+	frame_data_changed(fro);
 
 	return 0;
-
 }
 
 // from https://blog.ivank.net/fastest-gaussian-blur.html
-static void gaussBlur (float *scl, float *tcl, int w, int h, double r);
+static int gauss_blur_planes(float **scl, float **tcl, int nplanes, int w, int h, double r);
 
 int gauss_blur_frame(struct ccd_frame *fr, double r)
 {
     struct ccd_frame *nf = clone_frame(fr);
+    float *dpi[3], *dpo[3];
+    int nplanes = 0;
 
     if (nf == NULL) return -1;
 
     int plane_iter = 0;
-    while ((plane_iter = color_plane_iter(fr, plane_iter))) {
-        float *dpi = get_color_plane(fr, plane_iter);
-        float *dpo = get_color_plane(nf, plane_iter);
-
-        gaussBlur(dpo, dpi, fr->w, fr->h, r);
+    while ((plane_iter = color_plane_iter(fr, plane_iter)) && nplanes < 3) {
+        dpi[nplanes] = get_color_plane(fr, plane_iter);
+        dpo[nplanes] = get_color_plane(nf, plane_iter);
+        nplanes++;
     }
 
+    // the blurred planes end up in nf; those of fr are used as scratch
+    frame_pixels_write_lock(fr);
+    int ret = gauss_blur_planes(dpo, dpi, nplanes, fr->w, fr->h, r);
+
 // swap frame and filtered frame data
-//    plane_iter = 0;
-//    while ((plane_iter = color_plane_iter(fr, plane_iter))) {
-//        float *pnf = get_color_plane(nf, plane_iter);
-//        float *pfr = get_color_plane(fr, plane_iter);
+    plane_iter = 0;
+    while (ret == 0 && (plane_iter = color_plane_iter(fr, plane_iter))) {
+        float *pnf = get_color_plane(nf, plane_iter);
+        float *pfr = get_color_plane(fr, plane_iter);
 
-//        set_color_plane(fr, plane_iter, pnf);
-//        set_color_plane(nf, plane_iter, pfr);
-//    }
+        set_color_plane(fr, plane_iter, pnf);
+        set_color_plane(nf, plane_iter, pfr);
+    }
+    frame_pixels_write_unlock(fr);
 
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 
     release_frame(nf, "filter_frame_inplace 2");
 
-    return 0;
+    return ret;
 }
 
 static void set_row_to_cavg(struct ccd_frame *fr, int row)
 {
-    if (! fr->stats.statsok)
-        frame_stats(fr);
+    frame_stats(fr);
 
     int plane_iter = 0;
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
@@ -340,6 +355,7 @@ int filter_frame_inplace(struct ccd_frame *fr, float *kern, int size)
 
 // swap frame and filtered frame data
     int plane_iter = 0;
+    frame_pixels_write_lock(fr);
 	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         float *pnf = get_color_plane(nf, plane_iter);
         float *pfr = get_color_plane(fr, plane_iter);
@@ -347,8 +363,9 @@ int filter_frame_inplace(struct ccd_frame *fr, float *kern, int size)
         set_color_plane(fr, plane_iter, pnf);
         set_color_plane(nf, plane_iter, pfr);
 	}
+    frame_pixels_write_unlock(fr);
 
-    fr->stats.statsok = 0;
+    frame_data_changed(fr);
 
     release_frame(nf, "filter_frame_inplace 2");
 
@@ -364,13 +381,13 @@ int make_shift_ctrans(struct ctrans *ct, double dx, double dy)
 
 	ct->order = 1;
 
-	for (i = 0; i < MAX_ORDER; i++)
-		for (j = 0; j < MAX_ORDER; j++) {
+	for (i = 0; i <= MAX_ORDER; i++)
+		for (j = 0; j <= MAX_ORDER; j++) {
 			ct->a[i][j] = 0.0;
 			ct->b[i][j] = 0.0;
 		}
-	ct->u0 = dx;
-	ct->v0 = dy;
+	ct->u0 = -dx; // output pixels are taken from the input at ct(x, y)
+	ct->v0 = -dy;
 	ct->a[1][0] = 1.0;
 	ct->b[0][1] = 1.0;
 	return 0;
@@ -388,13 +405,13 @@ int make_roto_translate(struct ctrans *ct, double dx, double dy, double xs, doub
 
 	ct->order = 1;
 
-	for (i = 0; i < MAX_ORDER; i++)
-		for (j = 0; j < MAX_ORDER; j++) {
+	for (i = 0; i <= MAX_ORDER; i++)
+		for (j = 0; j <= MAX_ORDER; j++) {
 			ct->a[i][j] = 0.0;
 			ct->b[i][j] = 0.0;
 		}
-	ct->u0 = dx;
-	ct->v0 = dy;
+	ct->u0 = -dx;
+	ct->v0 = -dy;
 	sa = sin(-rot);
 	ca = cos(-rot);
 	ct->a[1][0] = 1.0 / xs * ca;
@@ -404,6 +421,32 @@ int make_roto_translate(struct ctrans *ct, double dx, double dy, double xs, doub
 	return 0;
 }
 
+// create the ctrans that undoes an alignment offset: output pixel p is taken
+// from the input at c + R(theta) (p + (dx, dy) - c), where R rotates by theta
+// (radians) and c = (xc, yc) is the center of the rotation
+int make_align_ctrans(struct ctrans *ct, double dx, double dy, double theta, double xc, double yc)
+{
+	int i,j;
+	double st, ct_;
+
+	ct->order = 1;
+
+	for (i = 0; i <= MAX_ORDER; i++)
+		for (j = 0; j <= MAX_ORDER; j++) {
+			ct->a[i][j] = 0.0;
+			ct->b[i][j] = 0.0;
+		}
+	st = sin(theta);
+	ct_ = cos(theta);
+	ct->u0 = xc + ct_ * (dx - xc) - st * (dy - yc);
+	ct->v0 = yc + st * (dx - xc) + ct_ * (dy - yc);
+	ct->a[1][0] = ct_;
+	ct->a[0][1] = -st;
+	ct->b[1][0] = st;
+	ct->b[0][1] = ct_;
+	return 0;
+}
+
 
 
 static void linear_y_shear_data(float *in, int wi, int hi, float *out, int wo, int ho, double a, double c, double filler) //, double doo, double dah)
@@ -520,7 +563,7 @@ static void linear_x_shear_data(float *in, int wi, int hi, float *out, int wo, i
 
 void warp_frame(struct ccd_frame *fr, double dx, double dy, double dt) {
 
-    if (!fr->stats.statsok) frame_stats(fr);
+    frame_stats(fr);
 
     float filler = fr->stats.cavg;  // filler value for out-of-frame spots
 
@@ -532,12 +575,286 @@ void warp_frame(struct ccd_frame *fr, double dx, double dy, double dt) {
     }
 }
 
-// change frame coordinates
-int warp_frame_old(struct ccd_frame *in, struct ccd_frame *out, struct ctrans *ct)
+// resampling through a ctrans
+
+#define RESAMPLE_PHASES 1024 // sub-pixel positions the kernel weights are tabulated at
+#define RESAMPLE_MAX_TAPS 6
+
+struct resample_kern {
+	int taps;	// kernel width, in pixels
+	float *w;	// RESAMPLE_PHASES rows of taps weights
+};
+
+static double sinc(double x)
+{
+	if (fabs(x) < 1e-9) return 1.0;
+	return sin(PI * x) / (PI * x);
+}
+
+// weight of kernel method at distance d from the sample point
+static double kern_weight(int method, double d)
 {
-	return -1;
+	d = fabs(d);
+	switch (method) {
+	case RESAMPLE_BICUBIC: // Keys, a = -0.5
+		if (d < 1) return (1.5 * d - 2.5) * d * d + 1;
+		if (d < 2) return ((-0.5 * d + 2.5) * d - 4) * d + 2;
+		return 0;
+	case RESAMPLE_LANCZOS3:
+		if (d < 3) return sinc(d) * sinc(d / 3);
+		return 0;
+	default: // bilinear
+		return (d < 1) ? 1 - d : 0;
+	}
 }
 
+// tabulate the weights of a kernel; each row sums to 1
+static int resample_kern_init(struct resample_kern *k, int method)
+{
+	int p, i;
+
+	switch (method) {
+	case RESAMPLE_BICUBIC: k->taps = 4; break;
+	case RESAMPLE_LANCZOS3: k->taps = 6; break;
+	default: k->taps = 2; break;
+	}
+
+	k->w = malloc(RESAMPLE_PHASES * k->taps * sizeof(float));
+	if (k->w == NULL) return -1;
+
+	for (p = 0; p < RESAMPLE_PHASES; p++) {
+		double f = (double) p / RESAMPLE_PHASES; // sample point between taps taps/2 - 1 and taps/2
+		double w[RESAMPLE_MAX_TAPS], sum = 0;
+
+		for (i = 0; i < k->taps; i++) {
+			w[i] = kern_weight(method, i - (k->taps / 2 - 1) - f);
+			sum += w[i];
+		}
+		for (i = 0; i < k->taps; i++)
+			k->w[p * k->taps + i] = w[i] / sum;
+	}
+	return 0;
+}
+
+struct resample_job {
+	float *in;	// input plane
+	float *out;	// output plane
+	int w;
+	int h;
+	struct ctrans *ct;
+	struct resample_kern k;
+	float filler;
+};
+
+// evaluate the transform polynomials at (x, y)
+static void ctrans_eval(struct ctrans *ct, double x, double y, double *xi, double *yi)
+{
+	double u = ct->u0, v = ct->v0;
+	double yp = 1;
+	int i, j;
+
+	for (j = 0; j <= ct->order; j++) {
+		double xp = yp;
+		for (i = 0; i + j <= ct->order; i++) {
+			u += ct->a[i][j] * xp;
+			v += ct->b[i][j] * xp;
+			xp *= x;
+		}
+		yp *= y;
+	}
+	*xi = u;
+	*yi = v;
+}
+
+// split an input position into the first tap and the weights row; return 0 if the
+// position is off the frame, 1 if all taps are in the frame, 2 if some are not
+static inline int resample_pos(double p, int n, int taps, int *i0, int *ph)
+{
+	if (! (p >= 0 && p <= n - 1)) return 0;
+
+	int i = floor(p);
+	int f = (p - i) * RESAMPLE_PHASES + 0.5;
+	if (f == RESAMPLE_PHASES) {
+		f = 0;
+		i++;
+	}
+	*i0 = i - (taps / 2 - 1);
+	*ph = f * taps;
+	return (*i0 >= 0 && *i0 + taps <= n) ? 1 : 2;
+}
+
+static float resample_pixel(struct resample_job *job, int ix, int px, int iy, int py)
+{
+	int taps = job->k.taps;
+	float *wx = job->k.w + px;
+	float *wy = job->k.w + py;
+	float v = 0;
+	int kx, ky;
+
+	for (ky = 0; ky < taps; ky++) {
+		int y = iy + ky;
+		if (y < 0) y = 0;
+		if (y > job->h - 1) y = job->h - 1;
+		float *row = job->in + y * job->w;
+		float s = 0;
+		for (kx = 0; kx < taps; kx++) {
+			int x = ix + kx;
+			if (x < 0) x = 0;
+			if (x > job->w - 1) x = job->w - 1;
+			s += wx[kx] * row[x];
+		}
+		v += wy[ky] * s;
+	}
+	return v;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/* AVX2: 8 output pixels with all their taps in the frame; the taps are gathered
+ * and summed in the same order as resample_pixel, so the results are the same */
+__attribute__((target("avx2")))
+static void resample_8_avx2(struct resample_job *job, int *ix, int *px, int *iy, int *py, float *out)
+{
+	int taps = job->k.taps;
+	int kx, ky;
+	__m256i base = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_loadu_si256((__m256i *)iy), _mm256_set1_epi32(job->w)),
+					_mm256_loadu_si256((__m256i *)ix));
+	__m256i vpx = _mm256_loadu_si256((__m256i *)px);
+	__m256i vpy = _mm256_loadu_si256((__m256i *)py);
+	__m256 wx[RESAMPLE_MAX_TAPS];
+
+	for (kx = 0; kx < taps; kx++)
+		wx[kx] = _mm256_i32gather_ps(job->k.w, _mm256_add_epi32(vpx, _mm256_set1_epi32(kx)), 4);
+
+	__m256 v = _mm256_setzero_ps();
+	for (ky = 0; ky < taps; ky++) {
+		__m256 wy = _mm256_i32gather_ps(job->k.w, _mm256_add_epi32(vpy, _mm256_set1_epi32(ky)), 4);
+		__m256i row = _mm256_add_epi32(base, _mm256_set1_epi32(ky * job->w));
+		__m256 s = _mm256_setzero_ps();
+		for (kx = 0; kx < taps; kx++) {
+			__m256 d = _mm256_i32gather_ps(job->in, _mm256_add_epi32(row, _mm256_set1_epi32(kx)), 4);
+			s = _mm256_add_ps(s, _mm256_mul_ps(wx[kx], d));
+		}
+		v = _mm256_add_ps(v, _mm256_mul_ps(wy, s));
+	}
+	_mm256_storeu_ps(out, v);
+}
+
+#endif
+
+static int resample_rows(void *data, int plane, int y0, int y1)
+{
+	struct resample_job *job = data;
+	int w = job->w;
+	int *ix = malloc(4 * w * sizeof(int));
+	unsigned char *in = malloc(w);
+	int x, y;
+
+	if (ix == NULL || in == NULL) {
+		free(ix);
+		free(in);
+		return -1;
+	}
+	int *px = ix + w, *iy = ix + 2 * w, *py = ix + 3 * w;
+
+#ifdef HAVE_X86_SIMD
+	int avx2 = (combine_simd() == COMBINE_AVX2);
+#endif
+	int affine = (job->ct->order <= 1);
+
+	for (y = y0; y < y1; y++) {
+		float *out = job->out + y * w;
+		double xi, yi;
+
+		// the input position of every pixel in the row, and where its taps fall
+		for (x = 0; x < w; x++) {
+			if (affine) {
+				xi = job->ct->u0 + job->ct->a[0][0] + job->ct->a[1][0] * x + job->ct->a[0][1] * y;
+				yi = job->ct->v0 + job->ct->b[0][0] + job->ct->b[1][0] * x + job->ct->b[0][1] * y;
+			} else {
+				ctrans_eval(job->ct, x, y, &xi, &yi);
+			}
+			int rx = resample_pos(xi, w, job->k.taps, ix + x, px + x);
+			int ry = (rx) ? resample_pos(yi, job->h, job->k.taps, iy + x, py + x) : 0;
+			in[x] = (rx && ry) ? ((rx == 1 && ry == 1) ? 1 : 2) : 0;
+		}
+
+		for (x = 0; x < w; x++) {
+#ifdef HAVE_X86_SIMD
+			if (avx2 && x + 8 <= w && in[x] == 1 && in[x + 1] == 1 && in[x + 2] == 1 && in[x + 3] == 1
+			    && in[x + 4] == 1 && in[x + 5] == 1 && in[x + 6] == 1 && in[x + 7] == 1) {
+				resample_8_avx2(job, ix + x, px + x, iy + x, py + x, out + x);
+				x += 7;
+				continue;
+			}
+#endif
+			out[x] = (in[x]) ? resample_pixel(job, ix[x], px[x], iy[x], py[x]) : job->filler;
+		}
+	}
+
+	free(ix);
+	free(in);
+	return 0;
+}
+
+/* resample frame fr in place through ct: output pixel (x, y) takes the value
+ * of the input at ct(x, y), interpolated with the kernel given by method
+ * (RESAMPLE_BILINEAR, RESAMPLE_BICUBIC or RESAMPLE_LANCZOS3). Pixel centers are at
+ * integer coordinates. Output pixels that map outside the input are set to cavg.
+ * Each plane is done in a single pass, in row bands on the worker pool.
+ * Return 0 for ok, -1 for error */
+int resample_frame(struct ccd_frame *fr, struct ctrans *ct, int method)
+{
+	struct resample_job job;
+	int ret = 0;
+
+	if (ct->order > MAX_ORDER) {
+		err_printf("resample_frame: bad transform order %d\n", ct->order);
+		return -1;
+	}
+
+	// a whole-pixel or bilinear translation is done faster by shift_frame
+	if (ct->order <= 1 && ct->a[1][0] == 1 && ct->a[0][1] == 0 && ct->b[1][0] == 0 && ct->b[0][1] == 1) {
+		double dx = ct->u0 + ct->a[0][0];
+		double dy = ct->v0 + ct->b[0][0];
+		if (method == RESAMPLE_BILINEAR || (dx == floor(dx) && dy == floor(dy)))
+			return shift_frame(fr, -dx, -dy);
+	}
+
+	frame_stats(fr);
+
+	memset(&job, 0, sizeof(struct resample_job));
+	job.w = fr->w;
+	job.h = fr->h;
+	job.ct = ct;
+	job.filler = fr->stats.cavg;  // filler value for out-of-frame spots
+
+	job.out = malloc(fr->w * fr->h * sizeof(float));
+	if (job.out == NULL || resample_kern_init(&job.k, method)) {
+		err_printf("resample_frame: alloc error\n");
+		free(job.out);
+		return -1;
+	}
+
+	int plane_iter = 0;
+	frame_pixels_write_lock(fr);
+	while ((plane_iter = color_plane_iter(fr, plane_iter))) {
+		job.in = get_color_plane(fr, plane_iter);
+		if (parallel_rows(fr->h, 1, 0, resample_rows, &job, NULL, NULL)) {
+			err_printf("resample_frame: alloc error\n");
+			ret = -1;
+			break;
+		}
+		memcpy(job.in, job.out, fr->w * fr->h * sizeof(float));
+	}
+	frame_pixels_write_unlock(fr);
+
+	free(job.k.w);
+	free(job.out);
+
+	frame_data_changed(fr);
+	return ret;
+}
 
 // fast shift-only functions
 
@@ -743,7 +1060,7 @@ static void linear_y_shear_frame(struct ccd_frame *in, struct ccd_frame *out, do
 {
     c = 1;
 
-    if (!in->stats.statsok) frame_stats(in);
+    frame_stats(in);
     float filler = in->stats.cavg;  // filler value for out-of-frame spots
 
     int plane_iter = 0;
@@ -761,7 +1078,7 @@ static void linear_x_shear_frame(struct ccd_frame *in, struct ccd_frame *out, do
 {
     c = 1; // no scaling
 
-    if (!in->stats.statsok) frame_stats(in);
+    frame_stats(in);
     float filler = in->stats.cavg;  // filler value for out-of-frame spots
 
     int plane_iter = 0;
@@ -785,12 +1102,13 @@ int shift_frame(struct ccd_frame *fr, double dx, double dy)
     float *dat;
     int plane_iter = 0;
 
-    if (!fr->stats.statsok) frame_stats(fr);
+    frame_stats(fr);
     float filler = fr->stats.cavg;  // filler value for out-of-frame spots
 
     w = fr->w;
     h = fr->h;
 
+    frame_pixels_write_lock(fr);
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         dat = get_color_plane(fr, plane_iter);
         if (dx > 0) { // shift right
@@ -826,7 +1144,9 @@ int shift_frame(struct ccd_frame *fr, double dx, double dy)
             }
         }
     }
+    frame_pixels_write_unlock(fr);
 
+    frame_data_changed(fr);
     return 0;
 }
 
@@ -834,17 +1154,19 @@ void rotate_frame_pi(struct ccd_frame *fr)
 {
 // in and out are the same size (width, height, planes)
     int plane_iter = 0;
+    frame_pixels_write_lock(fr);
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         float *in = get_color_plane(fr, plane_iter);
         rotate_data_pi(in, NULL, fr->w, fr->h);
     }
+    frame_pixels_write_unlock(fr);
 }
 
 // direction = 1 : clockwise
 // direction = -1 : anticlockwise
 void rotate_trame_pi_2(struct ccd_frame *fr, int direction)
 {
-    if (!fr->stats.statsok) frame_stats(fr);
+    frame_stats(fr);
 
 // in and out are the same size (width, height, planes), width and height swap
     int plane_iter = 0;
@@ -853,11 +1175,13 @@ void rotate_trame_pi_2(struct ccd_frame *fr, int direction)
     float filler = fr->stats.cavg;  // filler value for out-of-frame spots
 
     float *out = malloc(all * sizeof(float));
+    frame_pixels_write_lock(fr);
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         float *in = get_color_plane(fr, plane_iter);
         rotate_data_pi_2(in, out, fr->w, fr->h, direction);
         memcpy(in, out, all * sizeof(float));
     }
+    frame_pixels_write_unlock(fr);
     free(out);
 
 //    int t = fr->w;
@@ -870,11 +1194,13 @@ void flip_frame(struct ccd_frame *fr)
 {
 // in and out are the same size (width, height, planes)
     int plane_iter = 0;
+    frame_pixels_write_lock(fr);
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         float *in = get_color_plane(fr, plane_iter);
         flip_data(in, NULL, fr->w, fr->h);
     }
     fr->data_is_flipped = ~fr->data_is_flipped;
+    frame_pixels_write_unlock(fr);
 //    fr->fim.yinc = -fr->fim.yinc; // do this only
 //    fr->fim.flags ^= WCS_DATA_IS_FLIPPED;
 
@@ -884,7 +1210,7 @@ void flip_frame(struct ccd_frame *fr)
 
 int rotate_frame(struct ccd_frame *fr, double theta)
 {
-    if (!fr->stats.statsok) frame_stats(fr);
+    frame_stats(fr);
 
     int plane_iter = 0;
     int all = fr->w * fr->h;
@@ -892,12 +1218,15 @@ int rotate_frame(struct ccd_frame *fr, double theta)
     float filler = fr->stats.cavg;  // filler value for out-of-frame spots
 
     float *out = malloc(all * sizeof(float));
+    frame_pixels_write_lock(fr);
     while ((plane_iter = color_plane_iter(fr, plane_iter))) {
         float *in = get_color_plane(fr, plane_iter);
         rotate_data(in, out, fr->w, fr->h, theta, filler);
         memcpy(in, out, all * sizeof(float));
     }
+    frame_pixels_write_unlock(fr);
     free(out);
+    frame_data_changed(fr);
     return 0;
 }
 
@@ -1006,9 +1335,10 @@ static float *boxesForGauss(double sigma, int n)  // standard deviation, number
     int m = round(mIdeal);
 
     double sigmaActual = sqrt((m * wl * wl + (n - m) * wu * wu - n) / 12);
-    printf("sigms %f sigmaActual %f\n", sigma, sigmaActual); fflush(NULL);
+    d3_printf("sigma %f sigmaActual %f\n", sigma, sigmaActual);
 
     float *sizes = calloc(n, sizeof(float));
+    if (sizes == NULL) return NULL;
 
     int i;
     for (i = 0; i < n; i++) sizes[i] = (i < m) ? wl : wu;
@@ -1017,10 +1347,25 @@ static float *boxesForGauss(double sigma, int n)  // standard deviation, number
 }
 
 
-static void boxBlurH (float *scl, float *tcl, int w, int h, double r) {
-    double iarr = 1 / (r + r + 1);
+struct box_job {
+    float **scl;
+    float **tcl;
+    int w;
+    int h;
+    int r;
+    double iarr;
+};
+
+// horizontal running sums over rows [y0, y1)
+static int box_blur_rows(void *data, int plane, int y0, int y1)
+{
+    struct box_job *job = data;
+    float *scl = job->scl[plane], *tcl = job->tcl[plane];
+    int w = job->w, r = job->r;
+    double iarr = job->iarr;
     int i;
-    for (i = 0; i < h; i++) {
+
+    for (i = y0; i < y1; i++) {
         int ti = i * w, li = ti, ri = ti + r;
         float fv = scl[ti], lv = scl[ti + w - 1], val = (r + 1) * fv;
 
@@ -1040,56 +1385,112 @@ static void boxBlurH (float *scl, float *tcl, int w, int h, double r) {
             tcl[ti++] = round(val * iarr);
         }
     }
+    return 0;
 }
 
-static void boxBlurT (float *scl, float *tcl, int w, int h, double r) {
-    double iarr = 1 / (r + r + 1);
-
-    int i;
-    for(i = 0; i < w; i++) {
-        int ti = i, li = ti, ri = ti + r * w;
-        float fv = scl[ti], lv = scl[ti + w * (h - 1)], val = (r + 1) * fv;
+// one row of the vertical running sums: val += a - b, out = round(val * iarr)
+static void box_step(float *val, float *a, float *b, float *out, int x, int n, double iarr)
+{
+    for (; x < n; x++) {
+        val[x] += a[x] - b[x];
+        out[x] = round(val[x] * iarr);
+    }
+}
 
-        int j;
-        for (j = 0; j < r; j++) val += scl[ti + j * w];
+#ifdef HAVE_X86_SIMD
 
-        for (j = 0; j <= r; j++) {
-            val += scl[ri] - fv;
-            tcl[ti] = round(val * iarr);
-            ri += w;
-            ti += w;
-        }
-        for (j = r + 1; j < h - r; j++) {
-            val += scl[ri] - scl[li];
-            tcl[ti] = round(val * iarr);
-            li += w;
-            ri += w;
-            ti += w;
-        }
-        for (j = h - r; j < h; j++) {
-            val += lv - scl[li];
-            tcl[ti] = round(val * iarr);
-            li += w;
-            ti += w;
+/* AVX2: 8 columns at a time, rounding half away from zero like round() */
+__attribute__((target("avx2")))
+static int box_step_avx2(float *val, float *a, float *b, float *out, int n, double iarr)
+{
+    __m256d vi = _mm256_set1_pd(iarr);
+    __m256d half = _mm256_set1_pd(0.5);
+    __m256d one = _mm256_set1_pd(1.0);
+    __m256d sign = _mm256_set1_pd(-0.0);
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8) {
+        __m256 v = _mm256_add_ps(_mm256_loadu_ps(val + x),
+                                 _mm256_sub_ps(_mm256_loadu_ps(a + x), _mm256_loadu_ps(b + x)));
+        _mm256_storeu_ps(val + x, v);
+
+        __m256d q[2];
+        int k;
+        for (k = 0; k < 2; k++) {
+            __m256d d = _mm256_mul_pd(_mm256_cvtps_pd(k ? _mm256_extractf128_ps(v, 1) : _mm256_castps256_ps128(v)), vi);
+            __m256d t = _mm256_round_pd(d, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+            __m256d f = _mm256_andnot_pd(sign, _mm256_sub_pd(d, t));
+            __m256d up = _mm256_and_pd(_mm256_cmp_pd(f, half, _CMP_GE_OQ),
+                                       _mm256_or_pd(one, _mm256_and_pd(sign, d)));
+            q[k] = _mm256_add_pd(t, up);
         }
+        _mm256_storeu_ps(out + x, _mm256_set_m128(_mm256_cvtpd_ps(q[1]), _mm256_cvtpd_ps(q[0])));
     }
+    return x;
 }
 
+#endif
 
+static void box_step_simd(float *val, float *a, float *b, float *out, int n, double iarr)
+{
+    int x = 0;
 
-static void boxBlur (float *scl, float *tcl, int w, int h, double r) {
-    int i;
-    for (i = 0; i < w * h; i++) tcl[i] = scl[i];
-    boxBlurT(tcl, scl, w, h, r);
-    boxBlurH(scl, tcl, w, h, r);
+#ifdef HAVE_X86_SIMD
+    if (combine_simd() == COMBINE_AVX2)
+        x = box_step_avx2(val, a, b, out, n, iarr);
+#endif
+    box_step(val, a, b, out, x, n, iarr);
+}
+
+// vertical running sums over columns [x0, x1), walked a row at a time
+static int box_blur_columns(void *data, int plane, int x0, int x1)
+{
+    struct box_job *job = data;
+    float *scl = job->scl[plane] + x0, *tcl = job->tcl[plane] + x0;
+    int w = job->w, h = job->h, r = job->r;
+    int n = x1 - x0;
+    int x, j;
+
+    float *val = malloc(n * sizeof(float));
+    if (val == NULL) return -1;
+
+    float *fv = scl, *lv = scl + w * (h - 1);
+    for (x = 0; x < n; x++) val[x] = (r + 1) * fv[x];
+    for (j = 0; j < r; j++)
+        for (x = 0; x < n; x++) val[x] += scl[j * w + x];
+
+    for (j = 0; j <= r; j++)
+        box_step_simd(val, scl + (r + j) * w, fv, tcl + j * w, n, job->iarr);
+    for (j = r + 1; j < h - r; j++)
+        box_step_simd(val, scl + (r + j) * w, scl + (j - r - 1) * w, tcl + j * w, n, job->iarr);
+    for (j = h - r; j < h; j++)
+        box_step_simd(val, lv, scl + (j - r - 1) * w, tcl + j * w, n, job->iarr);
+
+    free(val);
+    return 0;
 }
 
-static void gaussBlur (float *scl, float *tcl, int w, int h, double r) {
+/* three box blurs approximating a gaussian of sigma r; each is a vertical
+ * pass from scl to tcl and a horizontal one back, so the result is in scl.
+ * The planes, and the rows or columns within a pass, run in parallel */
+static int gauss_blur_planes(float **scl, float **tcl, int nplanes, int w, int h, double r)
+{
     float *bxs = boxesForGauss(r, 3);
+    struct box_job job = {scl, tcl, w, h, 0, 0};
+    int i;
+
+    if (bxs == NULL) return -1;
 
-    boxBlur (scl, tcl, w, h, (bxs[0] - 1) / 2);
-    boxBlur (tcl, scl, w, h, (bxs[1] - 1) / 2);
-    boxBlur (scl, tcl, w, h, (bxs[2] - 1) / 2);
+    for (i = 0; i < 3; i++) {
+        job.r = (bxs[i] - 1) / 2;
+        job.iarr = 1.0 / (job.r + job.r + 1);
+
+        if (parallel_rows(w, nplanes, 0, box_blur_columns, &job, NULL, NULL)) break;
+        job.scl = tcl; job.tcl = scl;
+        parallel_rows(h, nplanes, 0, box_blur_rows, &job, NULL, NULL);
+        job.scl = scl; job.tcl = tcl;
+    }
 
     free(bxs);
+    return (i < 3) ? -1 : 0;
 }
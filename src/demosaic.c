@@ -93,123 +93,85 @@ int cfa_filters[] = { 0, FRAME_CFA_RGGB, FRAME_CFA_BGGR, FRAME_CFA_GRBG, FRAME_C
 
 #define FC(row,col) (filters >> ( (	(((row) << 1) & 14) + ((col) & 1) ) << 1 ) & 3 )
 
-// RGB demosaic only
-static int demosaic_bilinear(struct ccd_frame *fr)
-{
-	struct offset_t {
-		int pos;
-		int color;
-	};
+#define DEMOSAIC_TILE 128 // side of the tiles the frame is demosaiced in (even)
+#define DEMOSAIC_HALO 2 // bilinear margin around a tile, for the vng gradients
+#define TILE_STRIDE (DEMOSAIC_TILE + 2 * DEMOSAIC_HALO)
+
+// bilinear neighbours of a cfa position
+struct bilinear_code {
 	struct {
-		struct offset_t offset[9];
-        int count_0;
-        int count_1;
-        int count_2;
-        int count_3;
-	} code[16][16], *codep;
+		int pos;	// offset of the neighbour in the raw frame (0 if it is of the same color)
+		int color;
+	} offset[9];
+	int count[4];	// neighbours of each color
+};
+
+/*
+   This algorithm is officially called:
 
-	struct offset_t *ip;
+   "Interpolation using a Threshold-based variable number of gradients"
 
-	int i, x, y, row, col, color, c;
-	float *data, *r_data, *g_data, *b_data;
-	float fsum[4];
-	unsigned filters = fr->rmeta.color_matrix;
+   described in http://scien.stanford.edu/class/psych221/projects/99/tingchen/algodep/vargra.html
 
-	float wbr = 1.0, wbg = 1.0, wbgp = 1.0, wbb = 1.0;
-	if (P_INT(CCDRED_WHITEBAL_METHOD) == PAR_WHITEBAL_METHOD_CAMERA) {
-        wbr  = fr->rmeta.wbr;
-        wbg  = fr->rmeta.wbg;
-        wbgp = fr->rmeta.wbgp;
-        wbb  = fr->rmeta.wbb;
-	}
+   I've extended the basic idea to work with non-Bayer filter arrays.
+   Gradients are numbered clockwise from NW=0 to W=7.
+*/
+
+// vng gradients of a cfa position
+struct vng_code {
+	struct gradient_t {
+		int pixel1;	// raw frame offsets of the pixel pair
+		int pixel2;
+		int weight;
+		unsigned char direction[4];  //any pair can be a part of at most 4 gradients
+	} gradient[64];
+	int radius1px[8];	// tile offsets of the neighbour in each direction
+	int radius2px[8];	// and of the same color pixel beyond it, or 0
+};
+
+struct demosaic_job {
+	struct ccd_frame *fr;
+	int method;
+	unsigned filters;
+	float wb[4];	// white balance of the four cfa colors
+	struct bilinear_code bl[16][16];
+	struct vng_code *vng;	// (VNG_PROW + 1) * (VNG_PCOL + 1) codes
+};
+
+#define VNG_PROW 7
+#define VNG_PCOL 1
+
+#define FCLIP(x) ((x) > 65535 ? 65535 : (x) < 0 ? 0 : x)
+
+static void bilinear_codes(struct demosaic_job *job)
+{
+	unsigned filters = job->filters;
+	int x, y, row, col, color, c;
 
 	/* build 16x16 grid of offsets */
 	for (row=0; row < 16; row++) {
 		for (col=0; col < 16; col++) {
-			codep = &code[row][col];
-			ip = codep->offset;
+			struct bilinear_code *codep = &job->bl[row][col];
+			int i = 0;
 
-            int sum[4] = { 0 };
+			memset(codep->count, 0, sizeof(codep->count));
 
 			c = FC(row, col);
 			for (y=-1; y <= 1; y++) {
 				for (x=-1; x <= 1; x++) {
 					color = FC(row+y,col+x);
-					if(color == c) {
-						ip->pos = 0;
-					} else {
-						ip->pos = (fr->w*y + x);
-					}
-					ip->color = color;
-					ip++;
-					sum[color]++;
+					codep->offset[i].pos = (color == c) ? 0 : job->fr->w * y + x;
+					codep->offset[i].color = color;
+					codep->count[color]++;
+					i++;
 				}
 			}
-            codep->count_0 = sum[0];
-            codep->count_1 = sum[1];
-            codep->count_2 = sum[2];
-            codep->count_3 = sum[3];
-        }
-	}
-    data = (float *)fr->dat + fr->w;
-    r_data = (float *)fr->rdat + fr->w;
-    g_data = (float *)fr->gdat + fr->w;
-    b_data = (float *)fr->bdat + fr->w;
-	for (row=1; row < fr->h-1; row++) {
-		data++;
-		r_data++; g_data++; b_data++;
-		for (col=1; col < fr->w-1; col++) {
-			codep = &code[row & 15][col & 15];
-			ip = codep->offset;
-			fsum[0] = 0; fsum[1] = 0; fsum[2] = 0; fsum[3] = 0;
-			for (i = 0; i < 9; i++) {
-				fsum[ip->color] += *(data + ip->pos);
-				ip++;
-			}
-            float p;
-            p = wbr * fsum[0] / codep->count_0;
-            if (codep->count_1) p = wbg * fsum[1] / codep->count_1;
-            p = wbb * fsum[2] / codep->count_2;
-            if (codep->count_3) p = wbb * fsum[3] / codep->count_3;
-
-            *r_data++ = wbr * fsum[0] / codep->count_0;
-            *g_data++ = (wbg * fsum[1] + wbgp * fsum[3]) / (codep->count_1 + codep->count_3);
-            *b_data++ = wbb * fsum[2] / codep->count_2;
-
-			data++;
 		}
-        data++;
-        r_data++; g_data++; b_data++;
 	}
-	return 0;
 }
 
-/*
-   This algorithm is officially called:
-
-   "Interpolation using a Threshold-based variable number of gradients"
-
-   described in http://scien.stanford.edu/class/psych221/projects/99/tingchen/algodep/vargra.html
-
-   I've extended the basic idea to work with non-Bayer filter arrays.
-   Gradients are numbered clockwise from NW=0 to W=7.
-*/
-
-#define FCLIP(x) ((x) > 65535 ? 65535 : (x) < 0 ? 0 : x)
-
-static int demosaic_vng(struct ccd_frame *fr)
+static int vng_codes(struct demosaic_job *job)
 {
-	struct gradient_t {
-		int pixel1;
-		int pixel2;
-		int weight;
-		unsigned char direction[4];  //any pair can be a part of at most 4 gradients
-	} *ip;
-	struct code_t {
-		struct gradient_t gradient[64];
-		int radius1px[8];
-		int radius2px[8];
-  	} *code[16][16], *codep, *code_alloc;
 	static const struct {
 		signed char y1;
 		signed char x1;
@@ -241,162 +203,329 @@ static int demosaic_vng(struct ccd_frame *fr)
 		{+1,-1,+1,+1,0,0x88}, {+1,+0,+1,+2,0,0x08}, {+1,+0,+2,-1,0,0x40},
 		{+1,+0,+2,+1,0,0x10}
 	};
-	struct {
+	static const struct {
 		signed char y;
 		signed char x;
 	} octant[] = { {-1,-1}, {-1,0}, {-1,+1}, {0,+1}, {+1,+1}, {+1,0}, {+1,-1}, {0,-1} };
 
-    int prow=7, pcol=1, gmin, gmax;
-	int row, col, t, color, diag;
-	int g, diff, thold, num, c, i;
-	int offset;
-	float *rgb_data[3];
-	unsigned filters = fr->rmeta.color_matrix;
-	float *queue[3][5];
-
-	/* queue is used to store the past 3 lines of changes.  The 1st row in the queue
-	   is written back to the image after each line is processed.  This is needed so
-	   that we don't use values we just modified when computing gradients for the
-	   following line (the gradient calculation uses the current +/-2 lines
-	*/
-	for (c = 0; c < 3; c++) {
-		queue[c][4] = (float *)malloc(fr->w * 3 * sizeof(float));
-		queue[c][0] = queue[c][4];
-		queue[c][1] = queue[c][4] + 1 * fr->w;
-		queue[c][2] = queue[c][4] + 2 * fr->w;
-		queue[c][3] = queue[c][4] + 3 * fr->w;
-	}
+	unsigned filters = job->filters;
+	int row, col, t, g, i, color, diag;
+	int w = job->fr->w;
 
-	/* run bilinear interpolation to pre-populate rgb data.  This is critical to getting
-	   accurate gradient colors.  Note that since the bilinear filter applies the
-	   white-balance, there is no need to deal with it anywhere in this code
-	*/
-	demosaic_bilinear(fr);
+	job->vng = malloc(sizeof(struct vng_code) * (VNG_PROW + 1) * (VNG_PCOL + 1));
+	if (job->vng == NULL) return -1;
 
-	code_alloc = (struct code_t *)malloc(sizeof(struct code_t) * (prow + 1) * (pcol + 1));
 	/* Precalculate for VNG */
-	for (row=0; row <= prow; row++) {
-		for (col=0; col <= pcol; col++) {
-			code[row][col] = code_alloc + (row * pcol + col);
-			ip = code[row][col]->gradient;
-            for (cp = terms, t = 0; t < 64; t++, cp++) {
-                color = FC(row + cp->y1, col + cp->x1);
-                if (FC(row + cp->y2, col + cp->x2) != color) continue;
-
-                diag = (FC(row, col +1 ) == color && FC(row + 1, col) == color) ? 2:1;
-                if (abs(cp->y1 - cp->y2) == diag && abs(cp->x1 - cp->x2) == diag) continue;
-
-                ip->pixel1 = cp->y1 * fr->w + cp->x1;
-                ip->pixel2 = cp->y2 * fr->w + cp->x2;
+	for (row=0; row <= VNG_PROW; row++) {
+		for (col=0; col <= VNG_PCOL; col++) {
+			struct vng_code *codep = job->vng + row * (VNG_PCOL + 1) + col;
+			struct gradient_t *ip = codep->gradient;
+
+			for (cp = terms, t = 0; t < 64; t++, cp++) {
+				color = FC(row + cp->y1, col + cp->x1);
+				if (FC(row + cp->y2, col + cp->x2) != color) continue;
+
+				diag = (FC(row, col +1 ) == color && FC(row + 1, col) == color) ? 2:1;
+				if (abs(cp->y1 - cp->y2) == diag && abs(cp->x1 - cp->x2) == diag) continue;
+
+				ip->pixel1 = cp->y1 * w + cp->x1;
+				ip->pixel2 = cp->y2 * w + cp->x2;
 				ip->weight = cp->weight;
 				for (i=0, g=0; g < 8; g++) {
-                    if (cp->gradients & (1 << g))
-                        ip->direction[i++] = g;
+					if (cp->gradients & (1 << g))
+						ip->direction[i++] = g;
 					ip->direction[i] = -1;
 				}
 				ip++;
 			}
 			/* Mark the end of the used gradients */
-            ip->pixel1 = INT_MAX;
+			ip->pixel1 = INT_MAX;
 			color = FC(row,col);
 
 			/* determine the location of the pixel to use if a gradient is selected
 			  octant contains the 8 pixels immediately surrounding the current one
 			*/
 			for (g=0; g < 8; g++) {
-				code[row][col]->radius1px[g] = (octant[g].y * fr->w + octant[g].x);
+				codep->radius1px[g] = octant[g].y * TILE_STRIDE + octant[g].x;
 				if (FC(row+octant[g].y,col+octant[g].x) != color
 				    && FC(row+octant[g].y*2,col+octant[g].x*2) == color)
 				{
-					code[row][col]->radius2px[g] = 2 * code[row][col]->radius1px[g];
+					codep->radius2px[g] = 2 * codep->radius1px[g];
 				} else {
-					code[row][col]->radius2px[g] = 0;
+					codep->radius2px[g] = 0;
 				}
 			}
 		}
 	}
-	rgb_data[0] = (float *)fr->rdat + 2 * fr->w;
-	rgb_data[1] = (float *)fr->gdat + 2 * fr->w;
-	rgb_data[2] = (float *)fr->bdat + 2 * fr->w;
-
-	/* Do VNG interpolation */
-	for (row=2; row < fr->h-2; row++) {
-		for (col=2; col < fr->w-2; col++) {
-			offset = row * fr->w + col;
-			codep = code[row & prow][col & pcol];
-			ip = codep->gradient;
-
-            int gval[8] = { 0 };
-
-			/* Calculate gradients */
-			while (ip->pixel1 != INT_MAX) {
-                diff = fabs(*((float *)fr->dat + offset + ip->pixel1) - *((float *)fr->dat + offset + ip->pixel2)) * (1 + ip->weight);
-                for(i = 0; ip->direction[i] != (unsigned char) -1; i++) {
-					gval[ip->direction[i]] += diff;
-				}
-				ip++;
-			}
+	return 0;
+}
 
-			/* Choose a threshold */
-			gmin = gmax = gval[0];
-			for (g=1; g < 8; g++) {
-				if (gmin > gval[g])
-					gmin = gval[g];
-				if (gmax < gval[g])
-					gmax = gval[g];
-			}
+/* bilinear rgb of the pixel at (row, col), which is not on the frame edge */
+static inline void bilinear_pixel(struct demosaic_job *job, int row, int col, float *r, float *g, float *b)
+{
+	struct bilinear_code *codep = &job->bl[row & 15][col & 15];
+	float *data = (float *)job->fr->dat + row * job->fr->w + col;
+	float fsum[4] = { 0, 0, 0, 0 };
+	int i;
 
-			if (gmax == 0) {
-				/* use linear interpolation value */
-				continue;
-			}
-			thold = gmin + (gmax >> 1);
+	for (i = 0; i < 9; i++)
+		fsum[codep->offset[i].color] += *(data + codep->offset[i].pos);
 
-            int sum[4] = { 0 };
+	*r = job->wb[0] * fsum[0] / codep->count[0];
+	*g = (job->wb[1] * fsum[1] + job->wb[3] * fsum[3]) / (codep->count[1] + codep->count[3]);
+	*b = job->wb[2] * fsum[2] / codep->count[2];
+}
 
-			color = FC(row,col);
+/* vng interpolation of the pixel at (row, col), at least 2 pixels in from the
+ * frame edges; rgb_data point at the pixel in the tile's bilinear planes */
+static inline void vng_pixel(struct demosaic_job *job, int row, int col, float **rgb_data, float *out)
+{
+	unsigned filters = job->filters;
+	struct vng_code *codep = job->vng + (row & VNG_PROW) * (VNG_PCOL + 1) + (col & VNG_PCOL);
+	struct gradient_t *ip = codep->gradient;
+	float *dat = (float *)job->fr->dat + row * job->fr->w + col;
+	int gval[8] = { 0 };
+	int gmin, gmax, thold, diff, num, g, c, i, t;
+
+	/* Calculate gradients */
+	while (ip->pixel1 != INT_MAX) {
+		diff = fabs(*(dat + ip->pixel1) - *(dat + ip->pixel2)) * (1 + ip->weight);
+		for(i = 0; ip->direction[i] != (unsigned char) -1; i++) {
+			gval[ip->direction[i]] += diff;
+		}
+		ip++;
+	}
 
-			/* Average the neighbors */
-			for (num=g=0; g < 8; g++) {
-				if (gval[g] <= thold) {
-					for(c = 0; c < 3; c++) {
-						if (c == color &&  codep->radius2px[g])
-							sum[c] += (*(rgb_data[c] + offset)
-							           + *(rgb_data[c] + offset + codep->radius2px[g])
-							          ) / 2;
-						else
-							sum[c] += *(rgb_data[c] + offset + codep->radius1px[g]);
-					}
-					num++;
-				}
-			}
-			/* Save to buffer */
-			for (c=0; c < 3; c++) {
-				t = *((float *)rgb_data[color] + offset);
-				if (c != color) {
-					queue[c][2][col] = FCLIP(t + (sum[c] - sum[color]) / num);
-				} else {
-					queue[c][2][col] = FCLIP(t);
-				}
+	/* Choose a threshold */
+	gmin = gmax = gval[0];
+	for (g=1; g < 8; g++) {
+		if (gmin > gval[g])
+			gmin = gval[g];
+		if (gmax < gval[g])
+			gmax = gval[g];
+	}
+
+	if (gmax == 0) {
+		/* use linear interpolation value */
+		for (c = 0; c < 3; c++)
+			out[c] = *rgb_data[c];
+		return;
+	}
+	thold = gmin + (gmax >> 1);
+
+	int sum[4] = { 0 };
+
+	int color = FC(row,col);
+
+	/* Average the neighbors */
+	for (num=g=0; g < 8; g++) {
+		if (gval[g] <= thold) {
+			for(c = 0; c < 3; c++) {
+				if (c == color &&  codep->radius2px[g])
+					sum[c] += (*(rgb_data[c])
+					           + *(rgb_data[c] + codep->radius2px[g])
+					          ) / 2;
+				else
+					sum[c] += *(rgb_data[c] + codep->radius1px[g]);
 			}
+			num++;
 		}
-		/* Write head of queue to image */
-		for (c = 0; c < 3; c++) {
-			if (row > 3)
-				memcpy(rgb_data[c] + (row-2) * fr->w + 2, queue[c][0] + 2, (fr->w - 4) * sizeof(float));
-			for (i = 0; i < 4; i++)
-				queue[c][(i - 1) & 3] = queue[c][i];
+	}
+
+	t = *rgb_data[color];
+	for (c=0; c < 3; c++) {
+		if (c != color) {
+			out[c] = FCLIP(t + (sum[c] - sum[color]) / num);
+		} else {
+			out[c] = FCLIP(t);
 		}
 	}
-	for (c = 0; c < 3; c++) {
-		memcpy(rgb_data[c] + (row - 2) * fr->w +2, queue[c][0] + 2, (fr->w - 4) * sizeof(float));
-		memcpy(rgb_data[c] + (row - 1) * fr->w +2, queue[c][2] + 2, (fr->w - 4) * sizeof(float));
-		free(queue[c][4]);
+}
+
+/* bilinear interpolation of columns [x0, x1) of a frame row into the rgb
+ * planes at out (indexed by column). Pixels on the frame edge take the values
+ * of their nearest inner neighbour */
+static void bilinear_row(struct demosaic_job *job, int row, int x0, int x1, float **out)
+{
+	int w = job->fr->w, h = job->fr->h;
+	int r = (row < 1) ? 1 : (row > h - 2) ? h - 2 : row;
+	int col;
+
+	for (col = x0; col < x1; col++) {
+		int cl = (col < 1) ? 1 : (col > w - 2) ? w - 2 : col;
+		bilinear_pixel(job, r, cl, out[0] + col, out[1] + col, out[2] + col);
+	}
+}
+
+static int bilinear_rows(void *data, int plane, int y0, int y1)
+{
+	struct demosaic_job *job = data;
+	struct ccd_frame *fr = job->fr;
+	int row;
+
+	for (row = y0; row < y1; row++) {
+		float *out[3] = { (float *)fr->rdat + row * fr->w,
+				  (float *)fr->gdat + row * fr->w,
+				  (float *)fr->bdat + row * fr->w };
+		bilinear_row(job, row, 0, fr->w, out);
 	}
-	free (code_alloc);
 	return 0;
 }
 
+/* vng demosaic of the tile of rows [y0, y1) and columns [x0, x1): the bilinear
+ * values of the tile and a halo around it go to the tile planes, which vng
+ * then reads from. Pixels within 2 of the frame edge keep the bilinear values */
+static void vng_tile(struct demosaic_job *job, int y0, int y1, int x0, int x1, float **tile)
+{
+	struct ccd_frame *fr = job->fr;
+	int w = fr->w, h = fr->h;
+	int ty0 = (y0 - DEMOSAIC_HALO < 0) ? 0 : y0 - DEMOSAIC_HALO;
+	int ty1 = (y1 + DEMOSAIC_HALO > h) ? h : y1 + DEMOSAIC_HALO;
+	int tx0 = (x0 - DEMOSAIC_HALO < 0) ? 0 : x0 - DEMOSAIC_HALO;
+	int tx1 = (x1 + DEMOSAIC_HALO > w) ? w : x1 + DEMOSAIC_HALO;
+	float *out[3] = { fr->rdat, fr->gdat, fr->bdat };
+	int row, col, c;
+
+	// tile planes are indexed from (y0 - DEMOSAIC_HALO, x0 - DEMOSAIC_HALO)
+	int tofs = DEMOSAIC_HALO * TILE_STRIDE + DEMOSAIC_HALO - y0 * TILE_STRIDE - x0;
+
+	for (row = ty0; row < ty1; row++) {
+		float *trow[3];
+		for (c = 0; c < 3; c++)
+			trow[c] = tile[c] + tofs + row * TILE_STRIDE;
+		bilinear_row(job, row, tx0, tx1, trow);
+	}
+
+	for (row = y0; row < y1; row++) {
+		for (col = x0; col < x1; col++) {
+			int t = tofs + row * TILE_STRIDE + col;
+			int o = row * w + col;
+
+			if (row >= 2 && row < h - 2 && col >= 2 && col < w - 2) {
+				float *rgb_data[3] = { tile[0] + t, tile[1] + t, tile[2] + t };
+				float v[3];
+				vng_pixel(job, row, col, rgb_data, v);
+				for (c = 0; c < 3; c++) out[c][o] = v[c];
+			} else {
+				for (c = 0; c < 3; c++) out[c][o] = tile[c][t];
+			}
+		}
+	}
+}
+
+static int vng_rows(void *data, int plane, int y0, int y1)
+{
+	struct demosaic_job *job = data;
+	float *tile[3];
+	int x0, c;
+
+	tile[0] = malloc(3 * TILE_STRIDE * TILE_STRIDE * sizeof(float));
+	if (tile[0] == NULL) return -1;
+	for (c = 1; c < 3; c++)
+		tile[c] = tile[0] + c * TILE_STRIDE * TILE_STRIDE;
+
+	for (x0 = 0; x0 < job->fr->w; x0 += DEMOSAIC_TILE) {
+		int x1 = (x0 + DEMOSAIC_TILE < job->fr->w) ? x0 + DEMOSAIC_TILE : job->fr->w;
+		vng_tile(job, y0, y1, x0, x1, tile);
+	}
+
+	free(tile[0]);
+	return 0;
+}
+
+/* superpixel: every 2x2 cfa cell gives one rgb value, set on all four pixels
+ * of the cell; the last row or column of an odd sized frame use the cell before */
+static int superpixel_rows(void *data, int plane, int y0, int y1)
+{
+	struct demosaic_job *job = data;
+	struct ccd_frame *fr = job->fr;
+	unsigned filters = job->filters;
+	float *dat = fr->dat;
+	float *out[3] = { fr->rdat, fr->gdat, fr->bdat };
+	int w = fr->w, h = fr->h;
+	int row, col, c;
+
+	for (row = y0; row < y1; row += 2) {
+		int cy = (row + 1 < h) ? row : row - 1;
+		int color[2][2][2]; // by column parity, of the four pixels of a cell
+		int dy, dx, px;
+
+		for (px = 0; px < 2; px++)
+			for (dy = 0; dy < 2; dy++)
+				for (dx = 0; dx < 2; dx++)
+					color[px][dy][dx] = FC(cy + dy, px + dx);
+
+		for (col = 0; col < w; col += 2) {
+			int cx = (col + 1 < w) ? col : col - 1;
+			float v[4] = { 0, 0, 0, 0 };
+			int cnt[4] = { 0, 0, 0, 0 };
+
+			for (dy = 0; dy < 2; dy++)
+				for (dx = 0; dx < 2; dx++) {
+					c = color[cx & 1][dy][dx];
+					v[c] += dat[(cy + dy) * w + cx + dx];
+					cnt[c]++;
+				}
+
+			float rgb[3] = { job->wb[0] * v[0] / cnt[0],
+					 (job->wb[1] * v[1] + job->wb[3] * v[3]) / (cnt[1] + cnt[3]),
+					 job->wb[2] * v[2] / cnt[2] };
+
+			for (dy = 0; dy < 2 && row + dy < y1; dy++)
+				for (dx = 0; dx < 2 && col + dx < w; dx++)
+					for (c = 0; c < 3; c++)
+						out[c][(row + dy) * w + col + dx] = rgb[c];
+		}
+	}
+	return 0;
+}
+
+/* demosaic the cfa data of fr into its (allocated) rgb planes with method
+ * (PAR_DEMOSAIC_METHOD_*), in bands of rows on the worker pool; vng further
+ * splits the bands into tiles. Return 0 for ok, -1 for error */
+static int demosaic_frame(struct ccd_frame *fr, int method)
+{
+	struct demosaic_job *job;
+	int ret;
+
+	if (fr->w < 3 || fr->h < 3) {
+		err_printf("demosaic: frame too small (%d x %d)\n", fr->w, fr->h);
+		return -1;
+	}
+
+	job = calloc(1, sizeof(struct demosaic_job));
+	if (job == NULL) return -1;
+
+	job->fr = fr;
+	job->method = method;
+	job->filters = fr->rmeta.color_matrix;
+	job->wb[0] = job->wb[1] = job->wb[2] = job->wb[3] = 1.0;
+	if (P_INT(CCDRED_WHITEBAL_METHOD) == PAR_WHITEBAL_METHOD_CAMERA) {
+		job->wb[0] = fr->rmeta.wbr;
+		job->wb[1] = fr->rmeta.wbg;
+		job->wb[2] = fr->rmeta.wbb;
+		job->wb[3] = fr->rmeta.wbgp;
+	}
+
+	if (method == PAR_DEMOSAIC_METHOD_SUPERPIXEL) {
+		ret = parallel_rows(fr->h, 1, DEMOSAIC_TILE, superpixel_rows, job, NULL, NULL);
+	} else if (method == PAR_DEMOSAIC_METHOD_VNG) {
+		bilinear_codes(job);
+		if (vng_codes(job)) {
+			free(job);
+			return -1;
+		}
+		ret = parallel_rows(fr->h, 1, DEMOSAIC_TILE, vng_rows, job, NULL, NULL);
+	} else {
+		bilinear_codes(job);
+		ret = parallel_rows(fr->h, 1, DEMOSAIC_TILE, bilinear_rows, job, NULL, NULL);
+	}
+
+	free(job->vng);
+	free(job);
+	return ret;
+}
+
 int bayer_interpolate(struct ccd_frame *fr)
 {
 	int ret;
@@ -418,12 +547,17 @@ int bayer_interpolate(struct ccd_frame *fr)
     switch(P_INT(CCDRED_DEMOSAIC_METHOD)) {
 	case PAR_DEMOSAIC_METHOD_BILINEAR:
 		d1_printf("demosaic: using bilinear interpolation for demosaicing\n");
-		ret = demosaic_bilinear(fr);
+		ret = demosaic_frame(fr, PAR_DEMOSAIC_METHOD_BILINEAR);
 		break;
 
 	case PAR_DEMOSAIC_METHOD_VNG:
 		d1_printf("using vng for demosaicing\n");
-		ret = demosaic_vng(fr);
+		ret = demosaic_frame(fr, PAR_DEMOSAIC_METHOD_VNG);
+		break;
+
+	case PAR_DEMOSAIC_METHOD_SUPERPIXEL:
+		d1_printf("demosaic: using 2x2 superpixels\n");
+		ret = demosaic_frame(fr, PAR_DEMOSAIC_METHOD_SUPERPIXEL);
 		break;
 
 	default:
@@ -53,6 +53,7 @@
 #include "multiband.h"
 #include "query.h"
 #include "misc.h"
+#include "tycho2.h"
 
 static void show_usage(void) {
 	info_printf("%s", help_usage_page);
@@ -509,6 +510,33 @@ static int make_tycho_rcp(char *obj, double tycrcp_box, char *outf, double mag_l
     return res;
 }
 
+/* args: the ra, dec and radius (arcminutes) the tsv file was queried with */
+static int import_cds(char *fn, char **args, int nargs)
+{
+    double ra, dec, radius;
+    char *endp;
+
+    if (nargs < 3) {
+        err_printf("Please give the ra, dec and radius the file was queried with\n");
+        return 1;
+    }
+
+    int d_type = dms_to_degrees(args[0], &ra);
+    if (d_type < 0 || dms_to_degrees(args[1], &dec) < 0) {
+        err_printf("Bad position %s %s\n", args[0], args[1]);
+        return 1;
+    }
+    if (d_type == DMS_SEXA) ra *= 15;
+
+    radius = strtod(args[2], &endp);
+    if (endp == args[2] || radius <= 0) {
+        err_printf("Bad radius %s\n", args[2]);
+        return 1;
+    }
+
+    return (query_cache_import(fn, ra, dec, radius) < 0) ? 1 : 0;
+}
+
 static int cat_rcp(char *obj, unsigned int catalog, char *outf)
 {
     if ((obj == NULL) || (*obj == 0)) {
@@ -528,7 +556,10 @@ static int cat_rcp(char *obj, unsigned int catalog, char *outf)
 
 
 
-int extract_bad_pixels(char *badpix, char *outf)
+/* build a bad pixel map from the dark frame badpix, or from the stack of
+   badpix and the nmore frames in more, so pixels hit in only some of the
+   frames are left out */
+int extract_bad_pixels(char *badpix, char **more, int nmore, char *outf)
 {
     if (outf == NULL) {
         printf("extract_bad_pixels: no output file\n");
@@ -536,24 +567,48 @@ int extract_bad_pixels(char *badpix, char *outf)
     }
 
 	struct bad_pix_map *map;
+    int i, n = 0, ret = -1;
 
-    struct image_file *imf = imf_new(NULL, badpix);
+    struct image_file **imf = calloc(nmore + 1, sizeof(struct image_file *));
+    struct ccd_frame **frs = calloc(nmore + 1, sizeof(struct ccd_frame *));
+    if (imf == NULL || frs == NULL) {
+        err_printf("extract_bad_pixels: alloc error\n");
+        goto end;
+    }
+
+    for (i = 0; i <= nmore; i++) {
+        char *fn = (i == 0) ? badpix : more[i - 1];
+
+d3_printf("gcx.extract_bad_pixels %s\n", fn);
+        imf[n] = imf_new(NULL, fn);
+        if (imf[n] == NULL)
+            goto end;
+        if (imf_load_frame(imf[n]) < 0) {
+            imf_release(imf[n]);
+            goto end;
+        }
+        frs[n] = imf[n]->fr;
+        n++;
+    }
 
-d3_printf("gcx.extract_bad_pixels %s\n", badpix);
-    if (imf_load_frame(imf) >= 0) {
 //        map = calloc(1, sizeof(struct bad_pix_map));
-        map = bad_pix_map_new(outf);
-        if (map) {
-            if (find_bad_pixels(map, imf->fr, P_DBL(CCDRED_BADPIX_SIGMAS)) == 0)
-                save_bad_pix(map);
+    map = bad_pix_map_new(outf);
+    if (map) {
+        if (find_bad_pixels_stack(map, frs, n, P_DBL(CCDRED_BADPIX_SIGMAS)) == 0) {
+            save_bad_pix(map);
+            ret = 0;
         }
-        free_bad_pix(map);
+    }
+    free_bad_pix(map);
 
 //        imf_release_frame(imf, "extract_bad_pixels");
-    }
-    imf_release(imf);
+end:
+    for (i = 0; i < n; i++)
+        imf_release(imf[i]);
+    free(imf);
+    free(frs);
 
-    return 0;
+    return ret;
 }
 
 int extract_sources(char *starf, char *outf)
@@ -729,6 +784,8 @@ int fake_main(int ac, char **av)
 		{"set-target", required_argument, NULL, '_'},
 		{"make-tycho-rcp", required_argument, NULL, ']'},
 		{"make-cat-rcp", required_argument, NULL, '>'},
+		{"make-tycho2-index", required_argument, NULL, '{'},
+		{"import-cds", required_argument, NULL, '}'},
 		{"wcs-fit", no_argument, NULL, 'w'},
 
 		{"rep-to-table", required_argument, NULL, 'T'},
@@ -807,12 +864,23 @@ int fake_main(int ac, char **av)
 
             case 'e': main_ret = extract_sources(optarg, outf); goto exit_main;
 
-            case 'X': main_ret = extract_bad_pixels(optarg, outf); goto exit_main;
+            case 'X': { // more darks for the stack may follow
+                int nmore = 0;
+                while (optind + nmore < ac && av[optind + nmore][0] != '-') nmore++;
+                main_ret = extract_bad_pixels(optarg, av + optind, nmore, outf);
+                goto exit_main;
+            }
 
             case '^': main_ret = mb_reduce(optarg, outf); goto exit_main;
 
             case 'C': main_ret = print_scint_table(optarg); goto exit_main;  // print scintillation table for aperture
 
+            case '{': main_ret = tycho2_make_tiles(optarg); goto exit_main;
+
+            case '}': // ra, dec and radius follow
+                main_ret = import_cds(optarg, av + optind, ac - optind);
+                goto exit_main;
+
             case '4': main_ret = catalog_file_convert(optarg, outf, mag_limit); goto exit_main;
 
             case '2': if (! (optarg[0] == '-' && optarg[1] == 0) ) main_ret = recipe_file_convert(optarg, outf); goto exit_main;
@@ -16,6 +16,18 @@
 			     output = lut[input], cuts ignored */
 #define LUT_MODE_FULL 0   /* output = lut[(input - lcut)/(hcut - lcut) * LUT_SIZE] */
 
+/* zoomed-out display pyramid: level k holds the frame averaged over 2^k x 2^k blocks */
+#define MIP_LEVELS 4 /* down to 1/16 (MAX_ZOOM) */
+#define MIP_MAX_BYTES (512 << 20) /* levels that would take the pyramid past this are not built */
+
+struct mip_level {
+	float *dat;
+	int w;
+	int h;
+};
+
+struct tile_cache;
+
 /* this structure describes a channel (a frame and it's associated intesity mapping) */
 struct image_channel {
 	int ref_count; /* reference count for map */
@@ -41,6 +53,8 @@ struct image_channel {
 	struct map_cache *cache; /* image cache */
 	int color;		/* display a color image */
     int x, y, width, height; /* pixel values for displayed area */
+	struct mip_level mip[MIP_LEVELS + 1]; /* zoom-out pyramid of fr, built as needed (mip[0] unused) */
+	struct tile_cache *tiles; /* display tiles rendered in the background */
 };
 
 /* we keep a cache of the already trasformed image for quick expose
@@ -92,6 +106,7 @@ extern gboolean image_expose_cb(GtkWidget *widget, GdkEventExpose *event, gpoint
 extern void frame_to_channel(struct ccd_frame *fr, gpointer window, char *chname);
 extern void ref_image_channel(struct image_channel *channel);
 extern void release_image_channel(struct image_channel *channel);
+extern void image_channel_data_changed(struct image_channel *channel);
 extern int channel_to_pnm_file(struct image_channel *channel, GtkWidget *window, char *fn, int is_16bit);
 
 extern struct map_cache *new_map_cache(struct map_cache *cache, int size, int type);
@@ -72,6 +72,14 @@ char help_usage_page[] =
 "    --make-tycho-rcp <radius>      Create a recipe file for the object specified\n"
 "                                     with --object using tycho2 stars in a box\n"
 "                                     radius arcminutes around the object\n"
+"    --make-tycho2-index <tyc2.dat> Make the tiled index the tycho2 searches\n"
+"                                     use, next to the catalog file. It is\n"
+"                                     otherwise made on the first search\n"
+"    --import-cds <tsv_file> <ra> <dec> <radius>\n"
+"                                   Put the stars of a saved vizquery tsv output\n"
+"                                     in the catalog query cache. The output must\n"
+"                                     hold all the stars brighter than faintestmag\n"
+"                                     within radius arcminutes of ra, dec\n"
 //"    --convert-rcp <recipe_file>    Convert a recipe to the new format\n"
 //"                                     If an output file name is not specified\n"
 //"                                     (with the '-o' argument), stdout is used\n"
@@ -105,6 +113,10 @@ char help_usage_page[] =
 "-a, --align <align_ref_frame>      Set the alignment reference frame\n"
 "                                      / align frames\n"
 "-B, --badpix <bad_pixel_file>      Set the bad pixels map file\n"
+"-X, --extract-badpix <dark> [<dark>...]\n"
+"                                   Find the bad pixels of a dark frame, or of\n"
+"                                     a stack of darks, and save the map to the\n"
+"                                     file set with -o\n"
 "-A, --add-bias <bias>              Set a constant bias to add to all frames\n"
 "                                      / add a bias to frames\n" 
 "-M, --multiply <multiplier>        Set a constant to multiply all frames with\n" 
@@ -179,11 +179,12 @@ static void channel_cuts_action(struct image_channel *channel, int action)
 
 	switch(act) {
 	case CUTS_MINMAX:
-        if (!fr->stats.statsok) {
-			frame_stats(fr);
-		}
-        channel->lcut = fr->stats.min;
-        channel->hcut = fr->stats.max;
+    {
+        struct im_stats *st = frame_stats_sampled(fr, STATS_SAMPLE_STEP);
+        if (st == NULL) return;
+        channel->lcut = st->min;
+        channel->hcut = st->max;
+    }
 		break;
 	case CUTS_FLATTER:
 		span = span * CONTRAST_STEP;
@@ -227,11 +228,12 @@ d3_printf("invert is %d\n", channel->invert);
 	case CUTS_CONTRAST:
 		channel->avg_at = DEFAULT_AVG_AT;
 
-        if (!fr->stats.statsok) {
-			frame_stats(fr);
-		}
-        channel->davg = fr->stats.cavg;
-        channel->dsigma = fr->stats.csigma * 2;
+    {
+        struct im_stats *st = frame_stats_sampled(fr, STATS_SAMPLE_STEP);
+        if (st == NULL) return;
+        channel->davg = st->cavg;
+        channel->dsigma = st->csigma * 2;
+    }
 		if (val < 0)
 			val = 0;
 		if (val >= SIGMAS_VALS)
@@ -433,12 +435,16 @@ void stats_cb(gpointer window, guint action)
     struct ccd_frame *fr = window_get_current_frame(window);
     if (fr == NULL) return; /* no frame */
 
-    if (! fr->stats.statsok) frame_stats(fr);
+    struct im_stats *st = frame_stats_sampled(fr, STATS_SAMPLE_STEP);
+    if (st == NULL) {
+        release_frame(fr, "stats_cb");
+        return;
+    }
 
     double exptime; fits_get_double (fr, P_STR(FN_EXPTIME), &exptime);
 
     info_printf_sb2(window, "JDcenter %.6f Exp: %.3g Size: %d x %d cavg:%.1f csigma:%.1f min:%.1f max:%.1f",
-        frame_jdate(fr), exptime, fr->w, fr->h,	fr->stats.cavg, fr->stats.csigma, fr->stats.min, fr->stats.max );
+        frame_jdate(fr), exptime, fr->w, fr->h,	st->cavg, st->csigma, st->min, st->max );
 
     release_frame(fr, "stats_cb");
 }
@@ -757,12 +763,13 @@ static void plot_curve(GtkWidget *darea, GdkRectangle *area, struct image_channe
 static void draw_histogram(GtkWidget *darea, GdkRectangle *area, struct image_channel *channel,
             double low, double high, int logh)
 {
-    if (!channel->fr->stats.statsok) {
+    struct im_stats *st = frame_stats_sampled(channel->fr, STATS_SAMPLE_STEP);
+    if (st == NULL) {
         err_printf("draw_histogram: no stats\n");
         return;
     }
 
-    struct im_histogram *hist = &(channel->fr->stats.hist);
+    struct im_histogram *hist = &(st->hist);
     double hbinsize = (hist->end - hist->st) / hist->hsize;
     double dbinsize = (high - low) / darea->allocation.width;
 
@@ -254,6 +254,13 @@ void init_ptable(void)
     set_par_description(QUERY_MAX_RADIUS, "The maximum radius (minutes of arc) to search for catalog stars.");
     add_par_double(QUERY_FAINTEST_MAG, PAR_QUERY, PREC_1, "faintestmag", "Faintest Magnitude to retrieve from Vizier", 20.0);
     set_par_description(QUERY_FAINTEST_MAG, "The faintest star selecting from Vizier");
+    add_par_int(QUERY_CACHE, PAR_QUERY, FMT_BOOL, "cache", "Cache catalog queries", 1);
+    set_par_description(QUERY_CACHE, "Keep the stars downloaded from Vizier in sky tiles under the user cache "
+                        "directory, and answer later queries of the same catalog and faintest magnitude "
+                        "from them when they cover the whole field.");
+    add_par_int(QUERY_OFFLINE, PAR_QUERY, FMT_BOOL, "offline", "Work offline", 0);
+    set_par_description(QUERY_OFFLINE, "Never run vizquery; catalog queries return the cached stars "
+                        "only, even when the cache covers just part of the field.");
 
 	add_par_string(QUERY_WGET, PAR_QUERY, 0, "wget", "Wget command", "wget");
 	set_par_description(QUERY_WGET, "Path to the wget program.");
@@ -703,7 +710,8 @@ void init_ptable(void)
 			    "pathname of the toplevel gsc directory."
 			    "Make sure all subdirs and files names use lower case.");
     add_par_string(FILE_TYCHO2_PATH, PAR_FILES, 0, "tycho2_path", "Tycho2 location", "/usr/share/gcx/catalogs/tycho2");
-    set_par_description(FILE_TYCHO2_PATH, "Full pathname of the tycho2 catalog file.");
+    set_par_description(FILE_TYCHO2_PATH, "Full pathname of the tycho2 catalog file. "
+			    "A tiled index of it (tycho2.tiles) is made in the same directory on first use.");
 
     add_par_string(FILE_CATALOG_PATH, PAR_FILES, 0, "catalog_path", "Catalog files", "/usr/share/gcx/catalogs/*.gcx");
 	set_par_description(FILE_CATALOG_PATH,
@@ -739,6 +747,10 @@ void init_ptable(void)
 	set_par_description(FILE_WESTERN_LONGITUDES,
 			    "Interpret fits header longitudes as western, rather than "
                 "eastern. Report file longitudes are always western. ");
+    add_par_int(FILE_FLOAT_FITS, PAR_FILES, FMT_BOOL, "float_fits", "Save float FITS", 0);
+	set_par_description(FILE_FLOAT_FITS,
+			    "Save frames as 32-bit floating point fits files (BITPIX -32), "
+                "rather than rescaling them to 16-bit integers.");
 
 
 #define TAB_FORMAT_DEF "name ra dec mjd smag \"v\" flags"
@@ -1050,6 +1062,26 @@ void init_ptable(void)
 		    "Clipping sigmas for mmedian and k-s", 2);
 	add_par_int(CCDRED_AUTO, PAR_CCDRED, FMT_BOOL, "auto",
 		    "Run CCD reductions automatically on frame display", 1);
+	add_par_int(CCDRED_THREADS, PAR_CCDRED, 0, "threads",
+		    "Worker threads", 0);
+	set_par_description(CCDRED_THREADS,
+			    "Number of worker threads used for stacking and other "
+			    "frame operations. 0 uses one thread per processor; "
+			    "1 processes frames on a single thread.");
+	add_par_int(CCDRED_STACK_MEMORY, PAR_CCDRED, 0, "stack_memory",
+		    "Stack from disk within (MB)", 0);
+	set_par_description(CCDRED_STACK_MEMORY,
+			    "When non-zero, batch stacking reads the frames from their "
+			    "fits files in strips of rows that fit in this many megabytes, "
+			    "instead of loading every frame. The frames must already be "
+			    "reduced and saved uncompressed; there is no limit on their number.");
+	add_par_int(CCDRED_ALIGN_RESAMPLE, PAR_CCDRED, 0, "align_resample",
+		    "Interpolation used for aligning frames", PAR_RESAMPLE_METHOD_BILINEAR);
+	set_par_choices(CCDRED_ALIGN_RESAMPLE, resample_methods);
+	set_par_description(CCDRED_ALIGN_RESAMPLE,
+			    "Kernel used to interpolate frames when they are shifted and "
+			    "rotated into alignment. Bicubic and lanczos3 keep star profiles "
+			    "sharper than bilinear, at some extra cost.");
 
 	add_par_double(CCDRED_BADPIX_SIGMAS, PAR_CCDRED, 0, "badpix_sigmas",
 		       "Bad pixel sigmas", 12.0);
@@ -49,6 +49,8 @@ char * tele_types[] = PAR_CHOICE_TELE_TYPES;
 
 char * stack_methods[] = PAR_CHOICE_STACK_METHODS;
 
+char * resample_methods[] = PAR_CHOICE_RESAMPLE_METHODS;
+
 char * demosaic_methods[] = PAR_CHOICE_DEMOSAIC_METHODS;
 
 char * whitebal_methods[] = PAR_CHOICE_WHITEBAL_METHODS;
@@ -306,6 +306,7 @@ typedef enum {
 	FILE_UNSIGNED_FITS,
 	FILE_WESTERN_LONGITUDES,
 	FILE_DEFAULT_CFA,
+	FILE_FLOAT_FITS,
 
 	AP_R1 ,
 	AP_R2 ,
@@ -346,6 +347,9 @@ typedef enum {
 	CCDRED_SIGMAS,
 	CCDRED_ITER,
 	CCDRED_AUTO,
+	CCDRED_THREADS,
+	CCDRED_STACK_MEMORY,
+	CCDRED_ALIGN_RESAMPLE,
 
 	TELE_E_LIMIT,
 	TELE_E_LIMIT_EN,
@@ -393,6 +397,8 @@ typedef enum {
 	QUERY_MAX_RADIUS,
 	QUERY_MAX_STARS,
     QUERY_FAINTEST_MAG,
+    QUERY_CACHE,
+    QUERY_OFFLINE,
 	QUERY_WGET,
 	QUERY_SKYVIEW_RUNQUERY_URL,
 	QUERY_SKYVIEW_TEMPSPACE_URL,
@@ -442,10 +448,11 @@ enum {
 	PAR_TELE_TYPE_G11,
 };
 
-#define PAR_CHOICE_DEMOSAIC_METHODS {"bilinear", "vng", NULL}
+#define PAR_CHOICE_DEMOSAIC_METHODS {"bilinear", "vng", "superpixel", NULL}
 enum {
 	PAR_DEMOSAIC_METHOD_BILINEAR,
 	PAR_DEMOSAIC_METHOD_VNG,
+	PAR_DEMOSAIC_METHOD_SUPERPIXEL,
 };
 
 #define PAR_CHOICE_WHITEBAL_METHODS { "none", "camera", "user", NULL }
@@ -473,6 +480,15 @@ enum {
     PAR_STACK_METHOD_MEAN_MEDIAN
 };
 
+// in the order of the RESAMPLE_ kernels in ccd.h
+#define PAR_CHOICE_RESAMPLE_METHODS {"bilinear", "bicubic", "lanczos3", NULL}
+
+enum {
+	PAR_RESAMPLE_METHOD_BILINEAR,
+	PAR_RESAMPLE_METHOD_BICUBIC,
+	PAR_RESAMPLE_METHOD_LANCZOS3,
+};
+
 #define PAR_CHOICE_COLORS {"red", "orange", "yellow", "green", "cyan", \
 			"blue", "light_blue", "gray", "white", NULL}
 enum {
@@ -541,6 +557,8 @@ extern char * tele_types[];
 
 extern char * stack_methods[];
 
+extern char * resample_methods[];
+
 extern char * demosaic_methods[];
 
 extern char * whitebal_methods[];
@@ -172,7 +172,153 @@ int center_star(struct ccd_frame *fr, struct star *st, double max_ce)
 static int found = 0;
 char *rgb_filter_names[] = { NULL, NULL, "TR", "TG", "TB" };
 
-/* measure instrumental magnitudes for the stars in the stf. */
+/* what stf_aphot measures every star with */
+struct aphot_job {
+    struct ccd_frame *fr;
+    struct wcs *wcs;
+    struct ap_params *ap;
+    struct cat_star **stars;
+    char *filter;
+    gboolean dodiffam;
+    double ast_as_degrees;
+    double lat;
+    double lng;
+    double fam;
+    double scint;
+    double rm;
+};
+
+/* measure one catalog star; fr is the caller's own copy of the frame header,
+ * as the colour plane being measured is kept in fr->active_plane */
+static void stf_aphot_star(struct ccd_frame *fr, struct cat_star *cats, struct aphot_job *job)
+{
+    struct wcs *wcs = job->wcs;
+    struct ap_params *ap = job->ap;
+    char *filter = job->filter;
+
+    cats->flags &= ~CPHOT_MASK;
+
+    if (cats->gs && GUI_STAR(cats->gs)->flags & (STAR_DELETED | STAR_IGNORE)) {
+        cats->flags |= CPHOT_INVALID;
+        return;
+    }
+
+    double x, y;
+    cats_xypix(wcs, cats, &x, &y);
+
+    cats->pos[POS_X] = x;
+    cats->pos[POS_Y] = y;
+
+    cats->pos[CD_FRAC_X] = fabs(2 * x - fr->w) / fr->w;
+    cats->pos[CD_FRAC_Y] = fabs(2 * y - fr->h) / fr->h;
+
+//        if ( sqr (x - fr->w / 2) + sqr (y - fr->h / 2) > sqr (P_DBL(AP_MAX_STD_RADIUS)) * (sqr (fr->w / 2) + sqr (fr->h / 2)) ) return 0;
+
+    if (! star_in_frame (fr, x, y, job->rm)) {
+        cats->flags |= CPHOT_INVALID;
+        return;
+    }
+
+    if (job->dodiffam) {
+        cats->diffam = calculate_airmass (cats->ra, cats->dec, job->ast_as_degrees, job->lat, job->lng) - job->fam;
+        cats->flags |= INFO_DIFFAM;
+    }
+
+    struct star s = { 0 };
+    s.x = x;
+    s.y = y;
+    s.xerr = BIG_ERR;
+    s.yerr = BIG_ERR;
+    s.aph.scint = job->scint;
+
+    if (ap->center) {
+        if (center_star(fr, &s, P_DBL(AP_MAX_CENTER_ERR))) {
+            cats->flags |= CPHOT_NOT_FOUND;
+            return;
+        }
+        cats->flags |= CPHOT_CENTERED;
+    }
+
+//		ret = aperture_photometry(fr, &s, ap, NULL);
+    fr->active_plane = PLANE_NULL;
+
+    if (aphot_star(fr, &s, ap, NULL)) {
+        cats->flags |= CPHOT_INVALID;
+        return;
+    }
+
+    if ((cats->flags & CPHOT_CENTERED) && !(cats->flags & CATS_FLAG_ASTROMET) && P_INT(AP_MOVE_TARGETS)) {
+        wcs_worldpos(wcs, s.x, s.y, &cats->ra, &cats->dec);
+        cats->pos[POS_DX] = 0;
+        cats->pos[POS_DY] = 0;
+    } else {
+        cats->pos[POS_DX] = s.x - x;
+        cats->pos[POS_DY] = s.y - y;
+    }
+    cats->pos[POS_X] = s.x;
+    cats->pos[POS_Y] = s.y;
+    cats->pos[POS_XERR] = s.xerr * s.aph.star_err / s.aph.star; // how does this work ?
+    cats->pos[POS_YERR] = s.yerr * s.aph.star_err / s.aph.star;
+    cats->flags |= INFO_POS;
+
+    if (s.aph.flags & AP_STAR_SKIP) cats->flags |= CPHOT_BADPIX;
+    if (s.aph.flags & AP_BURNOUT) cats->flags |= CPHOT_BURNED;
+    if (s.aph.flags & AP_FAINT) cats->flags |= CPHOT_FAINT;
+
+    cats->noise[NOISE_SKY] = s.aph.sky_err * s.aph.star_all / s.aph.star;
+    cats->noise[NOISE_READ] = s.aph.rd_noise / s.aph.star;
+    cats->noise[NOISE_PHOTON] = s.aph.pshot_noise / s.aph.star;
+// try this
+// s.aph.scint = 1.5 * s.aph.pshot_noise / s.aph.star;
+    cats->noise[NOISE_SCINT] = s.aph.scint;
+    cats->flags |= INFO_NOISE;
+
+    cats->sky = s.aph.sky;
+    cats->flags |= INFO_SKY;
+
+//printf("stf_aphot %s %d star_err %.5g flux_err %.5g sky_err %.5g\n", cats->name, cats->gs->sort,
+//       s.aph.star_err, s.aph.flux_err, s.aph.sky_err);
+//fflush(NULL);
+
+    while (TRUE) { // fix me
+        double imag = s.aph.absmag;
+        double imag_err = sqrt (sqr (s.aph.magerr) + sqr (s.aph.scint)); // add scintillation
+
+        switch (fr->active_plane) {
+        case PLANE_RED:
+        case PLANE_GREEN:
+        case PLANE_BLUE:  filter = rgb_filter_names[fr->active_plane];
+            break;
+        }
+        //printf("photometry.stf_aphot %s imag %0.4f imag_err %0.4f\n", filter, imag, imag_err);
+
+        update_band_by_name(&cats->imags, filter, imag, imag_err);
+
+        fr->active_plane = color_plane_iter(fr, fr->active_plane);
+        if (fr->active_plane <= PLANE_RAW) break;
+
+        if (aphot_star(fr, &s, ap, NULL)) {
+            cats->flags |= CPHOT_INVALID;
+            continue;
+        }
+    }
+//printf("stf_aphot %s %d %08x %s %s\n", fr->name, cats->gs->sort, cats, cats->name, cats->imags); fflush(NULL);
+}
+
+static int stf_aphot_rows(void *data, int plane, int y0, int y1)
+{
+    struct aphot_job *job = data;
+    struct ccd_frame fr = *(job->fr); // private active_plane; the pixels are only read
+
+    int i;
+    for (i = y0; i < y1; i++)
+        stf_aphot_star(&fr, job->stars[i], job);
+
+    return 0;
+}
+
+/* measure instrumental magnitudes for the stars in the stf. Stars are independent,
+ * so they are measured in bands on the worker pool; each updates only its own cat_star */
 static int stf_aphot(struct stf *stf, struct ccd_frame *fr, struct wcs *wcs, struct ap_params *ap)
 {
 //    struct ap_params apdef;
@@ -213,131 +359,37 @@ static int stf_aphot(struct stf *stf, struct ccd_frame *fr, struct wcs *wcs, str
         }
     }
 
-    double ast_as_degrees = get_apparent_sidereal_time_as_degrees(jd);
-    double fam = calculate_airmass (wcs->xref, wcs->yref, ast_as_degrees, lat, lng);
-
-    double scint = stf_scint (stf);
-    double rm = ceil (ap->r3) + 1;
+    struct aphot_job job;
+
+    job.fr = fr;
+    job.wcs = wcs;
+    job.ap = ap;
+    job.filter = filter;
+    job.dodiffam = dodiffam;
+    job.lat = lat;
+    job.lng = lng;
+    job.ast_as_degrees = get_apparent_sidereal_time_as_degrees(jd);
+    job.fam = calculate_airmass (wcs->xref, wcs->yref, job.ast_as_degrees, lat, lng);
+    job.scint = stf_scint (stf);
+    job.rm = ceil (ap->r3) + 1;
+
+    int n = g_list_length(asl);
+    job.stars = malloc(n * sizeof(struct cat_star *));
+    if (job.stars == NULL) {
+        err_printf("stf_aphot: cannot alloc star table\n");
+        return -1;
+    }
 
     GList *sl;
     int i = 0;
-    for (sl = asl; sl != NULL; sl = g_list_next(sl)) {
-//        if (! (++i % 50)) {
-//            while (gtk_events_pending()) gtk_main_iteration();
-//        }
-
-        struct cat_star *cats = CAT_STAR(sl->data);
+    for (sl = asl; sl != NULL; sl = g_list_next(sl))
+        job.stars[i++] = CAT_STAR(sl->data);
 
-        cats->flags &= ~CPHOT_MASK;
-
-        if (cats->gs && GUI_STAR(cats->gs)->flags & (STAR_DELETED | STAR_IGNORE)) {
-            cats->flags |= CPHOT_INVALID;
-            continue;
-        }
-
-        double x, y;
-		cats_xypix(wcs, cats, &x, &y);
-
-        cats->pos[POS_X] = x;
-        cats->pos[POS_Y] = y;
-
-        cats->pos[CD_FRAC_X] = fabs(2 * x - fr->w) / fr->w;
-        cats->pos[CD_FRAC_Y] = fabs(2 * y - fr->h) / fr->h;
-
-//        if ( sqr (x - fr->w / 2) + sqr (y - fr->h / 2) > sqr (P_DBL(AP_MAX_STD_RADIUS)) * (sqr (fr->w / 2) + sqr (fr->h / 2)) ) return 0;
-
-        if (! star_in_frame (fr, x, y, rm)) {
-			cats->flags |= CPHOT_INVALID;
-			continue;
-		}
-
-        if (dodiffam) {
-            cats->diffam = calculate_airmass (cats->ra, cats->dec, ast_as_degrees, lat, lng) - fam;
-			cats->flags |= INFO_DIFFAM;
-        }
-
-        struct star s = { 0 };
-		s.x = x;
-		s.y = y;
-		s.xerr = BIG_ERR;
-		s.yerr = BIG_ERR;
-		s.aph.scint = scint;
-
-        if (ap->center) {
-			if (center_star(fr, &s, P_DBL(AP_MAX_CENTER_ERR))) {
-				cats->flags |= CPHOT_NOT_FOUND;
-                continue;
-            }
-            cats->flags |= CPHOT_CENTERED;
-		}
-
-//		ret = aperture_photometry(fr, &s, ap, NULL);
-		fr->active_plane = PLANE_NULL;
+    parallel_rows(n, 1, 0, stf_aphot_rows, &job, NULL, NULL);
 
-        if (aphot_star(fr, &s, ap, NULL)) {
-            cats->flags |= CPHOT_INVALID;
-
-            continue;
-        }
-
-        if ((cats->flags & CPHOT_CENTERED) && !(cats->flags & CATS_FLAG_ASTROMET) && P_INT(AP_MOVE_TARGETS)) {
-            wcs_worldpos(wcs, s.x, s.y, &cats->ra, &cats->dec);
-			cats->pos[POS_DX] = 0;
-			cats->pos[POS_DY] = 0;
-		} else {
-			cats->pos[POS_DX] = s.x - x;
-			cats->pos[POS_DY] = s.y - y;
-		}
-		cats->pos[POS_X] = s.x;
-		cats->pos[POS_Y] = s.y;
-        cats->pos[POS_XERR] = s.xerr * s.aph.star_err / s.aph.star; // how does this work ?
-        cats->pos[POS_YERR] = s.yerr * s.aph.star_err / s.aph.star;
-		cats->flags |= INFO_POS;
-
-        if (s.aph.flags & AP_STAR_SKIP) cats->flags |= CPHOT_BADPIX;
-        if (s.aph.flags & AP_BURNOUT) cats->flags |= CPHOT_BURNED;
-        if (s.aph.flags & AP_FAINT) cats->flags |= CPHOT_FAINT;
-
-		cats->noise[NOISE_SKY] = s.aph.sky_err * s.aph.star_all / s.aph.star;
-        cats->noise[NOISE_READ] = s.aph.rd_noise / s.aph.star;
-		cats->noise[NOISE_PHOTON] = s.aph.pshot_noise / s.aph.star;
-// try this
-// s.aph.scint = 1.5 * s.aph.pshot_noise / s.aph.star;
-        cats->noise[NOISE_SCINT] = s.aph.scint;
-		cats->flags |= INFO_NOISE;
-
-        cats->sky = s.aph.sky;
-		cats->flags |= INFO_SKY;
-
-//printf("stf_aphot %s %d star_err %.5g flux_err %.5g sky_err %.5g\n", cats->name, cats->gs->sort,
-//       s.aph.star_err, s.aph.flux_err, s.aph.sky_err);
-//fflush(NULL);
-
-        while (TRUE) { // fix me
-            double imag = s.aph.absmag;
-            double imag_err = sqrt (sqr (s.aph.magerr) + sqr (s.aph.scint)); // add scintillation
-
-            switch (fr->active_plane) {
-            case PLANE_RED:
-            case PLANE_GREEN:
-            case PLANE_BLUE:  filter = rgb_filter_names[fr->active_plane];
-                break;
-            }
-            //printf("photometry.stf_aphot %s imag %0.4f imag_err %0.4f\n", filter, imag, imag_err);
-
-            update_band_by_name(&cats->imags, filter, imag, imag_err);
-
-            fr->active_plane = color_plane_iter(fr, fr->active_plane);
-            if (fr->active_plane <= PLANE_RAW) break;
-
-            if (aphot_star(fr, &s, ap, NULL)) {
-                cats->flags |= CPHOT_INVALID;
-                continue;
-            }
-        }
-//printf("stf_aphot %s %d %08x %s %s\n", fr->name, cats->gs->sort, cats, cats->name, cats->imags); fflush(NULL);
-	}
+    fr->active_plane = PLANE_NULL;
 
+    free(job.stars);
 	return 0;
 }
 
@@ -1437,13 +1437,13 @@ void plot_sky_histogram(gpointer window, GSList *found)
 		double is, n;
 
         int i;
-		for (i = 0; i < H_SIZE; i++) {
-			all += rs->h[i];
+		for (i = 0; i < rs->nbins; i++) {
+			all += rs->hn[i];
         }
-		for (i = 0; i < H_SIZE; i++) { /* get the median */
-			iy += rs->h[i];
+		for (i = 0; i < rs->nbins; i++) { /* get the median */
+			iy += rs->hn[i];
 			if (iy >= all / 2) {
-				m = i + H_START;
+				m = rs->hv[i];
 				break;
 			}
 		}
@@ -1463,10 +1463,16 @@ void plot_sky_histogram(gpointer window, GSList *found)
 		if (e >= H_SIZE)
 			e = H_SIZE - 1;
 		is = 0; n = 0;
+		int k = 0; // walk the sparse histogram alongside the plotted bins
 		for (i = s; i < e; i++) {
-			fprintf(dfp, "%d %d\n", i + H_START, rs->h[i]);
-			is += rs->h[i] * (i + H_START);
-			n += rs->h[i];
+			int v = i + H_START;
+			while (k < rs->nbins && rs->hv[k] < v)
+				k++;
+			int c = (k < rs->nbins && rs->hv[k] == v) ? rs->hn[k] : 0;
+
+			fprintf(dfp, "%d %d\n", v, c);
+			is += c * v;
+			n += c;
 		}
 		d3_printf("centroid at %.1f\n", is / n);
 		fprintf(dfp, "e\n");
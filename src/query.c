@@ -46,6 +46,7 @@
 #include "recipe.h"
 #include "misc.h"
 #include "query.h"
+#include "querycache.h"
 #include "interface.h"
 
 static struct {
@@ -1691,11 +1692,16 @@ static int table_code(char *table)
 	}
 }
 
-/* return a list of catalog stars obtained by querying an on-line catalog */
-GList *query_catalog_body(char *cmd, int (* progress)(char *msg, void *data), void *data)
-{
-	FILE *vq;
+/* vizier tables to the catalog they are returned for */
+static int qtable_catalog[] = {QUERY_UCAC2, QUERY_UCAC2, QUERY_USNOB, QUERY_GSC_ACT, QUERY_GSC23,
+			       QUERY_UCAC4, QUERY_HIP, QUERY_TYCHO2, QUERY_APASS, QUERY_GAIA};
 
+/* read the tsv output of a vizier query from vq; return the list of stars in
+ * it. The bits of the tables read are set in *tables, and *aborted is set when
+ * the progress function stops the read (either can be NULL) */
+static GList *read_query_output(FILE *vq, int *tables, int *aborted,
+				int (* progress)(char *msg, void *data), void *data)
+{
 	int tnum = -1;
 	GList *cat=NULL;
 	fd_set fds;
@@ -1709,17 +1715,8 @@ GList *query_catalog_body(char *cmd, int (* progress)(char *msg, void *data), vo
 	int pabort;
 	char prp[256];
 
-	/* cmatei: FIXME
-
-	   vq != NULL if vizquery cannot be run, because the shell
-	   itself DOES run. We then go in a rather infinite loop
-	   below, due to suboptimal error handling :-) */
-	vq = popen(cmd, "r");
-
-	if (vq == NULL) {
-		err_printf("cannot run vizquery (%s)\n", strerror(errno));
-		return NULL;
-	}
+	if (tables) *tables = 0;
+	if (aborted) *aborted = 0;
 
 	ll = 256;
 	line = malloc(ll);
@@ -1736,8 +1733,10 @@ GList *query_catalog_body(char *cmd, int (* progress)(char *msg, void *data), vo
 		if (ret == 0 || errno || !FD_ISSET(fileno(vq), &fds)) {
 			if (progress) {
 				pabort = (* progress)(".", data);
-				if (pabort)
+				if (pabort) {
+					if (aborted) *aborted = 1;
 					break;
+				}
 			}
 			continue;
 		}
@@ -1767,6 +1766,8 @@ GList *query_catalog_body(char *cmd, int (* progress)(char *msg, void *data), vo
 			while (*p && isspace(*p))
 				p++;
 			tnum = table_code(p);
+			if (tnum >= 0 && tables)
+				*tables |= 1 << tnum;
 			if (tnum < 0) {
 				if (progress) {
 					(* progress)("Skipping unknown table ", data);
@@ -1807,27 +1808,57 @@ GList *query_catalog_body(char *cmd, int (* progress)(char *msg, void *data), vo
 				snprintf(prp, 32, "*");
 			}
 			pabort = (* progress)(prp, data);
-			if (pabort)
+			if (pabort) {
+				if (aborted) *aborted = 1;
 				break;
+			}
 		}
 	} while (ret >= 0);
 	if (progress) {
 		(* progress)("\n", data);
 	}
-    pclose(vq); // can wait forever here when no response
 	free(line);
 	return cat;
 }
 
-static GList *query_catalog(unsigned int catalog, double ra, double dec, int (* progress)(char *msg, void *data), void *data)
+/* return a list of catalog stars obtained by querying an on-line catalog */
+GList *query_catalog_body(char *cmd, int *tables, int *aborted,
+			  int (* progress)(char *msg, void *data), void *data)
 {
-	char cmd[1024];
-	char prp[256];
+	FILE *vq;
+	GList *cat;
 
-    if (catalog >= QUERY_CATALOGS) {
-        printf("unknown catalogue number\n");
-        return NULL;
-    }
+	/* cmatei: FIXME
+
+	   vq != NULL if vizquery cannot be run, because the shell
+	   itself DOES run. We then go in a rather infinite loop
+	   below, due to suboptimal error handling :-) */
+	vq = popen(cmd, "r");
+
+	if (vq == NULL) {
+		err_printf("cannot run vizquery (%s)\n", strerror(errno));
+		return NULL;
+	}
+
+	cat = read_query_output(vq, tables, aborted, progress, data);
+
+    pclose(vq); // can wait forever here when no response
+	return cat;
+}
+
+/* stars per square arcminute returned by the last query of each catalog, or 0
+ * when unknown; a lower bound when that query hit its star limit */
+static double query_density[QUERY_CATALOGS];
+
+/* run vizquery for the max_stars brightest stars of catalog within radius
+ * arcminutes of (ra, dec) */
+static GList *vizquery_cone(unsigned int catalog, double ra, double dec, double radius, double maglim,
+                            int max_stars, int *tables, int *aborted,
+                            int (* progress)(char *msg, void *data), void *data)
+{
+    char cmd[1024];
+    char prp[256];
+    char *name = vizquery_catalog[catalog].name;
 
     snprintf(cmd, 1023, "%s -mime=tsv <<====\n"
          "-source=%s\n"
@@ -1840,27 +1871,149 @@ static GList *query_catalog(unsigned int catalog, double ra, double dec, int (*
          "====\n",
 
          P_STR(QUERY_VIZQUERY),
-         vizquery_catalog [catalog].name,
+         name,
          ra, dec,
-         P_DBL(QUERY_MAX_RADIUS),
+         radius,
          vizquery_catalog [catalog].out_fields,
-         vizquery_catalog[catalog].search_mag, P_DBL(QUERY_FAINTEST_MAG),
+         vizquery_catalog[catalog].search_mag, maglim,
          vizquery_catalog[catalog].search_mag,
-         P_INT(QUERY_MAX_STARS));
+         max_stars);
 
-//    if (catalog != QUERY_GAIA) {
+    if (progress) {
+        snprintf(prp, 255, "Connecting to CDS for %s:\n"
+                           "ra=%.4f dec=%.4f radius=%.0f mag<%.1f max_stars=%d\n",
+                 name, ra, dec, radius, maglim, max_stars);
+        (* progress)(prp, data);
+    }
+
+    *tables = 0;
+    *aborted = 0;
+    return query_catalog_body(cmd, tables, aborted, progress, data);
+}
+
+/* stars of catalog within radius arcminutes of (ra, dec), from the query cache
+ * when it covers the field, else from vizier. The tiles a query covers go to
+ * the cache, so the query is widened to hold whole tiles; but never asks for
+ * more stars than the field alone would, and the widening is skipped when the
+ * density seen so far would fill it */
+static GList *query_catalog(unsigned int catalog, double ra, double dec, int (* progress)(char *msg, void *data), void *data)
+{
+	char prp[256];
+	GList *tsl;
+	int tables, aborted;
+
+    if (catalog >= QUERY_CATALOGS) {
+        printf("unknown catalogue number\n");
+        return NULL;
+    }
+
+    char *name = vizquery_catalog[catalog].name;
+    double radius = P_DBL(QUERY_MAX_RADIUS);
+    double maglim = P_DBL(QUERY_FAINTEST_MAG);
+    int max_stars = P_INT(QUERY_MAX_STARS);
+    int use_cache = P_INT(QUERY_CACHE) || P_INT(QUERY_OFFLINE);
+
+    if (use_cache) {
+        int complete;
+
+        tsl = query_cache_get(name, ra, dec, radius, maglim, &complete);
+        if (complete || P_INT(QUERY_OFFLINE)) {
+            if (progress) {
+                snprintf(prp, 255, "Using cached %s stars%s\n", name,
+                         complete ? "" : " (the cache does not cover the whole field)");
+                (* progress)(prp, data);
+            }
+            return query_cache_cone(tsl, ra, dec, radius, max_stars);
+        }
+        g_list_foreach(tsl, (GFunc)cat_star_release, "query_catalog");
+        g_list_free(tsl);
+    }
+
+    double fetch_radius = radius;
+
+    if (use_cache) {
+        double r = query_cache_fetch_radius(ra, dec, radius);
+        if (query_density[catalog] * PI * sqr(r) < 0.8 * max_stars)
+            fetch_radius = r;
+    }
+
+    tsl = vizquery_cone(catalog, ra, dec, fetch_radius, maglim, max_stars, &tables, &aborted, progress, data);
+    if (! tables || aborted)
+        return tsl;
+
+    int n = g_list_length(tsl);
+    query_density[catalog] = n / (PI * sqr(fetch_radius));
+
+    /* the brightest stars of the wider cone are not those of the field */
+    if (n >= max_stars && fetch_radius > radius) {
+        g_list_foreach(tsl, (GFunc)cat_star_release, "query_catalog");
+        g_list_free(tsl);
+
+        fetch_radius = radius;
+        tsl = vizquery_cone(catalog, ra, dec, radius, maglim, max_stars, &tables, &aborted, progress, data);
+        if (! tables || aborted)
+            return tsl;
+        n = g_list_length(tsl);
+    }
+
+    if (! use_cache)
+        return tsl;
+
+    /* a query cut short is not the whole of its tiles */
+    if (n < max_stars) {
+        int saved = query_cache_put(name, ra, dec, fetch_radius, maglim, tsl);
         if (progress) {
-            snprintf(prp, 255, "Connecting to CDS for %s:\n"
-                               "ra=%.4f dec=%.4f radius=%.0f mag<%.1f max_stars=%d\n",
-                     vizquery_catalog [catalog].name, ra, dec, P_DBL(QUERY_MAX_RADIUS), P_DBL(QUERY_FAINTEST_MAG), P_INT(QUERY_MAX_STARS));
+            snprintf(prp, 255, "Saved %d tiles to the query cache\n", saved);
             (* progress)(prp, data);
         }
+    }
+    return query_cache_cone(tsl, ra, dec, radius, max_stars);
+}
 
+/* put the stars of a saved vizier tsv output in the query cache. The output
+ * must hold all the catalog stars brighter than the faintestmag parameter
+ * within radius arcminutes of (ra, dec): the tiles inside that cone are
+ * saved. Return the number of tiles saved, or -1 */
+int query_cache_import(char *fn, double ra, double dec, double radius)
+{
+	FILE *inf;
+	GList *tsl;
+	int tables, tnum, catalog = -1;
 
-        return query_catalog_body(cmd, progress, data);
-//    }
-//    printf("query.query_catalog |%s|\n", cmd); fflush(NULL);
-//    return NULL;
+	inf = fopen(fn, "r");
+	if (inf == NULL) {
+		err_printf("cannot open %s (%s)\n", fn, strerror(errno));
+		return -1;
+	}
+
+	tsl = read_query_output(inf, &tables, NULL, NULL, NULL);
+	fclose(inf);
+
+	for (tnum = 0; tnum < QTABLES; tnum++) {
+		if (! (tables & (1 << tnum)))
+			continue;
+		if (catalog >= 0 && qtable_catalog[tnum] != catalog) {
+			err_printf("%s holds tables from more than one catalog\n", fn);
+			catalog = -1;
+			break;
+		}
+		catalog = qtable_catalog[tnum];
+	}
+
+	if (catalog < 0) {
+		if (tables == 0)
+			err_printf("no known catalog table in %s\n", fn);
+		g_list_foreach(tsl, (GFunc)cat_star_release, "query_cache_import");
+		g_list_free(tsl);
+		return -1;
+	}
+
+	int n = query_cache_put(vizquery_catalog[catalog].name, ra, dec, radius, P_DBL(QUERY_FAINTEST_MAG), tsl);
+	info_printf("%s: %d %s stars, %d tiles saved\n", fn, g_list_length(tsl), vizquery_catalog[catalog].name, n);
+
+	g_list_foreach(tsl, (GFunc)cat_star_release, "query_cache_import");
+	g_list_free(tsl);
+	return n;
 }
 
 
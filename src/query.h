@@ -31,5 +31,6 @@ enum {
                           {"hip", "Vmag", "*"} }
 
 int make_cat_rcp(char *obj, unsigned int catalog, FILE *outf) ;
+int query_cache_import(char *fn, double ra, double dec, double radius);
 
 #endif
@@ -0,0 +1,536 @@
+/*******************************************************************************
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by the Free
+  Software Foundation; either version 2 of the License, or (at your option)
+  any later version.
+
+  This program is distributed in the hope that it will be useful, but WITHOUT
+  ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+  FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+  more details.
+
+  You should have received a copy of the GNU General Public License along with
+  this program; if not, write to the Free Software Foundation, Inc., 59
+  Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+  The full GNU General Public License is included in this distribution in the
+  file called LICENSE.
+*******************************************************************************/
+
+/* local cache of on-line catalog queries */
+
+/* The sky is cut in declination zones QUERY_CACHE_TILE_H high, and each zone
+ * in ra cells about as wide. A tile holds all the stars of one catalog down to
+ * one magnitude limit, so it is only saved when a query covered it entirely
+ * and was not cut short by the star count limit. Tiles are kept one per file,
+ * under the user cache dir:
+ *
+ *	gcx/cds/<catalog>/m<maglim>/<zone>_<cell>
+ *
+ * in host byte order: the magic, the number of stars, then a record per star
+ * (see tile_put_star). A query whose tiles are all in the cache needs no
+ * connection to CDS. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "gcx.h"
+#include "catalogs.h"
+#include "querycache.h"
+
+#define TILE_MAGIC "GCXCDST1"
+#define TILE_MARGIN 0.001	// degrees, slack for the tile/cone containment tests
+
+struct tile {
+	int zone, cell;
+};
+
+static int cache_zones(void)
+{
+	return ceil(180.0 / QUERY_CACHE_TILE_H);
+}
+
+static double zone_dec0(int zone)
+{
+	return -90.0 + zone * QUERY_CACHE_TILE_H;
+}
+
+static int zone_cells(int zone)
+{
+	double dc = zone_dec0(zone) + QUERY_CACHE_TILE_H / 2;
+	int n = floor(360.0 * cos(degrad(dc)) / QUERY_CACHE_TILE_H);
+
+	return (n < 1) ? 1 : n;
+}
+
+/* angular distance between two points, in degrees */
+static double sky_dist(double ra1, double dec1, double ra2, double dec2)
+{
+	double sd = sin(degrad(dec2 - dec1) / 2);
+	double sr = sin(degrad(ra2 - ra1) / 2);
+	double h = sd * sd + cos(degrad(dec1)) * cos(degrad(dec2)) * sr * sr;
+
+	return raddeg(2 * asin(sqrt(fmin(h, 1.0))));
+}
+
+static void tile_of(double ra, double dec, struct tile *t)
+{
+	t->zone = floor((dec + 90.0) / QUERY_CACHE_TILE_H);
+	if (t->zone < 0) t->zone = 0;
+	if (t->zone >= cache_zones()) t->zone = cache_zones() - 1;
+
+	int n = zone_cells(t->zone);
+
+	ra = fmod(ra, 360.0);
+	if (ra < 0) ra += 360.0;
+
+	t->cell = floor(ra / 360.0 * n);
+	if (t->cell >= n) t->cell = n - 1;
+}
+
+static void tile_bounds(struct tile *t, double *ra0, double *ra1, double *dec0, double *dec1)
+{
+	double w = 360.0 / zone_cells(t->zone);
+
+	*ra0 = t->cell * w;
+	*ra1 = *ra0 + w;
+	*dec0 = zone_dec0(t->zone);
+	*dec1 = fmin(*dec0 + QUERY_CACHE_TILE_H, 90.0);
+}
+
+/* the least and greatest distances from (ra, dec) to a 3x3 grid of points on
+ * the tile; the least is taken to the nearest point of the tile */
+static void tile_dist(struct tile *t, double ra, double dec, double *dmin, double *dmax)
+{
+	double ra0, ra1, dec0, dec1;
+	int i, j;
+
+	tile_bounds(t, &ra0, &ra1, &dec0, &dec1);
+
+	*dmax = 0;
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++) {
+			double d = sky_dist(ra, dec, ra0 + i * (ra1 - ra0) / 2, dec0 + j * (dec1 - dec0) / 2);
+			if (d > *dmax) *dmax = d;
+		}
+
+	// nearest point: on the tile meridian nearer in ra, at the foot of the
+	// great circle from (ra, dec) perpendicular to it, clamped to the tile
+	double dra = fmod(ra - ra0, 360.0);
+	if (dra < 0) dra += 360.0;
+
+	double rn = ra, dn = dec;
+	if (dra > ra1 - ra0) {
+		rn = (dra - (ra1 - ra0) < 360.0 - dra) ? ra1 : ra0;
+		dn = raddeg(atan2(sin(degrad(dec)), cos(degrad(dec)) * cos(degrad(ra - rn))));
+	}
+
+	*dmin = sky_dist(ra, dec, rn, fmax(dec0, fmin(dec1, dn)));
+}
+
+/* put in *tiles (malloced) the tiles a cone of r degrees around (ra, dec)
+ * overlaps; return their number or -1 */
+static int cone_tiles(double ra, double dec, double r, struct tile **tiles)
+{
+	struct tile t0, t1;
+	int z, c, n = 0, size = 64;
+	double dra;
+
+	*tiles = malloc(size * sizeof(struct tile));
+	if (*tiles == NULL) return -1;
+
+	// ra half-width of the cone, all around when it holds a pole
+	if (fabs(dec) + r >= 90.0)
+		dra = 180.0;
+	else
+		dra = raddeg(asin(sin(degrad(r)) / cos(degrad(dec))));
+
+	tile_of(ra, dec - r, &t0);
+	tile_of(ra, dec + r, &t1);
+
+	for (z = t0.zone; z <= t1.zone; z++) {
+		int ncells = zone_cells(z);
+		int c0, c1;
+
+		if (dra >= 180.0) {
+			c0 = 0;
+			c1 = ncells - 1;
+		} else {
+			c0 = floor((ra - dra) / 360.0 * ncells);
+			c1 = floor((ra + dra) / 360.0 * ncells);
+			if (c1 - c0 >= ncells) c1 = c0 + ncells - 1;
+		}
+
+		for (c = c0; c <= c1; c++) {
+			struct tile t = { z, ((c % ncells) + ncells) % ncells };
+			double dmin, dmax;
+
+			tile_dist(&t, ra, dec, &dmin, &dmax);
+			if (dmin > r + TILE_MARGIN)
+				continue;
+
+			if (n >= size) {
+				struct tile *nt = realloc(*tiles, 2 * size * sizeof(struct tile));
+				if (nt == NULL) {
+					free(*tiles);
+					*tiles = NULL;
+					return -1;
+				}
+				*tiles = nt;
+				size *= 2;
+			}
+			(*tiles)[n++] = t;
+		}
+	}
+	return n;
+}
+
+static char *tile_file(char *catalog, double maglim, struct tile *t)
+{
+	char *mdir = NULL, *tname = NULL;
+
+	asprintf(&mdir, "m%.1f", maglim);
+	asprintf(&tname, "%d_%d", t->zone, t->cell);
+
+	char *fn = g_build_filename(g_get_user_cache_dir(), "gcx", "cds", catalog, mdir, tname, NULL);
+
+	free(mdir);
+	free(tname);
+	return fn;
+}
+
+static void put_string(GString *buf, char *s)
+{
+	guint16 len = (s == NULL) ? 0 : MIN(strlen(s), G_MAXUINT16);
+
+	g_string_append_len(buf, (char *)&len, sizeof(guint16));
+	if (len) g_string_append_len(buf, s, len);
+}
+
+#define PUT(buf, v) g_string_append_len(buf, (char *)&(v), sizeof(v))
+
+/* the fields the catalog parsers set, the strings as a length and the chars */
+static void tile_put_star(GString *buf, struct cat_star *cats)
+{
+	gint32 flags = cats->flags, type = cats->type;
+	guint8 astro = (cats->astro != NULL);
+
+	PUT(buf, cats->ra);
+	PUT(buf, cats->dec);
+	PUT(buf, cats->equinox);
+	PUT(buf, cats->perr);
+	PUT(buf, cats->mag);
+	PUT(buf, flags);
+	PUT(buf, type);
+	put_string(buf, cats->name);
+	put_string(buf, cats->comments);
+	put_string(buf, cats->cmags);
+
+	PUT(buf, astro);
+	if (astro) {
+		gint32 aflags = cats->astro->flags;
+
+		PUT(buf, aflags);
+		PUT(buf, cats->astro->epoch);
+		PUT(buf, cats->astro->ra_err);
+		PUT(buf, cats->astro->dec_err);
+		PUT(buf, cats->astro->ra_pm);
+		PUT(buf, cats->astro->dec_pm);
+		put_string(buf, cats->astro->catalog);
+	}
+}
+
+struct reader {
+	char *p, *end;
+	int bad;
+};
+
+static void get(struct reader *rd, void *v, size_t n)
+{
+	if (rd->bad || rd->end - rd->p < n) {
+		rd->bad = 1;
+		memset(v, 0, n);
+		return;
+	}
+	memcpy(v, rd->p, n);
+	rd->p += n;
+}
+
+#define GET(rd, v) get(rd, &(v), sizeof(v))
+
+static char *get_string(struct reader *rd)
+{
+	guint16 len;
+
+	GET(rd, len);
+	if (len == 0 || rd->bad) return NULL;
+	if (rd->end - rd->p < len) {
+		rd->bad = 1;
+		return NULL;
+	}
+
+	char *s = strndup(rd->p, len);
+	rd->p += len;
+	return s;
+}
+
+static struct cat_star *tile_get_star(struct reader *rd)
+{
+	struct cat_star *cats = cat_star_new();
+	gint32 flags, type;
+	guint8 astro;
+
+	GET(rd, cats->ra);
+	GET(rd, cats->dec);
+	GET(rd, cats->equinox);
+	GET(rd, cats->perr);
+	GET(rd, cats->mag);
+	GET(rd, flags);
+	GET(rd, type);
+	cats->flags = flags;
+	cats->type = type;
+	cats->name = get_string(rd);
+	cats->comments = get_string(rd);
+	cats->cmags = get_string(rd);
+
+	GET(rd, astro);
+	if (astro && ! rd->bad) {
+		gint32 aflags;
+
+		cats->astro = calloc(1, sizeof(struct cats_astro));
+		if (cats->astro == NULL) {
+			rd->bad = 1;
+		} else {
+			GET(rd, aflags);
+			cats->astro->flags = aflags;
+			GET(rd, cats->astro->epoch);
+			GET(rd, cats->astro->ra_err);
+			GET(rd, cats->astro->dec_err);
+			GET(rd, cats->astro->ra_pm);
+			GET(rd, cats->astro->dec_pm);
+			cats->astro->catalog = get_string(rd);
+		}
+	}
+
+	if (rd->bad || cats->name == NULL) {
+		cat_star_release(cats, "tile_get_star");
+		return NULL;
+	}
+	return cats;
+}
+
+/* read a cached tile; return -1 if it is missing or damaged */
+static int tile_load(char *catalog, double maglim, struct tile *t, GList **stars)
+{
+	char *fn = tile_file(catalog, maglim, t);
+	char *data;
+	gsize len;
+	gint32 n, i;
+	GList *sl = NULL;
+
+	if (! g_file_get_contents(fn, &data, &len, NULL)) {
+		g_free(fn);
+		return -1;
+	}
+
+	struct reader rd = { data + 8, data + len, 0 };
+
+	if (len < 8 || memcmp(data, TILE_MAGIC, 8))
+		rd.bad = 1;
+
+	GET(&rd, n);
+	for (i = 0; i < n && ! rd.bad; i++) {
+		struct cat_star *cats = tile_get_star(&rd);
+		if (cats) sl = g_list_prepend(sl, cats);
+	}
+	g_free(data);
+
+	if (rd.bad) {
+		d1_printf("query_cache: dropping damaged tile %s\n", fn);
+		unlink(fn);
+		g_free(fn);
+		g_list_foreach(sl, (GFunc)cat_star_release, "tile_load");
+		g_list_free(sl);
+		return -1;
+	}
+	g_free(fn);
+
+	*stars = g_list_concat(sl, *stars);
+	return 0;
+}
+
+static int tile_save(char *catalog, double maglim, struct tile *t, GPtrArray *stars)
+{
+	char *fn = tile_file(catalog, maglim, t);
+	char *dir = g_path_get_dirname(fn);
+	GString *buf = g_string_new(NULL);
+	gint32 n = (stars == NULL) ? 0 : stars->len;
+	int i, ret = -1;
+
+	g_string_append_len(buf, TILE_MAGIC, 8);
+	PUT(buf, n);
+	for (i = 0; i < n; i++)
+		tile_put_star(buf, g_ptr_array_index(stars, i));
+
+	if (g_mkdir_with_parents(dir, 0755) == 0) {
+		GError *err = NULL;
+		if (g_file_set_contents(fn, buf->str, buf->len, &err))
+			ret = 0;
+		else {
+			err_printf("cannot save query cache tile %s (%s)\n", fn, err->message);
+			g_error_free(err);
+		}
+	} else {
+		err_printf("cannot make query cache dir %s\n", dir);
+	}
+
+	g_string_free(buf, TRUE);
+	g_free(dir);
+	g_free(fn);
+	return ret;
+}
+
+/* return the stars of catalog (cut at maglim) in the cached tiles a cone of
+ * radius arcminutes around (ra, dec) overlaps; *complete is set when all
+ * those tiles were found. The stars are not limited to the cone
+ * (see query_cache_cone) */
+GList *query_cache_get(char *catalog, double ra, double dec, double radius, double maglim, int *complete)
+{
+	struct tile *tiles;
+	GList *sl = NULL;
+	int n, i;
+
+	*complete = 0;
+
+	n = cone_tiles(ra, dec, radius / 60.0, &tiles);
+	if (n < 0) return NULL;
+
+	*complete = 1;
+	for (i = 0; i < n; i++)
+		if (tile_load(catalog, maglim, tiles + i, &sl))
+			*complete = 0;
+
+	free(tiles);
+	return sl;
+}
+
+/* return the radius (arcminutes) of a cone around (ra, dec) that holds all
+ * the tiles a cone of radius overlaps, so that querying it fills them */
+double query_cache_fetch_radius(double ra, double dec, double radius)
+{
+	struct tile *tiles;
+	double r = radius / 60.0;
+	int n, i;
+
+	n = cone_tiles(ra, dec, radius / 60.0, &tiles);
+	if (n < 0) return radius;
+
+	for (i = 0; i < n; i++) {
+		double dmin, dmax;
+
+		tile_dist(tiles + i, ra, dec, &dmin, &dmax);
+		if (dmax + TILE_MARGIN > r) r = dmax + TILE_MARGIN;
+	}
+
+	free(tiles);
+	return ceil(r * 60.0);
+}
+
+static void free_ptr_array(gpointer a)
+{
+	g_ptr_array_free(a, TRUE);
+}
+
+/* save the tiles lying entirely inside the cone of radius arcminutes around
+ * (ra, dec), with the stars that fall in them. stars must be the complete
+ * result of querying catalog down to maglim over the cone. Return the number
+ * of tiles saved */
+int query_cache_put(char *catalog, double ra, double dec, double radius, double maglim, GList *stars)
+{
+	struct tile *tiles;
+	GHashTable *inside;
+	GList *sl;
+	int n, i, saved = 0;
+
+	n = cone_tiles(ra, dec, radius / 60.0, &tiles);
+	if (n <= 0) return 0;
+
+	// tiles inside the cone, keyed by zone and cell, to the stars in them
+	inside = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, free_ptr_array);
+
+	for (i = 0; i < n; i++) {
+		double dmin, dmax;
+
+		tile_dist(tiles + i, ra, dec, &dmin, &dmax);
+		if (dmax > radius / 60.0 - TILE_MARGIN)
+			continue;
+
+		gint64 *key = g_new(gint64, 1);
+		*key = (gint64)tiles[i].zone << 32 | tiles[i].cell;
+		g_hash_table_insert(inside, key, g_ptr_array_new());
+	}
+
+	for (sl = stars; sl != NULL; sl = g_list_next(sl)) {
+		struct cat_star *cats = CAT_STAR(sl->data);
+		struct tile t;
+
+		tile_of(cats->ra, cats->dec, &t);
+
+		gint64 key = (gint64)t.zone << 32 | t.cell;
+		GPtrArray *ts = g_hash_table_lookup(inside, &key);
+		if (ts) g_ptr_array_add(ts, cats);
+	}
+
+	for (i = 0; i < n; i++) {
+		gint64 key = (gint64)tiles[i].zone << 32 | tiles[i].cell;
+		GPtrArray *ts = g_hash_table_lookup(inside, &key);
+
+		if (ts && tile_save(catalog, maglim, tiles + i, ts) == 0)
+			saved++;
+	}
+
+	g_hash_table_destroy(inside);
+	free(tiles);
+	return saved;
+}
+
+static int mag_compare(struct cat_star *a, struct cat_star *b)
+{
+	return (a->mag > b->mag) - (a->mag < b->mag);
+}
+
+/* keep the stars within radius arcminutes of (ra, dec), the max_stars brightest
+ * if there are more; the others are released */
+GList *query_cache_cone(GList *stars, double ra, double dec, double radius, int max_stars)
+{
+	GList *sl, *keep = NULL;
+
+	for (sl = stars; sl != NULL; sl = g_list_next(sl)) {
+		struct cat_star *cats = CAT_STAR(sl->data);
+
+		if (sky_dist(ra, dec, cats->ra, cats->dec) <= radius / 60.0)
+			keep = g_list_prepend(keep, cats);
+		else
+			cat_star_release(cats, "query_cache_cone");
+	}
+	g_list_free(stars);
+
+	keep = g_list_sort(keep, (GCompareFunc)mag_compare);
+
+	if (max_stars > 0 && g_list_length(keep) > max_stars) {
+		GList *rest = g_list_nth(keep, max_stars);
+
+		rest->prev->next = NULL;
+		rest->prev = NULL;
+		g_list_foreach(rest, (GFunc)cat_star_release, "query_cache_cone");
+		g_list_free(rest);
+	}
+
+	return keep;
+}
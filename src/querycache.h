@@ -0,0 +1,15 @@
+#ifndef _QUERYCACHE_H_
+#define _QUERYCACHE_H_
+
+#include <glib.h>
+
+/* height of the declination zones the cache tiles the sky in (degrees); the
+ * zones are split in ra in cells about as wide */
+#define QUERY_CACHE_TILE_H 0.25
+
+GList *query_cache_get(char *catalog, double ra, double dec, double radius, double maglim, int *complete);
+double query_cache_fetch_radius(double ra, double dec, double radius);
+int query_cache_put(char *catalog, double ra, double dec, double radius, double maglim, GList *stars);
+GList *query_cache_cone(GList *stars, double ra, double dec, double radius, int max_stars);
+
+#endif
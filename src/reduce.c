@@ -69,22 +69,7 @@ int progress_print(char *msg, gpointer processing_dialog)
     return 0;
 }
 
-/* pixel combination methods
- * they all take an array of pointers to float, and
- * the "sigmas" and "iter" parameters, and return a
- * single float value. Some methods ignore sigmas and/or iter.
- */
-
-/* straight average */
-static float pix_average(float *dp[], int n, float sigmas, int iter)
-{
-	int i;
-	float m=0.0;
-	for (i=0; i<n; i++) {
-		m += *dp[i];
-	}
-	return m / n;
-}
+/* pixel combination methods are the tile kernels in ccd/combine.c */
 
 // divide this by sum of weights (over fr[]) to get weighted average
 static float weighted_pix_sum(float *dp[], float weights[], int n)
@@ -97,101 +82,6 @@ static float weighted_pix_sum(float *dp[], float weights[], int n)
     return m;
 }
 
-/* straight median */
-static float pix_median(float *dp[], int n, float sigmas, int iter)
-{
-	int i;
-	float pix[COMB_MAX];
-// copy pixels to the pix array
-	for (i=0; i<n; i++) {
-		pix[i] = *dp[i];
-	}
-
-//printf("%d : ", n);
-//for (i = 0; i < n; i++) {
-//	printf("%.2f ", pix[i]);
-//}
-//printf(": %.2f\n", fmedian(pix, n));
-
-	return fmedian(pix, n);
-}
-
-/* mean-median; we average pixels within sigmas of the median */
-static float pix_mmedian(float *dp[], int n, float sigmas, int iter)
-{
-	int i, k = 0;
-	float pix[COMB_MAX];
-	float sum = 0.0, sumsq = 0.0;
-	float m, s;
-
-	sigmas = sqr(sigmas);
-// copy pixels to the pix array
-	for (i=0; i<n; i++) {
-		sum += *dp[i];
-		sumsq += sqr(*dp[i]);
-		pix[i] = *dp[i];
-	}
-	m = sum / (1.0 * n);
-	s = sigmas * (sumsq / (1.0 * n) - sqr(m));
-	m = fmedian(pix, n);
-	sum = 0;
-	for (i=0; i<n; i++) {
-		if (sqr(*dp[i] - m) < s) {
-			sum += *dp[i];
-			k++;
-		}
-	}
-	if (k != 0)
-		return sum / (1.0 * k);
-	else
-		return *dp[0];
-}
-
-
-/* kappa-sigma. We start with a robust estimator: the median. Then, we
- * eliminate the pixels that are more than sigmas away from
- * the median. For the remaining pixels, we calculate the
- * mean and variance, and iterate (with the mean replacing the median)
- * until no pixels are eliminated or iter is reached
- */
-static float pix_ks(float *dp[], int n, float sigmas, int iter)
-{
-	int i, k = 0, r;
-	float pix[COMB_MAX];
-	float sum = 0.0, sumsq = 0.0;
-	float m, s;
-
-	sigmas = sqr(sigmas);
-// copy pixels to the pix array
-	for (i=0; i<n; i++) {
-		sum += *dp[i];
-		sumsq += sqr(*dp[i]);
-		pix[i] = *dp[i];
-	}
-	s = sigmas * (sumsq / (1.0 * n) - sqr(sum / (1.0 * n)));
-	m = fmedian(pix, n);
-
-	do {
-		iter --;
-		sum = 0.0;
-		sumsq = 0.0;
-		r = k;
-		k = 0;
-		for (i=0; i<n; i++) {
-			if (sqr(*dp[i] - m) < s) {
-				sum += *dp[i];
-				sumsq += sqr(*dp[i]);
-				k++;
-			}
-		}
-		if (k == 0)
-			break;
-		m = sum / (1.0 * (k));
-		s = sigmas * (sumsq / (1.0 * (k)) - sqr(m));
-	} while ((iter > 0) && (k != r));
-	return m;
-}
-
 
 /* file save functions*/
 
@@ -339,6 +229,214 @@ int save_image_file(struct image_file *imf, char *outf, int inplace, int *seq,
 	return 0;
 }
 
+/* batch pipeline: frames are loaded ahead of the one being reduced by reader threads,
+ * and saved behind it by a writer thread, so file i/o and decompression overlap the
+ * reduction. The reduction itself stays on the calling thread, as it polls the window
+ * for aborts. At most PIPELINE_DEPTH frames are in flight on either side.
+ * Only batch_reduce_frames uses it: the readers write to the image_files, which a
+ * gui may be showing, so frames reduced from a window are loaded serially */
+
+#define PIPELINE_DEPTH 2
+#define PIPELINE_READERS 2
+
+struct pipe_job {
+    struct image_file *imf;
+    int done;
+    GString *log;   // the writer's progress messages, passed on by the caller in input order
+};
+
+struct pipeline {
+    GThreadPool *readers;
+    GThreadPool *writer;
+    GMutex lock;
+    GCond cond;
+    GList *ahead;   // next file to queue for loading
+    GQueue loads;   // queued loads, in input order
+    GQueue saves;   // queued saves, in input order
+    char *outf;
+    int inplace;
+    int *seq;
+    progress_print_func progress;
+    gpointer processing_dialog;
+};
+
+static void pipe_job_done(struct pipeline *pl, struct pipe_job *job)
+{
+    g_mutex_lock(&pl->lock);
+    job->done = 1;
+    g_cond_broadcast(&pl->cond);
+    g_mutex_unlock(&pl->lock);
+}
+
+static void pipe_load_worker(gpointer data, gpointer user_data)
+{
+    struct pipe_job *job = data;
+
+    imf_load_frame(job->imf); // errors are reported again when the frame is reduced
+
+    pipe_job_done(user_data, job);
+}
+
+static int pipe_log(char *msg, gpointer data)
+{
+    g_string_append(data, msg);
+    return 0;
+}
+
+static void pipe_save_worker(gpointer data, gpointer user_data)
+{
+    struct pipeline *pl = user_data;
+    struct pipe_job *job = data;
+
+    save_image_file(job->imf, pl->outf, pl->inplace, pl->seq, pipe_log, job->log);
+    job->imf->state_flags &= ~IMG_STATE_SKIP;
+
+    pipe_job_done(pl, job);
+}
+
+/* files in imlist will be loaded ahead; reduced frames are saved according to outf,
+ * inplace and seq as in save_image_file. Return NULL if the threads cannot be started,
+ * the caller then works serially */
+static struct pipeline *pipeline_new(GList *imlist, char *outf, int inplace, int *seq,
+                                     progress_print_func progress, gpointer processing_dialog)
+{
+    struct pipeline *pl = calloc(1, sizeof(struct pipeline));
+    if (pl == NULL) return NULL;
+
+    g_mutex_init(&pl->lock);
+    g_cond_init(&pl->cond);
+    g_queue_init(&pl->loads);
+    g_queue_init(&pl->saves);
+
+    pl->ahead = imlist;
+    pl->outf = outf;
+    pl->inplace = inplace;
+    pl->seq = seq;
+    pl->progress = progress;
+    pl->processing_dialog = processing_dialog;
+
+    pl->readers = g_thread_pool_new(pipe_load_worker, pl, PIPELINE_READERS, FALSE, NULL);
+    if (outf) pl->writer = g_thread_pool_new(pipe_save_worker, pl, 1, FALSE, NULL);
+
+    if (pl->readers == NULL || (outf && pl->writer == NULL)) {
+        err_printf("pipeline_new: cannot start threads, reducing serially\n");
+        if (pl->readers) g_thread_pool_free(pl->readers, FALSE, TRUE);
+        if (pl->writer) g_thread_pool_free(pl->writer, FALSE, TRUE);
+        g_mutex_clear(&pl->lock);
+        g_cond_clear(&pl->cond);
+        free(pl);
+        return NULL;
+    }
+    return pl;
+}
+
+/* queue loads for the frames after imf, then wait for imf itself to be loaded */
+static void pipeline_load(struct pipeline *pl, struct image_file *imf)
+{
+    g_mutex_lock(&pl->lock);
+
+    while (pl->ahead && g_queue_get_length(&pl->loads) <= PIPELINE_DEPTH) {
+        struct image_file *next = pl->ahead->data;
+        pl->ahead = g_list_next(pl->ahead);
+
+        if (next->state_flags & IMG_STATE_SKIP) continue;
+
+        struct pipe_job *job = calloc(1, sizeof(struct pipe_job));
+        if (job == NULL) break;
+
+        job->imf = next;
+        g_queue_push_tail(&pl->loads, job);
+        g_thread_pool_push(pl->readers, job, NULL);
+    }
+
+    struct pipe_job *job;
+    while ((job = g_queue_peek_head(&pl->loads))) {
+        while (! job->done)
+            g_cond_wait(&pl->cond, &pl->lock);
+
+        g_queue_pop_head(&pl->loads);
+
+        int found = (job->imf == imf);
+        free(job);
+        if (found) break;
+    }
+
+    g_mutex_unlock(&pl->lock);
+}
+
+// pass on the messages of finished saves, in input order; called with the lock held
+static void pipeline_flush_saves(struct pipeline *pl, int wait)
+{
+    struct pipe_job *job;
+
+    while ((job = g_queue_peek_head(&pl->saves))) {
+        if (! job->done) {
+            if (! wait) break;
+            g_cond_wait(&pl->cond, &pl->lock);
+            continue;
+        }
+        g_queue_pop_head(&pl->saves);
+
+        if (pl->progress && job->log->len)
+            (* pl->progress)(job->log->str, pl->processing_dialog);
+
+        g_string_free(job->log, TRUE);
+        free(job);
+    }
+}
+
+/* hand a reduced frame to the writer, waiting while PIPELINE_DEPTH saves are pending */
+static void pipeline_save(struct pipeline *pl, struct image_file *imf)
+{
+    struct pipe_job *job = calloc(1, sizeof(struct pipe_job));
+
+    if (job == NULL) {
+        err_printf("pipeline_save: cannot alloc job\n");
+        return;
+    }
+    job->imf = imf;
+    job->log = g_string_new(NULL);
+
+    g_mutex_lock(&pl->lock);
+
+    pipeline_flush_saves(pl, FALSE);
+    while (g_queue_get_length(&pl->saves) >= PIPELINE_DEPTH) {
+        g_cond_wait(&pl->cond, &pl->lock);
+        pipeline_flush_saves(pl, FALSE);
+    }
+
+    g_queue_push_tail(&pl->saves, job);
+    g_thread_pool_push(pl->writer, job, NULL);
+
+    g_mutex_unlock(&pl->lock);
+}
+
+/* wait for the pending loads and saves and stop the threads */
+static void pipeline_free(struct pipeline *pl)
+{
+    g_mutex_lock(&pl->lock);
+
+    struct pipe_job *job;
+    while ((job = g_queue_pop_head(&pl->loads))) {
+        while (! job->done)
+            g_cond_wait(&pl->cond, &pl->lock);
+        free(job);
+    }
+    pipeline_flush_saves(pl, TRUE);
+
+    g_mutex_unlock(&pl->lock);
+
+    g_thread_pool_free(pl->readers, FALSE, TRUE);
+    if (pl->writer) g_thread_pool_free(pl->writer, FALSE, TRUE);
+
+    g_mutex_clear(&pl->lock);
+    g_cond_clear(&pl->cond);
+    free(pl);
+}
+
+static int stack_frames_tiled(struct image_file_list *imfl, struct ccd_reduce *ccdr, char *outf,
+         progress_print_func progress, gpointer processing_dialog);
+
 /* call point from main; reduce the frames acording to ccdr.
  * Print progress messages at level 1. If the inplace flag in ccdr->op_flags is true,
  * the source files are overwritten, else new files will be created according
@@ -361,23 +459,31 @@ int batch_reduce_frames(struct image_file_list *imfl, struct ccd_reduce *ccdr, c
 
 	nframes = g_list_length(imfl->imlist);
     if (!(ccdr->op_flags & IMG_OP_STACK)) { // no stack
+        int inplace = (ccdr->state_flags & IMG_STATE_INPLACE) != 0;
+        int *seqp = (inplace || nframes == 1) ? NULL : &seq;
+
+        struct pipeline *pl = pipeline_new(imfl->imlist, outf, inplace, seqp, progress_print, NULL);
+
 		gl = imfl->imlist;
 		while (gl != NULL) {
 			imf = gl->data;
 			gl = g_list_next(gl);
             if (imf->state_flags & IMG_STATE_SKIP)
 				continue;
+            if (pl) pipeline_load(pl, imf);
+
             ret = reduce_one_frame(imf, ccdr, progress_print, NULL);
 			if (ret || (outf == NULL))
 				continue;
 
-            if (ccdr->state_flags & IMG_STATE_INPLACE) {
-				save_image_file(imf, outf, 1, NULL, progress_print, NULL);
-			} else {
-                save_image_file(imf, outf, 0, (nframes == 1 ? NULL : &seq),	progress_print, NULL);
-			}
-            imf->state_flags &= ~IMG_STATE_SKIP;
+            if (pl) {
+                pipeline_save(pl, imf);
+            } else {
+                save_image_file(imf, outf, inplace, seqp, progress_print, NULL);
+                imf->state_flags &= ~IMG_STATE_SKIP;
+            }
 		}
+        if (pl) pipeline_free(pl);
 //printf("reduce.batch_reduce_frames return\n");
     } else { // stack
 
@@ -386,6 +492,13 @@ int batch_reduce_frames(struct image_file_list *imfl, struct ccd_reduce *ccdr, c
             if (!(ccdr->op_flags & IMG_OP_BG_ALIGN_MUL))
                 ccdr->op_flags |= IMG_OP_BG_ALIGN_ADD; // ?
         }
+        if (P_INT(CCDRED_STACK_MEMORY) > 0 && outf != NULL) {
+            if (ccdr->op_flags & ~(IMG_OP_STACK | IMG_OP_BG_ALIGN_ADD | IMG_OP_BG_ALIGN_MUL))
+                err_printf("stacking from disk needs frames already reduced, stacking in memory\n");
+            else
+                return stack_frames_tiled(imfl, ccdr, outf, progress_print, NULL) ? 1 : 0;
+        }
+
         if (reduce_frames(imfl, ccdr, progress_print, NULL)) return 1;
 
         fr = stack_frames(imfl, ccdr, progress_print, NULL);
@@ -458,7 +571,7 @@ int imf_load_frame(struct image_file *imf)
         }
     }
 
-    if (! fr->stats.statsok) frame_stats(fr);
+    frame_stats(fr);
 
     return reloaded;
 }
@@ -674,6 +787,7 @@ static int ccd_reduce_imf_body(struct image_file *imf, struct ccd_reduce *ccdr,
     }
 
     if ( ! (ccdr->state_flags & IMG_STATE_BG_VAL_SET) ) {
+        frame_stats(imf->fr);
 d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.median);
         ccdr->bg = imf->fr->stats.median;
         ccdr->state_flags |= IMG_STATE_BG_VAL_SET;
@@ -681,6 +795,10 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
 
     int abort = check_user_abort(ccdr->window);
 
+    // bias to mul/add are gathered here and applied in one pass by calib_frame
+    struct calib cb;
+    memset(&cb, 0, sizeof(struct calib));
+
     if ( (abort == 0) && (ccdr->op_flags & IMG_OP_BIAS) ) {
 //        g_return_val_if_fail(ccdr->bias->fr != NULL, -1);
 
@@ -688,7 +806,7 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
 
         if ( ! (imf->op_flags & IMG_OP_BIAS) ) {
 
-            if ( ccdr->bias->fr && (sub_frames(imf->fr, ccdr->bias->fr) == 0) ) {
+            if ( ccdr->bias->fr && (calib_add_sub(&cb, imf->fr, ccdr->bias->fr) == 0) ) {
                 fits_add_history(imf->fr, "'BIASSUB'");
 
                 imf->state_flags |= IMG_STATE_DIRTY;
@@ -708,7 +826,7 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
 
         if ( ! (imf->op_flags & IMG_OP_DARK) ) {
 
-            if ( ccdr->dark->fr && (sub_frames(imf->fr, ccdr->dark->fr) == 0) ) {
+            if ( ccdr->dark->fr && (calib_add_sub(&cb, imf->fr, ccdr->dark->fr) == 0) ) {
                 fits_add_history(imf->fr, "'DARKSUB'");
 
                 imf->state_flags |= IMG_STATE_DIRTY;
@@ -729,7 +847,7 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
 
         if (! (imf->op_flags & IMG_OP_FLAT) ) {
 
-            if ( ccdr->flat->fr && (flat_frame(imf->fr, ccdr->flat->fr) == 0) ) {
+            if ( ccdr->flat->fr && (calib_add_flat(&cb, imf->fr, ccdr->flat->fr) == 0) ) {
                 fits_add_history(imf->fr, "'FLATTED'");
 
                 imf->state_flags |= IMG_STATE_DIRTY;
@@ -749,7 +867,8 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
 
         if ( ! (imf->op_flags & IMG_OP_BADPIX) ) {
 
-            if ( ccdr->bad_pix_map && (fix_bad_pixels(imf->fr, ccdr->bad_pix_map) == 0) ) {
+            if ( ccdr->bad_pix_map ) {
+                cb.map = ccdr->bad_pix_map;
                 fits_add_history(imf->fr, "'PIXEL DEFECTS REMOVED'");
 
                 imf->state_flags |= IMG_STATE_DIRTY;
@@ -789,7 +908,7 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
             }
 
             if (! (isnan(m) && isnan(a)))
-                scale_shift_frame(imf->fr, isnan(m) ? 1.0 : m, isnan(a) ? 0 : a); // multiply then add
+                calib_add_scale(&cb, imf->fr, isnan(m) ? 1.0 : m, isnan(a) ? 0 : a); // multiply then add
 
             if (history) fits_add_history(imf->fr, history), free(history);
 
@@ -805,6 +924,11 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
         } else REPORT( " mul/add(already done)" )
     }
 
+    if (cb.nops > 0 || cb.map) {
+        calib_frame(imf->fr, &cb);
+        abort = check_user_abort(ccdr->window);
+    }
+
     if ( (abort == 0) && (ccdr->op_flags & (IMG_OP_BG_ALIGN_ADD | IMG_OP_BG_ALIGN_MUL)) ) {
         if ( ccdr->op_flags & IMG_OP_BG_ALIGN_ADD )
         {
@@ -815,7 +939,7 @@ d2_printf("reduce.ccd_reduce_imf setting background %.2f\n", imf->fr->stats.medi
             REPORT( " bg_align_mul" )
         }
 
-        if (! imf->fr->stats.statsok) frame_stats(imf->fr);
+        frame_stats(imf->fr);
 
 //        if ( (ccdr->op_flags & (IMG_OP_BG_ALIGN_MUL | IMG_OP_BG_ALIGN_ADD)) != (imf->op_flags & (IMG_OP_BG_ALIGN_MUL | IMG_OP_BG_ALIGN_ADD)) ) {
         if ( (ccdr->op_flags ^ imf->op_flags) & (IMG_OP_BG_ALIGN_MUL | IMG_OP_BG_ALIGN_ADD) ) {
@@ -1206,27 +1330,142 @@ static int get_unskipped_frames (struct image_file_list *imfl, struct ccd_frame
     return n;
 }
 
+/* row-parallel combine engine used by the do_stack_* methods.
+ * The output frame is split into bands of rows and all color planes are queued
+ * together on the worker pool. Within a band, each row is cut into runs of
+ * COMBINE_TILE_W pixels; the run is copied from every frame into a tile and
+ * combined by a tile kernel, so the result does not depend on the number of workers */
+
+struct combine_job {
+    tile_func combine;
+    int n;
+    float **src[4];                 // per band plane: row 0 of each of the n inputs
+    int *stride;                    // row length of each input
+    float *dst[4];                  // per band plane: row 0 of the output
+    int w;                          // output row length
+    float sigmas;
+    int iter;
+
+    void *window;                   // polled for control-c
+    progress_print_func progress;
+    gpointer processing_dialog;
+    int dots;                       // print up to 16 progress dots
+};
+
+static int combine_rows(void *data, int plane, int y0, int y1)
+{
+    struct combine_job *job = data;
+    int i, x, y;
+
+    int w = job->w;
+    int n = job->n;
+    int tw = COMBINE_TILE_W;
+
+    float *tile = malloc((size_t) n * tw * sizeof(float));
+    float *pix = malloc(COMBINE_SCRATCH(n) * sizeof(float));
+    if (tile == NULL || pix == NULL) {
+        err_printf("combine_rows: cannot alloc tile for %d frames\n", n);
+        if (tile) free(tile);
+        if (pix) free(pix);
+        return -1;
+    }
+
+    for (y = y0; y < y1; y++) {
+        float *odp = job->dst[plane] + y * w;
+
+        for (x = 0; x < w; x += tw) {
+            int run = (x + tw < w) ? tw : w - x;
+
+            for (i = 0; i < n; i++)
+                memcpy(tile + i * tw, job->src[plane][i] + y * job->stride[i] + x, run * sizeof(float));
+
+            (* job->combine)(tile, n, tw, run, job->sigmas, job->iter, odp + x, pix);
+        }
+    }
+    free(tile);
+    free(pix);
+    return 0;
+}
+
+/* runs on the calling thread: progress dots and control-c polling */
+static int combine_poll(void *data, int done, int total)
+{
+    struct combine_job *job = data;
+
+    if (job->dots >= 0 && job->progress) {
+        int dots = done * 16 / total;
+        while (job->dots < dots) {
+            job->dots++;
+            if ((* job->progress)(".", job->processing_dialog)) {
+                d1_printf("aborted\n");
+                return 1;
+            }
+        }
+    }
+    return check_user_abort(job->window);
+}
+
+/* combine n frames into fr with the tile kernel combine();
+ * return -1 if aborted */
+static int combine_frames(struct ccd_frame *frames[], int n, struct ccd_frame *fr,
+                          tile_func combine, float sigmas, int iter, gboolean dots,
+                          progress_print_func progress, gpointer processing_dialog)
+{
+    struct combine_job job = { 0 };
+
+    job.combine = combine;
+    job.n = n;
+    job.w = fr->w;
+    job.sigmas = sigmas;
+    job.iter = iter;
+    job.window = fr->window;
+    job.progress = progress;
+    job.processing_dialog = processing_dialog;
+    job.dots = dots ? 0 : -1;
+
+    float **src = malloc(4 * n * sizeof(float *));
+    int *stride = malloc(n * sizeof(int));
+    if (src == NULL || stride == NULL) {
+        err_printf("combine_frames: cannot alloc plane pointers\n");
+        if (src) free(src);
+        if (stride) free(stride);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < n; i++)
+        stride[i] = frames[i]->w;
+    job.stride = stride;
+
+    int nplanes = 0;
+    int plane_iter = 0;
+    while ((plane_iter = color_plane_iter(frames[0], plane_iter)) && nplanes < 4) {
+        job.src[nplanes] = src + nplanes * n;
+        for (i = 0; i < n; i++)
+            job.src[nplanes][i] = get_color_plane(frames[i], plane_iter);
+        job.dst[nplanes] = get_color_plane(fr, plane_iter);
+        nplanes++;
+    }
+
+    int ret = parallel_rows(fr->h, nplanes, 0, combine_rows, &job, combine_poll, &job);
+
+    free(src);
+    free(stride);
+    return ret;
+}
+
 /* the real work of avg-stacking frames
  * return -1 for errors */
 
 static int do_stack_avg(struct image_file_list *imfl, struct ccd_frame *fr,
             progress_print_func progress, gpointer processing_dialog)
 {
-    float *dp[COMB_MAX];
     struct ccd_frame *frames[COMB_MAX];
 
- // skip at end of row for frames wider than result.
- // Why bother? More generally could as easily handle arbitary positions and sizes.
-    int rs[COMB_MAX];
+    int w, h, i, n;
 
-    int w, h, i, y, x, n;
-
-    float *odp;
     GList *gl;
     struct image_file *imf;
-    char *lb;
-
-    int plane_iter = 0;
 
     w = fr->w;
     h = fr->h;
@@ -1244,7 +1483,6 @@ static int do_stack_avg(struct image_file_list *imfl, struct ccd_frame *fr,
             continue;
         }
         frames[i] = imf->fr;
-        rs[i] = imf->fr->w - w;
         i++;
         if (i >= COMB_MAX)
             break;
@@ -1257,29 +1495,7 @@ static int do_stack_avg(struct image_file_list *imfl, struct ccd_frame *fr,
     }
     fits_add_history_varg(fr, "'AVERAGE STACK %d FRAMES'", i);
 
-    int abort = 0;
-    while ((plane_iter = color_plane_iter(frames[0], plane_iter))) {
-        for (i = 0; i < n; i++) {
-            dp[i] = get_color_plane(frames[i], plane_iter);
-        }
-        odp = get_color_plane(fr, plane_iter);
-        for (y = 0; y < h; y++) {
-
-            if ((abort = check_user_abort(fr->window))) break;
-
-            for (x = 0; x < w; x++) {
-                *odp = pix_average(dp, n, 0, 1);
-                for (i = 0; i < n; i++)
-                    dp[i]++;
-                odp++;
-            }
-            for (i = 0; i < n; i++) {
-                dp[i] += rs[i];
-            }
-        }
-        if (abort) break;
-    }
-    return (abort) ? -1 : 0;
+    return combine_frames(frames, n, fr, tile_average, 0, 1, FALSE, progress, processing_dialog);
 }
 
 /* the real work of median-stacking frames
@@ -1288,8 +1504,6 @@ static int do_stack_median(struct image_file_list *imfl, struct ccd_frame *fr,
                progress_print_func progress, gpointer processing_dialog)
 {
 	struct ccd_frame *frames[COMB_MAX];
-    float *dp[COMB_MAX];
-    int rs[COMB_MAX];
 
     int w = fr->w;
     int h = fr->h;
@@ -1304,7 +1518,6 @@ static int do_stack_median(struct image_file_list *imfl, struct ccd_frame *fr,
         if ((imf->fr->w < w) || (imf->fr->h < h)) { err_printf("bad frame size\n"); continue; }
 
 		frames[i] = imf->fr;
-		rs[i] = imf->fr->w - w;
 		i++;
 
         if (i >= COMB_MAX) break;
@@ -1317,35 +1530,7 @@ static int do_stack_median(struct image_file_list *imfl, struct ccd_frame *fr,
 
     fits_add_history_varg(fr, "'MEDIAN STACK of %d FRAMES'", i);
 
-    int abort = 0;
-    int plane_iter = 0;
-	while ((plane_iter = color_plane_iter(frames[0], plane_iter))) {
-        int i;
-		for (i = 0; i < n; i++) {
-			dp[i] = get_color_plane(frames[i], plane_iter);
-		}
-
-        float *odp = get_color_plane(fr, plane_iter);
-        int y;
-		for (y = 0; y < h; y++) {
-
-            if ((abort = check_user_abort(fr->window))) break;
-
-            int x;
-			for (x = 0; x < w; x++) {
-				*odp = pix_median(dp, n, 0, 1);
-
-                for (i = 0; i < n; i++) dp[i]++;
-
-				odp++;
-			}
-			for (i = 0; i < n; i++) {
-				dp[i] += rs[i];
-			}
-		}
-        if (abort) break;
-	}
-    return (abort) ? -1 : 0;
+    return combine_frames(frames, n, fr, tile_median, 0, 1, FALSE, progress, processing_dialog);
 }
 
 /* the real work of k-s-stacking frames
@@ -1353,9 +1538,7 @@ static int do_stack_median(struct image_file_list *imfl, struct ccd_frame *fr,
 static int do_stack_ks(struct image_file_list *imfl, struct ccd_frame *fr,
             progress_print_func progress, gpointer processing_dialog)
 {
-	float *dp[COMB_MAX];
 	struct ccd_frame *frames[COMB_MAX];
-	int rs[COMB_MAX];
 
     int w = fr->w;
     int h = fr->h;
@@ -1370,7 +1553,6 @@ static int do_stack_ks(struct image_file_list *imfl, struct ccd_frame *fr,
         if ((imf->fr->w < w) || (imf->fr->h < h)) {	err_printf("bad frame size\n");	continue; }
 
 		frames[i] = imf->fr;
-		rs[i] = imf->fr->w - w;
 		i++;
         if (i >= COMB_MAX) { d1_printf("reached stacking limit\n");	break; }
 	}
@@ -1396,47 +1578,13 @@ static int do_stack_ks(struct image_file_list *imfl, struct ccd_frame *fr,
 
     fits_add_history_varg(fr, "'KAPPA-SIGMA STACK (s=%.1f) of %d FRAMES'", P_DBL(CCDRED_SIGMAS), i);
 
-    int abort = 0;
-    int plane_iter = 0;
-	while ((plane_iter = color_plane_iter(frames[0], plane_iter))) {
-        int i;
-		for (i = 0; i < n; i++) {
-			dp[i] = get_color_plane(frames[i], plane_iter);
-		}
-
-        float *odp = get_color_plane(fr, plane_iter);
-        int t = h / 16;
-
-        int y;
-		for (y = 0; y < h; y++) {
-
-            if ((abort = check_user_abort(fr->window))) break;
-
-			if (t-- == 0 && progress) {
-                int ret = (* progress)(".", processing_dialog);
-                if (ret) { d1_printf("aborted\n"); return -1; }
-
-				t = h / 16;
-			}
-
-            int x;
-			for (x = 0; x < w; x++) {
-				*odp = pix_ks(dp, n, P_DBL(CCDRED_SIGMAS), P_INT(CCDRED_ITER));
-                for (i = 0; i < n; i++)	dp[i]++;
-
-				odp++;
-			}
-			for (i = 0; i < n; i++) {
-				dp[i] += rs[i];
-			}
-		}
-        if (abort) break;
-	}
+    int ret = combine_frames(frames, n, fr, tile_ks, P_DBL(CCDRED_SIGMAS), P_INT(CCDRED_ITER), TRUE,
+                             progress, processing_dialog);
 	if (progress) {
         (* progress)("\n", processing_dialog);
 	}
 
-    return (abort) ? -1 : 0;
+    return ret;
 }
 
 /* the real work of mean-median-stacking frames
@@ -1444,9 +1592,7 @@ static int do_stack_ks(struct image_file_list *imfl, struct ccd_frame *fr,
 static int do_stack_mm(struct image_file_list *imfl, struct ccd_frame *fr,
             progress_print_func progress, gpointer processing_dialog)
 {
-	float *dp[COMB_MAX];
 	struct ccd_frame *frames[COMB_MAX];
-	int rs[COMB_MAX];
 
     int w = fr->w;
     int h = fr->h;
@@ -1461,7 +1607,6 @@ static int do_stack_mm(struct image_file_list *imfl, struct ccd_frame *fr,
         if ((imf->fr->w < w) || (imf->fr->h < h)) {	err_printf("bad frame size\n");	continue; }
 
 		frames[i] = imf->fr;
-		rs[i] = imf->fr->w - w;
 		i++;
 
         if (i >= COMB_MAX) { d1_printf("reached stacking limit\n");	break; }
@@ -1484,121 +1629,84 @@ static int do_stack_mm(struct image_file_list *imfl, struct ccd_frame *fr,
 
     fits_add_history_varg(fr, "'MEAN_MEDIAN STACK (s=%.1f) of %d FRAMES'", P_DBL(CCDRED_SIGMAS), i);
 
-    int abort = 0;
-    int plane_iter = 0;
-	while ((plane_iter = color_plane_iter(frames[0], plane_iter))) {
-        int i;
-		for (i = 0; i < n; i++) {
-			dp[i] = get_color_plane(frames[i], plane_iter);
-		}
-
-        float *odp = get_color_plane(fr, plane_iter);
-        int t = h / 16;
-
-        int y;
-		for (y = 0; y < h; y++) {
-
-            if ((abort = check_user_abort(fr->window))) break;
-
-            if ((t-- == 0) && progress) {
-                int ret = (* progress)(".", processing_dialog);
-                if (ret) { d1_printf("aborted\n"); return -1; }
-
-				t = h / 16;
-			}
-
-            int x;
-			for (x = 0; x < w; x++) {
-				*odp = pix_mmedian(dp, n, P_DBL(CCDRED_SIGMAS), P_INT(CCDRED_ITER));
-                for (i = 0; i < n; i++)	dp[i]++;
-				odp++;
-			}
-			for (i = 0; i < n; i++) {
-				dp[i] += rs[i];
-			}
-		}
-        if (abort) break;
-	}
+    int ret = combine_frames(frames, n, fr, tile_mmedian, P_DBL(CCDRED_SIGMAS), P_INT(CCDRED_ITER), TRUE,
+                             progress, processing_dialog);
 	if (progress) {
         (* progress)("\n", processing_dialog);
 	}
-    return (abort) ? -1 : 0;
+    return ret;
 }
 
-/* add to output frame the equivalent integration time, frame time and median airmass */
-static int do_stack_time(struct image_file_list *imfl, struct ccd_frame *fr,
+/* running totals for the stack time keywords; am has room for one airmass per frame */
+struct stack_time {
+	double expsum;
+	double exptime;
+	double last_exptime;
+	float *am;
+	int ami;
+	int i;
+};
+
+/* add the exposure of one stacked frame (only its header is used) */
+static void stack_time_add(struct stack_time *st, struct ccd_frame *hd,
             progress_print_func progress, gpointer processing_dialog)
 {
-	double expsum = 0.0;
-	double exptime = 0.0;
-    double last_exptime = 0.0;
-
-    float am[COMB_MAX];
-
-    int i = 0, ami = 0;
-
-    GList *gl = imfl->imlist;
-	while (gl != NULL) {
-        struct image_file *imf = gl->data;
-		gl = g_list_next(gl);
-        if (imf->state_flags & IMG_STATE_SKIP)
-			continue;
-		if (i >= COMB_MAX) {
-			d1_printf("reached stacking limit\n");
-			break;
-		}
-
-        double amv; fits_get_double(imf->fr, P_STR(FN_AIRMASS), &amv);
-        if (! isnan(amv)) {
-            am[ami] = amv;
-            ami++;
-        }
+    double amv; fits_get_double(hd, P_STR(FN_AIRMASS), &amv);
+    if (! isnan(amv)) {
+        st->am[st->ami] = amv;
+        st->ami++;
+    }
 
-		i++;
-        double jd = frame_jdate(imf->fr);
+    st->i++;
+    double jd = frame_jdate(hd);
 //printf("%s %20.5f\n", imf->filename, jd);
-		if (jd == 0) {
-            if (progress) (*progress)("stack_time: bad time\n", processing_dialog);
+	if (jd == 0) {
+        if (progress) (*progress)("stack_time: bad time\n", processing_dialog);
 //			continue;
-		}
+	}
 
-        double expv; fits_get_double(imf->fr, P_STR(FN_EXPTIME), &expv);
-        if (! isnan(expv)) {
-            d1_printf("stack time: using exptime = %.5f from %s\n", expv, P_STR(FN_EXPTIME));
-            if ((i != 1) && (last_exptime != expv))
-                if (progress)
-                    (*progress)("stack_time: exposures dont all have same exptime\n", processing_dialog);
+    double expv; fits_get_double(hd, P_STR(FN_EXPTIME), &expv);
+    if (! isnan(expv)) {
+        d1_printf("stack time: using exptime = %.5f from %s\n", expv, P_STR(FN_EXPTIME));
+        if ((st->i != 1) && (st->last_exptime != expv))
+            if (progress)
+                (*progress)("stack_time: exposures dont all have same exptime\n", processing_dialog);
 
-            last_exptime = expv;
+        st->last_exptime = expv;
 
-		} else {
-            if (progress)
-                (*progress)("stack_time: bad exptime\n", processing_dialog);
+	} else {
+        if (progress)
+            (*progress)("stack_time: bad exptime\n", processing_dialog);
 
 //			continue;
-		}
-        expsum += expv;
-//        exptime += (jd + expv / 2 / 24 / 3600) * expv; // using frame start
-        exptime += jd * expv; // using frame center
 	}
+    st->expsum += expv;
+//        st->exptime += (jd + expv / 2 / 24 / 3600) * expv; // using frame start
+    st->exptime += jd * expv; // using frame center
+}
+
+/* write the totals to the output frame header */
+static void stack_time_to_header(struct stack_time *st, struct ccd_frame *fr,
+            progress_print_func progress, gpointer processing_dialog)
+{
 //    if (expsum == 0) return 0;
 
 //    char *lb;
 	if (progress) {
-        char *lb = NULL; asprintf (&lb, "%d exposures: total exposure %.5fs, center at jd:%.7f\n", i, expsum, exptime / expsum);
+        char *lb = NULL; asprintf (&lb, "%d exposures: total exposure %.5fs, center at jd:%.7f\n", st->i, st->expsum, st->exptime / st->expsum);
         if (lb) (*progress)(lb, processing_dialog), free(lb);
 	}
     
-//    lb = NULL; asprintf (&lb, "%20.5f / TOTAL EXPOSURE TIME IN SECONDS", expsum);
+//    lb = NULL; asprintf (&lb, "%20.5f / TOTAL EXPOSURE TIME IN SECONDS", st->expsum);
 //    if (lb) fits_add_keyword (fr, P_STR(FN_EXPTIME), lb), free(lb);
-    fits_keyword_add(fr, P_STR(FN_EXPTIME), "%20.5f / TOTAL EXPOSURE TIME IN SECONDS", expsum);
+    fits_keyword_add(fr, P_STR(FN_EXPTIME), "%20.5f / TOTAL EXPOSURE TIME IN SECONDS", st->expsum);
 
 //    sprintf (lb, "%20.8f / JULIAN DATE OF EXPOSURE START", exptime / expsum - expsum / 2 / 24 / 3600);
 //    fits_add_keyword (fr, P_STR(FN_JDATE), lb);
 
 //    lb = NULL; asprintf (&lb, "%20.8f / JULIAN DATE OF EXPOSURE CENTER", exptime / expsum);
 //    if (lb) fits_add_keyword (fr, P_STR(FN_JDATE), lb), free(lb);
-    fr->fim.jd = exptime / expsum;
+    fr->fim.jd = st->exptime / st->expsum;
     fits_keyword_add(fr, P_STR(FN_JDATE), "%20.8f / JULIAN DATE OF EXPOSURE CENTER", fr->fim.jd);
 
 //    double tz = P_DBL(OBS_TIME_ZONE);
@@ -1613,10 +1721,10 @@ static int do_stack_time(struct image_file_list *imfl, struct ccd_frame *fr,
 //        printf("%s\n", date);
 //    }
 
-    if (ami) {
-//        lb = NULL; asprintf (&lb, "%20.3f / MEDIAN OF STACKED FRAMES", fmedian(am, ami));
+    if (st->ami) {
+//        lb = NULL; asprintf (&lb, "%20.3f / MEDIAN OF STACKED FRAMES", fmedian(st->am, st->ami));
 //        if (lb) fits_add_keyword (fr, P_STR(FN_AIRMASS), lb), free(lb);
-        fits_keyword_add(fr, P_STR(FN_AIRMASS), "%20.3f / MEDIAN OF STACKED FRAMES", fmedian(am, ami));
+        fits_keyword_add(fr, P_STR(FN_AIRMASS), "%20.3f / MEDIAN OF STACKED FRAMES", fmedian(st->am, st->ami));
     }
 
 //printf("done stack time\n");
@@ -1626,6 +1734,31 @@ static int do_stack_time(struct image_file_list *imfl, struct ccd_frame *fr,
     fits_delete_keyword (fr, P_STR(FN_TIME_OBS));
     fits_delete_keyword (fr, P_STR(FN_OBJECTALT));
     fits_delete_keyword (fr, P_STR(FN_DATE_OBS));
+}
+
+/* add to output frame the equivalent integration time, frame time and median airmass */
+static int do_stack_time(struct image_file_list *imfl, struct ccd_frame *fr,
+            progress_print_func progress, gpointer processing_dialog)
+{
+    float am[COMB_MAX];
+    struct stack_time st = { 0 };
+
+    st.am = am;
+
+    GList *gl = imfl->imlist;
+	while (gl != NULL) {
+        struct image_file *imf = gl->data;
+		gl = g_list_next(gl);
+        if (imf->state_flags & IMG_STATE_SKIP)
+			continue;
+		if (st.i >= COMB_MAX) {
+			d1_printf("reached stacking limit\n");
+			break;
+		}
+        stack_time_add(&st, imf->fr, progress, processing_dialog);
+	}
+
+    stack_time_to_header(&st, fr, progress, processing_dialog);
 
 	return 0;
 }
@@ -1776,6 +1909,330 @@ d3_printf("ccd_frame.stack_frames return ok\n");
     return fr;
 }
 
+/* stacking from disk: every frame is read from its fits file one strip of rows at a time,
+ * the strip is combined with the same tile kernels as stack_frames and written to the
+ * output file, so memory use is bounded by CCDRED_STACK_MEMORY and not by the number of frames */
+
+#define BG_SAMPLE_ROWS 64 // rows sampled per plane to estimate the background of a frame on disk
+
+/* estimate the background (median) of a frame on disk from evenly spaced rows; NAN for error */
+static double strip_background(struct fits_strip *fs)
+{
+    int rows = (fs->h < BG_SAMPLE_ROWS) ? fs->h : BG_SAMPLE_ROWS;
+    int n = rows * fs->nplanes;
+
+    float *buf = malloc((size_t) n * fs->w * sizeof(float));
+    if (buf == NULL) return NAN;
+
+    int i;
+    for (i = 0; i < n; i++) {
+        int y = (i % rows + 0.5) * fs->h / rows;
+        if (fits_strip_read(fs, i / rows, y, 1, buf + (size_t) i * fs->w)) {
+            free(buf);
+            return NAN;
+        }
+    }
+
+    double median = fmedian(buf, n * fs->w);
+    free(buf);
+
+    return median;
+}
+
+struct strip_read_job {
+    struct fits_strip **fs;
+    struct combine_job *cj;     // strip buffers are cj->src
+    double *m;                  // background alignment, pixel * m + a
+    double *a;
+    int y0;
+    int rows;
+};
+
+/* read the current strip of frames [i0, i1) for one plane */
+static int strip_read_frames(void *data, int plane, int i0, int i1)
+{
+    struct strip_read_job *job = data;
+    int i;
+
+    for (i = i0; i < i1; i++) {
+        float *dp = job->cj->src[plane][i];
+
+        if (fits_strip_read(job->fs[i], plane, job->y0, job->rows, dp))
+            return -1;
+
+        if (job->m[i] != 1.0 || job->a[i] != 0.0) {
+            size_t k, all = (size_t) job->rows * job->fs[i]->w;
+            for (k = 0; k < all; k++, dp++)
+                *dp = *dp * job->m[i] + job->a[i];
+        }
+    }
+    return 0;
+}
+
+/* batch stack of the non-skipped frames of imfl into the fits file outf, reading the frames
+ * in strips. The files are used as found on disk; only background alignment is applied.
+ * return 0 for ok, -1 for error */
+static int stack_frames_tiled(struct image_file_list *imfl, struct ccd_reduce *ccdr, char *outf,
+         progress_print_func progress, gpointer processing_dialog)
+{
+    int n = 0;
+
+    GList *gl;
+    for (gl = imfl->imlist; gl != NULL; gl = g_list_next(gl)) {
+        struct image_file *imf = gl->data;
+        if (! (imf->state_flags & IMG_STATE_SKIP)) n++;
+    }
+    if (n == 0) {
+        err_printf("stack_frames_tiled: No frames to stack\n");
+        return -1;
+    }
+
+    int ret = -1;
+
+    struct fits_strip **fs = calloc(n, sizeof(struct fits_strip *));
+    struct fits_strip *out = NULL;
+    struct ccd_frame *ohd = NULL; // output header, from the first frame
+    double *m = malloc(n * sizeof(double));
+    double *a = malloc(n * sizeof(double));
+    float *am = malloc(n * sizeof(float));
+    float **src = malloc(4 * n * sizeof(float *));
+    int *stride = malloc(n * sizeof(int));
+    float *buf = NULL;
+    float *obuf = NULL;
+
+    if (fs == NULL || m == NULL || a == NULL || am == NULL || src == NULL || stride == NULL) {
+        err_printf("stack_frames_tiled: cannot alloc frame tables\n");
+        goto err_exit;
+    }
+
+/* read the headers: output size, noise and time totals, background alignment */
+    struct stack_time st = { 0 };
+    st.am = am;
+
+    double b = 0, rdnsq = 0, fln = 0, sc = 0;
+    int ow = 0, oh = 0, nplanes = 0;
+
+    int bg_align = ccdr->op_flags & (IMG_OP_BG_ALIGN_ADD | IMG_OP_BG_ALIGN_MUL);
+    double bg = (ccdr->state_flags & IMG_STATE_BG_VAL_SET) ? ccdr->bg : NAN;
+
+    int i = 0;
+    for (gl = imfl->imlist; gl != NULL; gl = g_list_next(gl)) {
+        struct image_file *imf = gl->data;
+        if (imf->state_flags & IMG_STATE_SKIP) continue;
+
+        struct ccd_frame *hd = NULL;
+        fs[i] = fits_strip_open(imf->filename, P_INT(FILE_UNSIGNED_FITS), &hd);
+        if (fs[i] == NULL) {
+            err_printf("stack_frames_tiled: cannot read %s from disk\n", imf->filename);
+            goto err_exit;
+        }
+
+        if (nplanes == 0) nplanes = fs[i]->nplanes;
+        if (fs[i]->nplanes != nplanes) {
+            err_printf("stack_frames_tiled: %s has a different number of planes\n", imf->filename);
+            release_frame(hd, "stack_frames_tiled");
+            goto err_exit;
+        }
+
+        m[i] = 1.0;
+        a[i] = 0.0;
+        if (bg_align) {
+            double median = strip_background(fs[i]);
+            if (isnan(bg)) {
+                bg = median;
+                ccdr->bg = bg;
+                ccdr->state_flags |= IMG_STATE_BG_VAL_SET;
+            }
+
+            if (ccdr->op_flags & IMG_OP_BG_ALIGN_MUL) {
+                if (median > 0)
+                    m[i] = bg / median;
+                else
+                    PROGRESS_MESSAGE("%s: background too low for bg_align_mul\n", imf->filename)
+            } else if (! isnan(median)) {
+                a[i] = bg - median;
+            }
+            // as scale_shift_frame does for a loaded frame
+            hd->exp.bias = hd->exp.bias * m[i] + a[i];
+            hd->exp.scale /= fabs(m[i]);
+            hd->exp.rdnoise *= fabs(m[i]);
+        }
+
+        if (ow == 0 || fs[i]->w < ow)
+            ow = fs[i]->w;
+        if (oh == 0 || fs[i]->h < oh)
+            oh = fs[i]->h;
+
+        b += hd->exp.bias;
+        rdnsq += sqr(hd->exp.rdnoise);
+        fln += hd->exp.flat_noise;
+        sc += hd->exp.scale;
+
+        stack_time_add(&st, hd, progress, processing_dialog);
+
+        if (ohd == NULL)
+            ohd = hd;
+        else
+            release_frame(hd, "stack_frames_tiled");
+
+        i++;
+    }
+
+    tile_func combine = NULL;
+    double eff = 1.0;
+
+    switch(P_INT(CCDRED_STACK_METHOD)) {
+    case PAR_STACK_METHOD_AVERAGE:
+        eff = 1.0;
+        combine = tile_average;
+        fits_add_history_varg(ohd, "'AVERAGE STACK %d FRAMES'", n);
+        break;
+    case PAR_STACK_METHOD_KAPPA_SIGMA:
+        eff = 0.9;
+        combine = tile_ks;
+        PROGRESS_MESSAGE("kappa-sigma s=%.1f iter=%d (%d frames)\n", P_DBL(CCDRED_SIGMAS), P_INT(CCDRED_ITER), n)
+        fits_add_history_varg(ohd, "'KAPPA-SIGMA STACK (s=%.1f) of %d FRAMES'", P_DBL(CCDRED_SIGMAS), n);
+        break;
+    case PAR_STACK_METHOD_MEDIAN:
+        eff = 0.65;
+        combine = tile_median;
+        fits_add_history_varg(ohd, "'MEDIAN STACK of %d FRAMES'", n);
+        break;
+    case PAR_STACK_METHOD_MEAN_MEDIAN:
+        eff = 0.85;
+        combine = tile_mmedian;
+        PROGRESS_MESSAGE("mean-median s=%.1f (%d frames)\n", P_DBL(CCDRED_SIGMAS), n)
+        fits_add_history_varg(ohd, "'MEAN_MEDIAN STACK (s=%.1f) of %d FRAMES'", P_DBL(CCDRED_SIGMAS), n);
+        break;
+    default:
+        err_printf("unknown/unsupported stacking method %d\n", P_INT(CCDRED_STACK_METHOD));
+        goto err_exit;
+    }
+
+    stack_time_to_header(&st, ohd, progress, processing_dialog);
+
+    ohd->exp.rdnoise = sqrt(rdnsq) / n / eff;
+    ohd->exp.flat_noise = fln / n;
+    ohd->exp.scale = sc;
+
+    double bias = b / n; // subtracted from the output, as stack_frames does
+    ohd->exp.bias = 0.0;
+    noise_to_fits_header(ohd);
+
+/* size the strips to the memory budget */
+    size_t row_bytes = (size_t) ow * nplanes * sizeof(float);
+    for (i = 0; i < n; i++)
+        row_bytes += (size_t) fs[i]->w * nplanes * sizeof(float);
+
+    size_t budget = (size_t) P_INT(CCDRED_STACK_MEMORY) * 1024 * 1024;
+    size_t budget_rows = budget / row_bytes;
+    int rows = (budget_rows < (size_t) oh) ? budget_rows : oh;
+    if (rows < 1) {
+        PROGRESS_MESSAGE("stack memory of %d MB is less than one row of every frame, using %.1f MB\n",
+                         P_INT(CCDRED_STACK_MEMORY), row_bytes / 1048576.0)
+        rows = 1;
+    }
+
+    buf = malloc((row_bytes - (size_t) ow * nplanes * sizeof(float)) * rows);
+    obuf = malloc((size_t) ow * nplanes * rows * sizeof(float));
+    if (buf == NULL || obuf == NULL) {
+        err_printf("stack_frames_tiled: cannot alloc strip buffers for %d rows\n", rows);
+        goto err_exit;
+    }
+
+    struct combine_job job = { 0 };
+
+    job.combine = combine;
+    job.n = n;
+    job.stride = stride;
+    job.w = ow;
+    job.sigmas = P_DBL(CCDRED_SIGMAS);
+    job.iter = P_INT(CCDRED_ITER);
+    job.window = ccdr->window;
+    job.dots = -1;
+
+    int p;
+    float *bp = buf;
+    for (p = 0; p < nplanes; p++) {
+        job.src[p] = src + p * n;
+        job.dst[p] = obuf + (size_t) p * ow * rows;
+    }
+    for (i = 0; i < n; i++) {
+        stride[i] = fs[i]->w;
+        for (p = 0; p < nplanes; p++) {
+            job.src[p][i] = bp;
+            bp += (size_t) fs[i]->w * rows;
+        }
+    }
+
+    struct strip_read_job rj = { fs, &job, m, a, 0, 0 };
+
+    out = fits_strip_create(outf, ohd, ow, oh, nplanes);
+    if (out == NULL) goto err_exit;
+
+    PROGRESS_MESSAGE("Frame stack from disk: output size %d x %d, %d rows per strip\n", ow, oh, rows)
+
+/* read, combine and write one strip at a time */
+    int dots = 0;
+    int y0;
+    for (y0 = 0; y0 < oh; y0 += rows) {
+        int r = (y0 + rows < oh) ? rows : oh - y0;
+
+        rj.y0 = y0;
+        rj.rows = r;
+        if (parallel_rows(n, nplanes, 1, strip_read_frames, &rj, combine_poll, &job))
+            goto err_exit;
+
+        if (parallel_rows(r, nplanes, 0, combine_rows, &job, combine_poll, &job))
+            goto err_exit;
+
+        for (p = 0; p < nplanes; p++) {
+            if (bias != 0.0) {
+                float *dp = job.dst[p];
+                size_t k, all = (size_t) ow * r;
+                for (k = 0; k < all; k++, dp++)
+                    *dp = *dp - bias;
+            }
+            if (fits_strip_write(out, p, y0, r, job.dst[p]))
+                goto err_exit;
+        }
+
+        if (progress) {
+            while (dots < (y0 + r) * 16 / oh) {
+                dots++;
+                if ((* progress)(".", processing_dialog)) {
+                    d1_printf("aborted\n");
+                    goto err_exit;
+                }
+            }
+        }
+    }
+    if (progress) (* progress)("\n", processing_dialog);
+
+    ret = fits_strip_close(out);
+    out = NULL;
+
+    if (ret == 0) PROGRESS_MESSAGE("%d frames stacked to %s\n", n, outf)
+
+err_exit:
+    if (out) fits_strip_close(out);
+    if (fs) {
+        for (i = 0; i < n; i++)
+            if (fs[i]) fits_strip_close(fs[i]);
+        free(fs);
+    }
+    if (ohd) release_frame(ohd, "stack_frames_tiled");
+    if (m) free(m);
+    if (a) free(a);
+    if (am) free(am);
+    if (src) free(src);
+    if (stride) free(stride);
+    if (buf) free(buf);
+    if (obuf) free(obuf);
+
+    return ret;
+}
+
 static double star_size_flux(double flux, double ref_flux, double fwhm)
 {
 	double size;
@@ -1965,8 +2422,10 @@ int align_imf_new(struct image_file *imf, struct ccd_reduce *ccdr, progress_prin
                 double dt = degrad(dtheta);
 //                warp_frame(imf->fr, -dx, -dy, -dt); /* use opencv */
 
-                if (rotate) rotate_frame(imf->fr, -dt);
-                shift_frame(imf->fr, -dx, -dy);
+                // pairs_fit rotates about the origin; shift and rotate in one resampling pass
+                struct ctrans ct;
+                make_align_ctrans(&ct, dx, dy, rotate ? dt : 0, 0, 0);
+                resample_frame(imf->fr, &ct, P_INT(CCDRED_ALIGN_RESAMPLE));
 
                 struct wcs *wcs = & imf->fr->fim;
                 if (wcs->wcsset == WCS_VALID) {
@@ -2162,9 +2621,10 @@ int align_imf(struct image_file *imf, struct ccd_reduce *ccdr, progress_print_fu
 
                             PROGRESS_MESSAGE( " (x,y)[%.1f, %.1f]", dx, dy );
 
-                            if (rotate) rotate_frame(imf->fr, -dt);
-
-                            shift_frame(imf->fr, -dx, -dy);
+                            // dx, dy were measured on the copy rotated about the frame center
+                            struct ctrans ct;
+                            make_align_ctrans(&ct, dx, dy, rotate ? dt : 0, imf->fr->w / 2.0, imf->fr->h / 2.0);
+                            resample_frame(imf->fr, &ct, P_INT(CCDRED_ALIGN_RESAMPLE));
 
 // doesn't work
 //                           adjust_wcs(wcs, 0, 0, 1, -dtheta);
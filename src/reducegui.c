@@ -1489,6 +1489,7 @@ static void ccdred_run_cb(GtkAction *action, gpointer processing_dialog)
             imf_display_cb (NULL, processing_dialog); // before run
 
             if ((ccdr->state_flags & IMG_STATE_BG_VAL_SET) == 0) { // bg before processing
+                frame_stats(imf->fr);
                 ccdr->bg = imf->fr->stats.median;
             //        ccdr->bg = imf->fr->stats.avg;
                 ccdr->state_flags |= IMG_STATE_BG_VAL_SET;
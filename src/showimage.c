@@ -190,6 +190,9 @@ d3_printf("release map cache, free cache %p\n", cache->dat);
 }
 
 
+static void tile_cache_reset(struct tile_cache *tc);
+static void release_tile_cache(struct tile_cache *tc);
+
 /*
  * create a image channel; returns NULL for error
  */
@@ -252,6 +255,8 @@ void release_image_channel(struct image_channel *channel)
 		if (channel->ref_count == 1) {
             if (channel->fr) release_frame(channel->fr, "release_image_channel");
             if (channel->cache)	release_map_cache(channel->cache);
+            image_channel_data_changed(channel);
+            if (channel->tiles) release_tile_cache(channel->tiles);
 			free(channel);
 			return;
 		}
@@ -259,6 +264,83 @@ void release_image_channel(struct image_channel *channel)
 	}
 }
 
+/*
+ * the pixels of channel->fr have changed (or it is a new frame): drop the
+ * rendered tiles and the zoom-out pyramid and have the display redrawn
+ */
+void image_channel_data_changed(struct image_channel *channel)
+{
+	int k;
+
+	if (channel->tiles)
+		tile_cache_reset(channel->tiles);
+
+	for (k = 1; k <= MIP_LEVELS; k++) {
+		if (channel->mip[k].dat) free(channel->mip[k].dat);
+		channel->mip[k].dat = NULL;
+		channel->mip[k].w = channel->mip[k].h = 0;
+	}
+	channel->channel_changed = 1;
+}
+
+/*
+ * get pyramid level k (1 .. MIP_LEVELS) of a float channel, building it (and
+ * the levels above it) from the frame if needed. Return NULL if it cannot be
+ * built within MIP_MAX_BYTES
+ */
+static struct mip_level *channel_mip_level(struct image_channel *channel, int k)
+{
+	struct ccd_frame *fr = channel->fr;
+	gint64 t0 = g_get_monotonic_time();
+	int i;
+
+	if (channel->mip[k].dat)
+		return &channel->mip[k];
+
+	if (fr->w >> k < 1 || fr->h >> k < 1)
+		return NULL;
+
+	size_t bytes = 0; // the whole pyramid down to level k
+	for (i = 1; i <= k; i++)
+		bytes += (size_t) (fr->w >> i) * (fr->h >> i) * sizeof(float);
+	if (bytes > MIP_MAX_BYTES)
+		return NULL;
+
+	float *src = (float *)fr->dat;
+	int sw = fr->w;
+
+	if (k > 1) {
+		struct mip_level *up = channel_mip_level(channel, k - 1);
+		if (up == NULL) return NULL;
+		src = up->dat;
+		sw = up->w;
+	}
+
+	struct mip_level *ml = &channel->mip[k];
+	ml->w = fr->w >> k;
+	ml->h = fr->h >> k;
+	ml->dat = malloc((size_t) ml->w * ml->h * sizeof(float));
+	if (ml->dat == NULL) {
+		err_printf("channel_mip_level: cannot alloc level %d\n", k);
+		ml->w = ml->h = 0;
+		return NULL;
+	}
+
+	// each pixel is the average of a 2x2 block of the level above
+	int x, y;
+	for (y = 0; y < ml->h; y++) {
+		float *s0 = src + 2 * y * sw;
+		float *s1 = s0 + sw;
+		float *d = ml->dat + y * ml->w;
+		for (x = 0; x < ml->w; x++)
+			d[x] = (s0[2 * x] + s0[2 * x + 1] + s1[2 * x] + s1[2 * x + 1]) * 0.25f;
+	}
+
+	d3_printf("channel_mip_level: built level %d (%d x %d) in %.1f ms\n", k, ml->w, ml->h,
+		  (g_get_monotonic_time() - t0) / 1000.0);
+	return ml;
+}
+
 /*
  * return 1 if the requested area is inside the cache
  */
@@ -672,22 +754,43 @@ static void cache_render_float_zo(struct map_cache *cache, struct image_channel
 	unsigned char *cdat = cache->dat;
 	unsigned char pix;
 
-	float avgf = 1.0 / (zoom * zoom);
-	float pixf;
-
-	int fj2, xx, yy;
-
 	cache->x = fx / zoom;
 	cache->y = fy / zoom;
 
 	cache->w = fw / zoom;
 	cache->h = fh / zoom;
 
-	fdat = (float *)fr->dat + fx + fy * fr->w;
+	/* read from the pyramid level whose blocks tile the zoom x zoom blocks:
+	 * the largest power of two dividing zoom that can be had */
+	float *src = (float *)fr->dat;
+	int sw = fr->w;
+	int k;
+
+	for (k = MIP_LEVELS; k > 0; k--) {
+		if (zoom % (1 << k)) continue;
+
+		struct mip_level *ml = channel_mip_level(channel, k);
+		if (ml == NULL) continue;
+
+		src = ml->dat;
+		sw = ml->w;
+		zoom >>= k;
+		fx >>= k;
+		fy >>= k;
+		fw >>= k;
+		break;
+	}
+
+	float avgf = 1.0 / (zoom * zoom);
+	float pixf;
+
+	int fj2, xx, yy;
+
+	fdat = src + fx + fy * sw;
 	fd0 = fdat;
 
-	fjump = fr->w - fw + (zoom - 1) * fr->w;
-	fj2 = fr->w - zoom; /* jump from last pixel in zoom row to first one in the next row */
+	fjump = sw - cache->w * zoom + (zoom - 1) * sw;
+	fj2 = sw - zoom; /* jump from last pixel in zoom row to first one in the next row */
 
 //	d3_printf("zoom %d, fjump:%d, fj2:%d, fj3:%d\n", zoom, fjump, fj2, fj3);
 
@@ -824,49 +927,29 @@ static unsigned cached_area_size(GdkRectangle *area, struct map_cache *cache)
 
 
 /*
- * update the cache so that it contains a representation of the given area
+ * render the given display area at zoom into cache, which must be large
+ * enough (see cached_area_size). The frame region drawn is returned in
+ * fx, fy, fw, fh
  */
-static void update_cache(struct map_cache *cache,
-		       struct map_geometry *geom, struct image_channel *channel,
-		       GdkRectangle *area)
+static void render_area(struct map_cache *cache, double zoom,
+			struct image_channel *channel, GdkRectangle *area,
+			int *fxp, int *fyp, int *fwp, int *fhp)
 {
 	struct ccd_frame *fr;
 	int fx, fy, fw, fh;
 	int zoom_in = 1;
 	int zoom_out = 1;
+	gint64 t0 = g_get_monotonic_time();
 
-	if (geom->zoom > 1.0 && geom->zoom <= 16.0) {
-		zoom_in = floor(geom->zoom + 0.5);
-	} else if (geom->zoom < 1.0 && geom->zoom >= (1.0 / 16.0)) {
-		zoom_out = floor(1.0 / geom->zoom + 0.5);
+	if (zoom > 1.0 && zoom <= 16.0) {
+		zoom_in = floor(zoom + 0.5);
+	} else if (zoom < 1.0 && zoom >= (1.0 / 16.0)) {
+		zoom_out = floor(1.0 / zoom + 0.5);
 	}
-	cache->zoom = geom->zoom;
+	cache->zoom = zoom;
 
 	fr = channel->fr;
-	if (cached_area_size(area, cache) > cache->size) {
-/* free the cache and realloc */
-d3_printf("update cache, freeing old cache %p\n");
-		free(cache->dat);
-		cache->dat = NULL;
-	}
-
-	if (cache->dat == NULL) { /* we need to alloc (new) data area */
-
-		void *dat;
-		if (channel->color)
-			cache->type = MAP_CACHE_RGB;
-		else
-			cache->type = MAP_CACHE_GRAY;
 
-		cache->size = cached_area_size(area, cache);
-		dat = malloc(cache->size);
-d3_printf("update cache %p %d\n", dat, cache->size);
-		if (dat == NULL) {
-			err_printf("update cache: alloc error\n");
-			return ;
-		}
-		cache->dat = dat;
-	}
 //	d3_printf("expose area is %d by %d starting at %d, %d\n",
 //		  area->width, area->height, area->x, area->y);
 /* calculate the frame coords for the exposed area */
@@ -919,6 +1002,50 @@ d3_printf("update cache %p %d\n", dat, cache->size);
 	default:
 		err_printf("update cache: unsupported frame format %d\n", fr->pix_format);
 	}
+	d3_printf("render_area: %d x %d at zoom %.3g in %.1f ms\n", fw, fh, zoom,
+		  (g_get_monotonic_time() - t0) / 1000.0);
+
+	*fxp = fx;
+	*fyp = fy;
+	*fwp = fw;
+	*fhp = fh;
+}
+
+/*
+ * update the cache so that it contains a representation of the given area
+ */
+static void update_cache(struct map_cache *cache,
+		       struct map_geometry *geom, struct image_channel *channel,
+		       GdkRectangle *area)
+{
+	int fx, fy, fw, fh;
+
+	if (cached_area_size(area, cache) > cache->size) {
+/* free the cache and realloc */
+d3_printf("update cache, freeing old cache %p\n");
+		free(cache->dat);
+		cache->dat = NULL;
+	}
+
+	if (cache->dat == NULL) { /* we need to alloc (new) data area */
+
+		void *dat;
+		if (channel->color)
+			cache->type = MAP_CACHE_RGB;
+		else
+			cache->type = MAP_CACHE_GRAY;
+
+		cache->size = cached_area_size(area, cache);
+		dat = malloc(cache->size);
+d3_printf("update cache %p %d\n", dat, cache->size);
+		if (dat == NULL) {
+			err_printf("update cache: alloc error\n");
+			return ;
+		}
+		cache->dat = dat;
+	}
+
+	render_area(cache, geom->zoom, channel, area, &fx, &fy, &fw, &fh);
 
     // this should be the visible rectangle area
     channel->x = fx;
@@ -970,6 +1097,325 @@ void paint_from_rgb_cache(GtkWidget *widget, struct map_cache *cache, GdkRectang
 }
 
 
+/*
+ * background tile rendering for the image window
+ *
+ * The display is split into TILE_SIZE x TILE_SIZE tiles (in display
+ * pixels). Tiles are rendered by worker threads into a cache kept per
+ * channel, keyed by tile position; the cache is dropped when the zoom
+ * changes. Each tile remembers the generation of the channel it was drawn
+ * from: a lut change bumps the generation, and the old tile is painted
+ * until its replacement is ready. Tiles never rendered are filled with the
+ * window background.
+ */
+#define TILE_SIZE 256
+#define TILE_CACHE_MAX 512 /* tiles kept before the ones out of view are dropped */
+
+struct render_tile {
+	gint64 key;		/* (ty << 32) | tx */
+	unsigned gen;		/* generation the tile was drawn from, 0 = not drawn */
+	unsigned req_gen;	/* last generation requested from the workers */
+	unsigned used;		/* serial of the last expose that painted it */
+	struct map_cache *mc;
+};
+
+struct tile_cache {
+	int ref_count;		/* channel + pending jobs; main thread only */
+	GtkWidget *widget;	/* the drawing area */
+	GHashTable *tiles;
+	double zoom;		/* zoom the tiles were drawn at */
+	unsigned gen;		/* current channel generation */
+	unsigned serial;	/* expose counter */
+	GMutex lock;		/* protects epoch and rendering */
+	GCond idle_cond;
+	unsigned epoch;		/* bumped when the frame data changes; older jobs are dropped */
+	int rendering;		/* jobs running now */
+};
+
+struct tile_job {
+	struct tile_cache *tc;
+	gint64 key;
+	int tx, ty;
+	double zoom;
+	unsigned gen;
+	unsigned epoch;
+	struct image_channel chan;	/* snapshot of the channel, chan.fr is reffed */
+	float *mip_dat[MIP_LEVELS + 1];	/* pyramid levels shared with the channel */
+	struct map_cache *mc;		/* the result */
+};
+
+static GThreadPool *tile_pool = NULL;
+
+static void free_render_tile(struct render_tile *t)
+{
+	if (t->mc) release_map_cache(t->mc);
+	free(t);
+}
+
+static struct tile_cache *new_tile_cache(GtkWidget *widget)
+{
+	struct tile_cache *tc = calloc(1, sizeof(struct tile_cache));
+	if (tc == NULL) {
+		err_printf("new_tile_cache: alloc error\n");
+		return NULL;
+	}
+	tc->ref_count = 1;
+	tc->widget = widget;
+	g_object_ref(widget);
+	tc->tiles = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)free_render_tile);
+	tc->gen = 1;
+	g_mutex_init(&tc->lock);
+	g_cond_init(&tc->idle_cond);
+	return tc;
+}
+
+static void release_tile_cache(struct tile_cache *tc)
+{
+	if (--tc->ref_count > 0) return;
+
+	g_hash_table_destroy(tc->tiles);
+	g_object_unref(tc->widget);
+	g_mutex_clear(&tc->lock);
+	g_cond_clear(&tc->idle_cond);
+	free(tc);
+}
+
+/* drop the jobs in flight and wait for the running ones to finish, so the
+ * channel pixels and pyramid can be changed */
+static void tile_cache_cancel(struct tile_cache *tc)
+{
+	g_mutex_lock(&tc->lock);
+	tc->epoch++;
+	while (tc->rendering > 0)
+		g_cond_wait(&tc->idle_cond, &tc->lock);
+	g_mutex_unlock(&tc->lock);
+}
+
+/* drop all tiles, after the frame data has changed */
+static void tile_cache_reset(struct tile_cache *tc)
+{
+	tile_cache_cancel(tc);
+	g_hash_table_remove_all(tc->tiles);
+}
+
+/* install a finished tile; runs on the main thread */
+static gboolean tile_done_idle(gpointer data)
+{
+	struct tile_job *job = data;
+	struct tile_cache *tc = job->tc;
+
+	if (job->mc && job->epoch == tc->epoch && job->zoom == tc->zoom) {
+		struct render_tile *t = g_hash_table_lookup(tc->tiles, &job->key);
+		if (t && job->gen > t->gen) {
+			if (t->mc) release_map_cache(t->mc);
+			t->mc = job->mc;
+			t->gen = job->gen;
+			job->mc = NULL;
+
+			if (gtk_widget_get_window(tc->widget))
+				gtk_widget_queue_draw_area(tc->widget, t->mc->x, t->mc->y, t->mc->w, t->mc->h);
+		}
+	}
+
+	if (job->mc) release_map_cache(job->mc);
+	release_frame(job->chan.fr, "tile_done_idle");
+	release_tile_cache(tc);
+	free(job);
+	return FALSE;
+}
+
+static void tile_render_worker(gpointer data, gpointer user_data)
+{
+	struct tile_job *job = data;
+	struct tile_cache *tc = job->tc;
+	int k;
+
+	// in-place operations on the frame hold the write lock; take the read lock
+	// before counting as rendering, so tile_cache_cancel does not wait on us then
+	frame_pixels_read_lock(job->chan.fr);
+
+	g_mutex_lock(&tc->lock);
+	int stale = (job->epoch != tc->epoch);
+	if (! stale) tc->rendering++;
+	g_mutex_unlock(&tc->lock);
+
+	if (! stale) {
+		GdkRectangle area;
+		int fx, fy, fw, fh;
+
+		area.x = job->tx * TILE_SIZE;
+		area.y = job->ty * TILE_SIZE;
+		area.width = TILE_SIZE;
+		area.height = TILE_SIZE;
+
+		int type = job->chan.color ? MAP_CACHE_RGB : MAP_CACHE_GRAY;
+		job->mc = new_map_cache(NULL, (TILE_SIZE + 2 * MAX_ZOOM) * (TILE_SIZE + 2 * MAX_ZOOM), type);
+		if (job->mc)
+			render_area(job->mc, job->zoom, &job->chan, &area, &fx, &fy, &fw, &fh);
+
+		g_mutex_lock(&tc->lock);
+		tc->rendering--;
+		g_cond_signal(&tc->idle_cond);
+		g_mutex_unlock(&tc->lock);
+	}
+
+	frame_pixels_read_unlock(job->chan.fr);
+
+	// levels this job had to build for itself are not shared
+	for (k = 1; k <= MIP_LEVELS; k++)
+		if (job->chan.mip[k].dat != job->mip_dat[k])
+			free(job->chan.mip[k].dat);
+
+	g_idle_add(tile_done_idle, job);
+}
+
+/* queue tile (tx, ty) of the channel for rendering at the current generation */
+static void request_tile(struct tile_cache *tc, struct render_tile *t, struct image_channel *channel, int tx, int ty)
+{
+	int k;
+
+	if (tile_pool == NULL) {
+		tile_pool = g_thread_pool_new(tile_render_worker, NULL, ccd_threads(), FALSE, NULL);
+		if (tile_pool == NULL) return;
+	}
+
+	struct tile_job *job = calloc(1, sizeof(struct tile_job));
+	if (job == NULL) {
+		err_printf("request_tile: alloc error\n");
+		return;
+	}
+
+	job->tc = tc;
+	job->key = t->key;
+	job->tx = tx;
+	job->ty = ty;
+	job->zoom = tc->zoom;
+	job->gen = tc->gen;
+	job->epoch = tc->epoch;
+	job->chan = *channel;
+	job->chan.cache = NULL;
+	job->chan.tiles = NULL;
+	for (k = 1; k <= MIP_LEVELS; k++)
+		job->mip_dat[k] = channel->mip[k].dat;
+
+	get_frame(channel->fr, "request_tile");
+	tc->ref_count++;
+
+	if (! g_thread_pool_push(tile_pool, job, NULL)) {
+		release_frame(channel->fr, "request_tile");
+		tc->ref_count--;
+		free(job);
+		return;
+	}
+	t->req_gen = tc->gen;
+}
+
+/* paint area of the window from the tile cache, queueing the tiles that
+ * are missing or out of date */
+static void paint_from_tiles(GtkWidget *widget, struct tile_cache *tc, struct image_channel *channel,
+			     double zoom, GdkRectangle *area)
+{
+	struct ccd_frame *fr = channel->fr;
+	int zoom_in = 1;
+	int zoom_out = 1;
+	int k, tx, ty;
+
+	if (zoom > 1.0 && zoom <= 16.0) {
+		zoom_in = floor(zoom + 0.5);
+	} else if (zoom < 1.0 && zoom >= (1.0 / 16.0)) {
+		zoom_out = floor(1.0 / zoom + 0.5);
+	}
+
+	if (channel->channel_changed) {
+		tc->gen++;
+		channel->channel_changed = 0;
+	}
+	if (tc->zoom != zoom) {
+		g_hash_table_remove_all(tc->tiles);
+		tc->zoom = zoom;
+	}
+	tc->serial++;
+
+	// build the pyramid level the workers will read here, so it is shared
+	if (zoom_out > 1 && ! channel->color)
+		for (k = MIP_LEVELS; k > 0; k--)
+			if (zoom_out % (1 << k) == 0 && channel_mip_level(channel, k))
+				break;
+
+	int dw = fr->w * zoom_in / zoom_out; // size of the frame on the display
+	int dh = fr->h * zoom_in / zoom_out;
+
+	int x0 = area->x, y0 = area->y;
+	int x1 = MIN(area->x + area->width, dw);
+	int y1 = MIN(area->y + area->height, dh);
+
+	for (ty = y0 / TILE_SIZE; ty * TILE_SIZE < y1; ty++) {
+		for (tx = x0 / TILE_SIZE; tx * TILE_SIZE < x1; tx++) {
+			gint64 key = ((gint64) ty << 32) | tx;
+			struct render_tile *t = g_hash_table_lookup(tc->tiles, &key);
+
+			if (t == NULL) {
+				t = calloc(1, sizeof(struct render_tile));
+				if (t == NULL) {
+					err_printf("paint_from_tiles: alloc error\n");
+					return;
+				}
+				t->key = key;
+				g_hash_table_insert(tc->tiles, &t->key, t);
+			}
+			t->used = tc->serial;
+
+			if (t->gen < tc->gen && t->req_gen < tc->gen)
+				request_tile(tc, t, channel, tx, ty);
+
+			GdkRectangle tr, r;
+			tr.x = tx * TILE_SIZE;
+			tr.y = ty * TILE_SIZE;
+			tr.width = TILE_SIZE;
+			tr.height = TILE_SIZE;
+			if (! gdk_rectangle_intersect(area, &tr, &r))
+				continue;
+
+			GdkRectangle cr, pr;
+			if (t->mc) {
+				cr.x = t->mc->x;
+				cr.y = t->mc->y;
+				cr.width = t->mc->w;
+				cr.height = t->mc->h;
+			}
+			if (t->mc && gdk_rectangle_intersect(&r, &cr, &pr)) {
+				if (t->mc->type == MAP_CACHE_GRAY)
+					paint_from_gray_cache(widget, t->mc, &pr);
+				else
+					paint_from_rgb_cache(widget, t->mc, &pr);
+			} else {
+				gdk_draw_rectangle(widget->window, widget->style->bg_gc[GTK_STATE_NORMAL], TRUE,
+						   r.x, r.y, r.width, r.height);
+			}
+		}
+	}
+
+	// the frame region of the exposed area
+	int fx = area->x * zoom_out / zoom_in;
+	int fy = area->y * zoom_out / zoom_in;
+	channel->x = MIN(fx, fr->w - 1);
+	channel->y = MIN(fy, fr->h - 1);
+	channel->width = MIN(area->width * zoom_out / zoom_in, fr->w - channel->x);
+	channel->height = MIN(area->height * zoom_out / zoom_in, fr->h - channel->y);
+
+	if (g_hash_table_size(tc->tiles) > TILE_CACHE_MAX) {
+		GHashTableIter iter;
+		gpointer value;
+
+		g_hash_table_iter_init(&iter, tc->tiles);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct render_tile *t = value;
+			if (t->used != tc->serial)
+				g_hash_table_iter_remove(&iter);
+		}
+	}
+}
+
 /*
  * an expose event to our image window
  * we only handle the i channel for now
@@ -988,6 +1434,22 @@ gboolean image_expose_cb(GtkWidget *widget, GdkEventExpose *event, gpointer wind
     struct map_geometry *geom = g_object_get_data(G_OBJECT(window), "geometry");
     if (geom == NULL) return TRUE; /* no geometry */
 
+    if (i_channel->fr->pix_format == PIX_FLOAT) {
+        if (i_channel->tiles && i_channel->tiles->widget != widget) {
+            tile_cache_cancel(i_channel->tiles);
+            release_tile_cache(i_channel->tiles);
+            i_channel->tiles = NULL;
+        }
+        if (i_channel->tiles == NULL)
+            i_channel->tiles = new_tile_cache(widget);
+
+        if (i_channel->tiles) {
+            paint_from_tiles(widget, i_channel->tiles, i_channel, geom->zoom, &(event->area));
+            draw_sources_hook(widget, window, &(event->area));
+            return TRUE;
+        }
+    }
+
     if ((!i_channel->color && cache->type != MAP_CACHE_GRAY) ||	(i_channel->color && cache->type != MAP_CACHE_RGB)) {
         d3_printf("expose: other cache type\n");
 d3_printf("image expose, free cache %p\n", cache->dat);
@@ -1077,10 +1539,11 @@ void frame_to_channel(struct ccd_frame *fr, gpointer window, char *chname)
 
     get_frame(fr, "frame_to_channel");
     channel->fr = fr;
+    image_channel_data_changed(channel);
 
-    if (! fr->stats.statsok) frame_stats(fr);
+    struct im_stats *st = frame_stats_sampled(fr, STATS_SAMPLE_STEP); // display only, full stats are made when needed
 
-    if (new_channel && fr->stats.statsok && fr->pix_format != PIX_BYTE ) set_default_channel_cuts(channel);
+    if (new_channel && st && fr->pix_format != PIX_BYTE ) set_default_channel_cuts(channel);
 
 	int w, h, x, y, d;
 
@@ -1103,7 +1566,7 @@ void frame_to_channel(struct ccd_frame *fr, gpointer window, char *chname)
 	channel->color = 0;
     if (fr->magic & FRAME_VALID_RGB) channel->color = 1;
 
-    if (fr->stats.statsok && fr->pix_format != PIX_BYTE) channel->davg = fr->stats.cavg;
+    if (st && fr->pix_format != PIX_BYTE) channel->davg = st->cavg;
 
     struct wcs *wcs = window_get_wcs(window);
     refresh_wcs(window);
@@ -366,7 +366,7 @@ void act_stars_add_synthetic (GtkAction *action, gpointer window)
 // assume largish counts so noise distribution is gaussian
 // monochrome image only
 
-        if (! dark_fr->stats.statsok) frame_stats(dark_fr);
+        frame_stats(dark_fr);
 
 //        struct exp_data exp;
 //        rescan_fits_exp(fr, &exp);
@@ -405,7 +405,7 @@ void act_stars_add_synthetic (GtkAction *action, gpointer window)
     }
 
     frame_stats(dark_fr);
-    i_channel->channel_changed = 1;
+    image_channel_data_changed(i_channel);
 	gtk_widget_queue_draw(GTK_WIDGET(window));
 	g_list_free(ssl);
 
@@ -20,12 +20,33 @@
 
 /* read tycho records from the tyc2.dat file */
 
+/* The catalogue is searched through a tiled copy of it, made next to tyc2.dat
+ * the first time it is needed (or with gcx --make-tycho2-index), or in the
+ * user's cache directory when the catalogue directory is read-only. The tiles
+ * record the size and mtime of tyc2.dat, and are made again when those change.
+ * The sky is cut in declination zones TYCHO2_ZONE_H high, and each zone in ra
+ * cells about as wide; the stars are packed by tile, so a search maps the few
+ * tiles it covers and scans only them. The file is mmapped and in host byte
+ * order:
+ *
+ *	struct tiles_header
+ *	uint32_t zone_first[zones + 1]	first tile of each zone
+ *	uint32_t tile_first[tiles + 1]	first star of each tile
+ *	struct tile_star stars[nstars]	by tile, ascending ra within a tile
+ */
+
 #define _GNU_SOURCE
 
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib.h>
 #ifdef HAVE_LIBGEN_H
 #include <libgen.h>
 #else
@@ -36,348 +57,546 @@
 #include "tycho2.h"
 #include "catalogs.h"
 
-#define TYCNRECS 2540000   // number of recordings
+#define TILES_MAGIC "GCXTYC2T"
+#define TILES_VERSION 2
+#define TILES_BYTE_ORDER 0x01020304
+
+#define POS_SCALE 1.0e7		// packed position units per degree
+#define MAG_SCALE 1000.0	// packed magnitude units per mag
+#define MAG_MISSING INT16_MIN
+
+struct tiles_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t zones;
+	uint32_t tiles;
+	uint32_t nstars;
+	float zone_h;
+	int64_t cat_size;	// of the tyc2.dat the tiles were made from
+	int64_t cat_mtime;
+};
+
+/* a star as packed in the tiles file */
+struct tile_star {
+	uint32_t ra;		// POS_SCALE units
+	int32_t dec;
+	int16_t vt, vterr, bt, bterr;	// MAG_SCALE units or MAG_MISSING
+	uint16_t raerr, decerr;	// mas
+	uint16_t tyc1, tyc2;
+	uint8_t tyc3;
+	uint8_t pad[3];
+};
+
+/* an open tiles file */
+struct tiles {
+	char *path;		// of the tyc2.dat it was made from
+	void *map;
+	size_t size;
+	struct tiles_header *hdr;
+	uint32_t *zone_first;
+	uint32_t *tile_first;
+	struct tile_star *stars;
+};
+
+static struct tiles *open_tiles = NULL; // the tiles of the last catalogue searched
+static char *failed_tiles = NULL; // catalogue whose tiles could not be made
+
+static int zone_of(double dec)
+{
+	int z = floor((dec + 90.0) / TYCHO2_ZONE_H);
+	int zones = ceil(180.0 / TYCHO2_ZONE_H);
 
-static char tyb[300];      // buffer for one tycho record
+	if (z < 0) return 0;
+	if (z >= zones) return zones - 1;
+	return z;
+}
 
-typedef struct ixent {     // index entry
-	float param;             // parameter to sort by
-	long  offs;              // offset in the tycho catalog (first entry is 0, second is 1)
-} IXENT;
+/* number of ra cells in zone z: enough for cells no wider than the zone is high
+ * at the zone edge nearest the equator */
+static int zone_cells(int z)
+{
+	double d0 = -90.0 + z * TYCHO2_ZONE_H;
+	double d1 = d0 + TYCHO2_ZONE_H;
+	double dmin = (d0 <= 0 && d1 >= 0) ? 0 : fmin(fabs(d0), fabs(d1));
+	int n = ceil(360.0 * cos(degrad(dmin)) / TYCHO2_ZONE_H - 1e-9);
 
-static int comp_ixent(const void *a, const void *b) {
-	if (a == NULL || b == NULL)
-		return 0;
-	if (((IXENT *)a)->param < ((IXENT *)b)->param)  // lots of isp
-		return -1;
-	if (((IXENT *)a)->param > ((IXENT *)b)->param)
-		return 1;
-	return 0;
+	return n < 1 ? 1 : n;
 }
 
-static int icomp_ixent(const void *a, const void *b) {
-	if ((a == NULL) || (b == NULL))
-		return 0;
-	if (((IXENT *)a)->offs < ((IXENT *)b)->offs)
-		return -1;
-	if (((IXENT *)a)->offs > ((IXENT *)b)->offs)
-		return 1;
+static int cell_of(double ra, int ncells)
+{
+	int c = floor(ra / 360.0 * ncells);
+
+	if (c < 0) return 0;
+	if (c >= ncells) return ncells - 1;
+	return c;
+}
+
+/* parse a field of a tyc2.dat record; return 0 if the field is blank */
+static int tyc_field(char *rec, int offs, double *v)
+{
+	char *endp;
+
+	*v = strtod(rec + offs, &endp);
+	return endp != rec + offs;
+}
+
+static int16_t pack_mag(char *rec, int offs)
+{
+	double v;
+
+	if (! tyc_field(rec, offs, &v)) return MAG_MISSING;
+	return lrint(v * MAG_SCALE);
+}
+
+static float unpack_mag(int16_t m, float missing)
+{
+	return (m == MAG_MISSING) ? missing : m / MAG_SCALE;
+}
+
+/* fill ts from a tyc2.dat record; stars without a mean position get their
+ * observed one. Return -1 if the record has no position */
+static int pack_record(char *rec, struct tile_star *ts)
+{
+	double ra, dec, v;
+
+	memset(ts, 0, sizeof(struct tile_star));
+
+	if (! tyc_field(rec, 15, &ra) || ! tyc_field(rec, 28, &dec)) {
+		if (! tyc_field(rec, 152, &ra) || ! tyc_field(rec, 165, &dec))
+			return -1;
+	}
+
+	if (ra < 0) ra += 360.0;
+	ts->ra = lrint(ra * POS_SCALE) % (uint32_t) lrint(360 * POS_SCALE);
+	ts->dec = lrint(dec * POS_SCALE);
+
+	ts->vt = pack_mag(rec, 123);
+	ts->vterr = pack_mag(rec, 130);
+	ts->bt = pack_mag(rec, 110);
+	ts->bterr = pack_mag(rec, 117);
+
+	if (tyc_field(rec, 57, &v)) ts->raerr = v;
+	if (tyc_field(rec, 61, &v)) ts->decerr = v;
+
+	ts->tyc1 = atoi(rec);
+	ts->tyc2 = atoi(rec + 5);
+	ts->tyc3 = atoi(rec + 11);
+
 	return 0;
 }
 
-/* create index files to the tycho catalog; needs write permission to
- * the directory containing the tyc2.dat file. return 0 if sucessfull */
-static int make_tycho2_indices(char *tycho,
-			       char *raix,
-			       char *decix,
-			       char *raixx,
-			       char *decixx) {
-	IXENT *rai;
-	IXENT *deci;
-	FILE *tf, *raf, *decf;
-	long radi[3600];  // index in raix of the first object at each 0.1deg
-	long decdi[3600]; // index in decix of the first object at each 0.1deg
-	int tyl;  // actual length of tycho
-	int i,rj,dj;
-	float a;
-
-	rai = (IXENT *)malloc(TYCNRECS * sizeof(IXENT));
-	deci = (IXENT *)malloc(TYCNRECS * sizeof(IXENT));
-	if ((rai==NULL) || (deci==NULL)) {
-		err_printf("No memory for indices\n");
-		return -1;
+static void unpack_star(struct tile_star *ts, struct tycho2_star *st)
+{
+	st->ra = ts->ra / POS_SCALE;
+	st->dec = ts->dec / POS_SCALE;
+	st->raerr = ts->raerr;
+	st->decerr = ts->decerr;
+	st->vt = unpack_mag(ts->vt, MAG_UNSET);
+	st->vterr = unpack_mag(ts->vterr, BIG_ERR);
+	st->bt = unpack_mag(ts->bt, MAG_UNSET);
+	st->bterr = unpack_mag(ts->bterr, BIG_ERR);
+	st->tyc1 = ts->tyc1;
+	st->tyc2 = ts->tyc2;
+	st->tyc3 = ts->tyc3;
+}
+
+static int tile_of(uint32_t *zone_first, struct tile_star *ts)
+{
+	int z = zone_of(ts->dec / POS_SCALE);
+
+	return zone_first[z] + cell_of(ts->ra / POS_SCALE, zone_first[z + 1] - zone_first[z]);
+}
+
+static int comp_star_ra(const void *a, const void *b)
+{
+	uint32_t ra = ((struct tile_star *)a)->ra;
+	uint32_t rb = ((struct tile_star *)b)->ra;
+
+	return (ra > rb) - (ra < rb);
+}
+
+/* return the name of the tiles file for catalogue path (malloced): next to
+ * the catalogue, or if cached in the user's cache directory, named after the
+ * catalogue path */
+static char *tiles_name(char *path, int cached)
+{
+	char *cat, *name = NULL;
+
+	if (cached) {
+		char *sum = g_compute_checksum_for_string(G_CHECKSUM_MD5, path, -1);
+		char *dir = g_build_filename(g_get_user_cache_dir(), "gcx", NULL);
+
+		if (asprintf(&name, "%s/%s-%s", dir, sum, TYCHO2_TILES_NAME) == -1)
+			name = NULL;
+
+		g_free(sum);
+		g_free(dir);
+		return name;
 	}
-	tf = fopen(tycho, "r");
-	if (tf==NULL) {
+
+	cat = strdup(path);
+	if (cat == NULL) return NULL;
+
+	if (asprintf(&name, "%s/%s", dirname(cat), TYCHO2_TILES_NAME) == -1)
+		name = NULL;
+
+	free(cat);
+	return name;
+}
+
+/* whether the directory of the catalogue at path is writable */
+static int cat_dir_writable(char *path)
+{
+	char *cat = strdup(path);
+	int ok;
+
+	if (cat == NULL) return 0;
+	ok = (access(dirname(cat), W_OK) == 0);
+	free(cat);
+	return ok;
+}
+
+/* make the tiled catalogue from the tyc2.dat file at path, next to it or in
+ * the user's cache directory if the catalogue directory is not writable.
+ * Return 0 if successful */
+int tycho2_make_tiles(char *path)
+{
+	struct tiles_header hdr;
+	struct tile_star *stars = NULL, *sorted = NULL;
+	uint32_t *zone_first = NULL, *tile_first = NULL, *fill = NULL;
+	char *name = NULL, *tmp = NULL;
+	char rec[TYCRECSZ + 1];
+	int nstars = 0, size = 0;
+	int zones, tiles, i, z, cached, ret = -1;
+	struct stat cst;
+	FILE *tf, *of;
+
+	tf = fopen(path, "r");
+	if (tf == NULL || fstat(fileno(tf), &cst)) {
 		err_printf("Invalid tycho catalog name\n");
+		if (tf) fclose(tf);
 		return -1;
 	}
 
-	i = 0;
-
-	while (!feof(tf) && i<TYCNRECS) {  // the second is needed for testing with shorter cat
-		if(fread(tyb,1,TYCRECSZ,tf)<TYCRECSZ)
-			break;
-		rai[i].offs = i;
-		deci[i].offs = i;
-		rai[i].param =  atof(tyb+15);
-		deci[i].param = atof(tyb+28);
-		i++;
-		if (!(i % 1000))
-			d3_printf("\r%10d", i);
+	rec[TYCRECSZ] = 0;
+	while (fread(rec, 1, TYCRECSZ, tf) == TYCRECSZ) {
+		if (nstars >= size) {
+			int nsize = size ? size * 2 : 1 << 20;
+			struct tile_star *ns = realloc(stars, nsize * sizeof(struct tile_star));
+			if (ns == NULL) {
+				err_printf("No memory for tycho2 tiles\n");
+				fclose(tf);
+				goto err_out;
+			}
+			stars = ns;
+			size = nsize;
+		}
+		if (pack_record(rec, stars + nstars) == 0)
+			nstars++;
 	}
-
-	tyl = i;
 	fclose(tf);
 
-	d3_printf("Sorting ra index ...\n");
-	qsort(rai,tyl,sizeof(IXENT),&comp_ixent);
-	d3_printf("Sorting dec index ...\n");
-	qsort(deci,tyl,sizeof(IXENT),&comp_ixent);
-
-	// build second level (direct) indices
-
-	rj = 0;
-	dj = 0;
-	for(a=0.0, i=0; a<360.0; a+=0.1, i++) {
-		while (rj<tyl && rai[rj].param<=a)
-			rj++;
-		while (dj<tyl && deci[dj].param<=(a-180.0))
-			dj++;
-		radi[i] = rj;
-		decdi[i] = dj;
-		d3_printf("%4d %4d %6.1f\n", rj, dj, a);
-	}
+	d3_printf("tycho2_make_tiles: %d stars\n", nstars);
 
-	raf = fopen(raixx, "w");
-	if (raf==NULL) {
-		err_printf("Can't open ra index index file for write\n");
-		return -1;
-	}
-	fwrite(radi,3600,sizeof(long),raf);
-	fclose(raf);
+	zones = zone_of(90.0) + 1;
+	zone_first = malloc((zones + 1) * sizeof(uint32_t));
+	if (zone_first == NULL) goto err_out;
 
-	decf = fopen(decixx, "w");
-	if (decf==NULL) {
-		err_printf("Can't open dec index index file for write\n");
-		return -1;
+	for (tiles = 0, z = 0; z < zones; z++) {
+		zone_first[z] = tiles;
+		tiles += zone_cells(z);
 	}
-	fwrite(decdi,3600,sizeof(long),decf);
-	fclose(decf);
-
-	raf = fopen(raix, "w");
-	if (raf==NULL) {
-		err_printf("Can't open ra index file for write\n");
-		return -1;
+	zone_first[zones] = tiles;
+
+	// counting sort of the stars by tile
+	tile_first = calloc(tiles + 1, sizeof(uint32_t));
+	fill = malloc((tiles + 1) * sizeof(uint32_t));
+	sorted = malloc((nstars + 1) * sizeof(struct tile_star));
+	if (tile_first == NULL || fill == NULL || sorted == NULL) {
+		err_printf("No memory for tycho2 tiles\n");
+		goto err_out;
 	}
-	fwrite(rai,tyl,sizeof(IXENT),raf);
-	fclose(raf);
 
-	decf = fopen(decix, "w");
-	if (decf==NULL) {
-		err_printf("Can't open dec index file for write\n");
-		return -1;
+	for (i = 0; i < nstars; i++)
+		tile_first[tile_of(zone_first, stars + i) + 1]++;
+	for (i = 0; i < tiles; i++)
+		tile_first[i + 1] += tile_first[i];
+
+	memcpy(fill, tile_first, (tiles + 1) * sizeof(uint32_t));
+	for (i = 0; i < nstars; i++)
+		sorted[fill[tile_of(zone_first, stars + i)]++] = stars[i];
+
+	for (i = 0; i < tiles; i++)
+		qsort(sorted + tile_first[i], tile_first[i + 1] - tile_first[i],
+		      sizeof(struct tile_star), comp_star_ra);
+
+	memset(&hdr, 0, sizeof(struct tiles_header));
+	memcpy(hdr.magic, TILES_MAGIC, sizeof(hdr.magic));
+	hdr.version = TILES_VERSION;
+	hdr.byte_order = TILES_BYTE_ORDER;
+	hdr.zones = zones;
+	hdr.tiles = tiles;
+	hdr.nstars = nstars;
+	hdr.zone_h = TYCHO2_ZONE_H;
+	hdr.cat_size = cst.st_size;
+	hdr.cat_mtime = cst.st_mtime;
+
+	// write to a temporary file, so a search never maps a partial one
+	cached = ! cat_dir_writable(path);
+	name = tiles_name(path, cached);
+	if (name == NULL || asprintf(&tmp, "%s.tmp", name) == -1) {
+		tmp = NULL;
+		goto err_out;
 	}
-	fwrite(deci,tyl,sizeof(IXENT),decf);
-	fclose(decf);
 
-	free(rai);
-	free(deci);
-	return 0;
-}
-
-static int find_index(const char *tycho, // same as above, the files of the catalog
-		      const char *raix,
-		      const char *decix,
-		      const char *raixx,
-		      const char *decixx,
-		      const float minra,
-		      const float maxra,
-		      const float mindec,
-		      const float maxdec,
-		      const int retsize,  // size of the return vector
-		      long *retvals) {    // preallocated return vector of size retsize
-	IXENT *rai;
-	IXENT *deci;
-	FILE *raf, *decf;
-	long radi[3600];  // index in raix of the first object at each 0.1deg
-	long decdi[3600]; // index in decix of the first object at each 0.1deg
-	int i,rj,dj;
-	int minrai, maxrai, mindeci, maxdeci, rail, decil;
-	int ret;
-
-	d4_printf("dec %.3f/%.3f (%.3f) ra: %.3f/%.3f (%.3f)\n", 
-		  mindec, maxdec, maxdec-mindec, minra, maxra, maxra-minra);
-  
-	raf = fopen(raixx, "r");
-	if (raf==NULL) {
-		err_printf("Can't open ra index index for read\n");
-		return -1;
+	if (cached) {
+		char *dir = g_path_get_dirname(name);
+		g_mkdir_with_parents(dir, 0755);
+		g_free(dir);
 	}
-	ret = fread(radi, sizeof(long), 3600, raf);
-	fclose(raf);
-	if (ret != 3600) {
-		err_printf("error reading raixx (%d instead of %d)\n",
-			   ret, 3600);
-		return -1;
+
+	of = fopen(tmp, "w");
+	if (of == NULL) {
+		err_printf("Can't open %s for write\n", tmp);
+		goto err_out;
 	}
 
-	decf = fopen(decixx, "r");
-	if (decf==NULL) {
-		err_printf("Can't open dec index index for read\n");
-		return -1;
+	if (fwrite(&hdr, sizeof(struct tiles_header), 1, of) != 1 ||
+	    fwrite(zone_first, sizeof(uint32_t), zones + 1, of) != zones + 1 ||
+	    fwrite(tile_first, sizeof(uint32_t), tiles + 1, of) != tiles + 1 ||
+	    fwrite(sorted, sizeof(struct tile_star), nstars, of) != nstars) {
+		err_printf("Error writing %s\n", tmp);
+		fclose(of);
+		unlink(tmp);
+		goto err_out;
 	}
-	ret = fread(decdi, sizeof(long), 3600, decf);
-	fclose(decf);
-	if (ret != 3600) {
-		err_printf("error reading decxx (%d instead of %d)\n",
-			   ret, 3600);
-		return -1;
+
+	if (fclose(of) || rename(tmp, name)) {
+		err_printf("Error writing %s\n", name);
+		unlink(tmp);
+		goto err_out;
 	}
 
-	minrai = floor(minra / 0.1);
-	maxrai = ceil(maxra / 0.1);
-	if (maxrai > 3599)
-		maxrai = 3599;
-	mindeci = 1800 + floor(mindec / 0.1);
-	maxdeci = 1800 + ceil(maxdec / 0.1);
-	if (maxdeci >= 3599)
-		maxdeci = 3599;
+	d3_printf("tycho2_make_tiles: wrote %s, %d tiles\n", name, tiles);
+	ret = 0;
+
+err_out:
+	free(stars);
+	free(sorted);
+	free(zone_first);
+	free(tile_first);
+	free(fill);
+	free(name);
+	free(tmp);
+	return ret;
+}
 
-	d4_printf("minrai=%d, maxrai=%d\n", minrai, maxrai);
+static void close_tiles(struct tiles *t)
+{
+	if (t == NULL) return;
 
-	rai = (IXENT *)malloc((rail = (radi[maxrai] - radi[minrai] + 1))*sizeof(IXENT));
-	deci = (IXENT *)malloc((decil = (decdi[maxdeci] - decdi[mindeci] + 1))*sizeof(IXENT));
+	if (t->map) munmap(t->map, t->size);
+	free(t->path);
+	free(t);
+}
 
-	d4_printf("rail=%d, decil=%d\n", rail, decil);
-	raf = fopen(raix, "r");
-	if (raf==NULL) {
-		err_printf("Can't open ra index for read\n");
-		return -1;
+/* map the tiles file name made from the catalogue with stat cst; return NULL
+ * if it is missing, not valid or older than the catalogue */
+static struct tiles *map_tiles_file(char *name, struct stat *cst)
+{
+	struct tiles *t;
+	struct stat st;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0) return NULL;
+
+	t = calloc(1, sizeof(struct tiles));
+	if (t == NULL || fstat(fd, &st) || st.st_size < sizeof(struct tiles_header)) {
+		close(fd);
+		free(t);
+		return NULL;
 	}
-	fseek(raf, sizeof(IXENT)*radi[minrai], SEEK_SET);
-	ret = fread(rai, sizeof(IXENT), rail, raf);
-	fclose(raf);
 
-	if (ret != rail) {
-		err_printf("error reading rai (%d instead of %d)\n",
-			   ret, rail);
-		return -1;
+	t->size = st.st_size;
+	t->map = mmap(NULL, t->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (t->map == MAP_FAILED) {
+		t->map = NULL;
+		close_tiles(t);
+		return NULL;
 	}
 
-	decf = fopen(decix, "r");
-	if (decf==NULL) {
-		err_printf("Can't open dec index for read\n");
-		return -1;
+	t->hdr = t->map;
+	t->zone_first = (uint32_t *)(t->hdr + 1);
+	t->tile_first = t->zone_first + t->hdr->zones + 1;
+	t->stars = (struct tile_star *)(t->tile_first + t->hdr->tiles + 1);
+
+	if (memcmp(t->hdr->magic, TILES_MAGIC, sizeof(t->hdr->magic))
+	    || t->hdr->version != TILES_VERSION
+	    || t->hdr->byte_order != TILES_BYTE_ORDER
+	    || t->hdr->zone_h != (float) TYCHO2_ZONE_H
+	    || t->hdr->zones != zone_of(90.0) + 1
+	    || t->size != sizeof(struct tiles_header)
+	                  + (t->hdr->zones + 1 + t->hdr->tiles + 1) * sizeof(uint32_t)
+	                  + (size_t) t->hdr->nstars * sizeof(struct tile_star)
+	    || t->zone_first[t->hdr->zones] != t->hdr->tiles
+	    || t->tile_first[t->hdr->tiles] != t->hdr->nstars) {
+		d3_printf("tycho2: %s is not a valid tiles file\n", name);
+		close_tiles(t);
+		return NULL;
 	}
-	fseek(decf, sizeof(IXENT)*decdi[mindeci], SEEK_SET);
-	ret = fread(deci, sizeof(IXENT), decil, decf);
-	fclose(decf);
 
-	if (ret != decil) {
-		err_printf("error reading deci (%d instead of %d)\n",
-			   ret, decil);
-		return -1;
+	if (t->hdr->cat_size != cst->st_size || t->hdr->cat_mtime != cst->st_mtime) {
+		d3_printf("tycho2: %s is out of date\n", name);
+		close_tiles(t);
+		return NULL;
 	}
+	return t;
+}
 
-	qsort(rai,rail,sizeof(IXENT),icomp_ixent);
-	qsort(deci,decil,sizeof(IXENT),icomp_ixent);
+/* map the tiles of the catalogue at path, from next to it or from the cache */
+static struct tiles *map_tiles(char *path)
+{
+	struct tiles *t = NULL;
+	struct stat cst;
+	int cached;
 
-	rj=0;
-	dj=0;
-	i = 0;  // index in the output vector
-	while((rj<rail) && (dj<decil) && (i<retsize)) {
-		if(rai[rj].offs<deci[dj].offs) {
-			rj++;
-			continue;
-		}
+	if (stat(path, &cst)) return NULL;
 
-		if(rai[rj].offs>deci[dj].offs) {
-			dj++;
-			continue;
-		}
-		if(rai[rj].offs==deci[dj].offs) {
-			if ((rai[rj].param>=minra) && (rai[rj].param<=maxra) &&
-			    (deci[dj].param>=mindec) && (deci[dj].param<=maxdec)) 
-				retvals[i++] = rai[rj].offs;
-			rj++;
-			dj++;
-		}
+	for (cached = 0; cached < 2 && t == NULL; cached++) {
+		char *name = tiles_name(path, cached);
+		if (name == NULL) continue;
+
+		t = map_tiles_file(name, &cst);
+		free(name);
 	}
-  
-	free(rai);
-	free(deci);
-	return i;
+	if (t) t->path = strdup(path);
+	return t;
 }
 
-/* return 1 if the file can be opened for reading */
-static int file_readable(char *name)
+/* get the tiles of the catalogue at path, making them if needed; a failed
+ * build is not tried again for the rest of the session */
+static struct tiles *get_tiles(char *path)
 {
-	FILE *fp;
-	d3_printf("checking %s\n", name);
-	fp = fopen(name, "r");
-	if (fp == NULL)
-		return 0;
-	fclose(fp);
-	return 1;
+	if (open_tiles && ! strcmp(open_tiles->path, path))
+		return open_tiles;
+
+	close_tiles(open_tiles);
+
+	open_tiles = map_tiles(path);
+	if (open_tiles == NULL) {
+		if (access(path, R_OK))
+			return NULL;
+		if (failed_tiles && ! strcmp(failed_tiles, path))
+			return NULL;
+
+		d3_printf("tycho2: making tiles for %s\n", path);
+		if (tycho2_make_tiles(path) == 0)
+			open_tiles = map_tiles(path);
+
+		if (open_tiles == NULL) {
+			free(failed_tiles);
+			failed_tiles = strdup(path);
+		}
+	}
+	return open_tiles;
 }
 
-/* search tycho2 stars in a wxh box (degrees) centerd on ra,dec. Fill the 
- * buf with zero-terminated ascii records from the file. Return 
- * the number of record read, or a negative error */
-/* path is the full pathname to the tycho2 catalog file */
-int tycho2_search(double ra, double dec, double w, double h, 
-		  char *buf, int sz, char *path)
+/* search the tiles for stars with decmin <= dec <= decmax and ra in
+ * [ramin, ramax] (0 <= ramin < 360, ramin <= ramax < ramin + 360, so the range
+ * may wrap past 360); if radius > 0, stars must also be within radius degrees
+ * of (ra, dec). Store up to n stars; return the number stored */
+static int search_tiles(struct tiles *t, double ramin, double ramax, double decmin, double decmax,
+			double ra, double dec, double radius, struct tycho2_star *stars, int n)
 {
-	long rets[CAT_GET_SIZE];
-	long retl;
-	int i=0, ret = -1;
-	FILE *tf;
+	double cosr = cos(degrad(radius));
+	double sd = sin(degrad(dec)), cd = cos(degrad(dec));
+	int z, k, found = 0;
 
-	char *dir, *cat, *raix=NULL, *decix=NULL, *raixx=NULL, *decixx=NULL;
+	for (z = zone_of(decmin); z <= zone_of(decmax) && found < n; z++) {
+		int ncells = t->zone_first[z + 1] - t->zone_first[z];
+		int c0 = cell_of(ramin, ncells);
+		int c1 = floor(ramax / 360.0 * ncells); // past ncells when the range wraps
 
-	cat = strdup(path);
-	dir = dirname(cat);
+		if (c1 > c0 + ncells - 1) c1 = c0 + ncells - 1;
 
-	d3_printf("dirname is %s, path is %s\n", dir, path);
-	if (-1 == asprintf(&raix, "%s/ra.ix", dir))
-		goto err_out;
-	if (-1 == asprintf(&raixx, "%s/ra.ixx", dir))
-		goto err_out;
-	if (-1 == asprintf(&decix, "%s/dec.ix", dir))
-		goto err_out;
-	if (-1 == asprintf(&decixx, "%s/dec.ixx", dir))
-		goto err_out;
+		for (k = c0; k <= c1 && found < n; k++) {
+			int tile = t->zone_first[z] + k % ncells;
+			uint32_t i;
 
-	tf = fopen(path, "r");
-	if (tf==NULL) {
-//		err_printf("Invalid tycho catalog: %s\n", path);
-		ret=-1;
-		goto err_out;
-	}
+			for (i = t->tile_first[tile]; i < t->tile_first[tile + 1] && found < n; i++) {
+				struct tile_star *ts = t->stars + i;
+				double sdec = ts->dec / POS_SCALE;
+				double sra = ts->ra / POS_SCALE;
 
-	if (!file_readable(raix) || !file_readable(raixx)
-	    || !file_readable(decix) || !file_readable(decixx)) {
-//		d3_printf("Remaking indices\n");
-		ret = make_tycho2_indices(path, raix, decix, raixx, decixx);
-		if (ret)
-			goto err_out;
-	}
+				if (sdec < decmin || sdec > decmax) continue;
+				if (sra < ramin) sra += 360.0;
+				if (sra > ramax) continue;
 
+				if (radius > 0 && sin(degrad(sdec)) * sd + cos(degrad(sdec)) * cd * cos(degrad(sra - ra)) < cosr)
+					continue;
 
-	retl = find_index(path, raix, decix, raixx, decixx,
-			  ra-w/2 >= 0 ? ra-w/2 : 0, 
-			  ra+w/2 < 360.0 ? ra+w/2 : 360.0, 
-			  dec-h/2 > -90.0 ? dec-h/2 : -90.0, 
-			  dec+h/2 < 90.0 ? dec+h/2 : 90.0, 
-			  CAT_GET_SIZE, rets);
-
-	d4_printf("find index returns: %d\n", retl);
-
-  	i = 0;
-	while (!feof(tf) && i < retl && sz > TYCRECSZ + 1) {  
-		fseek(tf, TYCRECSZ*rets[i], SEEK_SET);
-		if (fread(buf, 1, TYCRECSZ, tf) < TYCRECSZ)
-			break;
-		buf[TYCRECSZ]=0;
-		buf += TYCRECSZ + 1;
-		i++;
-		sz -= TYCRECSZ + 1;
+				unpack_star(ts, stars + found);
+				found++;
+			}
+		}
 	}
-	fclose(tf);
-	ret = i;
+	return found;
+}
 
-err_out:
-	if (cat)
-		free(cat);
-	if (raix)
-		free(raix);
-	if (raixx)
-		free(raixx);
-	if (decix)
-		free(decix);
-	if (decixx)
-		free(decixx);
+/* search tycho2 stars in a w x h box (degrees) centered on ra, dec; path is the
+ * full pathname of the tyc2.dat file. Put up to n stars in stars; return the
+ * number found, or a negative error */
+int tycho2_box(char *path, double ra, double dec, double w, double h,
+	       struct tycho2_star *stars, int n)
+{
+	struct tiles *t = get_tiles(path);
+	double decmin = dec - h / 2, decmax = dec + h / 2;
+	double ramin, ramax;
+
+	if (t == NULL) return -1;
+
+	if (decmin < -90.0) decmin = -90.0;
+	if (decmax > 90.0) decmax = 90.0;
+
+	w = fabs(w);
+	if (w >= 360.0) {
+		ramin = 0;
+		ramax = 360.0;
+	} else {
+		ramin = fmod(ra - w / 2, 360.0);
+		if (ramin < 0) ramin += 360.0;
+		ramax = ramin + w;
+	}
+	return search_tiles(t, ramin, ramax, decmin, decmax, ra, dec, 0, stars, n);
+}
 
-	return ret;
+/* search tycho2 stars within radius degrees of ra, dec; otherwise
+ * like tycho2_box */
+int tycho2_cone(char *path, double ra, double dec, double radius,
+		struct tycho2_star *stars, int n)
+{
+	struct tiles *t = get_tiles(path);
+	double decmin = dec - radius, decmax = dec + radius;
+	double ramin = 0, ramax = 360.0;
+
+	if (t == NULL) return -1;
+
+	if (decmin < -90.0) decmin = -90.0;
+	if (decmax > 90.0) decmax = 90.0;
+
+	// the ra half width of the cone, unless it covers a pole
+	if (decmin > -90.0 && decmax < 90.0) {
+		double s = sin(degrad(radius)) / cos(degrad(dec));
+		if (s < 1.0) {
+			double dra = raddeg(asin(s));
+			ramin = fmod(ra - dra, 360.0);
+			if (ramin < 0) ramin += 360.0;
+			ramax = ramin + 2 * dra;
+		}
+	}
+	return search_tiles(t, ramin, ramax, decmin, decmax, ra, dec, radius, stars, n);
 }
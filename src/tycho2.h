@@ -4,8 +4,27 @@
 /* size of a TYCHO2 record, without the trailing zero */
 #define TYCRECSZ 207
 
-int tycho2_search(double ra, double dec, double w, double h, 
-		  char *buf, int sz, char *path);
+/* name of the tiled catalogue, made next to the tyc2.dat file (or in the
+ * user's cache directory when that is read-only) */
+#define TYCHO2_TILES_NAME "tycho2.tiles"
 
+/* height of the declination zones the sky is tiled in (degrees); the zones
+ * are split in ra in cells about as wide */
+#define TYCHO2_ZONE_H 1.0
+
+/* a star of the tiled catalogue */
+struct tycho2_star {
+	double ra, dec;			/* mean (or observed) position, J2000 */
+	float raerr, decerr;		/* mas */
+	float vt, vterr, bt, bterr;	/* MAG_UNSET / BIG_ERR when missing */
+	int tyc1, tyc2, tyc3;
+};
+
+int tycho2_make_tiles(char *path);
+
+int tycho2_box(char *path, double ra, double dec, double w, double h,
+	       struct tycho2_star *stars, int n);
+int tycho2_cone(char *path, double ra, double dec, double radius,
+		struct tycho2_star *stars, int n);
 
 #endif
@@ -1058,6 +1058,56 @@ static double gui_star_pa(struct gui_star *b, struct gui_star *a)
 	return atan2((b->y - a->y), b->x - a->x);
 }
 
+/* catalog stars for matching: the list in order, and a grid over their
+ * positions so the searches below only look at nearby stars */
+struct cat_index {
+	int n;
+	struct gui_star **s;	// catalog list, in list order
+	struct point_grid *grid;	// over s[i] positions
+	int *near;	// point_grid_box result buffer
+	int near_size;
+};
+
+static struct cat_index *cat_index_new(GSList *cat)
+{
+	struct cat_index *ci = calloc(1, sizeof(struct cat_index));
+	if (ci == NULL) return NULL;
+
+	ci->n = g_slist_length(cat);
+	ci->s = malloc((ci->n + 1) * sizeof(struct gui_star *));
+	double *x = malloc((ci->n + 1) * sizeof(double));
+	double *y = malloc((ci->n + 1) * sizeof(double));
+
+	if (ci->s && x && y) {
+		int i;
+		for (i = 0; cat != NULL; cat = g_slist_next(cat), i++) {
+			ci->s[i] = GUI_STAR(cat->data);
+			x[i] = ci->s[i]->x;
+			y[i] = ci->s[i]->y;
+		}
+		ci->grid = point_grid_new(x, y, ci->n, 0);
+	}
+	free(x);
+	free(y);
+
+	if (ci->grid == NULL) {
+		free(ci->s);
+		free(ci);
+		return NULL;
+	}
+	return ci;
+}
+
+static void cat_index_free(struct cat_index *ci)
+{
+	if (ci == NULL) return;
+
+	point_grid_free(ci->grid);
+	free(ci->near);
+	free(ci->s);
+	free(ci);
+}
+
 /* find a catalog star that matches the transformed position of c within MATCH_TOL
  * return 0 : match found
  * return 1 : no match found
@@ -1066,7 +1116,7 @@ static double gui_star_pa(struct gui_star *b, struct gui_star *a)
 static int find_cc(gpointer window,
               struct gui_star *fa, struct gui_star *fb,
 			  struct gui_star *ca, struct gui_star *cb,
-              struct gui_star *fc, GSList *cat,
+              struct gui_star *fc, struct cat_index *ci,
               struct gui_star **cfound)
 {
 //	d3_printf("c: %.1f %.1f\n", c->x, c->y);
@@ -1084,25 +1134,19 @@ static int find_cc(gpointer window,
     double ymin = y - MATCH_TOL;
     double ymax = y + MATCH_TOL;
 
-    while (cat != NULL) {
-        struct gui_star *cc = GUI_STAR(cat->data);
-		cat = g_slist_next(cat);
-
-//		d3_printf("----- cc: %.1f %.1f\n", cc->x, cc->y);
-
-        if (cc->x > xmax || cc->x < xmin || cc->y < ymin || cc->y > ymax) continue;
+    // first star of the catalog list inside the box
+    int i = point_grid_first(ci->grid, xmin, ymin, xmax, ymax);
+    if (i < 0) return 1;
 
-        *cfound = cc;
+    *cfound = ci->s[i];
 
-        return 0;
-	}
-    return 1;
+    return 0;
 }
 
 
 /* find stars that are positioned relative to ca as fb is to fa (taking the
  * tolerances into account) */
-static GSList * find_likely_cb_list (struct gui_star *fa, struct gui_star *fb, struct gui_star *ca, GSList *cat)
+static GSList * find_likely_cb_list (struct gui_star *fa, struct gui_star *fb, struct gui_star *ca, struct cat_index *ci)
 {
     GSList *match = NULL;
 
@@ -1114,9 +1158,11 @@ static GSList * find_likely_cb_list (struct gui_star *fa, struct gui_star *fb, s
     double pamin = pa_ba - ROT_TOL * PI / 180;
     double pamax = pa_ba + ROT_TOL * PI / 180;
 
-	while (cat != NULL) {
-        struct gui_star *cb = GUI_STAR(cat->data);
-		cat = g_slist_next(cat);
+    int n = point_grid_box(ci->grid, ca->x - dmax, ca->y - dmax, ca->x + dmax, ca->y + dmax, &ci->near, &ci->near_size);
+
+    int i;
+    for (i = 0; i < n; i++) { // candidates come in catalog list order
+        struct gui_star *cb = ci->s[ci->near[i]];
 
         double d_cbca = gui_star_distance(ca, cb);
 
@@ -1129,8 +1175,9 @@ static GSList * find_likely_cb_list (struct gui_star *fa, struct gui_star *fb, s
 
         if (pa_cbca > pamax || pa_cbca < pamin)	continue;
 
-        match = g_slist_append(match, cb);
+        match = g_slist_prepend(match, cb);
 	}
+    match = g_slist_reverse(match);
 //    if (g_slist_length(ret))
 //        d3_printf("found %d\n", g_slist_length(ret));
 
@@ -1165,7 +1212,7 @@ void make_pair(struct gui_star *cs, struct gui_star *s)
 static int more_pairs(gpointer window,
            struct gui_star *fa, struct gui_star *fb,
 	       struct gui_star *ca, struct gui_star *cb,
-           GSList *field, GSList *cat,
+           GSList *field, struct cat_index *ci,
            GSList **fm, GSList **cm)
 {
 	int pairs = 0;
@@ -1177,7 +1224,7 @@ static int more_pairs(gpointer window,
         struct gui_star *fc = GUI_STAR (field->data);
 
         struct gui_star *cc = NULL;
-        find_cc (window, fa, fb, ca, cb, fc, cat, &cc);
+        find_cc (window, fa, fb, ca, cb, fc, ci, &cc);
 
 		if (cc != NULL) {
             *fm = g_slist_append(*fm, fc);
@@ -1214,15 +1261,14 @@ static void make_pairs_from_list(GSList *cm, GSList *fm)
 
 #define MAX_DEPTH 20
 // return number found or -1 (user abort)
-static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star *fb, GSList *field, GSList *cat)
+static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star *fb, GSList *field, struct cat_index *ci)
 {
 //    GSList *sl;
 //    for (sl = field; sl != NULL; sl = sl->next)
 //        d3_printf("FIELD: %.0f, %.0f: size: %.1f\n", GUI_STAR(sl->data)->x, GUI_STAR(sl->data)->y, GUI_STAR(sl->data)->size);
 
-/* this is a n**3 algorithm, which really should be optimised */
+/* this is a n**3 algorithm; the catalog searches go through the grid */
 
-    GSList *ca_list = cat;
     int max = 0;
 
 //    d3_printf("wcs.match_from_a_b fa: %.1f %.1f, fb: %.1f. %.1f\n", fa->x, fa->y, fb->x, fb->y);
@@ -1230,11 +1276,11 @@ static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star
     gboolean abort = FALSE;
 
     int depth_a;
-    for (depth_a = 0; ca_list != NULL && ! abort && depth_a < MAX_DEPTH; depth_a++) {
+    for (depth_a = 0; depth_a < ci->n && ! abort && depth_a < MAX_DEPTH; depth_a++) {
 
-        struct gui_star *ca = GUI_STAR(ca_list->data);
+        struct gui_star *ca = ci->s[depth_a];
 
-        GSList *cb_list_start = find_likely_cb_list (fa, fb, ca, cat);
+        GSList *cb_list_start = find_likely_cb_list (fa, fb, ca, ci);
 
         GSList *cb_list = cb_list_start;
 
@@ -1263,7 +1309,7 @@ static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star
 
 //                d3_printf("looking for cc to match fc: %.1f %.1f ...\n", fc->x, fc->y);
 
-                find_cc (window, fa, fb, ca, cb, fc, cat, &cc); // find cc to match fc
+                find_cc (window, fa, fb, ca, cb, fc, ci, &cc); // find cc to match fc
 
 //                d3_printf("no cc found\n");
                 if (cc != NULL) break; // found cc
@@ -1285,7 +1331,7 @@ static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star
 
                 GSList *fm = NULL, *cm = NULL;
 
-                int ret = more_pairs (window, fa, fb, ca, cb, fc_list, cat, &fm, &cm);
+                int ret = more_pairs (window, fa, fb, ca, cb, fc_list, ci, &fm, &cm);
 
                 if (ret >= 0) {
                     int matched = ret + 3;
@@ -1316,7 +1362,6 @@ static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star
 //        printf("depth_b %d\n", depth_b); fflush(NULL);
 
         g_slist_free(cb_list_start);
-        ca_list = g_slist_next(ca_list);
 	}
 //    d3_printf("no match ;-(\n");
 //    printf("depth_a %d\n", depth_a); fflush(NULL);
@@ -1328,7 +1373,7 @@ static int match_from_a_b(gpointer window, struct gui_star *fa, struct gui_star
 /* try to match starting with the first two stars in field
  * return number of stars matched
  */
-static int match_from(gpointer window, GSList *field, GSList *cat)
+static int match_from(gpointer window, GSList *field, struct cat_index *ci)
 {
     struct gui_star *fa = GUI_STAR(field->data); // first star
 
@@ -1355,10 +1400,10 @@ static int match_from(gpointer window, GSList *field, GSList *cat)
     }
 //    printf("depth %d\n", depth); fflush(NULL);
 
-    return (abort == 0) ? match_from_a_b (window, fa, fb, fc_list, cat) : -1;
+    return (abort == 0) ? match_from_a_b (window, fa, fb, fc_list, ci) : -1;
 }
 
-static int short_match(gpointer window, GSList *field, GSList *cat)
+static int short_match(gpointer window, GSList *field, struct cat_index *ci)
 {
 
 //printf("wcs.match_from\n");
@@ -1371,122 +1416,317 @@ static int short_match(gpointer window, GSList *field, GSList *cat)
     if (fb == NULL) return 0; // fix this : find best match star in cat nearish to fa
 
 // fc_list is field less fa and fb
-    return match_from_a_b (window, fa, fb, (field->next) ? field->next->next : NULL, cat);
+    return match_from_a_b (window, fa, fb, (field->next) ? field->next->next : NULL, ci);
 }
 
-/*
- * match the field stars to the catalog. create pairs in field
- * for the stars that are matched. Return the number of matches found
- * for best performance, the field list should be sorted by flux, so the first
- * stars are likely to be in the catalog.
- */
-int fastmatch(gpointer window, GSList *field, GSList *cat)
+/* geometric hashing: triangles of the brightest stars are described by the
+ * ratios of their sides, which do not change with scale and rotation. The
+ * catalog triangles are put in a grid by those ratios; each field triangle
+ * looks up the catalog triangles with about the same ratios, and the matches
+ * vote for the star pairs they imply. The best voted triangles are then tried
+ * as in more_pairs, by how many of the field stars they bring onto catalog
+ * stars */
+
+#define HASH_FIELD_STARS 30 /* brightest field stars used to make triangles */
+#define HASH_CAT_STARS 100 /* brightest catalog stars used to make triangles */
+#define HASH_CELL 0.01 /* grid step of the side ratios */
+#define HASH_MIN_TOL 0.005 /* least tolerance of the side ratios */
+#define HASH_MIN_RATIO 0.1 /* shortest / longest side of the triangles used */
+#define HASH_MAX_TRY 50 /* most triangle matches tried */
+
+struct triangle {
+	int v[3]; /* star indices, opposite the shortest, middle and longest side */
+	double ba, ca; /* middle and shortest side, over the longest */
+	double c; /* longest side, from v[0] to v[1] */
+	double pa; /* position angle of v[1] from v[0] */
+	int cw; /* orientation */
+};
+
+struct tri_match {
+	int f, c; /* field and catalog triangles */
+	int votes;
+};
+
+/* describe the triangle of stars i, j, k; return 0 if it is usable */
+static int make_triangle(struct gui_star **s, int i, int j, int k, struct triangle *t)
 {
-	int ret = 0;
-	int max = 0;
-    if (g_slist_length(field) <= 2) {
-        ret = short_match(window, field, cat);
+	int v[3] = { i, j, k };
+	double d[3];
+	int m, n;
+
+	d[0] = gui_star_distance(s[j], s[k]);
+	d[1] = gui_star_distance(s[i], s[k]);
+	d[2] = gui_star_distance(s[i], s[j]);
+
+	// sort by the side opposite each vertex
+	for (m = 1; m < 3; m++)
+		for (n = m; n > 0 && d[n] < d[n - 1]; n--) {
+			double td = d[n]; d[n] = d[n - 1]; d[n - 1] = td;
+			int tv = v[n]; v[n] = v[n - 1]; v[n - 1] = tv;
+		}
 
-    } else {        
-        while (g_slist_length(field) >= 2) { /* loop dropping the first star in the list */
-            ret = match_from(window, field, cat);
+	if (d[2] < MIN_AB_DISTANCE || d[0] < HASH_MIN_RATIO * d[2])
+		return 1;
 
-            if (ret == -1) break;
-            if (ret >= MIN_PAIRS) break;
+	struct gui_star *a = s[v[0]], *b = s[v[1]], *c = s[v[2]];
 
-            if (ret > max) max = ret;
+	memcpy(t->v, v, sizeof(v));
+	t->ca = d[0] / d[2];
+	t->ba = d[1] / d[2];
+	t->c = d[2];
+	t->pa = gui_star_pa(b, a);
+	t->cw = ((b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x)) > 0;
 
-            field = g_slist_next(field);
-        }
-    }
+	return 0;
+}
 
-    if (ret == -1) return -1; // user abort
+/* all the usable triangles of the first n stars in s, in *tri (malloced);
+ * return their number or -1 */
+static int make_triangles(struct gui_star **s, int n, struct triangle **tri)
+{
+	int i, j, k, nt = 0;
 
-	if (ret < MIN_PAIRS) {
-		err_printf("Only found %d pairs, need at least %d\n", max, MIN_PAIRS);
-		return 0;
-	}
-	return ret;
+	*tri = malloc((n * (n - 1) * (n - 2) / 6 + 1) * sizeof(struct triangle));
+	if (*tri == NULL) return -1;
+
+	for (i = 0; i < n; i++)
+		for (j = i + 1; j < n; j++)
+			for (k = j + 1; k < n; k++)
+				if (make_triangle(s, i, j, k, *tri + nt) == 0)
+					nt++;
+
+	return nt;
 }
 
-#define LOOP_COUNT0 3
-#define LOOP_COUNT1 3
-#define LOOP_COUNT2 3
-#define LOOP_COUNT3 3
-#define GOOD_FIT 5
-#define SMALL_NUMBER 1.0
+static int tri_match_compare(struct tri_match *a, struct tri_match *b)
+{
+	return b->votes - a->votes;
+}
+
+/* try the pairing of fa to ca and fb to cb over the field list; keep the
+ * pairs in fm, cm. return the number of pairs */
+static int try_pairs(gpointer window, struct gui_star *fa, struct gui_star *fb,
+		     struct gui_star *ca, struct gui_star *cb,
+		     GSList *field, struct cat_index *ci, GSList **fm, GSList **cm)
+{
+	int pairs = 0;
+
+	for (; field != NULL && pairs < MAX_PAIRS; field = g_slist_next(field)) {
+		struct gui_star *fc = GUI_STAR(field->data);
+		struct gui_star *cc = NULL;
+
+		find_cc(window, fa, fb, ca, cb, fc, ci, &cc);
+		if (cc == NULL) continue;
+
+		*fm = g_slist_prepend(*fm, fc);
+		*cm = g_slist_prepend(*cm, cc);
+		pairs++;
+	}
+	*fm = g_slist_reverse(*fm);
+	*cm = g_slist_reverse(*cm);
+
+	return pairs;
+}
 
-int fastmatch_new(GSList *field_list, GSList *cat_list) // translation only
+/* match the field to the catalog by geometric hashing; make the pairs and
+ * return their number if there are at least MIN_PAIRS, else return the most
+ * pairs found. -1 on user abort */
+static int hash_match(gpointer window, GSList *field, struct cat_index *ci)
 {
-    gboolean got_a_fit = FALSE;
+	struct gui_star *fs[HASH_FIELD_STARS];
+	struct triangle *ctri = NULL, *ftri = NULL;
+	struct point_grid *grid = NULL;
+	struct tri_match *tm = NULL;
+	int *votes = NULL, *near = NULL;
+	int near_size = 0, ntm = 0, tm_size = 0;
+	int nf, nc, nct, nft, i, j;
+	int max = 0, abort = 0;
+	GSList *sl;
 
-    struct gui_star *fs = NULL, *cs = NULL;
+	for (nf = 0, sl = field; sl != NULL && nf < HASH_FIELD_STARS; sl = g_slist_next(sl))
+		fs[nf++] = GUI_STAR(sl->data);
+	nc = MIN(ci->n, HASH_CAT_STARS);
 
-    int count0 = LOOP_COUNT0;
-    GSList *fl = field_list;
+	if (nf < 3 || nc < 3)
+		return 0;
 
-    while (fl && count0--) {
+	nct = make_triangles(ci->s, nc, &ctri);
+	nft = make_triangles(fs, nf, &ftri);
+	votes = calloc(nf * nc, sizeof(int));
 
-        struct gui_star *ffs = GUI_STAR(fl->data);
+	if (nct < 0 || nft < 0 || votes == NULL) {
+		err_printf("hash_match: cannot alloc triangles\n");
+		goto out;
+	}
 
-        int count1 = LOOP_COUNT1;
-        GSList *cl = cat_list;
+	double *x = malloc((nct + 1) * sizeof(double));
+	double *y = malloc((nct + 1) * sizeof(double));
+	if (x && y) {
+		for (i = 0; i < nct; i++) {
+			x[i] = ctri[i].ba;
+			y[i] = ctri[i].ca;
+		}
+		grid = point_grid_new(x, y, nct, HASH_CELL);
+	}
+	free(x);
+	free(y);
 
-        while (cl && count1--) {
+	if (grid == NULL) {
+		err_printf("hash_match: cannot index triangles\n");
+		goto out;
+	}
 
-            struct gui_star *fcs = GUI_STAR(cl->data);
+	// look up the field triangles, and vote for the pairs of the matches
+	for (i = 0; i < nft && ! abort; i++) {
+		struct triangle *ft = ftri + i;
+		double tol = MAX(HASH_MIN_TOL, 2 * MATCH_TOL / ft->c);
 
-            double fdx = ffs->x - fcs->x;
-            double fdy = ffs->y - fcs->y;
+		// the vertex order is not reliable when two sides are about equal
+		if (ft->ba - ft->ca < tol || 1 - ft->ba < tol)
+			continue;
 
-            fl = g_slist_next(fl);
-            if (!fl) break;
+		int n = point_grid_box(grid, ft->ba - tol, ft->ca - tol, ft->ba + tol, ft->ca + tol, &near, &near_size);
 
-            int count2 = LOOP_COUNT2;
-            GSList *nfl = fl;
-            while (nfl && count2--) {
+		for (j = 0; j < n; j++) {
+			struct triangle *ct = ctri + near[j];
 
-                struct gui_star *nfs = GUI_STAR(nfl);
-                int good_count = 0;
+			if (ct->cw != ft->cw) continue;
 
-                cl = g_slist_next(cl);
-                if (!cl) break;
+			double scale = ct->c / ft->c;
+			if (fabs(scale - 1) > SCALE_TOL) continue;
 
-                GSList *ncl = cl;
-                int count3 = LOOP_COUNT3;
-                while (ncl && count3--) {
-                    struct gui_star *ncs = GUI_STAR(ncl);
+			double rot = angular_diff(ct->pa, ft->pa);
+			if (fabs(rot) > ROT_TOL) continue; // degrees
 
-                    double ndx = nfs->x - ncs->x;
-                    double ndy = nfs->y - ncs->y;
+			if (ntm >= tm_size) {
+				int nsize = (tm_size < 256) ? 256 : 2 * tm_size;
+				struct tri_match *ntm_buf = realloc(tm, nsize * sizeof(struct tri_match));
+				if (ntm_buf == NULL) {
+					err_printf("hash_match: cannot alloc matches\n");
+					goto out;
+				}
+				tm = ntm_buf;
+				tm_size = nsize;
+			}
+			tm[ntm].f = i;
+			tm[ntm].c = near[j];
+			ntm++;
 
-                    if (sqrt(sqr(ndx - fdx) + sqr(ndy - fdy)) < SMALL_NUMBER) good_count++;
+			int k;
+			for (k = 0; k < 3; k++)
+				votes[ft->v[k] * nc + ct->v[k]]++;
+		}
 
-                    got_a_fit = (good_count >= GOOD_FIT);
-                    if (got_a_fit) {
-                        fs = ffs;
-                        cs = fcs;
-                        break;
-                    }
+		if ((i & 255) == 0)
+			abort = check_user_abort(window);
+	}
 
-                    ncl = g_slist_next(ncl);
-               }
-               if (got_a_fit) break;
+	// a match is as good as the pairs it implies
+	for (i = 0; i < ntm; i++) {
+		struct triangle *ft = ftri + tm[i].f;
+		struct triangle *ct = ctri + tm[i].c;
 
-               nfl = g_slist_next(nfl);
-            }
-            if (got_a_fit) break;
+		tm[i].votes = 0;
+		for (j = 0; j < 3; j++)
+			tm[i].votes += votes[ft->v[j] * nc + ct->v[j]];
+	}
+	qsort(tm, ntm, sizeof(struct tri_match), (int (*)(const void *, const void *))tri_match_compare);
 
-            cl = g_slist_next(cl);
-        }
-        if (got_a_fit) break;
+	// keep the match bringing most stars together; a few pairs can happen by
+	// chance in a crowded catalog, the right match has many more
+	GSList *best_fm = NULL, *best_cm = NULL;
+
+	for (i = 0; i < ntm && i < HASH_MAX_TRY && max < MAX_PAIRS && ! abort; i++) {
+		struct triangle *ft = ftri + tm[i].f;
+		struct triangle *ct = ctri + tm[i].c;
+		GSList *fm = NULL, *cm = NULL;
+
+		struct gui_star *fa = fs[ft->v[0]], *fb = fs[ft->v[1]];
+		struct gui_star *ca = ci->s[ct->v[0]], *cb = ci->s[ct->v[1]];
 
-        fl = g_slist_next(fl);
+		int pairs = try_pairs(window, fa, fb, ca, cb, field, ci, &fm, &cm);
+
+		if (pairs > max) {
+			max = pairs;
+			g_slist_free(best_fm);
+			g_slist_free(best_cm);
+			best_fm = fm;
+			best_cm = cm;
+		} else {
+			g_slist_free(fm);
+			g_slist_free(cm);
+		}
+
+		abort = check_user_abort(window);
+	}
+
+	if (max >= MIN_PAIRS && ! abort)
+		make_pairs_from_list(best_cm, best_fm);
+
+	g_slist_free(best_fm);
+	g_slist_free(best_cm);
+
+out:
+	point_grid_free(grid);
+	free(near);
+	free(tm);
+	free(votes);
+	free(ctri);
+	free(ftri);
+
+	return (abort) ? -1 : max;
+}
+
+/*
+ * match the field stars to the catalog. create pairs in field
+ * for the stars that are matched. Return the number of matches found
+ * for best performance, the field list should be sorted by flux, so the first
+ * stars are likely to be in the catalog.
+ * The triangle hash is tried first; the search dropping field stars one at
+ * a time is the fallback.
+ */
+int fastmatch(gpointer window, GSList *field, GSList *cat)
+{
+	int ret = 0;
+	int max = 0;
+
+    struct cat_index *ci = cat_index_new(cat);
+    if (ci == NULL) {
+        err_printf("fastmatch: cannot index catalog stars\n");
+        return 0;
     }
-    if (got_a_fit)
-        ; // fs and cs are a pair
 
-    return 0;
+    ret = hash_match(window, field, ci);
+    if (ret > max) max = ret;
+
+    if (ret >= 0 && ret < MIN_PAIRS) {
+        if (g_slist_length(field) <= 2) {
+            ret = short_match(window, field, ci);
+
+        } else {
+            while (g_slist_length(field) >= 2) { /* loop dropping the first star in the list */
+                ret = match_from(window, field, ci);
+
+                if (ret == -1) break;
+                if (ret >= MIN_PAIRS) break;
+
+                if (ret > max) max = ret;
+
+                field = g_slist_next(field);
+            }
+        }
+    }
+
+    cat_index_free(ci);
+
+    if (ret == -1) return -1; // user abort
+
+	if (ret < MIN_PAIRS) {
+		err_printf("Only found %d pairs, need at least %d\n", max, MIN_PAIRS);
+		return 0;
+	}
+	return ret;
 }
 
 
+
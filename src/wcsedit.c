@@ -599,7 +599,7 @@ static void wcs_flip_field_cb( GtkWidget *widget, gpointer wcs_dialog )
     flip_frame(fr);
 
     struct image_channel *i_chan = g_object_get_data(G_OBJECT(window), "i_channel");
-    i_chan->channel_changed = 1;
+    image_channel_data_changed(i_chan);
 
 //    refresh_wcs(window);
 //    fits_frame_params_to_fim(fr); // try this